@@ -82,6 +82,12 @@ deletePackage = function (packageId) {
         console.error(error);
       }
 
+      // Files shared with other packages live on in the object store; drop any that this
+      // package was the last user of.
+      ChildProcess.spawn(sandstormExe("spk"), ["gc-store", SANDSTORM_OBJECTDIR], {
+        stdio: ["ignore", "ignore", process.stderr]
+      });
+
       Packages.remove(packageId);
     }
     delete installers[packageId];
@@ -404,7 +410,7 @@ AppInstaller.prototype.doUnpack = function() {
   this.updateProgress("unpack");
 
   var child = ChildProcess.spawn(sandstormExe("spk"),
-      ["unpack", this.verifiedPath, this.unpackingPath], {
+      ["unpack", "--store", SANDSTORM_OBJECTDIR, this.verifiedPath, this.unpackingPath], {
     stdio: ["ignore", "pipe", process.stderr]
   });
 
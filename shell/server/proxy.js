@@ -34,6 +34,7 @@ SANDSTORM_VARDIR = (SANDSTORM_ALTHOME || "") + "/var/sandstorm";
 SANDSTORM_APPDIR = SANDSTORM_VARDIR + "/apps";
 SANDSTORM_GRAINDIR = SANDSTORM_VARDIR + "/grains";
 SANDSTORM_DOWNLOADDIR = SANDSTORM_VARDIR + "/downloads";
+SANDSTORM_OBJECTDIR = SANDSTORM_VARDIR + "/objects";
 
 sandstormExe = function (progname) {
   if (SANDSTORM_ALTHOME) {
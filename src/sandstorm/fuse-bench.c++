@@ -0,0 +1,530 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fuse.h"
+#include "union-fs.h"
+#include "util.h"
+#include <kj/main.h>
+#include <kj/io.h>
+#include <kj/async-unix.h>
+#include <kj/debug.h>
+#include <kj/thread.h>
+#include <capnp/message.h>
+#include <algorithm>
+#include <atomic>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+
+namespace sandstorm {
+
+static std::atomic<uint64_t> allocationCount(0);
+// Number of heap allocations made so far by any thread, which includes the FUSE servers running in
+// the background. Maintained by the malloc() wrappers below.
+
+}  // namespace sandstorm
+
+// Count allocations by wrapping glibc's allocator. operator new and capnp's message segments
+// both end up here.
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size) {
+  sandstorm::allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+  sandstorm::allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+  sandstorm::allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+
+}  // extern "C"
+
+namespace sandstorm {
+
+class FuseBench {
+  // Measures the per-request cost of the FUSE driver and of the filesystems we serve through it,
+  // by running the same fixed set of operations against a raw directory and against loopback
+  // and union-fs mounts of it.
+
+public:
+  FuseBench(kj::ProcessContext& context): context(context) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "Fuse benchmark, unknown version",
+          "Creates a scratch directory tree under <work-dir> (default: $TMPDIR or /tmp) and "
+          "times a fixed set of operations on it: first directly, then through a loopback FUSE "
+          "mount, then through a union-fs mount layering it under several other directories. "
+          "Each mount is fresh, and every operation is run twice: \"cold\", when the kernel "
+          "has cached nothing from the mount, and \"warm\". (Underlying files are in the page "
+          "cache either way.) Besides throughput and latency, reports the number of heap "
+          "allocations per operation, counted across all threads, so including the FUSE "
+          "server's. Requires fusermount.")
+        .addOption({'c', "cache-forever"}, KJ_BIND_METHOD(*this, setCacheForever),
+                   "Mount with FuseOptions::cacheForever.")
+        .addOptionWithArg({'t', "threads"}, KJ_BIND_METHOD(*this, setThreads), "<count>",
+                          "Serve each mount from <count> threads.")
+        .addOptionWithArg({"ttl"}, KJ_BIND_METHOD(*this, setTtl), "<ms>",
+                          "TTL for the loopback nodes, in milliseconds. Default 1000. With 0, "
+                          "every operation goes to the FUSE server.")
+        .addOptionWithArg({'n', "files"}, KJ_BIND_METHOD(*this, setFileCount), "<count>",
+                          "Number of files in the large directory. Default 10000.")
+        .addOptionWithArg({'s', "size"}, KJ_BIND_METHOD(*this, setBigFileSize), "<MiB>",
+                          "Size of the large file. Default 64.")
+        .addOptionWithArg({'r', "reads"}, KJ_BIND_METHOD(*this, setRandomReads), "<count>",
+                          "Number of random 4k reads. Default 10000.")
+        .addOptionWithArg({'l', "layers"}, KJ_BIND_METHOD(*this, setLayers), "<count>",
+                          "Number of search path entries in the union-fs mount. Default 6.")
+        .expectOptionalArg("<work-dir>", KJ_BIND_METHOD(*this, setWorkDir))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  FuseOptions bindOptions;
+  uint64_t ttlMs = 1000;
+  uint fileCount = 10000;
+  uint64_t bigFileSize = 64 << 20;
+  uint randomReads = 10000;
+  uint layerCount = 6;
+  kj::String workDir;
+
+  kj::MainBuilder::Validity setCacheForever() {
+    bindOptions.cacheForever = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setThreads(kj::StringPtr arg) {
+    KJ_IF_MAYBE(n, parseUInt(arg, 10)) {
+      if (*n >= 1 && *n <= 256) {
+        bindOptions.threadCount = *n;
+        return true;
+      }
+    }
+    return "invalid thread count";
+  }
+
+  kj::MainBuilder::Validity setTtl(kj::StringPtr arg) {
+    KJ_IF_MAYBE(n, parseUInt(arg, 10)) {
+      ttlMs = *n;
+      return true;
+    }
+    return "invalid TTL";
+  }
+
+  kj::MainBuilder::Validity setFileCount(kj::StringPtr arg) {
+    KJ_IF_MAYBE(n, parseUInt(arg, 10)) {
+      if (*n >= 1) {
+        fileCount = *n;
+        return true;
+      }
+    }
+    return "invalid file count";
+  }
+
+  kj::MainBuilder::Validity setBigFileSize(kj::StringPtr arg) {
+    KJ_IF_MAYBE(n, parseUInt(arg, 10)) {
+      if (*n >= 1) {
+        bigFileSize = uint64_t(*n) << 20;
+        return true;
+      }
+    }
+    return "invalid size";
+  }
+
+  kj::MainBuilder::Validity setRandomReads(kj::StringPtr arg) {
+    KJ_IF_MAYBE(n, parseUInt(arg, 10)) {
+      randomReads = *n;
+      return true;
+    }
+    return "invalid read count";
+  }
+
+  kj::MainBuilder::Validity setLayers(kj::StringPtr arg) {
+    KJ_IF_MAYBE(n, parseUInt(arg, 10)) {
+      if (*n >= 1) {
+        layerCount = *n;
+        return true;
+      }
+    }
+    return "invalid layer count";
+  }
+
+  kj::MainBuilder::Validity setWorkDir(kj::StringPtr arg) {
+    if (access(arg.cStr(), F_OK) != 0 || !isDirectory(arg)) {
+      return "not a directory";
+    }
+    workDir = kj::heapString(arg);
+    return true;
+  }
+
+  // =====================================================================================
+  // Fixture
+
+  kj::String scratch;
+  // Created under `workDir`. Contains:
+  //   data/      The tree being benchmarked: `files/` (`fileCount` small files) and `big`.
+  //   layer<n>/  Extra search path entries for the union-fs mount, each with a few files.
+  //   mnt/       Mount point.
+
+  void createFixture() {
+    if (workDir == nullptr) {
+      const char* tmpdir = getenv("TMPDIR");
+      workDir = kj::heapString(tmpdir == nullptr ? "/tmp" : tmpdir);
+    }
+
+    auto name = kj::str(workDir, "/fuse-bench.XXXXXX");
+    if (mkdtemp(name.begin()) == nullptr) {
+      KJ_FAIL_SYSCALL("mkdtemp", errno, name);
+    }
+    scratch = kj::mv(name);
+
+    auto data = kj::str(scratch, "/data");
+    KJ_SYSCALL(mkdir(data.cStr(), 0777));
+    KJ_SYSCALL(mkdir(kj::str(data, "/files").cStr(), 0777));
+    for (uint i = 0; i < fileCount; i++) {
+      writeFile(kj::str(data, "/files/f", i), kj::str("file ", i, "\n"));
+    }
+
+    {
+      auto chunk = kj::heapArray<kj::byte>(1 << 20);
+      for (uint i: kj::indices(chunk)) chunk[i] = i * 7;
+      auto fd = raiiOpen(kj::str(data, "/big"), O_WRONLY | O_CREAT | O_EXCL, 0666);
+      kj::FdOutputStream out(fd.get());
+      for (uint64_t written = 0; written < bigFileSize; written += chunk.size()) {
+        out.write(chunk.begin(), kj::min(chunk.size(), bigFileSize - written));
+      }
+    }
+
+    for (uint i = 0; i + 1 < layerCount; i++) {
+      auto layer = kj::str(scratch, "/layer", i);
+      KJ_SYSCALL(mkdir(layer.cStr(), 0777));
+      KJ_SYSCALL(mkdir(kj::str(layer, "/files").cStr(), 0777));
+      for (uint j = 0; j < 16; j++) {
+        writeFile(kj::str(layer, "/files/layer", i, "-", j), kj::str("layer ", i, "\n"));
+      }
+    }
+
+    KJ_SYSCALL(mkdir(kj::str(scratch, "/mnt").cStr(), 0777));
+  }
+
+  static void writeFile(kj::StringPtr path, kj::StringPtr content) {
+    auto fd = raiiOpen(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    kj::FdOutputStream(fd.get()).write(content.begin(), content.size());
+  }
+
+  // =====================================================================================
+  // Mounting
+
+  class BackgroundMount {
+    // Mounts a FUSE filesystem and serves it from a background thread until destroyed.
+
+  public:
+    BackgroundMount(kj::StringPtr mountPoint, kj::Function<fuse::Node::Client()> rootFactory,
+                    FuseOptions options)
+        : mount(kj::heap<FuseMount>(mountPoint, "")),
+          thread(kj::heap<kj::Thread>(
+              [this, KJ_MVCAP(rootFactory), options]() mutable {
+            serve(kj::mv(rootFactory), options);
+          })) {}
+
+    ~BackgroundMount() noexcept(false) {
+      // Unmounting makes the server's bindFuse() return, after which the thread can be joined.
+      mount = nullptr;
+      thread = nullptr;
+    }
+
+    KJ_DISALLOW_COPY(BackgroundMount);
+
+  private:
+    kj::Own<FuseMount> mount;
+    kj::AutoCloseFd fd = mount->disownFd();
+    kj::Own<kj::Thread> thread;
+
+    void serve(kj::Function<fuse::Node::Client()> rootFactory, FuseOptions options) {
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        kj::UnixEventPort eventPort;
+        kj::EventLoop loop(eventPort);
+        kj::WaitScope waitScope(loop);
+        bindFuse(eventPort, fd, kj::mv(rootFactory), options).wait(waitScope);
+      })) {
+        KJ_LOG(ERROR, "FUSE server failed", *exception);
+      }
+    }
+  };
+
+  kj::Function<void(kj::StringPtr)> ignorePath = [](kj::StringPtr) {};
+  capnp::MallocMessageBuilder unionConfig;
+
+  kj::Function<fuse::Node::Client()> loopbackFactory() {
+    auto path = kj::str(scratch, "/data");
+    kj::Duration ttl = int64_t(ttlMs) * kj::MILLISECONDS;
+    return [KJ_MVCAP(path), ttl]() {
+      return newLoopbackFuseNode(path, ttl);
+    };
+  }
+
+  kj::Function<fuse::Node::Client()> unionFactory() {
+    // Put the benchmark tree last in the search path, after the extra layers, so that every
+    // lookup has to consider all of them, as with an app whose files come from several places.
+    auto root = unionConfig.getRoot<spk::SourceMap>();
+    auto searchPath = root.initSearchPath(layerCount);
+    for (uint i = 0; i + 1 < layerCount; i++) {
+      searchPath[i].setSourcePath(kj::str(scratch, "/layer", i));
+    }
+    searchPath[layerCount - 1].setSourcePath(kj::str(scratch, "/data"));
+
+    return [this]() {
+      capnp::MallocMessageBuilder empty;
+      return makeUnionFs("", unionConfig.getRoot<spk::SourceMap>().asReader(),
+                         empty.getRoot<spk::Manifest>().asReader(),
+                         empty.getRoot<spk::BridgeConfig>().asReader(),
+                         "/dev/null", ignorePath);
+    };
+  }
+
+  // =====================================================================================
+  // Operations
+
+  struct Result {
+    kj::String target;
+    kj::StringPtr operation;
+    kj::StringPtr pass;
+    uint64_t bytes = 0;
+    uint64_t allocations = 0;
+    int64_t elapsedNs = 0;
+    kj::Vector<int64_t> latencies;  // One per operation, in nanoseconds.
+  };
+
+  static int64_t monotonicNanos() {
+    struct timespec ts;
+    KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+  }
+
+  template <typename Func>
+  static void timeOp(Result& result, Func&& func) {
+    uint64_t startAllocations = allocationCount.load(std::memory_order_relaxed);
+    int64_t start = monotonicNanos();
+    result.bytes += func();
+    int64_t end = monotonicNanos();
+    result.allocations += allocationCount.load(std::memory_order_relaxed) - startAllocations;
+    result.latencies.add(end - start);
+  }
+
+  void lookupHit(kj::StringPtr root, Result& result) {
+    for (uint i = 0; i < fileCount; i++) {
+      auto path = kj::str(root, "/files/f", i);
+      timeOp(result, [&]() {
+        struct stat stats;
+        KJ_SYSCALL(lstat(path.cStr(), &stats), path);
+        return 0;
+      });
+    }
+  }
+
+  void lookupMiss(kj::StringPtr root, Result& result) {
+    for (uint i = 0; i < fileCount; i++) {
+      auto path = kj::str(root, "/files/missing", i);
+      timeOp(result, [&]() {
+        struct stat stats;
+        KJ_ASSERT(lstat(path.cStr(), &stats) < 0 && errno == ENOENT, path);
+        return 0;
+      });
+    }
+  }
+
+  void getattr(kj::StringPtr root, Result& result) {
+    auto path = kj::str(root, "/big");
+    for (uint i = 0; i < fileCount; i++) {
+      timeOp(result, [&]() {
+        struct stat stats;
+        KJ_SYSCALL(lstat(path.cStr(), &stats), path);
+        return 0;
+      });
+    }
+  }
+
+  void readdir(kj::StringPtr root, Result& result) {
+    auto path = kj::str(root, "/files");
+    for (uint i = 0; i < 10; i++) {
+      timeOp(result, [&]() {
+        DIR* dir = opendir(path.cStr());
+        if (dir == nullptr) {
+          KJ_FAIL_SYSCALL("opendir", errno, path);
+        }
+        KJ_DEFER(closedir(dir));
+        uint count = 0;
+        while (::readdir(dir) != nullptr) ++count;
+        KJ_ASSERT(count >= fileCount, "readdir() returned too few entries", count);
+        return 0;
+      });
+    }
+  }
+
+  void sequentialRead(kj::StringPtr root, Result& result) {
+    auto fd = raiiOpen(kj::str(root, "/big"), O_RDONLY);
+    auto buffer = kj::heapArray<kj::byte>(128 << 10);
+    for (;;) {
+      ssize_t n;
+      timeOp(result, [&]() {
+        KJ_SYSCALL(n = ::read(fd, buffer.begin(), buffer.size()));
+        return n;
+      });
+      if (n == 0) break;
+    }
+  }
+
+  void randomRead(kj::StringPtr root, Result& result) {
+    auto fd = raiiOpen(kj::str(root, "/big"), O_RDONLY);
+    kj::byte buffer[4096];
+    unsigned int seed = 12345;  // Same offsets every time.
+    uint64_t blocks = bigFileSize / sizeof(buffer);
+    for (uint i = 0; i < randomReads; i++) {
+      off_t offset = (uint64_t(rand_r(&seed)) * RAND_MAX + rand_r(&seed)) % blocks
+                   * sizeof(buffer);
+      timeOp(result, [&]() {
+        ssize_t n;
+        KJ_SYSCALL(n = pread(fd, buffer, sizeof(buffer), offset));
+        KJ_ASSERT(n == sizeof(buffer), "short read");
+        return n;
+      });
+    }
+  }
+
+  typedef void (FuseBench::*Operation)(kj::StringPtr root, Result& result);
+
+  void runAll(kj::StringPtr target, kj::StringPtr root) {
+    static const struct { kj::StringPtr name; Operation op; } OPERATIONS[] = {
+      { "lookup (hit)", &FuseBench::lookupHit },
+      { "lookup (miss)", &FuseBench::lookupMiss },
+      { "getattr", &FuseBench::getattr },
+      { "readdir", &FuseBench::readdir },
+      { "read (seq 128k)", &FuseBench::sequentialRead },
+      { "read (rand 4k)", &FuseBench::randomRead },
+    };
+
+    for (kj::StringPtr pass: {kj::StringPtr("cold"), kj::StringPtr("warm")}) {
+      for (auto& operation: OPERATIONS) {
+        Result result;
+        result.target = kj::heapString(target);
+        result.operation = operation.name;
+        result.pass = pass;
+        int64_t start = monotonicNanos();
+        (this->*operation.op)(root, result);
+        result.elapsedNs = monotonicNanos() - start;
+        report(result);
+      }
+    }
+  }
+
+  // =====================================================================================
+  // Reporting
+
+  void printHeader() {
+    print("%-10s %-16s %-5s %11s %9s %9s %9s %9s %9s %9s\n",
+          "target", "operation", "pass", "ops/s", "MB/s",
+          "p50(us)", "p90(us)", "p99(us)", "max(us)", "allocs/op");
+  }
+
+  void report(Result& result) {
+    auto& latencies = result.latencies;
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) -> double {
+      if (latencies.size() == 0) return 0;
+      size_t i = kj::min(latencies.size() - 1, size_t(p * latencies.size()));
+      return latencies[i] / 1000.0;
+    };
+
+    double seconds = result.elapsedNs / 1e9;
+    double allocationsPerOp =
+        latencies.size() == 0 ? 0 : double(result.allocations) / latencies.size();
+    print("%-10s %-16s %-5s %11.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+          result.target.cStr(), result.operation.cStr(), result.pass.cStr(),
+          latencies.size() / seconds, result.bytes / seconds / (1 << 20),
+          percentile(0.5), percentile(0.9), percentile(0.99), percentile(1.0),
+          allocationsPerOp);
+  }
+
+  template <typename... Params>
+  void print(const char* format, Params... params) {
+    char line[256];
+    int n = snprintf(line, sizeof(line), format, params...);
+    kj::FdOutputStream(STDOUT_FILENO).write(line, kj::min(n, int(sizeof(line) - 1)));
+  }
+
+  void reportStats(kj::StringPtr target, const FuseStats& stats) {
+    print("%-10s node table: %llu nodes (peak %llu), %llu names, ~%llu bytes\n",
+          target.cStr(),
+          (unsigned long long)stats.nodeCount.load(),
+          (unsigned long long)stats.peakNodeCount.load(),
+          (unsigned long long)stats.internedNames.load(),
+          (unsigned long long)stats.tableBytes.load());
+  }
+
+  // =====================================================================================
+
+  kj::MainBuilder::Validity run() {
+    createFixture();
+    KJ_DEFER(recursivelyDelete(scratch));
+
+    auto mountPoint = kj::str(scratch, "/mnt");
+    printHeader();
+
+    runAll("raw", kj::str(scratch, "/data"));
+
+    {
+      FuseStats stats;
+      FuseOptions options = bindOptions;
+      options.stats = &stats;
+      {
+        BackgroundMount mount(mountPoint, loopbackFactory(), options);
+        runAll("loopback", mountPoint);
+      }
+      reportStats("loopback", stats);
+    }
+
+    {
+      FuseStats stats;
+      FuseOptions options = bindOptions;
+      options.stats = &stats;
+      {
+        BackgroundMount mount(mountPoint, unionFactory(), options);
+        // The union mount's root is the union of the layers, so the benchmark tree is at the top.
+        runAll("union-fs", mountPoint);
+      }
+      reportStats("union-fs", stats);
+    }
+
+    return true;
+  }
+};
+
+}  // namespace sandstorm
+
+KJ_MAIN(sandstorm::FuseBench)
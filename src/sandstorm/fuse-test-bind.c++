@@ -19,6 +19,7 @@
 #include <kj/io.h>
 #include <kj/async-unix.h>
 #include <kj/debug.h>
+#include <stdlib.h>
 
 namespace sandstorm {
 
@@ -35,6 +36,9 @@ public:
                           "Set mount options.")
         .addOption({'c', "cache-forever"}, KJ_BIND_METHOD(*this, setCacheForever),
                    "Assume for caching purposes that the source directory never changes.")
+        .addOptionWithArg({'t', "threads"}, KJ_BIND_METHOD(*this, setThreads), "<count>",
+                          "Serve the mount from <count> threads, each with its own cloned "
+                          "channel to /dev/fuse.")
         .expectArg("<mount-point>", KJ_BIND_METHOD(*this, setMountPoint))
         .expectArg("<soure-dir>", KJ_BIND_METHOD(*this, setBindTo))
         .callAfterParsing(KJ_BIND_METHOD(*this, run))
@@ -58,6 +62,16 @@ private:
     return true;
   }
 
+  kj::MainBuilder::Validity setThreads(kj::StringPtr arg) {
+    char* end;
+    unsigned long count = strtoul(arg.cStr(), &end, 10);
+    if (arg.size() == 0 || *end != '\0' || count < 1 || count > 256) {
+      return "invalid thread count";
+    }
+    bindOptions.threadCount = count;
+    return true;
+  }
+
   kj::MainBuilder::Validity setMountPoint(kj::StringPtr arg) {
     mountPoint = arg;
     return true;
@@ -88,13 +102,16 @@ private:
       context.warning(kj::str("Shutting down due to signal: ", strsignal(sig.si_signo)));
     });
 
-    auto root = newLoopbackFuseNode(bindTo, 1 * kj::SECONDS);
+    kj::StringPtr bindTo = this->bindTo;
+    kj::Function<fuse::Node::Client()> rootFactory = [bindTo]() {
+      return newLoopbackFuseNode(bindTo, 1 * kj::SECONDS);
+    };
 
     FuseMount mount(mountPoint, options);
 
     context.warning("FUSE mirror mounted. Ctrl+C to unmount.");
 
-    bindFuse(eventPort, mount.getFd(), kj::mv(root), bindOptions)
+    bindFuse(eventPort, mount.getFd(), kj::mv(rootFactory), bindOptions)
         .then([&]() {
           context.warning("Shutting down due to unmount.");
           mount.dontUnmount();
@@ -18,7 +18,12 @@
 #include "send-fd.h"
 #include <linux/fuse.h>
 #include <kj/debug.h>
+#include <kj/mutex.h>
+#include <kj/thread.h>
+#include <kj/vector.h>
 #include <unordered_map>
+#include <set>
+#include <algorithm>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
@@ -33,6 +38,9 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <string.h>
 
 namespace sandstorm {
 
@@ -48,13 +56,519 @@ namespace sandstorm {
 
 using kj::uint;
 
+namespace {
+
+class LocalFdRegistry {
+  // Maps the tokens returned by File.getLocalFdToken() back to file descriptors. Only files
+  // implemented in this process can register, so a driver that redeems a token knows it can read
+  // the descriptor directly.
+
+public:
+  uint64_t add(int fd) {
+    uint64_t token;
+    auto lock = fds.lockExclusive();
+    do {
+      kj::FdInputStream(randomFd).read(&token, sizeof(token));
+    } while (token == 0 || lock->count(token) > 0);
+    lock->insert(std::make_pair(token, fd));
+    return token;
+  }
+
+  void remove(uint64_t token) {
+    fds.lockExclusive()->erase(token);
+  }
+
+  kj::Maybe<int> find(uint64_t token) {
+    auto lock = fds.lockExclusive();
+    auto iter = lock->find(token);
+    if (iter == lock->end()) {
+      return nullptr;
+    } else {
+      return iter->second;
+    }
+  }
+
+private:
+  kj::AutoCloseFd randomFd = openRandom();
+  kj::MutexGuarded<std::unordered_map<uint64_t, int>> fds;
+
+  static kj::AutoCloseFd openRandom() {
+    int fd;
+    KJ_SYSCALL(fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC));
+    return kj::AutoCloseFd(fd);
+  }
+};
+
+LocalFdRegistry& getLocalFdRegistry() {
+  static LocalFdRegistry registry;
+  return registry;
+}
+
+}  // namespace
+
+static uint32_t hashName(kj::StringPtr name) {
+  // FNV-1a.
+  // TODO(someday): Add hash functions to KJ and use them here.
+  uint32_t hash = 0x811c9dc5u;
+  for (char c: name) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 0x01000193u;
+  }
+  return hash;
+}
+
+class NodeTable {
+  // The kernel's view of the filesystem tree: each node ID the kernel holds, the parent and name
+  // under which it was found (so that any channel can re-derive its capability), and an index
+  // from (parent, name) to child so that repeated lookups return the same ID.
+  //
+  // Nodes are removed as soon as the kernel forgets them (and they have no remaining children),
+  // so the table is proportional to the kernel's inode cache rather than to everything ever
+  // looked up. Nodes live in a flat slab, and each node ID encodes its slot number along with a
+  // generation count, so finding a node by ID is just an array index. The (parent, name) index is
+  // an open-addressed hash table storing slot numbers. Names are interned, since the same few
+  // names ("node_modules", "__init__.py", ...) tend to appear in many directories.
+
+public:
+  NodeTable() {
+    // Slot 0 is never used, since node ID 0 is invalid. Slot 1 is the root, whose ID (generation
+    // zero) is FUSE_ROOT_ID. The kernel never forgets the root.
+    nodes.add();
+    nodes.add();
+    nodes[1].inUse = true;
+    nodes[1].refcount = 1;
+    nodeCount = 1;
+    static_assert(FUSE_ROOT_ID == 1, "root ID must map to slot 1");
+    index = kj::heapArray<IndexSlot>(64);
+    memset(index.begin(), 0, index.size() * sizeof(IndexSlot));
+  }
+
+  KJ_DISALLOW_COPY(NodeTable);
+
+  struct Node {
+    uint64_t parentId = 0;
+    uint64_t inode = 0;
+    uint64_t refcount = 0;  // number of "lookup" replies the kernel hasn't forgotten
+    uint64_t lastUsed = 0;  // value of `clock` when last returned by a lookup
+    kj::StringPtr name;     // interned; see `names`
+    uint32_t nameHash = 0;
+    uint32_t generation = 0;
+    uint32_t childCount = 0;  // live nodes whose parent is this one
+    bool inUse = false;
+  };
+
+  struct Stats {
+    uint64_t nodeCount;
+    uint64_t peakNodeCount;
+    uint64_t internedNames;
+    uint64_t approximateBytes;
+  };
+
+  kj::Maybe<Node&> find(uint64_t nodeId) {
+    uint64_t slot = nodeId & 0xffffffffu;
+    if (slot == 0 || slot >= nodes.size()) return nullptr;
+    Node& node = nodes[slot];
+    if (!node.inUse || node.generation != (nodeId >> 32)) return nullptr;
+    return node;
+  }
+
+  kj::Maybe<uint64_t> findChild(uint64_t parentId, kj::StringPtr name) {
+    uint32_t hash = hashName(name);
+    KJ_IF_MAYBE(pos, findIndex(parentId, name, hash)) {
+      return idOf(index[*pos].slot);
+    } else {
+      return nullptr;
+    }
+  }
+
+  uint64_t lookup(uint64_t parentId, kj::StringPtr name, uint64_t inode) {
+    // Record that the kernel is being told about child `name` of `parentId`, which has the given
+    // inode number, and return the ID to tell it. Each call adds one reference, to be released by
+    // forget().
+
+    ++clock;
+    uint32_t hash = hashName(name);
+    KJ_IF_MAYBE(pos, findIndex(parentId, name, hash)) {
+      uint32_t slot = index[*pos].slot;
+      Node& node = nodes[slot];
+      if (node.inode == inode) {
+        // This appears to be exactly the same child we returned previously. Use the same node ID.
+        ++node.refcount;
+        node.lastUsed = clock;
+        return idOf(slot);
+      }
+
+      // The inode number has changed since we looked it up, so we assume it has been replaced by
+      // a new node. The old node stays in the slab until the kernel forgets it, but lookups now
+      // find the new one.
+      //
+      // TODO(someday): It would be better to detect when a node has been replaced by
+      //   comparing the capabilities, though this requires "join" support (level 4 RPC).
+      removeIndex(*pos);
+    }
+
+    KJ_IF_MAYBE(parent, find(parentId)) {
+      ++parent->childCount;
+    } else {
+      KJ_FAIL_REQUIRE("lookup on unknown node ID", parentId);
+    }
+
+    uint32_t slot;
+    if (freeSlots.size() > 0) {
+      slot = freeSlots.end()[-1];
+      freeSlots.removeLast();
+    } else {
+      KJ_REQUIRE(nodes.size() < 0xffffffffu, "too many FUSE nodes");
+      slot = nodes.size();
+      nodes.add();
+    }
+
+    Node& node = nodes[slot];
+    node.parentId = parentId;
+    node.inode = inode;
+    node.refcount = 1;
+    node.lastUsed = clock;
+    node.name = intern(name);
+    node.nameHash = hash;
+    node.childCount = 0;
+    node.inUse = true;
+    insertIndex(IndexSlot { parentId, hash, slot });
+
+    if (++nodeCount > peakNodeCount) peakNodeCount = nodeCount;
+    return idOf(slot);
+  }
+
+  bool forget(uint64_t nodeId, uint64_t nlookup) {
+    // Release `nlookup` references. Returns true if the kernel no longer holds any, in which case
+    // capabilities for the node should be dropped. (The table itself may still need the entry in
+    // order to re-derive the node's children.)
+
+    KJ_IF_MAYBE(node, find(nodeId)) {
+      KJ_REQUIRE(node->refcount >= nlookup, "Kernel forgot more lookups than it had.", nodeId);
+      node->refcount -= nlookup;
+      if (node->refcount > 0) return false;
+      maybeFree(nodeId & 0xffffffffu);
+      return true;
+    } else {
+      KJ_FAIL_REQUIRE("Kernel forgot unknown node ID.", nodeId);
+    }
+  }
+
+  template <typename Func>
+  void forEachChild(Func&& func) {
+    // Calls func(parentId, name, nodeId) for every node other than the root.
+    for (uint32_t slot = 2; slot < nodes.size(); slot++) {
+      Node& node = nodes[slot];
+      if (node.inUse) {
+        func(node.parentId, node.name, idOf(slot));
+      }
+    }
+  }
+
+  kj::Vector<uint64_t> chooseEvictions(size_t count) {
+    // Pick up to `count` nodes which the kernel holds, which have no children, and which were
+    // least recently looked up. The caller will ask the kernel to drop them.
+
+    kj::Vector<std::pair<uint64_t, uint32_t>> candidates(nodeCount);
+    for (uint32_t slot = 2; slot < nodes.size(); slot++) {
+      Node& node = nodes[slot];
+      if (node.inUse && node.refcount > 0 && node.childCount == 0) {
+        candidates.add(std::make_pair(node.lastUsed, slot));
+      }
+    }
+
+    count = kj::min(count, candidates.size());
+    std::nth_element(candidates.begin(), candidates.begin() + count, candidates.end());
+
+    kj::Vector<uint64_t> result(count);
+    for (size_t i = 0; i < count; i++) {
+      result.add(idOf(candidates[i].second));
+    }
+    return result;
+  }
+
+  Stats getStats() {
+    return Stats {
+      nodeCount, peakNodeCount, names.size(),
+      nodes.capacity() * sizeof(Node) + index.size() * sizeof(IndexSlot) + nameBytes
+    };
+  }
+
+  inline uint64_t size() { return nodeCount; }
+
+private:
+  struct IndexSlot {
+    uint64_t parentId;
+    uint32_t nameHash;
+    uint32_t slot;  // zero = empty
+  };
+
+  struct InternedName {
+    kj::String text;
+    uint refcount;
+  };
+
+  struct NameHash {
+    inline size_t operator()(kj::StringPtr name) const { return hashName(name); }
+  };
+
+  kj::Vector<Node> nodes;
+  kj::Vector<uint32_t> freeSlots;
+  kj::Array<IndexSlot> index;  // size is always a power of two
+  size_t indexCount = 0;
+  std::unordered_map<kj::StringPtr, InternedName, NameHash> names;
+  size_t nameBytes = 0;
+  uint64_t nodeCount = 0;
+  uint64_t peakNodeCount = 0;
+  uint64_t clock = 0;
+
+  inline uint64_t idOf(uint32_t slot) {
+    return (uint64_t(nodes[slot].generation) << 32) | slot;
+  }
+
+  inline size_t homeOf(uint64_t parentId, uint32_t nameHash) {
+    uint64_t h = (parentId * 0x9e3779b97f4a7c15ull) ^ nameHash;
+    return (h ^ (h >> 29)) & (index.size() - 1);
+  }
+
+  kj::Maybe<size_t> findIndex(uint64_t parentId, kj::StringPtr name, uint32_t hash) {
+    size_t mask = index.size() - 1;
+    for (size_t pos = homeOf(parentId, hash);; pos = (pos + 1) & mask) {
+      IndexSlot& entry = index[pos];
+      if (entry.slot == 0) return nullptr;
+      if (entry.parentId == parentId && entry.nameHash == hash &&
+          nodes[entry.slot].name == name) {
+        return pos;
+      }
+    }
+  }
+
+  void insertIndex(IndexSlot entry) {
+    if ((indexCount + 1) * 2 > index.size()) {
+      // Keep the load factor at most 1/2.
+      auto old = kj::mv(index);
+      index = kj::heapArray<IndexSlot>(old.size() * 2);
+      memset(index.begin(), 0, index.size() * sizeof(IndexSlot));
+      indexCount = 0;
+      for (auto& oldEntry: old) {
+        if (oldEntry.slot != 0) insertIndex(oldEntry);
+      }
+    }
+
+    size_t mask = index.size() - 1;
+    size_t pos = homeOf(entry.parentId, entry.nameHash);
+    while (index[pos].slot != 0) pos = (pos + 1) & mask;
+    index[pos] = entry;
+    ++indexCount;
+  }
+
+  void removeIndex(size_t pos) {
+    // Backward-shift deletion, so that no tombstones are needed.
+    size_t mask = index.size() - 1;
+    size_t next = pos;
+    for (;;) {
+      next = (next + 1) & mask;
+      IndexSlot& entry = index[next];
+      if (entry.slot == 0) break;
+      size_t home = homeOf(entry.parentId, entry.nameHash);
+      // Can `entry` move back to `pos`? Only if its home is not cyclically within (pos, next].
+      bool homeInRange = pos <= next ? (pos < home && home <= next)
+                                     : (pos < home || home <= next);
+      if (!homeInRange) {
+        index[pos] = entry;
+        pos = next;
+      }
+    }
+    index[pos].slot = 0;
+    --indexCount;
+  }
+
+  void maybeFree(uint32_t slot) {
+    // Free the node in `slot` if nothing needs it anymore, then likewise its parent.
+
+    while (slot != 1) {
+      Node& node = nodes[slot];
+      if (node.refcount > 0 || node.childCount > 0) return;
+
+      // Remove from the index, unless it has already been replaced there.
+      KJ_IF_MAYBE(pos, findIndex(node.parentId, node.name, node.nameHash)) {
+        if (index[*pos].slot == slot) removeIndex(*pos);
+      }
+
+      uint64_t parentId = node.parentId;
+      unintern(node.name);
+      node.inUse = false;
+      node.name = nullptr;
+      ++node.generation;
+      freeSlots.add(slot);
+      --nodeCount;
+
+      KJ_IF_MAYBE(parent, find(parentId)) {
+        --parent->childCount;
+      }
+      slot = parentId & 0xffffffffu;
+    }
+  }
+
+  kj::StringPtr intern(kj::StringPtr name) {
+    auto iter = names.find(name);
+    if (iter == names.end()) {
+      InternedName interned { kj::heapString(name), 0 };
+      kj::StringPtr key = interned.text;
+      nameBytes += name.size() + 1;
+      iter = names.insert(std::make_pair(key, kj::mv(interned))).first;
+    }
+    ++iter->second.refcount;
+    return iter->second.text;
+  }
+
+  void unintern(kj::StringPtr name) {
+    auto iter = names.find(name);
+    KJ_ASSERT(iter != names.end());
+    if (--iter->second.refcount == 0) {
+      nameBytes -= name.size() + 1;
+      names.erase(iter);
+    }
+  }
+};
+
+struct FuseSharedState {
+  // Bookkeeping which must agree across every channel serving a single mount: which node IDs the
+  // kernel currently knows about, how to re-derive each of them from their parent, and which
+  // handle numbers have been handed out. With a single channel this is only ever touched by one
+  // thread, but the lock is uncontended and so costs next to nothing.
+  //
+  // Capabilities can't be shared between threads, so this table doesn't hold any; each
+  // FuseDriver keeps its own caps and consults this table to fill in IDs it hasn't seen before.
+
+  enum class IdType { NODE, FILE, DIRECTORY };
+
+  struct DroppedId {
+    IdType idType;
+    uint64_t id;
+  };
+
+  NodeTable nodes;
+  uint64_t handleCounter = 0;
+
+  uint64_t evictionsRequested = 0;
+  // Number of entries we've asked the kernel to drop because `nodes` grew past
+  // FuseOptions::maxNodes.
+
+  uint64_t lookupsSinceEviction = 0;
+
+  kj::Array<kj::Vector<DroppedId>> dropQueues;
+  // One queue per channel. When the kernel forgets a node or releases a handle via one channel,
+  // the ID is queued here for every other channel so that they can drop their own capabilities
+  // for it.
+
+  explicit FuseSharedState(uint channelCount)
+      : dropQueues(kj::heapArray<kj::Vector<DroppedId>>(channelCount)) {}
+
+  void drop(uint fromChannel, IdType idType, uint64_t id) {
+    for (uint i: kj::indices(dropQueues)) {
+      if (i != fromChannel) {
+        dropQueues[i].add(DroppedId { idType, id });
+      }
+    }
+  }
+};
+
+class FuseNotifier {
+  // Writes cache invalidation notifications to /dev/fuse from a dedicated thread.
+  //
+  // Notifications can't be written from the thread that serves requests: FUSE_NOTIFY_INVAL_ENTRY
+  // takes the lock on the parent directory, which may be held by some other process that is in
+  // the middle of a lookup, and that lookup can't complete until we reply to it.
+
+public:
+  explicit FuseNotifier(int fuseFd)
+      : fuseFd(fuseFd), wakePipe(makeWakePipe()),
+        thread([this]() { run(); }) {}
+
+  ~FuseNotifier() noexcept(false) {
+    // Closing the write end makes the thread see EOF, at which point it exits. Destroying
+    // `thread` then joins it.
+    wakePipe.writeEnd = nullptr;
+  }
+
+  KJ_DISALLOW_COPY(FuseNotifier);
+
+  void send(kj::Array<kj::byte> message) {
+    bool wasEmpty;
+    {
+      auto lock = queue.lockExclusive();
+      wasEmpty = lock->size() == 0;
+      lock->add(kj::mv(message));
+    }
+
+    if (wasEmpty) {
+      kj::byte b = 0;
+      KJ_SYSCALL(write(wakePipe.writeEnd, &b, 1));
+    }
+  }
+
+private:
+  struct WakePipe {
+    kj::AutoCloseFd readEnd;
+    kj::AutoCloseFd writeEnd;
+  };
+
+  int fuseFd;
+  kj::MutexGuarded<kj::Vector<kj::Array<kj::byte>>> queue;
+  WakePipe wakePipe;
+  kj::Thread thread;  // Must be last so that it starts after, and stops before, everything else.
+
+  static WakePipe makeWakePipe() {
+    int fds[2];
+    KJ_SYSCALL(pipe2(fds, O_CLOEXEC));
+    return WakePipe { kj::AutoCloseFd(fds[0]), kj::AutoCloseFd(fds[1]) };
+  }
+
+  void run() {
+    for (;;) {
+      kj::byte scratch[64];
+      ssize_t n = read(wakePipe.readEnd, scratch, sizeof(scratch));
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        int error = errno;
+        KJ_LOG(ERROR, "FUSE notifier wake pipe failed", strerror(error));
+        return;
+      } else if (n == 0) {
+        return;
+      }
+
+      kj::Vector<kj::Array<kj::byte>> messages;
+      {
+        auto lock = queue.lockExclusive();
+        messages = kj::mv(*lock);
+      }
+
+      for (auto& message: messages) {
+        while (write(fuseFd, message.begin(), message.size()) < 0) {
+          int error = errno;
+          if (error == EINTR) continue;
+          // ENOENT means the kernel didn't have the entry cached in the first place, and ENODEV
+          // means the filesystem has been unmounted. Either way, there's nothing to invalidate.
+          if (error != ENOENT && error != ENODEV) {
+            KJ_LOG(ERROR, "couldn't write FUSE notification", strerror(error));
+          }
+          break;
+        }
+      }
+    }
+  }
+};
+
 class FuseDriver final: private kj::TaskSet::ErrorHandler {
 public:
   FuseDriver(kj::UnixEventPort& eventPort, int fuseFd, fuse::Node::Client&& root,
-             FuseOptions options)
+             FuseOptions options, kj::MutexGuarded<FuseSharedState>& shared, uint channel)
       : observer(eventPort, fuseFd, kj::UnixEventPort::FdObserver::OBSERVE_READ),
-        fuseFd(fuseFd), options(options) {
-    nodeMap.insert(std::make_pair(FUSE_ROOT_ID, NodeMapEntry { kj::mv(root), 1 }));
+        fuseFd(fuseFd), options(options), shared(shared), channel(channel),
+        buffer(kj::heapArray<kj::byte>(READ_BUFFER_SIZE)),
+        splicePipe(makeSplicePipe()) {
+    nodeMap.insert(std::make_pair(FUSE_ROOT_ID, NodeMapEntry { kj::mv(root) }));
 
     int flags;
     KJ_SYSCALL(flags = fcntl(fuseFd, F_GETFL));
@@ -63,10 +577,28 @@ public:
     }
   }
 
+  ~FuseDriver() noexcept(false) {
+    // Outstanding responses must be returned to the pools before the pools are destroyed.
+    tasks.clear();
+    lastCompletedTask = nullptr;
+
+    KJ_IF_MAYBE(link, watchLink) {
+      // The watcher may outlive us if the filesystem holds on to it.
+      link->get()->driver = nullptr;
+    }
+  }
+
+  KJ_DISALLOW_COPY(FuseDriver);
+
   kj::Promise<void> run() {
     auto paf = kj::newPromiseAndFulfiller<void>();
     abortReadLoop = kj::mv(paf.fulfiller);
 
+    if (channel == 0) {
+      // Only one channel needs to watch, since they all share the same node table.
+      startWatching();
+    }
+
     // Wait for readLoop() to report disconnect, but fail early if aborted.
     return readLoop().exclusiveJoin(kj::mv(paf.promise));
   }
@@ -75,6 +607,8 @@ private:
   kj::UnixEventPort::FdObserver observer;
   int fuseFd;
   FuseOptions options;
+  kj::MutexGuarded<FuseSharedState>& shared;
+  uint channel;  // Index of this driver's queue in `shared.dropQueues`.
   std::unordered_map<uint64_t, kj::Promise<void>> tasks;
   kj::Own<kj::PromiseFulfiller<void>> abortReadLoop;  // Reject this to stop reading early.
 
@@ -83,9 +617,10 @@ private:
   //   you are currently running is bad, so it is moved to this member instead, where we know it
   //   won't be overwritten at least until after returning.
 
+  typedef FuseSharedState::IdType IdType;
+
   struct NodeMapEntry {
     fuse::Node::Client node;
-    uint refcount = 0;  // number of "lookup" requests that have returned this node
 
     // TODO(cleanup):  Come up with better map implementation that doesn't freak out about the
     //   non-const copy constructor.
@@ -96,6 +631,10 @@ private:
 
   struct FileMapEntry {
     fuse::File::Client cap;
+    int localFd = -1;  // If not -1, `cap` is implemented in this process and reads from this fd.
+    uint64_t knownSize = 0;
+    // Size of `localFd` as of the last fstat(). Reads that end within it don't fstat() again; if
+    // the file has since shrunk, the splice just comes up short.
 
     // TODO(cleanup):  Come up with better map implementation that doesn't freak out about the
     //   non-const copy constructor.
@@ -114,43 +653,65 @@ private:
     DirectoryMapEntry& operator=(DirectoryMapEntry&&) = default;
   };
 
-  struct ChildKey {
-    uint64_t parentId;
-    kj::StringPtr name;
-
-    struct Eq {
-      inline bool operator()(const ChildKey& a, const ChildKey& b) const {
-        return a.parentId == b.parentId && a.name == b.name;
-      }
-    };
-    struct Hash {
-      inline size_t operator()(const ChildKey& key) const {
-        // TODO(someday): Add hash functions to KJ and use them here.
-        uint64_t hash = key.parentId ^ 0xcbf29ce484222325ull;
-        for (char c: key.name) {
-          hash = hash * 0x100000001b3ull;
-          hash ^= c;
-        }
-        return hash;
-      }
-    };
-  };
+  // Capabilities known to this channel. Reference counts and the parent/name needed to
+  // reconstruct missing entries live in `shared`.
+  std::unordered_map<uint64_t, NodeMapEntry> nodeMap;
+  std::unordered_map<uint64_t, FileMapEntry> fileMap;
+  std::unordered_map<uint64_t, DirectoryMapEntry> directoryMap;
 
-  struct ChildInfo {
-    uint64_t nodeId;
-    uint64_t inode;
-    kj::String name;
+  static constexpr uint MAX_WRITE = 65536;
+  // The max_write we always offer in FUSE_INIT. We don't support writes, so there's no reason to
+  // negotiate anything bigger (or smaller).
+
+  static constexpr size_t READ_BUFFER_SIZE = MAX_WRITE + 4096;
+  // The kernel refuses to read into a buffer that couldn't hold a maximum-size write plus its
+  // headers, even on a read-only filesystem. This is fixed rather than taken from the FUSE_INIT
+  // exchange because the buffer has to exist before FUSE_INIT arrives, and other channels may
+  // already be reading by the time it does; since we never offer anything but MAX_WRITE, the two
+  // come to the same thing.
+
+  kj::Array<kj::byte> buffer;
+  // Requests are read into this one buffer, which is reused for the life of the driver.
+
+  struct SplicePipe {
+    // Pipe through which FUSE_READ replies are spliced from local files into /dev/fuse.
+    kj::AutoCloseFd readEnd;
+    kj::AutoCloseFd writeEnd;
+    size_t maxContentSize;
+    // Largest read we'll try to splice. The kernel accounts pipe capacity in page-sized slots
+    // rather than bytes, and the header and an unaligned read each take up an extra slot, so this
+    // is somewhat less than the pipe's nominal size.
+
+    void drain() {
+      // Discard anything left in the pipe after a failed splice.
+      kj::byte scratch[4096];
+      while (read(readEnd, scratch, sizeof(scratch)) > 0) {}
+    }
   };
 
-  std::unordered_map<uint64_t, NodeMapEntry> nodeMap;
-  std::unordered_map<ChildKey, ChildInfo, ChildKey::Hash, ChildKey::Eq> childMap;
-  uint64_t nodeIdCounter = 1000;
+  kj::Maybe<SplicePipe> splicePipe;
+  // Null if splicing isn't available, in which case all reads go through File.read().
 
-  std::unordered_map<uint64_t, FileMapEntry> fileMap;
-  std::unordered_map<uint64_t, DirectoryMapEntry> directoryMap;
-  uint64_t handleCounter = 0;
+  static kj::Maybe<SplicePipe> makeSplicePipe() {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0) {
+      return nullptr;
+    }
+    SplicePipe result { kj::AutoCloseFd(fds[0]), kj::AutoCloseFd(fds[1]), 0 };
 
-  kj::byte buffer[65536 + 100];
+    // The default pipe size (64k) can't hold a maximum-size read plus its header, so try to grow
+    // it. Reads that still don't fit just take the slow path.
+    int capacity = fcntl(result.writeEnd, F_SETPIPE_SZ, 1 << 20);
+    if (capacity < 0) {
+      KJ_SYSCALL(capacity = fcntl(result.writeEnd, F_GETPIPE_SZ));
+    }
+    size_t headroom = 2 * sysconf(_SC_PAGESIZE);
+    if (size_t(capacity) <= headroom) {
+      return nullptr;
+    }
+    result.maxContentSize = capacity - headroom;
+    return kj::mv(result);
+  }
 
   // =====================================================================================
 
@@ -169,21 +730,315 @@ private:
   }
 
   // =====================================================================================
-  // Write helpers
+  // Cross-channel helpers
 
-  enum class IdType { NODE, FILE, DIRECTORY };
+  fuse::Node::Client getNode(uint64_t nodeId) {
+    // Get the capability for the given node ID. If the kernel obtained this node through some
+    // other channel, look it up again by name from its parent. The lookups are pipelined, so
+    // this doesn't add a round trip before the caller's request is sent.
+
+    auto iter = nodeMap.find(nodeId);
+    if (iter != nodeMap.end()) {
+      return iter->second.node;
+    }
+
+    uint64_t parentId;
+    kj::String name;
+    {
+      auto lock = shared.lockExclusive();
+      KJ_IF_MAYBE(info, lock->nodes.find(nodeId)) {
+        parentId = info->parentId;
+        name = kj::heapString(info->name);
+      } else {
+        KJ_FAIL_REQUIRE("Kernel asked for unknown node ID.", nodeId);
+      }
+    }
+
+    auto request = getNode(parentId).lookupRequest(
+        capnp::MessageSize { name.size() / sizeof(capnp::word) + 8, 0 });
+    request.setName(name);
+    fuse::Node::Client node = request.send().getNode();
+    nodeMap.insert(std::make_pair(nodeId, NodeMapEntry { node }));
+    return node;
+  }
+
+  fuse::File::Client getFile(uint64_t handle, uint64_t nodeId) {
+    auto iter = fileMap.find(handle);
+    if (iter != fileMap.end()) {
+      return iter->second.cap;
+    }
+
+    // Opened through another channel. Since we only support reading, opening the node again is
+    // indistinguishable from sharing the other channel's handle.
+    KJ_REQUIRE(options.threadCount > 1, "Kernel requested invalid file handle?");
+    fuse::File::Client file = getNode(nodeId).openAsFileRequest(capnp::MessageSize {4, 0})
+        .send().getFile();
+    fileMap.insert(std::make_pair(handle, FileMapEntry { file }));
+    return file;
+  }
+
+  fuse::Directory::Client getDirectory(uint64_t handle, uint64_t nodeId) {
+    auto iter = directoryMap.find(handle);
+    if (iter != directoryMap.end()) {
+      return iter->second.cap;
+    }
+
+    // Opened through another channel. Directory offsets are stable across opens, so reopening
+    // the node is fine here as well.
+    KJ_REQUIRE(options.threadCount > 1, "Kernel requested invalid directory handle?");
+    fuse::Directory::Client directory =
+        getNode(nodeId).openAsDirectoryRequest(capnp::MessageSize {4, 0}).send().getDirectory();
+    directoryMap.insert(std::make_pair(handle, DirectoryMapEntry { directory }));
+    return directory;
+  }
+
+  void forget(kj::Locked<FuseSharedState>& lock, uint64_t nodeId, uint64_t nlookup) {
+    if (lock->nodes.forget(nodeId, nlookup)) {
+      nodeMap.erase(nodeId);
+      lock->drop(channel, IdType::NODE, nodeId);
+      updateStats(lock);
+    }
+  }
+
+  void updateStats(kj::Locked<FuseSharedState>& lock) {
+    if (options.stats != nullptr) {
+      auto& stats = *options.stats;
+      auto tableStats = lock->nodes.getStats();
+      stats.nodeCount.store(tableStats.nodeCount, std::memory_order_relaxed);
+      stats.peakNodeCount.store(tableStats.peakNodeCount, std::memory_order_relaxed);
+      stats.internedNames.store(tableStats.internedNames, std::memory_order_relaxed);
+      stats.tableBytes.store(tableStats.approximateBytes, std::memory_order_relaxed);
+      stats.evictionsRequested.store(lock->evictionsRequested, std::memory_order_relaxed);
+    }
+  }
+
+  void maybeEvict(kj::Locked<FuseSharedState>& lock) {
+    // If the node table has grown past `options.maxNodes`, ask the kernel to drop some of the
+    // least-recently-used entries. It will FORGET them once nothing on the system is using them,
+    // at which point they are removed from the table. We can't simply delete them ourselves,
+    // since the kernel may use any node ID it holds at any time.
+    //
+    // Scanning for victims is linear in the table size, so we do it in batches of 1/8 of the
+    // limit, and at most once per that many lookups.
+
+    if (options.maxNodes == 0 || lock->nodes.size() <= options.maxNodes) return;
+
+    uint64_t batch = kj::max(options.maxNodes / 8, uint64_t(1));
+    if (++lock->lookupsSinceEviction < batch) return;
+    lock->lookupsSinceEviction = 0;
+
+    for (uint64_t nodeId: lock->nodes.chooseEvictions(batch)) {
+      KJ_IF_MAYBE(info, lock->nodes.find(nodeId)) {
+        notifyInvalEntry(info->parentId, info->name);
+        ++lock->evictionsRequested;
+      }
+    }
+  }
+
+  void processDrops() {
+    // Drop capabilities that other channels have told us the kernel is done with.
+
+    kj::Vector<FuseSharedState::DroppedId> drops;
+    {
+      auto lock = shared.lockExclusive();
+      auto& queue = lock->dropQueues[channel];
+      if (queue.size() == 0) return;
+      drops = kj::mv(queue);
+    }
+
+    for (auto& drop: drops) {
+      switch (drop.idType) {
+        case IdType::NODE: nodeMap.erase(drop.id); break;
+        case IdType::FILE: fileMap.erase(drop.id); break;
+        case IdType::DIRECTORY: directoryMap.erase(drop.id); break;
+      }
+    }
+  }
+
+  // =====================================================================================
+  // Cache invalidation
+
+  struct WatchLink: public kj::Refcounted {
+    kj::Maybe<FuseDriver&> driver;  // Null once the driver is destroyed.
+  };
+
+  class ChangeWatcherImpl final: public fuse::ChangeWatcher::Server {
+  public:
+    explicit ChangeWatcherImpl(kj::Own<WatchLink> link): link(kj::mv(link)) {}
+
+  protected:
+    kj::Promise<void> invalidate(InvalidateContext context) override {
+      KJ_IF_MAYBE(driver, link->driver) {
+        for (auto path: context.getParams().getPaths()) {
+          driver->invalidate(path);
+        }
+      }
+      return kj::READY_NOW;
+    }
+
+  private:
+    kj::Own<WatchLink> link;
+  };
+
+  kj::Maybe<kj::Own<WatchLink>> watchLink;
+  kj::Maybe<kj::Own<FuseNotifier>> notifier;
+  kj::Promise<void> watchTask = nullptr;
+  Handle::Client watchHandle = nullptr;
+
+  void startWatching() {
+    auto link = kj::refcounted<WatchLink>();
+    link->driver = *this;
+
+    auto request = nodeMap.find(FUSE_ROOT_ID)->second.node.watchRequest();
+    request.setWatcher(kj::heap<ChangeWatcherImpl>(kj::addRef(*link)));
+    watchLink = kj::mv(link);
+
+    watchTask = request.send().then([this](auto&& response) {
+      // Hold on to the handle for as long as we're running.
+      watchHandle = response.getHandle();
+    }, [](kj::Exception&& e) {
+      // Most filesystems can't detect changes and so don't implement watch(). That's fine; we
+      // just rely on TTLs.
+      if (e.getType() != kj::Exception::Type::UNIMPLEMENTED) {
+        KJ_LOG(WARNING, "couldn't watch FUSE filesystem for changes", e);
+      }
+    }).eagerlyEvaluate(nullptr);
+  }
+
+  void invalidate(kj::StringPtr path) {
+    // Tell the kernel to drop whatever it has cached about the node at `path`, relative to the
+    // root. Nodes the kernel has never looked up are skipped, since there's nothing to drop.
+
+    auto lock = shared.lockExclusive();
+
+    if (path.size() == 0) {
+      // Anything may have changed. Invalidate every entry the kernel might know about.
+      lock->nodes.forEachChild([this](uint64_t parentId, kj::StringPtr name, uint64_t nodeId) {
+        notifyInvalEntry(parentId, name);
+        notifyInvalInode(nodeId);
+      });
+      notifyInvalInode(FUSE_ROOT_ID);
+      return;
+    }
+
+    uint64_t parentId = FUSE_ROOT_ID;
+    for (;;) {
+      kj::String name;
+      kj::StringPtr rest;
+      KJ_IF_MAYBE(slashPos, path.findFirst('/')) {
+        name = kj::heapString(path.slice(0, *slashPos));
+        rest = path.slice(*slashPos + 1);
+      } else {
+        name = kj::heapString(path);
+      }
+
+      if (name.size() == 0) {
+        // Empty component, e.g. from a doubled or trailing slash.
+        if (rest.size() == 0) break;
+        path = rest;
+        continue;
+      }
+
+      uint64_t childId;
+      KJ_IF_MAYBE(id, lock->nodes.findChild(parentId, name)) {
+        childId = *id;
+      } else {
+        // The kernel doesn't know about this, so it has nothing cached at or below it.
+        return;
+      }
+
+      if (rest.size() == 0) {
+        // Found the changed node. Drop the directory entry, the node's attributes and content,
+        // and the parent's attributes (whose mtime and link count may have changed).
+        notifyInvalEntry(parentId, name);
+        notifyInvalInode(childId);
+        notifyInvalInode(parentId);
+        return;
+      }
+
+      parentId = childId;
+      path = rest;
+    }
+
+    // The path named a directory with a trailing slash; just invalidate the directory itself.
+    notifyInvalInode(parentId);
+  }
+
+  FuseNotifier& getNotifier() {
+    KJ_IF_MAYBE(n, notifier) {
+      return **n;
+    } else {
+      auto newNotifier = kj::heap<FuseNotifier>(fuseFd);
+      auto& result = *newNotifier;
+      notifier = kj::mv(newNotifier);
+      return result;
+    }
+  }
+
+  void notifyInvalEntry(uint64_t parentId, kj::StringPtr name) {
+    struct fuse_out_header header;
+    struct fuse_notify_inval_entry_out body;
+    memset(&header, 0, sizeof(header));
+    memset(&body, 0, sizeof(body));
+
+    auto message = kj::heapArray<kj::byte>(sizeof(header) + sizeof(body) + name.size() + 1);
+    header.len = message.size();
+    header.error = FUSE_NOTIFY_INVAL_ENTRY;  // Notifications put their code here, with unique = 0.
+    body.parent = parentId;
+    body.namelen = name.size();
+
+    memcpy(message.begin(), &header, sizeof(header));
+    memcpy(message.begin() + sizeof(header), &body, sizeof(body));
+    memcpy(message.begin() + sizeof(header) + sizeof(body), name.cStr(), name.size() + 1);
+    getNotifier().send(kj::mv(message));
+  }
+
+  void notifyInvalInode(uint64_t nodeId) {
+    // Invalidates the node's attributes and all of its cached content.
+
+    struct fuse_out_header header;
+    struct fuse_notify_inval_inode_out body;
+    memset(&header, 0, sizeof(header));
+    memset(&body, 0, sizeof(body));
+
+    auto message = kj::heapArray<kj::byte>(sizeof(header) + sizeof(body));
+    header.len = message.size();
+    header.error = FUSE_NOTIFY_INVAL_INODE;
+    body.ino = nodeId;
+    body.off = 0;
+    body.len = 0;  // zero = to end of file
+
+    memcpy(message.begin(), &header, sizeof(header));
+    memcpy(message.begin() + sizeof(header), &body, sizeof(body));
+    getNotifier().send(kj::mv(message));
+  }
+
+  // =====================================================================================
+  // Write helpers
 
   struct CapToInsert {
     IdType idType;
     uint64_t id;
     capnp::Capability::Client cap;
+
+    uint64_t parentId = 0;
+    kj::String name;
+    uint64_t inode = 0;
+    uint64_t* nodeIdOut = nullptr;
+    // For nodes only: the parent, name, and inode number under which the node was looked up. Node
+    // IDs are assigned in insertObject(), which also writes the ID to `*nodeIdOut` (in the body of
+    // the response); `id` is ignored.
+
+    int localFd = -1;
+    // For files only: the descriptor backing the file, if it lives in this process. See
+    // File.getLocalFdToken().
   };
 
   struct ResponseBase {
-    kj::Maybe<CapToInsert> newObject;
-    // If the operation created a new capability, this is it. It hasn't been added to the tables
-    // yet; that should happen when the write() completes successfully, in case the operation is
-    // canceled (and the promised dropped) before that.
+    kj::Vector<CapToInsert> newObjects;
+    // Capabilities created by the operation (usually at most one, but READDIRPLUS may return many).
+    // They haven't been added to the tables yet; that happens in writeResponse(), in case the
+    // operation is canceled (and the promise dropped) before that.
 
     struct fuse_out_header header;
     // Do not place any other members after `header` -- we rely on the subclass being able to
@@ -192,6 +1047,12 @@ private:
     inline ResponseBase() { memset(&header, 0, sizeof(header)); }
     virtual ~ResponseBase() noexcept(false) {}
 
+    void reset() {
+      // Prepare a recycled object for reuse; see ResponsePool.
+      if (newObjects.size() > 0) newObjects = kj::Vector<CapToInsert>();
+      memset(&header, 0, sizeof(header));
+    }
+
     virtual size_t size() { return sizeof(header); }
     virtual ssize_t writeSelf(int fd) { return write(fd, &header, sizeof(header)); }
   };
@@ -205,6 +1066,12 @@ private:
       memset(&body, 0, sizeof(body));
     }
 
+    void reset() {
+      ResponseBase::reset();
+      memset(&body, 0, sizeof(body));
+      bodySize = sizeof(body);
+    }
+
     virtual size_t size() override {
       return sizeof(header) + bodySize;
     }
@@ -263,13 +1130,171 @@ private:
     }
   };
 
+  struct SpliceResponse: public ResponseBase {
+    // Response to FUSE_READ whose content is spliced directly from a local file into /dev/fuse,
+    // never passing through our address space.
+
+    fuse::File::Client owner;  // Keeps `fd` open.
+    int fd;
+    uint64_t offset;
+    size_t contentSize;
+    SplicePipe& pipe;
+
+    inline SpliceResponse(fuse::File::Client owner, int fd, uint64_t offset, size_t contentSize,
+                          SplicePipe& pipe)
+        : owner(kj::mv(owner)), fd(fd), offset(offset), contentSize(contentSize), pipe(pipe) {}
+
+    virtual size_t size() override {
+      return sizeof(header) + contentSize;
+    }
+
+    virtual ssize_t writeSelf(int fuseFd) override {
+      // Stage the header in the pipe followed by the content, then move all of it into /dev/fuse
+      // with a single splice() so that the kernel sees one message. If staging fails in any way,
+      // fall back to copying.
+
+      ssize_t n = write(pipe.writeEnd, &header, sizeof(header));
+      if (n != sizeof(header)) {
+        // The pipe should be empty here, so this is unexpected, but it's no reason to fail.
+        pipe.drain();
+        return writeCopied(fuseFd);
+      }
+
+      size_t spliced = 0;
+      loff_t pos = offset;
+      while (spliced < contentSize) {
+        n = splice(fd, &pos, pipe.writeEnd, nullptr, contentSize - spliced, SPLICE_F_MOVE);
+        if (n < 0) {
+          if (errno == EINTR) continue;
+          break;
+        } else if (n == 0) {
+          // Unexpected EOF; the file must have been truncated since we stat()ed it.
+          break;
+        }
+        spliced += n;
+      }
+
+      if (spliced < contentSize) {
+        // Rare: we couldn't splice everything, e.g. because the pipe filled up despite our
+        // headroom. Start over the ordinary way, which also sorts out truncation and read errors.
+        pipe.drain();
+        return writeCopied(fuseFd);
+      }
+
+      n = splice(pipe.readEnd, nullptr, fuseFd, nullptr, header.len, SPLICE_F_MOVE);
+      if (n < 0) {
+        // Leave the pipe empty for the next reply, but report the original error.
+        int error = errno;
+        pipe.drain();
+        errno = error;
+      }
+      return n;
+    }
+
+    ssize_t writeCopied(int fuseFd) {
+      // Reply by reading the content into memory and writing it along with the header.
+
+      auto message = kj::heapArray<kj::byte>(sizeof(header) + contentSize);
+      size_t got = 0;
+      int readError = 0;
+      while (got < contentSize) {
+        ssize_t n = pread(fd, message.begin() + sizeof(header) + got, contentSize - got,
+                          offset + got);
+        if (n < 0) {
+          if (errno == EINTR) continue;
+          readError = errno;
+          break;
+        } else if (n == 0) {
+          break;
+        }
+        got += n;
+      }
+
+      if (readError != 0) {
+        header.error = -EIO;
+        header.len = sizeof(header);
+      } else {
+        header.len = sizeof(header) + got;
+      }
+      memcpy(message.begin(), &header, sizeof(header));
+      return write(fuseFd, message.begin(), header.len);
+    }
+  };
+
+  template <typename T>
+  class ResponsePool final: public kj::Disposer {
+    // Recycles response objects of type T (which must be exactly ResponseBase or some
+    // Response<U>). Nearly every request allocates one of these and frees it again as soon as it
+    // has been written, so keeping a few around saves a malloc()/free() pair per request.
+
+  public:
+    ResponsePool() = default;
+    ~ResponsePool() noexcept(false) {
+      for (auto object: freeList) {
+        delete object;
+      }
+    }
+    KJ_DISALLOW_COPY(ResponsePool);
+
+    kj::Own<T> alloc() {
+      T* object;
+      if (freeList.size() > 0) {
+        object = freeList.end()[-1];
+        freeList.removeLast();
+      } else {
+        object = new T();
+      }
+      return kj::Own<T>(object, *this);
+    }
+
+  private:
+    mutable kj::Vector<T*> freeList;
+
+    static constexpr size_t MAX_FREE = 64;
+    // Enough to cover a burst of concurrent requests without hoarding memory.
+
+    void disposeImpl(void* pointer) const override {
+      // `pointer` points at the most-derived object, which is exactly a T.
+      T* object = reinterpret_cast<T*>(pointer);
+      if (freeList.size() < MAX_FREE) {
+        object->reset();
+        freeList.add(object);
+      } else {
+        delete object;
+      }
+    }
+  };
+
+  // Pools for the response types used by the most frequent requests. Note that responses may be
+  // held by `tasks`, so the destructor must clear it before these are destroyed.
+  ResponsePool<ResponseBase> emptyResponsePool;
+  ResponsePool<Response<struct fuse_entry_out>> entryResponsePool;
+  ResponsePool<Response<struct fuse_attr_out>> attrResponsePool;
+  ResponsePool<Response<struct fuse_open_out>> openResponsePool;
+
+  template <typename T>
+  kj::Maybe<ResponsePool<Response<T>>&> poolFor(T*) { return nullptr; }
+  kj::Maybe<ResponsePool<Response<struct fuse_entry_out>>&> poolFor(struct fuse_entry_out*) {
+    return entryResponsePool;
+  }
+  kj::Maybe<ResponsePool<Response<struct fuse_attr_out>>&> poolFor(struct fuse_attr_out*) {
+    return attrResponsePool;
+  }
+  kj::Maybe<ResponsePool<Response<struct fuse_open_out>>&> poolFor(struct fuse_open_out*) {
+    return openResponsePool;
+  }
+
   template <typename T>
   kj::Own<Response<T>> allocResponse() {
-    return kj::heap<Response<T>>();
+    KJ_IF_MAYBE(pool, poolFor(static_cast<T*>(nullptr))) {
+      return pool->alloc();
+    } else {
+      return kj::heap<Response<T>>();
+    }
   }
 
   kj::Own<ResponseBase> allocEmptyResponse() {
-    return kj::heap<ResponseBase>();
+    return emptyResponsePool.alloc();
   }
 
   template <typename T, typename ContentOwner>
@@ -284,7 +1309,7 @@ private:
       response->header.unique = requestId;
       return kj::mv(response);
     }, [this, requestId, defaultError](kj::Exception&& e) {
-      auto errorResponse = kj::heap<ResponseBase>();
+      auto errorResponse = allocEmptyResponse();
       errorResponse->header.error = -defaultError;  // TODO(someday): Real error numbers.
       errorResponse->header.unique = requestId;
       return kj::mv(errorResponse);
@@ -306,7 +1331,7 @@ private:
   }
 
   void sendError(uint64_t requestId, int error) {
-    auto response = kj::heap<ResponseBase>();
+    auto response = allocEmptyResponse();
     response->header.error = -error;  // Has to be negative. Just because.
     response->header.unique = requestId;
     writeResponse(kj::mv(response));
@@ -316,6 +1341,13 @@ private:
     size_t size = response->size();
     response->header.len = size;
 
+    // Add any new capability to the appropriate table *before* the kernel hears about it: with
+    // multiple channels, the kernel may use the new ID on another thread before write() even
+    // returns here.
+    for (auto& newObj: response->newObjects) {
+      insertObject(newObj);
+    }
+
   retry:
     ssize_t n = response->writeSelf(fuseFd);
 
@@ -330,33 +1362,60 @@ private:
           // According to the libfuse code, this means "the operation was interrupted". It's
           // unclear to me if this is officially part of the protocol or if libfuse is just not
           // doing the proper bookkeeping and is double-replying to interrupted requests. In any
-          // case, it seems safe to move on here (without updating the cap maps).
+          // case, it seems safe to move on here (after backing out the cap maps).
+          for (auto& newObj: response->newObjects) {
+            removeObject(newObj);
+          }
           break;
         default:
           KJ_FAIL_SYSCALL("write(/dev/fuse)", error);
       }
     } else {
-      KJ_ASSERT(n == size, "write() to FUSE device didn't accept entire command?");
-
-      // Message accepted. Make sure any new capability is added to the appropriate table.
-      KJ_IF_MAYBE(newObj, response->newObject) {
-        switch (newObj->idType) {
-          case IdType::NODE: {
-            auto insertResult = nodeMap.insert(std::make_pair(newObj->id,
-                NodeMapEntry { newObj->cap.castAs<fuse::Node>(), 0 }));
-            ++insertResult.first->second.refcount;
-            break;
-          }
-          case IdType::FILE:
-            fileMap.insert(std::make_pair(newObj->id,
-                FileMapEntry { newObj->cap.castAs<fuse::File>() }));
-            break;
-          case IdType::DIRECTORY:
-            directoryMap.insert(std::make_pair(newObj->id,
-                DirectoryMapEntry { newObj->cap.castAs<fuse::Directory>() }));
-            break;
+      // Note that header.len may be smaller than `size` if a spliced read came up short.
+      KJ_ASSERT(n == response->header.len,
+                "write() to FUSE device didn't accept entire command?");
+    }
+  }
+
+  void insertObject(CapToInsert& newObj) {
+    switch (newObj.idType) {
+      case IdType::NODE: {
+        {
+          auto lock = shared.lockExclusive();
+          newObj.id = lock->nodes.lookup(newObj.parentId, newObj.name, newObj.inode);
+          maybeEvict(lock);
+          updateStats(lock);
         }
+        *newObj.nodeIdOut = newObj.id;
+        // If the kernel already holds this ID then we already have a cap for it, which we keep.
+        nodeMap.insert(std::make_pair(newObj.id,
+            NodeMapEntry { newObj.cap.castAs<fuse::Node>() }));
+        break;
+      }
+      case IdType::FILE:
+        fileMap.insert(std::make_pair(newObj.id,
+            FileMapEntry { newObj.cap.castAs<fuse::File>(), newObj.localFd }));
+        break;
+      case IdType::DIRECTORY:
+        directoryMap.insert(std::make_pair(newObj.id,
+            DirectoryMapEntry { newObj.cap.castAs<fuse::Directory>() }));
+        break;
+    }
+  }
+
+  void removeObject(CapToInsert& newObj) {
+    switch (newObj.idType) {
+      case IdType::NODE: {
+        auto lock = shared.lockExclusive();
+        forget(lock, newObj.id, 1);
+        break;
       }
+      case IdType::FILE:
+        fileMap.erase(newObj.id);
+        break;
+      case IdType::DIRECTORY:
+        directoryMap.erase(newObj.id);
+        break;
     }
   }
 
@@ -365,7 +1424,7 @@ private:
 
   kj::Promise<void> readLoop() {
     for (;;) {
-      ssize_t bytesRead = read(fuseFd, buffer, sizeof(buffer));
+      ssize_t bytesRead = read(fuseFd, buffer.begin(), buffer.size());
 
       if (bytesRead < 0) {
         int error = errno;
@@ -391,7 +1450,9 @@ private:
       }
 
       // OK, we got some bytes.
-      auto bufferPtr = kj::arrayPtr(buffer, bytesRead);
+      auto bufferPtr = kj::arrayPtr(buffer.begin(), bytesRead);
+
+      processDrops();
 
       while (bufferPtr.size() > 0) {
         struct fuse_in_header header;
@@ -408,11 +1469,6 @@ private:
   }
 
   bool dispatch(struct fuse_in_header& header, kj::ArrayPtr<const kj::byte> body) {
-    auto iter = nodeMap.find(header.nodeid);
-    KJ_REQUIRE(header.nodeid == 0 || iter != nodeMap.end(),
-        "Kernel asked for unknown node ID.", header.nodeid);
-    fuse::Node::Client node = header.nodeid == 0 ? nullptr : iter->second.node;
-
     switch (header.opcode) {
       case FUSE_INIT: {
         auto initBody = consumeStruct<struct fuse_init_in>(body);
@@ -422,14 +1478,46 @@ private:
         auto reply = allocResponse<struct fuse_init_out>();
         reply->body.major = 7;
         reply->body.minor = 20;
-        reply->body.max_readahead = 65536;
-        reply->body.max_write = 65536;
+        reply->body.max_readahead = kj::min(initBody.max_readahead, options.maxReadahead);
+        reply->body.max_write = MAX_WRITE;
+
+        // Only request features that the kernel offered.
+        auto negotiate = [&](bool wanted, uint32_t flag) {
+          if (wanted && (initBody.flags & flag)) {
+            reply->body.flags |= flag;
+          }
+        };
+        negotiate(options.asyncRead, FUSE_ASYNC_READ);
+        negotiate(options.autoInvalidateData, FUSE_AUTO_INVAL_DATA);
+#ifdef FUSE_PARALLEL_DIROPS
+        negotiate(options.parallelDirops, FUSE_PARALLEL_DIROPS);
+#endif
+
+        if (initBody.minor >= 21 && (initBody.flags & FUSE_DO_READDIRPLUS)) {
+          // Let the kernel decide when readdirplus is worthwhile (FUSE_READDIRPLUS_AUTO); it
+          // falls back to plain readdir for directories that are being listed but not stat()ed.
+          reply->body.minor = 21;
+          reply->body.flags |= FUSE_DO_READDIRPLUS;
+          if (initBody.flags & FUSE_READDIRPLUS_AUTO) {
+            reply->body.flags |= FUSE_READDIRPLUS_AUTO;
+          }
+        }
 
 #ifdef FUSE_COMPAT_22_INIT_OUT_SIZE
         // Compatibility with pre-2.15 kernels.
         reply->bodySize = FUSE_COMPAT_22_INIT_OUT_SIZE;
 #endif
 
+#ifdef FUSE_MAX_PAGES
+        if (options.maxPages > 0 && (initBody.flags & FUSE_MAX_PAGES)) {
+          // Allow reads bigger than 32 pages. max_pages lies beyond the compat struct size, so
+          // we have to send the whole thing; kernels new enough to offer FUSE_MAX_PAGES accept it.
+          reply->body.flags |= FUSE_MAX_PAGES;
+          reply->body.max_pages = options.maxPages;
+          reply->bodySize = sizeof(reply->body);
+        }
+#endif
+
         sendReply(header.unique, kj::mv(reply));
         break;
       }
@@ -439,29 +1527,25 @@ private:
 
       case FUSE_FORGET: {
         auto requestBody = consumeStruct<struct fuse_forget_in>(body);
-        if ((iter->second.refcount -= requestBody.nlookup) == 0) {
-          nodeMap.erase(iter);
-        }
+        auto lock = shared.lockExclusive();
+        forget(lock, header.nodeid, requestBody.nlookup);
         break;
       }
 
       case FUSE_BATCH_FORGET: {
         auto requestBody = consumeStruct<struct fuse_batch_forget_in>(body);
 
+        auto lock = shared.lockExclusive();
         for (uint i = 0; i < requestBody.count; i++) {
           auto item = consumeStruct<struct fuse_forget_one>(body);
-          auto iter2 = nodeMap.find(item.nodeid);
-          KJ_REQUIRE(iter2 != nodeMap.end());
-          if ((iter2->second.refcount -= item.nlookup) == 0) {
-            nodeMap.erase(iter2);
-          }
+          forget(lock, item.nodeid, item.nlookup);
         }
         break;
       }
 
       case FUSE_LOOKUP: {
         auto name = consumeString(body);
-        auto request = node.lookupRequest(
+        auto request = getNode(header.nodeid).lookupRequest(
             capnp::MessageSize { name.size() / sizeof(capnp::word) + 8, 0 });
         request.setName(name);
 
@@ -480,50 +1564,12 @@ private:
               (auto&& attrResult) mutable -> kj::Own<ResponseBase> {
             auto reply = allocResponse<struct fuse_entry_out>();
             auto attributes = attrResult.getAttributes();
-            uint64_t inode = attributes.getInodeNumber();
-
-            auto insertResult = childMap.insert(std::make_pair(
-                ChildKey { parentId, ownName }, ChildInfo()));
-
-            // Make sure the StringPtr in the key points at the String in the value.
-            if (insertResult.second) {
-              // This is a newly-inserted entry.
-              insertResult.first->second.name = kj::mv(ownName);
-            } else {
-              // Existing entry. Check consistency.
-              KJ_ASSERT(insertResult.first->second.name.begin() ==
-                        insertResult.first->first.name.begin());
-            }
 
-            if (insertResult.second || insertResult.first->second.inode != inode) {
-              // Either we've never looked up this child before, or the inode number has changed
-              // since we looked it up so we assume it has been replaced by a new node.
-              //
-              // TODO(someday): It would be better to detect when a node has been replaced by
-              //   comparing the capabilities, though this requires "join" support (level 4 RPC).
-              reply->body.nodeid = nodeIdCounter++;
-              insertResult.first->second.nodeId = reply->body.nodeid;
-              insertResult.first->second.inode = inode;
-            } else {
-              // This appears to be exactly the same child we returned previously. Use the same
-              // node ID.
-              reply->body.nodeid = insertResult.first->second.nodeId;
-            }
-
-            reply->body.generation = 0;
-            reply->newObject = CapToInsert {
-                IdType::NODE, reply->body.nodeid, lookupResult.getNode() };
-
-            translateAttrs(attributes, &reply->body.attr);
-            if (options.cacheForever) {
-              reply->body.entry_valid = 365 * kj::DAYS / kj::SECONDS;
-              reply->body.attr_valid = 365 * kj::DAYS / kj::SECONDS;
-            } else {
-              splitTime(lookupResult.getTtl(),
-                  &reply->body.entry_valid, &reply->body.entry_valid_nsec);
-              splitTime(attrResult.getTtl(),
-                  &reply->body.attr_valid, &reply->body.attr_valid_nsec);
-            }
+            // The node ID is filled in when the reply is written.
+            reply->newObjects.add(CapToInsert {
+                IdType::NODE, 0, lookupResult.getNode(), parentId, kj::mv(ownName),
+                attributes.getInodeNumber(), &reply->body.nodeid });
+            fillEntry(&reply->body, 0, attributes, lookupResult.getTtl(), attrResult.getTtl());
 
             return kj::mv(reply);
           });
@@ -533,7 +1579,8 @@ private:
       }
 
       case FUSE_GETATTR:
-        addReplyTask(header.unique, EIO, node.getAttributesRequest(capnp::MessageSize {4, 0}).send()
+        addReplyTask(header.unique, EIO,
+            getNode(header.nodeid).getAttributesRequest(capnp::MessageSize {4, 0}).send()
             .then([this](auto&& response) -> kj::Own<ResponseBase> {
           auto reply = allocResponse<struct fuse_attr_out>();
           if (options.cacheForever) {
@@ -548,7 +1595,8 @@ private:
 
       case FUSE_READLINK:
         // No input.
-        addReplyTask(header.unique, EINVAL, node.readlinkRequest(capnp::MessageSize {4, 0}).send()
+        addReplyTask(header.unique, EINVAL,
+            getNode(header.nodeid).readlinkRequest(capnp::MessageSize {4, 0}).send()
             .then([this](auto&& response) -> kj::Own<ResponseBase> {
           auto link = response.getLink();
           auto bytes = kj::arrayPtr(reinterpret_cast<const kj::byte*>(link.begin()), link.size());
@@ -566,14 +1614,40 @@ private:
 
         // TODO(perf): Can we assume the kernel will check permissions before open()? If so,
         //   perhaps we ought to assume this should always succeed and thus pipeline it?
-        addReplyTask(header.unique, EIO, node.openAsFileRequest(capnp::MessageSize {4, 0}).send()
-            .then([this](auto&& response) -> kj::Own<ResponseBase> {
-          auto reply = allocResponse<struct fuse_open_out>();
-          reply->body.fh = handleCounter++;
-          reply->newObject = CapToInsert { IdType::FILE, reply->body.fh, response.getFile() };
-          // TODO(someday):  Fill in open_flags, especially "nonseekable"?  See FOPEN_* in fuse.h.
-          if (options.cacheForever) reply->body.open_flags |= FOPEN_KEEP_CACHE;
-          return kj::mv(reply);
+        auto openPromise =
+            getNode(header.nodeid).openAsFileRequest(capnp::MessageSize {4, 0}).send();
+
+        // Find out (pipelined) whether the file lives in this process, so that reads can be
+        // spliced. Remote files won't implement this, which is fine.
+        kj::Promise<kj::Maybe<int>> localFdPromise = nullptr;
+        if (splicePipe == nullptr) {
+          localFdPromise = kj::Maybe<int>(nullptr);
+        } else {
+          localFdPromise = openPromise.getFile()
+              .getLocalFdTokenRequest(capnp::MessageSize {4, 0}).send()
+              .then([](auto&& response) -> kj::Maybe<int> {
+            return getLocalFdRegistry().find(response.getToken());
+          }, [](kj::Exception&& e) -> kj::Maybe<int> {
+            return nullptr;
+          });
+        }
+
+        addReplyTask(header.unique, EIO, openPromise.then(
+            [this, KJ_MVCAP(localFdPromise)](auto&& response) mutable {
+          return localFdPromise.then(
+              [this, KJ_MVCAP(response)](kj::Maybe<int> localFd) mutable
+              -> kj::Own<ResponseBase> {
+            auto reply = allocResponse<struct fuse_open_out>();
+            reply->body.fh = shared.lockExclusive()->handleCounter++;
+            CapToInsert newObject { IdType::FILE, reply->body.fh, response.getFile() };
+            KJ_IF_MAYBE(fd, localFd) {
+              newObject.localFd = *fd;
+            }
+            reply->newObjects.add(kj::mv(newObject));
+            // TODO(someday):  Fill in open_flags, especially "nonseekable"?  See FOPEN_* in fuse.h.
+            if (options.cacheForever) reply->body.open_flags |= FOPEN_KEEP_CACHE;
+            return kj::mv(reply);
+          });
         }));
         break;
       }
@@ -581,10 +1655,32 @@ private:
       case FUSE_READ: {
         auto request = consumeStruct<struct fuse_read_in>(body);
 
-        auto iter2 = fileMap.find(request.fh);
-        KJ_REQUIRE(iter2 != fileMap.end(), "Kernel requested invalid file handle?");
+        KJ_IF_MAYBE(pipe, splicePipe) {
+          auto iter2 = fileMap.find(request.fh);
+          if (iter2 != fileMap.end() && iter2->second.localFd >= 0 &&
+              request.size <= pipe->maxContentSize) {
+            // Fast path: the file is backed by a descriptor in this process, so there's no need
+            // to make an RPC at all; splice the content straight into the device.
+            auto& entry = iter2->second;
+            if (request.offset + request.size > entry.knownSize) {
+              // Reading up to or past what we think is EOF; the file may have grown.
+              struct stat stats;
+              if (fstat(entry.localFd, &stats) < 0) {
+                sendError(header.unique, errno);
+                break;
+              }
+              entry.knownSize = stats.st_size;
+            }
+            uint64_t fileSize = entry.knownSize;
+            uint64_t available = fileSize > request.offset ? fileSize - request.offset : 0;
+            size_t size = kj::min(available, uint64_t(request.size));
+            sendReply(header.unique, kj::heap<SpliceResponse>(
+                entry.cap, entry.localFd, request.offset, size, *pipe));
+            break;
+          }
+        }
 
-        auto rpc = iter2->second.cap.readRequest(capnp::MessageSize {4, 0});
+        auto rpc = getFile(request.fh, header.nodeid).readRequest(capnp::MessageSize {4, 0});
         rpc.setOffset(request.offset);
         rpc.setSize(request.size);
         addReplyTask(header.unique, EIO, rpc.send()
@@ -600,7 +1696,9 @@ private:
         // TODO(someday): When we support writes, we'll need to flush them here and possibly return
         //   an error.
         auto request = consumeStruct<struct fuse_release_in>(body);
-        KJ_REQUIRE(fileMap.erase(request.fh) == 1, "Kernel released invalid file handle?");
+        KJ_REQUIRE(fileMap.erase(request.fh) == 1 || options.threadCount > 1,
+                   "Kernel released invalid file handle?");
+        shared.lockExclusive()->drop(channel, IdType::FILE, request.fh);
         sendReply(header.unique, allocEmptyResponse());
         break;
       }
@@ -616,12 +1714,12 @@ private:
         // TODO(perf): Can we assume the kernel will check permissions before open()? If so,
         //   perhaps we ought to assume this should always succeed and thus pipeline it?
         addReplyTask(header.unique, EIO,
-            node.openAsDirectoryRequest(capnp::MessageSize {4, 0}).send()
+            getNode(header.nodeid).openAsDirectoryRequest(capnp::MessageSize {4, 0}).send()
             .then([this](auto&& response) -> kj::Own<ResponseBase> {
           auto reply = allocResponse<struct fuse_open_out>();
-          reply->body.fh = handleCounter++;
-          reply->newObject = CapToInsert {
-              IdType::DIRECTORY, reply->body.fh, response.getDirectory() };
+          reply->body.fh = shared.lockExclusive()->handleCounter++;
+          reply->newObjects.add(CapToInsert {
+              IdType::DIRECTORY, reply->body.fh, response.getDirectory() });
           return kj::mv(reply);
         }));
         break;
@@ -630,10 +1728,8 @@ private:
       case FUSE_READDIR: {
         auto request = consumeStruct<struct fuse_read_in>(body);
 
-        auto iter2 = directoryMap.find(request.fh);
-        KJ_REQUIRE(iter2 != directoryMap.end(), "Kernel requested invalid directory handle?");
-
-        auto rpc = iter2->second.cap.readRequest(capnp::MessageSize {4, 0});
+        auto rpc = getDirectory(request.fh, header.nodeid)
+            .readRequest(capnp::MessageSize {4, 0});
         rpc.setOffset(request.offset);
 
         // Annoyingly, request.size is actually a size, in bytes. How many entries fit into that
@@ -673,17 +1769,7 @@ private:
             dirent.ino = entry.getInodeNumber();
             dirent.off = entry.getNextOffset();
             dirent.namelen = name.size();
-            dirent.type = DT_UNKNOWN;
-            switch (entry.getType()) {
-              case fuse::Node::Type::UNKNOWN:                                 break;
-              case fuse::Node::Type::BLOCK_DEVICE:     dirent.type = DT_BLK ; break;
-              case fuse::Node::Type::CHARACTER_DEVICE: dirent.type = DT_CHR ; break;
-              case fuse::Node::Type::DIRECTORY:        dirent.type = DT_DIR ; break;
-              case fuse::Node::Type::FIFO:             dirent.type = DT_FIFO; break;
-              case fuse::Node::Type::SYMLINK:          dirent.type = DT_LNK ; break;
-              case fuse::Node::Type::REGULAR:          dirent.type = DT_REG ; break;
-              case fuse::Node::Type::SOCKET:           dirent.type = DT_SOCK; break;
-            }
+            dirent.type = translateDirentType(entry.getType());
 
             memcpy(dirent.name, name.begin(), name.size());
             pos += FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + name.size());
@@ -702,11 +1788,58 @@ private:
         break;
       }
 
+      case FUSE_READDIRPLUS: {
+        auto request = consumeStruct<struct fuse_read_in>(body);
+        auto directory = getDirectory(request.fh, header.nodeid);
+
+        // Same estimate as for FUSE_READDIR, but entries are much bigger.
+        uint count = request.size / (sizeof(struct fuse_direntplus) + 16);
+        auto rpc = directory.readPlusRequest(capnp::MessageSize {4, 0});
+        rpc.setOffset(request.offset);
+        rpc.setCount(count);
+
+        auto requestedSize = request.size;
+        uint64_t parentId = header.nodeid;
+        uint64_t offset = request.offset;
+        addReplyTask(header.unique, EIO, rpc.send()
+            .then([this, requestedSize, parentId](auto&& response)
+                  -> kj::Promise<kj::Own<ResponseBase>> {
+          return makeDirentPlusReply(parentId, requestedSize, response.getEntries());
+        }, [this, KJ_MVCAP(directory), requestedSize, offset, count](kj::Exception&& e) mutable
+               -> kj::Promise<kj::Own<ResponseBase>> {
+          // This directory doesn't support readPlus(). Fall back to a plain read, leaving it to
+          // the kernel to look up each entry separately.
+          auto rpc = directory.readRequest(capnp::MessageSize {4, 0});
+          rpc.setOffset(offset);
+          rpc.setCount(count);
+          return rpc.send().then([this, requestedSize](auto&& response) -> kj::Own<ResponseBase> {
+            auto entries = response.getEntries();
+            auto bytes = kj::heapArray<kj::byte>(
+                direntPlusSize(entries, requestedSize, [](auto entry) { return entry; }));
+            memset(bytes.begin(), 0, bytes.size());
+            kj::byte* pos = bytes.begin();
+            for (auto entry: entries) {
+              if (pos == bytes.end()) break;
+              auto& direntplus = *reinterpret_cast<struct fuse_direntplus*>(pos);
+              fillDirent(&direntplus.dirent, entry);
+              // nodeid = 0 tells the kernel we aren't returning a node for this entry.
+              pos += FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + entry.getName().size());
+            }
+            KJ_ASSERT(pos == bytes.end());
+
+            auto bytesPtr = bytes.asPtr();  // Don't inline; param construction order is undefined.
+            return allocResponse<void>(kj::mv(bytes), bytesPtr);
+          });
+        }));
+        break;
+      }
+
       case FUSE_RELEASEDIR: {
         // Presumably since directories aren't writable there's no possibility of close() errors.
         auto request = consumeStruct<struct fuse_release_in>(body);
-        KJ_REQUIRE(directoryMap.erase(request.fh) == 1,
+        KJ_REQUIRE(directoryMap.erase(request.fh) == 1 || options.threadCount > 1,
                    "Kernel released invalid directory handle?");
+        shared.lockExclusive()->drop(channel, IdType::DIRECTORY, request.fh);
         sendReply(header.unique, allocEmptyResponse());
         break;
       }
@@ -724,7 +1857,7 @@ private:
         } else if (request.mask != 0) {
           // Need to check permissions.
           addReplyTask(header.unique, EACCES,
-              node.getAttributesRequest(capnp::MessageSize {4, 0}).send()
+              getNode(header.nodeid).getAttributesRequest(capnp::MessageSize {4, 0}).send()
               .then([this, mask](auto&& response) -> kj::Own<ResponseBase> {
             // TODO(someday):  Account for uid/gid?  Currently irrelevant.
             if (mask & R_OK) {
@@ -756,8 +1889,7 @@ private:
         sendReply(header.unique, allocEmptyResponse());
         break;
 
-        // TODO(someday): Missing read-only syscalls: statfs, getxaddr, listxaddr, locking,
-        //     readdirplus (we currently set protocol version to pre-readdirplus to avoid it)
+        // TODO(someday): Missing read-only syscalls: statfs, getxaddr, listxaddr, locking.
         // TODO(someday): Write calls.
 
       case FUSE_STATFS:
@@ -781,6 +1913,71 @@ private:
   // =====================================================================================
   // helpers
 
+  template <typename List, typename GetEntry>
+  static size_t direntPlusSize(List entries, size_t requestedSize, GetEntry&& getEntry) {
+    // Compute how many bytes of `fuse_direntplus` records to return for `entries`, stopping
+    // before we'd exceed `requestedSize`.
+
+    size_t totalBytes = 0;
+    for (auto item: entries) {
+      size_t next = totalBytes +
+          FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + getEntry(item).getName().size());
+      if (next > requestedSize) {
+        break;
+      }
+      totalBytes = next;
+    }
+    return totalBytes;
+  }
+
+  static void fillDirent(struct fuse_dirent* dirent, fuse::Directory::Entry::Reader entry) {
+    auto name = entry.getName();
+    dirent->ino = entry.getInodeNumber();
+    dirent->off = entry.getNextOffset();
+    dirent->namelen = name.size();
+    dirent->type = translateDirentType(entry.getType());
+    memcpy(dirent->name, name.begin(), name.size());
+  }
+
+  template <typename EntryList>
+  kj::Own<ResponseBase> makeDirentPlusReply(uint64_t parentId, size_t requestedSize,
+                                            EntryList entries) {
+    // Build the reply to FUSE_READDIRPLUS from the results of Directory.readPlus(). Each entry
+    // which comes with a node counts as a lookup, exactly as if FUSE_LOOKUP had returned it.
+
+    auto bytes = kj::heapArray<kj::byte>(
+        direntPlusSize(entries, requestedSize, [](auto item) { return item.getEntry(); }));
+    memset(bytes.begin(), 0, bytes.size());
+    kj::Vector<CapToInsert> newObjects;
+
+    kj::byte* pos = bytes.begin();
+    for (auto item: entries) {
+      if (pos == bytes.end()) break;
+
+      auto entry = item.getEntry();
+      auto name = entry.getName();
+      auto& direntplus = *reinterpret_cast<struct fuse_direntplus*>(pos);
+      fillDirent(&direntplus.dirent, entry);
+
+      // The kernel never links "." or "..", and won't count a lookup for them either.
+      if (item.hasNode() && name != "." && name != "..") {
+        auto attributes = item.getAttributes();
+        newObjects.add(CapToInsert {
+            IdType::NODE, 0, item.getNode(), parentId, kj::heapString(name),
+            attributes.getInodeNumber(), &direntplus.entry_out.nodeid });
+        fillEntry(&direntplus.entry_out, 0, attributes, item.getTtl(), item.getTtl());
+      }
+
+      pos += FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + name.size());
+    }
+    KJ_ASSERT(pos == bytes.end());
+
+    auto bytesPtr = bytes.asPtr();  // Don't inline; param construction order is undefined.
+    auto reply = allocResponse<void>(kj::mv(bytes), bytesPtr);
+    reply->newObjects = kj::mv(newObjects);
+    return kj::mv(reply);
+  }
+
   template <typename T>
   T consumeStruct(kj::ArrayPtr<const kj::byte>& bytes) {
     T result;
@@ -819,6 +2016,35 @@ private:
     *nsecs = signedNsec;
   }
 
+  void fillEntry(struct fuse_entry_out* entry, uint64_t nodeId,
+                 fuse::Node::Attributes::Reader attributes, uint64_t entryTtl, uint64_t attrTtl) {
+    entry->nodeid = nodeId;
+    entry->generation = 0;
+
+    translateAttrs(attributes, &entry->attr);
+    if (options.cacheForever) {
+      entry->entry_valid = 365 * kj::DAYS / kj::SECONDS;
+      entry->attr_valid = 365 * kj::DAYS / kj::SECONDS;
+    } else {
+      splitTime(entryTtl, &entry->entry_valid, &entry->entry_valid_nsec);
+      splitTime(attrTtl, &entry->attr_valid, &entry->attr_valid_nsec);
+    }
+  }
+
+  static uint8_t translateDirentType(fuse::Node::Type type) {
+    switch (type) {
+      case fuse::Node::Type::UNKNOWN:          return DT_UNKNOWN;
+      case fuse::Node::Type::BLOCK_DEVICE:     return DT_BLK;
+      case fuse::Node::Type::CHARACTER_DEVICE: return DT_CHR;
+      case fuse::Node::Type::DIRECTORY:        return DT_DIR;
+      case fuse::Node::Type::FIFO:             return DT_FIFO;
+      case fuse::Node::Type::SYMLINK:          return DT_LNK;
+      case fuse::Node::Type::REGULAR:          return DT_REG;
+      case fuse::Node::Type::SOCKET:           return DT_SOCK;
+    }
+    return DT_UNKNOWN;
+  }
+
   void translateAttrs(fuse::Node::Attributes::Reader src, struct fuse_attr* dst) {
     memset(dst, 0, sizeof(*dst));
 
@@ -851,11 +2077,162 @@ private:
   }
 };
 
+class FuseSession {
+  // Owns the state shared by all channels of a mount, along with the threads serving every
+  // channel other than the first (which runs on the caller's event loop). If any channel fails,
+  // the whole session does: see onChannelFailure().
+
+public:
+  FuseSession(kj::Function<fuse::Node::Client()> rootFactory, FuseOptions options,
+              kj::Array<kj::AutoCloseFd> extraChannels)
+      : rootFactory(kj::mv(rootFactory)), options(options),
+        extraChannels(kj::mv(extraChannels)), shared(this->extraChannels.size() + 1) {
+    int fds[2];
+    KJ_SYSCALL(pipe2(fds, O_CLOEXEC));
+    shutdownReadEnd = kj::AutoCloseFd(fds[0]);
+    shutdownWriteEnd = kj::AutoCloseFd(fds[1]);
+    KJ_SYSCALL(pipe2(fds, O_CLOEXEC));
+    failureReadEnd = kj::AutoCloseFd(fds[0]);
+    failureWriteEnd = kj::AutoCloseFd(fds[1]);
+  }
+
+  ~FuseSession() noexcept(false) {
+    // Closing the pipe makes it readable in every worker, at which point each one returns from its
+    // event loop. Destroying the threads then joins them.
+    shutdownWriteEnd = nullptr;
+    threads = nullptr;
+  }
+
+  KJ_DISALLOW_COPY(FuseSession);
+
+  inline kj::MutexGuarded<FuseSharedState>& getShared() { return shared; }
+  inline fuse::Node::Client makeRoot() { return rootFactory(); }
+
+  void start() {
+    auto builder = kj::heapArrayBuilder<kj::Own<kj::Thread>>(extraChannels.size());
+    for (uint i: kj::indices(extraChannels)) {
+      builder.add(kj::heap<kj::Thread>([this, i]() {
+        runChannel(i + 1, extraChannels[i]);
+      }));
+    }
+    threads = builder.finish();
+  }
+
+  kj::Promise<void> onChannelFailure(kj::UnixEventPort& eventPort) {
+    // Rejects, on the caller's event loop, with the error of the first channel thread that fails.
+
+    auto observer = kj::heap<kj::UnixEventPort::FdObserver>(eventPort, failureReadEnd,
+        kj::UnixEventPort::FdObserver::OBSERVE_READ);
+    auto promise = observer->whenBecomesReadable();
+    return promise.then([this]() -> kj::Promise<void> {
+      auto lock = failure.lockExclusive();
+      return kj::cp(KJ_ASSERT_NONNULL(*lock));
+    }).attach(kj::mv(observer));
+  }
+
+private:
+  kj::Function<fuse::Node::Client()> rootFactory;
+  FuseOptions options;
+  kj::Array<kj::AutoCloseFd> extraChannels;
+  kj::MutexGuarded<FuseSharedState> shared;
+  kj::AutoCloseFd shutdownReadEnd;
+  kj::AutoCloseFd shutdownWriteEnd;
+  kj::MutexGuarded<kj::Maybe<kj::Exception>> failure;  // First channel failure, if any.
+  kj::AutoCloseFd failureReadEnd;  // Readable once `failure` is set.
+  kj::AutoCloseFd failureWriteEnd;
+  kj::Array<kj::Own<kj::Thread>> threads;
+
+  void runChannel(uint channel, int fd) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      kj::UnixEventPort eventPort;
+      kj::EventLoop loop(eventPort);
+      kj::WaitScope waitScope(loop);
+
+      FuseDriver driver(eventPort, fd, makeRoot(), options, shared, channel);
+      kj::UnixEventPort::FdObserver shutdownObserver(eventPort, shutdownReadEnd,
+          kj::UnixEventPort::FdObserver::OBSERVE_READ);
+
+      driver.run().exclusiveJoin(shutdownObserver.whenBecomesReadable()).wait(waitScope);
+    })) {
+      // The kernel would hand this channel's share of requests to the others, but carrying on
+      // with fewer channels would hide whatever is wrong. Fail the session instead.
+      KJ_LOG(ERROR, "FUSE channel failed", channel, *exception);
+      {
+        auto lock = failure.lockExclusive();
+        if (*lock == nullptr) {
+          *lock = kj::mv(*exception);
+        }
+      }
+      char c = 0;
+      ssize_t n;
+      KJ_NONBLOCKING_SYSCALL(n = write(failureWriteEnd, &c, 1));
+    }
+  }
+};
+
+static kj::Maybe<kj::AutoCloseFd> cloneFuseFd(int fuseFd) {
+  // Open another channel to the same FUSE connection. The kernel hands each request to whichever
+  // channel reads it first.
+
+#ifdef FUSE_DEV_IOC_CLONE
+  int fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    int error = errno;
+    KJ_LOG(WARNING, "couldn't open /dev/fuse to clone FUSE channel", strerror(error));
+    return nullptr;
+  }
+  kj::AutoCloseFd result(fd);
+
+  uint32_t sessionFd = fuseFd;
+  if (ioctl(result, FUSE_DEV_IOC_CLONE, &sessionFd) < 0) {
+    int error = errno;
+    KJ_LOG(WARNING, "FUSE_DEV_IOC_CLONE failed", strerror(error));
+    return nullptr;
+  }
+
+  return kj::mv(result);
+#else
+  KJ_LOG(WARNING, "compiled against kernel headers without FUSE_DEV_IOC_CLONE");
+  return nullptr;
+#endif
+}
+
 kj::Promise<void> bindFuse(kj::UnixEventPort& eventPort, int fuseFd, fuse::Node::Client root,
                            FuseOptions options) {
-  auto driver = kj::heap<FuseDriver>(eventPort, fuseFd, kj::mv(root), options);
+  KJ_REQUIRE(options.threadCount <= 1,
+             "Serving FUSE on multiple threads requires a root factory; see fuse.h.");
+  options.threadCount = 1;
+
+  auto shared = kj::heap<kj::MutexGuarded<FuseSharedState>>(1u);
+  auto driver = kj::heap<FuseDriver>(eventPort, fuseFd, kj::mv(root), options, *shared, 0);
+  FuseDriver* driverPtr = driver.get();
+  return driverPtr->run().attach(kj::mv(driver)).attach(kj::mv(shared));
+}
+
+kj::Promise<void> bindFuse(kj::UnixEventPort& eventPort, int fuseFd,
+                           kj::Function<fuse::Node::Client()> rootFactory, FuseOptions options) {
+  kj::Vector<kj::AutoCloseFd> extraChannels;
+  for (uint i = 1; i < options.threadCount; i++) {
+    KJ_IF_MAYBE(clone, cloneFuseFd(fuseFd)) {
+      extraChannels.add(kj::mv(*clone));
+    } else {
+      break;
+    }
+  }
+  options.threadCount = extraChannels.size() + 1;
+
+  auto session = kj::heap<FuseSession>(kj::mv(rootFactory), options,
+                                       extraChannels.releaseAsArray());
+  auto driver = kj::heap<FuseDriver>(eventPort, fuseFd, session->makeRoot(), options,
+                                     session->getShared(), 0);
+  session->start();
+
+  // Note that the driver must be destroyed before the session, since it refers to the session's
+  // shared state.
   FuseDriver* driverPtr = driver.get();
-  return driverPtr->run().attach(kj::mv(driver));
+  auto failure = session->onChannelFailure(eventPort);
+  return driverPtr->run().exclusiveJoin(kj::mv(failure))
+      .attach(kj::mv(driver)).attach(kj::mv(session));
 }
 
 // =======================================================================================
@@ -874,7 +2251,21 @@ public:
     fd = kj::AutoCloseFd(ifd);
   }
 
+  ~FileImpl() noexcept(false) {
+    if (localFdToken != 0) {
+      getLocalFdRegistry().remove(localFdToken);
+    }
+  }
+
 protected:
+  kj::Promise<void> getLocalFdToken(GetLocalFdTokenContext context) override {
+    if (localFdToken == 0) {
+      localFdToken = getLocalFdRegistry().add(fd);
+    }
+    context.getResults(capnp::MessageSize {4, 0}).setToken(localFdToken);
+    return kj::READY_NOW;
+  }
+
   kj::Promise<void> read(ReadContext context) override {
     auto params = context.getParams();
     auto size = params.getSize();
@@ -911,11 +2302,13 @@ protected:
 
 private:
   kj::AutoCloseFd fd;
+  uint64_t localFdToken = 0;  // Registered lazily on the first getLocalFdToken() call.
 };
 
 class DirectoryImpl final: public fuse::Directory::Server {
 public:
-  DirectoryImpl(kj::StringPtr path) {
+  DirectoryImpl(kj::StringPtr path, kj::Duration ttl, kj::Maybe<kj::UnixEventPort&> eventPort)
+      : path(kj::heapString(path)), ttl(ttl), eventPort(eventPort) {
     dir = opendir(path.cStr());
     if (dir == nullptr) {
       int error = errno;
@@ -930,20 +2323,44 @@ public:
 protected:
   kj::Promise<void> read(ReadContext context) {
     auto params = context.getParams();
+    auto entries = readEntries(params.getOffset(), params.getCount());
+
+    capnp::MessageSize messageSize = { 6, 0 };
+    for (auto& entry: entries) {
+      // Don't forget NUL byte...
+      messageSize.wordCount += capnp::sizeInWords<fuse::Directory::Entry>() +
+          (strlen(entry.d_name) + sizeof(capnp::word)) / sizeof(capnp::word);
+    }
+
+    auto builder = context.getResults(messageSize).initEntries(entries.size());
+    for (size_t i: kj::indices(entries)) {
+      fillEntry(builder[i], entries[i]);
+    }
+
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> readPlus(ReadPlusContext context);
+  // Defined after NodeImpl.
+
+private:
+  DIR* dir;
+  size_t currentOffset;
+  kj::String path;
+  kj::Duration ttl;
+  kj::Maybe<kj::UnixEventPort&> eventPort;
 
-    if (params.getOffset() != currentOffset) {
-      seekdir(dir, params.getOffset());
-      currentOffset = params.getOffset();
+  kj::Vector<struct dirent> readEntries(uint64_t offset, uint32_t requestedCount) {
+    if (offset != currentOffset) {
+      seekdir(dir, offset);
+      currentOffset = offset;
     }
 
-    auto requestedCount = params.getCount();
     KJ_REQUIRE(requestedCount < 8192, "readdir too large", requestedCount);
 
     kj::Vector<struct dirent> entries(requestedCount);
 
-    uint count = 0;
-    capnp::MessageSize messageSize = { 6, 0 };
-    for (; count < requestedCount; count++) {
+    for (uint count = 0; count < requestedCount; count++) {
       struct dirent* ent = readdir(dir);
       if (ent == nullptr) {
         // End of directory.
@@ -953,67 +2370,293 @@ protected:
       currentOffset = ent->d_off;
 
       entries.add(*ent);
+    }
 
-      // Don't forget NUL byte...
-      messageSize.wordCount += capnp::sizeInWords<fuse::Directory::Entry>() +
-          (strlen(ent->d_name) + sizeof(capnp::word)) / sizeof(capnp::word);
+    return entries;
+  }
+
+  static void fillEntry(fuse::Directory::Entry::Builder entryBuilder, struct dirent& entry) {
+    entryBuilder.setInodeNumber(entry.d_ino);
+    entryBuilder.setNextOffset(entry.d_off);
+
+    switch (entry.d_type) {
+      case DT_BLK:  entryBuilder.setType(fuse::Node::Type::BLOCK_DEVICE); break;
+      case DT_CHR:  entryBuilder.setType(fuse::Node::Type::CHARACTER_DEVICE); break;
+      case DT_DIR:  entryBuilder.setType(fuse::Node::Type::DIRECTORY); break;
+      case DT_FIFO: entryBuilder.setType(fuse::Node::Type::FIFO); break;
+      case DT_LNK:  entryBuilder.setType(fuse::Node::Type::SYMLINK); break;
+      case DT_REG:  entryBuilder.setType(fuse::Node::Type::REGULAR); break;
+      case DT_SOCK: entryBuilder.setType(fuse::Node::Type::SOCKET); break;
+      default:      entryBuilder.setType(fuse::Node::Type::UNKNOWN); break;
     }
 
-    auto builder = context.getResults(messageSize).initEntries(count);
+    entryBuilder.setName(entry.d_name);
+  }
+};
 
-    for (size_t i: kj::indices(entries)) {
-      auto entryBuilder = builder[i];
-      auto& entry = entries[i];
-
-      entryBuilder.setInodeNumber(entry.d_ino);
-      entryBuilder.setNextOffset(entry.d_off);
-
-      switch (entry.d_type) {
-        case DT_BLK:  entryBuilder.setType(fuse::Node::Type::BLOCK_DEVICE); break;
-        case DT_CHR:  entryBuilder.setType(fuse::Node::Type::CHARACTER_DEVICE); break;
-        case DT_DIR:  entryBuilder.setType(fuse::Node::Type::DIRECTORY); break;
-        case DT_FIFO: entryBuilder.setType(fuse::Node::Type::FIFO); break;
-        case DT_LNK:  entryBuilder.setType(fuse::Node::Type::SYMLINK); break;
-        case DT_REG:  entryBuilder.setType(fuse::Node::Type::REGULAR); break;
-        case DT_SOCK: entryBuilder.setType(fuse::Node::Type::SOCKET); break;
-        default:      entryBuilder.setType(fuse::Node::Type::UNKNOWN); break;
-      }
+class LoopbackWatcher final: public Handle::Server, private kj::TaskSet::ErrorHandler {
+  // Watches a file or directory tree with inotify on behalf of NodeImpl::watch(), reporting
+  // every change to a fuse::ChangeWatcher. Stops when dropped.
+  //
+  // This is structured much like DiskUsageWatcher in supervisor.c++, but since we only need to
+  // know *that* something changed, not how it affects disk usage, it is much simpler. The tree is
+  // walked WATCH_BATCH_SIZE directories at a time, returning to the event loop in between, so
+  // that a large tree doesn't stall everything else served from the same loop.
 
-      entryBuilder.setName(entry.d_name);
+public:
+  LoopbackWatcher(kj::UnixEventPort& eventPort, kj::StringPtr root,
+                  fuse::ChangeWatcher::Client watcher, capnp::List<capnp::Text>::Reader ignore)
+      : eventPort(eventPort), root(kj::heapString(root)), watcher(kj::mv(watcher)),
+        invalidations(*this) {
+    for (auto path: ignore) {
+      // Normalize away leading and trailing slashes, to match the paths we build below.
+      kj::StringPtr p = path;
+      while (p.startsWith("/")) p = p.slice(1);
+      size_t end = p.size();
+      while (end > 0 && p[end - 1] == '/') --end;
+      if (end > 0) ignorePaths.insert(kj::heapString(p.slice(0, end)));
     }
 
-    return kj::READY_NOW;
+    readTask = init().eagerlyEvaluate([](kj::Exception&& e) {
+      KJ_LOG(ERROR, "inotify watch failed; changes will no longer be noticed", e);
+    });
   }
 
 private:
-  DIR* dir;
-  size_t currentOffset;
+  static constexpr uint WATCH_BATCH_SIZE = 256;
+
+  kj::UnixEventPort& eventPort;
+  kj::String root;
+  fuse::ChangeWatcher::Client watcher;
+  std::set<kj::String> ignorePaths;  // Directories (relative to `root`) not to descend into.
+  kj::AutoCloseFd inotifyFd;
+  kj::Own<kj::UnixEventPort::FdObserver> observer;
+
+  std::unordered_map<int, kj::String> watchMap;
+  // Maps inotify watch descriptors to the path (relative to `root`) being watched. The root
+  // itself is represented by an empty string.
+
+  kj::Vector<kj::String> pendingWatches;
+  // Directories we would like to watch, but we can't add watches on them just yet because we need
+  // to finish processing a list of events received from inotify before we mess with the watch
+  // descriptor table.
+
+  kj::TaskSet invalidations;
+  kj::Promise<void> readTask = nullptr;
+
+  void taskFailed(kj::Exception&& exception) override {
+    KJ_LOG(ERROR, "ChangeWatcher.invalidate() failed", exception);
+  }
+
+  kj::Promise<void> init() {
+    // Start watching the root.
+
+    // Note: this function is also called to restart watching from scratch when the inotify event
+    //   queue overflows (hopefully rare).
+
+    int fd;
+    KJ_SYSCALL(fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    inotifyFd = kj::AutoCloseFd(fd);
+
+    // Note that because we create the FdObserver before creating any watches, we don't have
+    // to worry about the possibility that we missed an event between creation of the fd and
+    // creation of the FdObserver.
+    observer = kj::heap<kj::UnixEventPort::FdObserver>(eventPort, inotifyFd,
+        kj::UnixEventPort::FdObserver::OBSERVE_READ);
+
+    watchMap.clear();
+    pendingWatches.add(kj::heapString(""));
+    return readLoop();
+  }
+
+  bool addPendingWatches() {
+    // Add watches for up to WATCH_BATCH_SIZE pending directories. Returns true if more remain.
+    //
+    // We treat pendingWatches as a stack here in order to get DFS traversal of the directory tree.
+    for (uint i = 0; i < WATCH_BATCH_SIZE && pendingWatches.size() > 0; i++) {
+      auto path = kj::mv(pendingWatches.end()[-1]);
+      pendingWatches.removeLast();
+      addWatch(kj::mv(path));
+    }
+    return pendingWatches.size() > 0;
+  }
+
+  void addPendingWatch(kj::String&& path) {
+    if (ignorePaths.count(path) == 0) {
+      pendingWatches.add(kj::mv(path));
+    }
+  }
+
+  void addWatch(kj::String&& path) {
+    // Start watching `path`, and queue its subdirectories to be watched. This is idempotent.
+
+    static const uint32_t FLAGS =
+        IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO |
+        IN_DELETE_SELF | IN_MOVE_SELF | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+    auto fullPath = path.size() == 0 ? kj::heapString(root) : kj::str(root, '/', path);
+
+    int wd;
+    for (;;) {
+      wd = inotify_add_watch(inotifyFd, fullPath.cStr(), FLAGS);
+      if (wd >= 0) break;
+
+      int error = errno;
+      switch (error) {
+        case EINTR:
+          continue;
+        case ENOENT:
+        case ENOTDIR:
+          // Apparently it was deleted before we got to it. No matter; we'll have reported its
+          // parent as changed.
+          return;
+        case ENOSPC:
+          KJ_LOG(WARNING, "out of inotify watches; changes beneath this path will not be noticed "
+                 "(try raising fs.inotify.max_user_watches)", fullPath);
+          return;
+        default:
+          KJ_FAIL_SYSCALL("inotify_add_watch", error, fullPath);
+      }
+    }
+
+    // Note that inotify_add_watch() may have returned a pre-existing watch descriptor if the
+    // directory was moved. Replacing the path is exactly what we want in that case.
+    watchMap[wd] = kj::heapString(path);
+
+    DIR* dir = opendir(fullPath.cStr());
+    if (dir == nullptr) {
+      // Not a directory (or deleted in the meantime).
+      return;
+    }
+    KJ_DEFER(closedir(dir));
+
+    for (;;) {
+      errno = 0;
+      struct dirent* entry = readdir(dir);
+      if (entry == nullptr) {
+        int error = errno;
+        if (error == 0) {
+          break;
+        } else {
+          KJ_FAIL_SYSCALL("readdir", error, fullPath);
+        }
+      }
+
+      kj::StringPtr name = entry->d_name;
+      if (name == "." || name == "..") continue;
+
+      bool isDir = entry->d_type == DT_DIR;
+      if (entry->d_type == DT_UNKNOWN) {
+        struct stat stats;
+        isDir = lstat(kj::str(fullPath, '/', name).cStr(), &stats) == 0 && S_ISDIR(stats.st_mode);
+      }
+      if (isDir) {
+        addPendingWatch(path.size() == 0 ? kj::heapString(name) : kj::str(path, '/', name));
+      }
+    }
+  }
+
+  kj::Promise<void> readLoop() {
+    kj::Promise<void> ready = nullptr;
+    if (addPendingWatches()) {
+      // Still walking. Let other events in, then check for changes (in what we've watched so
+      // far) before the next batch.
+      ready = eventPort.atSteadyTime(eventPort.steadyTime());
+    } else {
+      ready = observer->whenBecomesReadable();
+    }
+
+    return ready.then([this]() {
+      alignas(uint64_t) kj::byte buffer[4096];
+      kj::Vector<kj::String> changed;
+
+      for (;;) {
+        ssize_t n;
+        KJ_NONBLOCKING_SYSCALL(n = read(inotifyFd, buffer, sizeof(buffer)));
+
+        if (n < 0) {
+          // EAGAIN; report what we've got and try again later.
+          report(changed.releaseAsArray());
+          return readLoop();
+        }
+
+        KJ_ASSERT(n > 0, "inotify EOF?");
+
+        kj::byte* pos = buffer;
+        while (n > 0) {
+          // Split off one event.
+          auto event = reinterpret_cast<struct inotify_event*>(pos);
+          size_t eventSize = sizeof(struct inotify_event) + event->len;
+          KJ_ASSERT(eventSize <= n, "inotify returned partial event?");
+          n -= eventSize;
+          pos += eventSize;
+
+          if (event->mask & IN_Q_OVERFLOW) {
+            // Queue overflow; start over from scratch, and assume everything changed.
+            inotifyFd = nullptr;
+            KJ_LOG(WARNING, "inotify event queue overflow; restarting watch from scratch");
+            auto everything = kj::heapArrayBuilder<kj::String>(1);
+            everything.add(kj::heapString(""));
+            report(everything.finish());
+            return init();
+          }
+
+          auto iter = watchMap.find(event->wd);
+          if (iter == watchMap.end()) {
+            // Stale event for a watch we've already dropped.
+            continue;
+          }
+
+          // Note that event->name is NUL-padded, hence strlen() rather than event->len.
+          kj::StringPtr name = event->len > 0 ? kj::StringPtr(event->name) : kj::StringPtr("");
+          kj::String path = name.size() == 0 ? kj::heapString(iter->second) :
+              iter->second.size() == 0 ? kj::heapString(name) : kj::str(iter->second, '/', name);
+
+          if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+            // New directory; watch it too.
+            addPendingWatch(kj::heapString(path));
+          }
+
+          if (event->mask & IN_IGNORED) {
+            // This watch descriptor is being removed, probably because it was deleted.
+            watchMap.erase(iter);
+          }
+
+          if (changed.size() == 0 || changed.end()[-1] != path) {
+            changed.add(kj::mv(path));
+          }
+        }
+      }
+    });
+  }
+
+  void report(kj::Array<kj::String> paths) {
+    if (paths.size() == 0) return;
+
+    auto request = watcher.invalidateRequest();
+    auto list = request.initPaths(paths.size());
+    for (uint i: kj::indices(paths)) {
+      list.set(i, paths[i]);
+    }
+    invalidations.add(request.send().then([](auto&&) {}));
+  }
 };
 
 class NodeImpl final: public fuse::Node::Server {
 public:
-  NodeImpl(kj::StringPtr path, kj::Duration ttl)
-      : path(kj::heapString(path)), ttl(ttl) {
+  NodeImpl(kj::StringPtr path, kj::Duration ttl, kj::Maybe<kj::UnixEventPort&> eventPort)
+      : path(kj::heapString(path)), ttl(ttl), eventPort(eventPort) {
     updateStats();  // Mainly to throw an exception if it doesn't exist.
   }
 
-protected:
-  kj::Promise<void> lookup(LookupContext context) override {
-    auto name = context.getParams().getName();
-
-    KJ_REQUIRE(name != "." && name != "..", "Please implement . and .. at a higher level.");
-
-    auto results = context.getResults(capnp::MessageSize {8, 1});
-    results.setNode(kj::heap<NodeImpl>(kj::str(path, '/', name), ttl));
-    results.setTtl(ttl / kj::NANOSECONDS);
-    return kj::READY_NOW;
+  NodeImpl(kj::StringPtr path, kj::Duration ttl, kj::Maybe<kj::UnixEventPort&> eventPort,
+           const struct stat& stats)
+      : path(kj::heapString(path)), ttl(ttl), eventPort(eventPort), stats(stats) {
+    // Use stats which the caller just obtained.
+    statsExpirationTime = monotonicNanos() + ttl / kj::NANOSECONDS;
   }
 
-  kj::Promise<void> getAttributes(GetAttributesContext context) override {
-    updateStats();
-
-    auto results = context.getResults(capnp::MessageSize { 16, 0 });
-    auto attrs = results.getAttributes();
+  static void fillAttributes(const struct stat& stats, fuse::Node::Attributes::Builder attrs) {
     attrs.setInodeNumber(stats.st_ino);
 
     switch (stats.st_mode & S_IFMT) {
@@ -1039,6 +2682,25 @@ protected:
     attrs.setLastAccessTime(toNanos(stats.st_atim));
     attrs.setLastModificationTime(toNanos(stats.st_mtim));
     attrs.setLastStatusChangeTime(toNanos(stats.st_ctim));
+  }
+
+protected:
+  kj::Promise<void> lookup(LookupContext context) override {
+    auto name = context.getParams().getName();
+
+    KJ_REQUIRE(name != "." && name != "..", "Please implement . and .. at a higher level.");
+
+    auto results = context.getResults(capnp::MessageSize {8, 1});
+    results.setNode(kj::heap<NodeImpl>(kj::str(path, '/', name), ttl, eventPort));
+    results.setTtl(ttl / kj::NANOSECONDS);
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> getAttributes(GetAttributesContext context) override {
+    updateStats();
+
+    auto results = context.getResults(capnp::MessageSize { 16, 0 });
+    fillAttributes(stats, results.getAttributes());
     results.setTtl(ttl / kj::NANOSECONDS);
 
     return kj::READY_NOW;
@@ -1051,7 +2713,7 @@ protected:
   }
 
   kj::Promise<void> openAsDirectory(OpenAsDirectoryContext context) override {
-    auto directory = kj::heap<DirectoryImpl>(path);
+    auto directory = kj::heap<DirectoryImpl>(path, ttl, eventPort);
     context.getResults(capnp::MessageSize {2, 1}).setDirectory(kj::mv(directory));
     return kj::READY_NOW;
   }
@@ -1065,16 +2727,34 @@ protected:
     return kj::READY_NOW;
   }
 
+  kj::Promise<void> watch(WatchContext context) override {
+    KJ_IF_MAYBE(e, eventPort) {
+      auto watcher = context.getParams().getWatcher();
+      context.getResults(capnp::MessageSize {2, 1})
+          .setHandle(kj::heap<LoopbackWatcher>(*e, path, kj::mv(watcher),
+                                               context.getParams().getIgnore()));
+      return kj::READY_NOW;
+    } else {
+      // No event loop to watch from.
+      return fuse::Node::Server::watch(kj::mv(context));
+    }
+  }
+
 private:
   kj::String path;
   kj::Duration ttl;
+  kj::Maybe<kj::UnixEventPort&> eventPort;
   struct stat stats;
   int64_t statsExpirationTime = 0;
 
-  void updateStats() {
+  static int64_t monotonicNanos() {
     struct timespec ts;
     KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
-    uint64_t time = toNanos(ts);
+    return toNanos(ts);
+  }
+
+  void updateStats() {
+    int64_t time = monotonicNanos();
     if (time >= statsExpirationTime) {
       statsExpirationTime = time + ttl / kj::NANOSECONDS;
       KJ_SYSCALL(lstat(path.cStr(), &stats), path);
@@ -1082,10 +2762,48 @@ private:
   }
 };
 
+kj::Promise<void> DirectoryImpl::readPlus(ReadPlusContext context) {
+  auto params = context.getParams();
+  auto entries = readEntries(params.getOffset(), params.getCount());
+
+  capnp::MessageSize messageSize = { 6, 0 };
+  for (auto& entry: entries) {
+    messageSize.wordCount += capnp::sizeInWords<fuse::Directory::EntryPlus>() +
+        capnp::sizeInWords<fuse::Directory::Entry>() +
+        capnp::sizeInWords<fuse::Node::Attributes>() +
+        (strlen(entry.d_name) + sizeof(capnp::word)) / sizeof(capnp::word);
+    ++messageSize.capCount;
+  }
+
+  auto builder = context.getResults(messageSize).initEntries(entries.size());
+  for (size_t i: kj::indices(entries)) {
+    auto itemBuilder = builder[i];
+    auto& entry = entries[i];
+    fillEntry(itemBuilder.initEntry(), entry);
+
+    kj::StringPtr name = entry.d_name;
+    if (name == "." || name == "..") continue;
+
+    auto childPath = kj::str(path, '/', name);
+    struct stat stats;
+    if (lstat(childPath.cStr(), &stats) < 0) {
+      // Probably deleted since we read the directory. Leave the node null.
+      continue;
+    }
+
+    NodeImpl::fillAttributes(stats, itemBuilder.initAttributes());
+    itemBuilder.setNode(kj::heap<NodeImpl>(childPath, ttl, eventPort, stats));
+    itemBuilder.setTtl(ttl / kj::NANOSECONDS);
+  }
+
+  return kj::READY_NOW;
+}
+
 }  // namespace
 
-fuse::Node::Client newLoopbackFuseNode(kj::StringPtr path, kj::Duration cacheTtl) {
-  return kj::heap<NodeImpl>(path, cacheTtl);
+fuse::Node::Client newLoopbackFuseNode(kj::StringPtr path, kj::Duration cacheTtl,
+                                       kj::Maybe<kj::UnixEventPort&> eventPort) {
+  return kj::heap<NodeImpl>(path, cacheTtl, eventPort);
 }
 
 // =======================================================================================
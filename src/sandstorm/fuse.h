@@ -21,16 +21,85 @@
 #include <kj/time.h>
 #include <kj/io.h>
 #include <kj/function.h>
+#include <atomic>
 
 namespace kj { class UnixEventPort; }
 
 namespace sandstorm {
 
+struct FuseStats {
+  // Counters describing a mount's node table, for monitoring memory use. Updated by bindFuse()
+  // as the kernel looks up and forgets nodes; may be read from any thread.
+
+  std::atomic<uint64_t> nodeCount;
+  // Number of nodes the table currently tracks, including the root.
+
+  std::atomic<uint64_t> peakNodeCount;
+  // Highest value `nodeCount` has reached.
+
+  std::atomic<uint64_t> internedNames;
+  // Number of distinct names stored. Names are shared between all nodes that have them.
+
+  std::atomic<uint64_t> tableBytes;
+  // Approximate heap usage of the table, in bytes. Doesn't include capabilities.
+
+  std::atomic<uint64_t> evictionsRequested;
+  // Number of entries we've asked the kernel to drop because of `FuseOptions::maxNodes`.
+
+  FuseStats(): nodeCount(0), peakNodeCount(0), internedNames(0), tableBytes(0),
+               evictionsRequested(0) {}
+  KJ_DISALLOW_COPY(FuseStats);
+};
+
 struct FuseOptions {
   bool cacheForever = false;
   // Set true to ignore the TTL values returned by the filesystem implementation and instead
   // assume for caching purposes that content never changes. In addition to ignoring TTLs, the
   // page cache will not be flushed when a file is reopened.
+  //
+  // This is safe to use with a tree that changes if the root implements `Node.watch()`: in that
+  // case bindFuse() asks the kernel to drop its cached copies of whatever the tree reports as
+  // changed.
+
+  kj::uint threadCount = 1;
+  // Number of channels (and threads) serving the mount. With a value greater than one, the FUSE
+  // device is cloned (FUSE_DEV_IOC_CLONE) once per extra channel and each clone is served by its
+  // own thread with its own event loop, so that independent requests can be processed in
+  // parallel. Only honored by the `bindFuse()` overload that takes a root factory. If the kernel
+  // doesn't support cloning, we log a warning and fall back to fewer channels. Once serving, a
+  // failure on any channel fails the whole mount.
+
+  // The remaining options are negotiated with the kernel during FUSE_INIT. Each is only applied
+  // if the kernel offers it; older kernels silently get the defaults.
+
+  kj::uint maxReadahead = 65536;
+  // Maximum readahead, in bytes. The kernel may lower this further.
+
+  kj::uint maxPages = 0;
+  // If non-zero, the maximum number of pages per request (FUSE_MAX_PAGES), allowing reads
+  // larger than the kernel's default of 32 pages (128k). Zero leaves the kernel default.
+
+  bool asyncRead = false;
+  // Allow the kernel to issue several reads (including readahead) on the same file at once
+  // (FUSE_ASYNC_READ). All of our File implementations handle concurrent reads, so this mostly
+  // helps sequential throughput.
+
+  bool parallelDirops = false;
+  // Allow concurrent lookups and readdirs in the same directory (FUSE_PARALLEL_DIROPS). This
+  // matters mostly with `threadCount > 1`.
+
+  bool autoInvalidateData = false;
+  // Have the kernel drop a file's cached pages when it notices the modification time has changed
+  // (FUSE_AUTO_INVAL_DATA). Only useful when not using `cacheForever`.
+
+  uint64_t maxNodes = 0;
+  // If non-zero, a soft limit on the number of nodes tracked for the kernel. Past this limit, the
+  // least-recently-looked-up entries are invalidated so that the kernel forgets them, unless
+  // something is still using them. Zero means no limit; the table then grows and shrinks with
+  // the kernel's own inode cache.
+
+  FuseStats* stats = nullptr;
+  // If non-null, kept up to date with the node table's size. Must outlive the bindFuse() promise.
 };
 
 kj::Promise<void> bindFuse(kj::UnixEventPort& eventPort, int fuseFd, fuse::Node::Client root,
@@ -50,13 +119,31 @@ kj::Promise<void> bindFuse(kj::UnixEventPort& eventPort, int fuseFd, fuse::Node:
 // error code that it returns for all errors.  In the future, this situation may be improved if
 // kj::Exception gains a notion of error codes and error code namespaces.
 
-fuse::Node::Client newLoopbackFuseNode(kj::StringPtr path, kj::Duration cacheTtl);
+kj::Promise<void> bindFuse(kj::UnixEventPort& eventPort, int fuseFd,
+                           kj::Function<fuse::Node::Client()> rootFactory, FuseOptions options);
+// Like the above, but supports `options.threadCount > 1`. Capabilities cannot be shared between
+// threads, so instead of a single root node, `rootFactory` is called once on each serving thread
+// (including the calling thread) to produce that thread's root. Each root must represent the same
+// tree. `rootFactory` may be called concurrently from several threads.
+//
+// Nodes, file handles, and directory handles that the kernel obtained through one channel may be
+// used on any other channel. A channel that sees an unfamiliar ID re-derives the capability by
+// repeating the lookup path (or open) against its own root, so the tree must be read-only or at
+// least tolerate seeing a slightly different version of itself from different threads.
+
+fuse::Node::Client newLoopbackFuseNode(kj::StringPtr path, kj::Duration cacheTtl,
+                                       kj::Maybe<kj::UnixEventPort&> eventPort = nullptr);
 // Returns a "loopback" fuse node which simply mirrors the directory (or file) at the given path.
 // Throws an exception if the path doesn't exist.
 //
 // `cacheTtl` is the amount of time for which callers are allowed to cache path lookups and
 // attributes. It is OK to set this to zero, but performance will be reduced.
 //
+// If `eventPort` is given, the node implements `watch()` using inotify, so that `bindFuse()` can
+// invalidate exactly what changed on disk and the caller can safely set `cacheForever`. Note that
+// each watched directory consumes an inotify watch (see fs.inotify.max_user_watches), so avoid
+// watching large trees such as `/`; directories listed in the watch's `ignore` are skipped.
+//
 // At present this node and nodes created from it store their paths as strings. This means that
 // if the underlying filesystem changes, an existing node could become invalid, leading its methods
 // to throw exceptions. In the future, the implementation may change to open a file descriptor to
@@ -0,0 +1,254 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "indexed-spk.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <capnp/message.h>
+#include <sodium/crypto_sign.h>
+#include <sodium/crypto_hash.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+namespace sandstorm {
+namespace {
+
+kj::AutoCloseFd openTempFile() {
+  char name[] = "/tmp/indexed-spk-test.XXXXXX";
+  int fd;
+  KJ_SYSCALL(fd = mkstemp(name));
+  KJ_SYSCALL(unlink(name));
+  return kj::AutoCloseFd(fd);
+}
+
+kj::AutoCloseFd reopen(int fd) {
+  // IndexedSpkReader takes ownership, so give it a descriptor of its own.
+  int result;
+  KJ_SYSCALL(result = dup(fd));
+  return kj::AutoCloseFd(result);
+}
+
+void initKey(spk::KeyFile::Builder key) {
+  crypto_sign_keypair(key.initPublicKey(crypto_sign_PUBLICKEYBYTES).begin(),
+                      key.initPrivateKey(crypto_sign_SECRETKEYBYTES).begin());
+}
+
+kj::Array<capnp::word> makeManifest(kj::StringPtr version) {
+  capnp::MallocMessageBuilder message;
+  message.getRoot<spk::Manifest>().initAppMarketingVersion().setDefaultText(version);
+  return capnp::messageToFlatArray(message);
+}
+
+kj::ArrayPtr<const byte> asBytes(kj::ArrayPtr<const capnp::word> words) {
+  return kj::arrayPtr(reinterpret_cast<const byte*>(words.begin()),
+                      words.size() * sizeof(capnp::word));
+}
+
+void writeTrailer(int fd, spk::KeyFile::Reader key, capnp::MessageBuilder& indexMessage) {
+  // Append a trailer carrying `indexMessage` exactly as given, correctly signed with `key` -- as a
+  // hostile packer could.
+
+  kj::FdOutputStream out(fd);
+  auto indexWords = capnp::messageToFlatArray(indexMessage);
+  auto indexBytes = asBytes(indexWords);
+  byte hash[crypto_hash_BYTES];
+  crypto_hash(hash, indexBytes.begin(), indexBytes.size());
+
+  capnp::MallocMessageBuilder trailerMessage;
+  auto trailer = trailerMessage.getRoot<spk::IndexedPackage>();
+  trailer.setPublicKey(key.getPublicKey());
+  unsigned long long siglen = crypto_hash_BYTES + crypto_sign_BYTES;
+  crypto_sign(trailer.initSignature(siglen).begin(), &siglen,
+              hash, sizeof(hash), key.getPrivateKey().begin());
+  trailer.setIndex(indexBytes);
+
+  auto trailerWords = capnp::messageToFlatArray(trailerMessage);
+  uint64_t trailerSize = trailerWords.size() * sizeof(capnp::word);
+  out.write(trailerWords.begin(), trailerSize);
+  byte sizeBytes[8];
+  for (uint i = 0; i < 8; i++) {
+    sizeBytes[i] = trailerSize >> (i * 8);
+  }
+  out.write(sizeBytes, sizeof(sizeBytes));
+}
+
+void writeSigned(int fd, spk::KeyFile::Reader key, capnp::MessageBuilder& indexMessage) {
+  // Write a package with no blocks, just `indexMessage`.
+
+  auto magic = spk::INDEXED_MAGIC_NUMBER.get();
+  kj::FdOutputStream(fd).write(magic.begin(), magic.size());
+  writeTrailer(fd, key, indexMessage);
+}
+
+KJ_TEST("indexed spk round trip") {
+  capnp::MallocMessageBuilder keyMessage;
+  auto key = keyMessage.getRoot<spk::KeyFile>();
+  initKey(key);
+
+  auto manifest = makeManifest("1.0");
+  kj::StringPtr content = "hello world";
+
+  capnp::MallocMessageBuilder archiveMessage;
+  auto files = archiveMessage.getRoot<spk::Archive>().initFiles(2);
+  files[0].setName("sandstorm-manifest");
+  files[0].setRegular(asBytes(manifest));
+  files[1].setName("dir");
+  auto children = files[1].initDirectory(1);
+  children[0].setName("file");
+  children[0].setRegular(content.asBytes());
+
+  auto fd = openTempFile();
+  writeIndexedSpk(fd, archiveMessage.getRoot<spk::Archive>().asReader(), key.asReader(), 2);
+  KJ_EXPECT(isIndexedSpk(fd));
+
+  IndexedSpkReader reader(reopen(fd));
+  KJ_IF_MAYBE(file, reader.find("dir/file")) {
+    KJ_ASSERT(file->isRegular());
+    auto bytes = reader.read(file->getRegular());
+    KJ_EXPECT(kj::heapString(bytes.asChars()) == content);
+  } else {
+    KJ_FAIL_EXPECT("dir/file not found");
+  }
+  KJ_EXPECT(reader.find("dir/missing") == nullptr);
+  KJ_EXPECT(reader.find("sandstorm-manifest/file") == nullptr);
+
+  KJ_IF_MAYBE(m, reader.getManifest()) {
+    KJ_EXPECT(m->getAppMarketingVersion().getDefaultText() == "1.0");
+  } else {
+    KJ_FAIL_EXPECT("manifest not found");
+  }
+}
+
+KJ_TEST("indexed spk rejects hostile indexes") {
+  capnp::MallocMessageBuilder keyMessage;
+  auto key = keyMessage.getRoot<spk::KeyFile>();
+  initKey(key);
+
+  {
+    // A block size far beyond what any packer uses, which would make us allocate huge buffers.
+    capnp::MallocMessageBuilder indexMessage;
+    auto index = indexMessage.getRoot<spk::PackageIndex>();
+    index.setContentSize(1);
+    index.setBlockSize(0xffffffffu);
+    auto block = index.initBlocks(1)[0];
+    block.setOffset(spk::INDEXED_MAGIC_NUMBER.get().size());
+    block.initHash(crypto_hash_BYTES);
+    auto fd = openTempFile();
+    writeSigned(fd, key, indexMessage);
+    KJ_EXPECT_THROW_MESSAGE("Package index is corrupt", IndexedSpkReader(reopen(fd)));
+  }
+
+  {
+    // Content size chosen to overflow the block count arithmetic.
+    capnp::MallocMessageBuilder indexMessage;
+    auto index = indexMessage.getRoot<spk::PackageIndex>();
+    index.setContentSize(0xffffffffffffffffull);
+    index.setBlockSize(1 << 20);
+    auto fd = openTempFile();
+    writeSigned(fd, key, indexMessage);
+    KJ_EXPECT_THROW_MESSAGE("App too big", IndexedSpkReader(reopen(fd)));
+  }
+
+  {
+    // More blocks than the content needs.
+    capnp::MallocMessageBuilder indexMessage;
+    auto index = indexMessage.getRoot<spk::PackageIndex>();
+    index.setContentSize(0);
+    index.setBlockSize(1 << 20);
+    index.initBlocks(1);
+    auto fd = openTempFile();
+    writeSigned(fd, key, indexMessage);
+    KJ_EXPECT_THROW_MESSAGE("Package index is corrupt", IndexedSpkReader(reopen(fd)));
+  }
+
+  {
+    // A block pointing outside the file.
+    capnp::MallocMessageBuilder indexMessage;
+    auto index = indexMessage.getRoot<spk::PackageIndex>();
+    index.setContentSize(1);
+    index.setBlockSize(1 << 20);
+    auto block = index.initBlocks(1)[0];
+    block.setOffset(1ull << 40);
+    block.setSize(16);
+    block.initHash(crypto_hash_BYTES);
+    auto fd = openTempFile();
+    writeSigned(fd, key, indexMessage);
+    KJ_EXPECT_THROW_MESSAGE("Package index is corrupt", IndexedSpkReader(reopen(fd)));
+  }
+
+  {
+    // An index whose manifest copy disagrees with the (absent) archived manifest.
+    capnp::MallocMessageBuilder indexMessage;
+    auto index = indexMessage.getRoot<spk::PackageIndex>();
+    index.setBlockSize(1 << 20);
+    index.setManifest(asBytes(makeManifest("6.6.6")));
+    auto fd = openTempFile();
+    writeSigned(fd, key, indexMessage);
+    IndexedSpkReader reader(reopen(fd));
+    KJ_EXPECT_THROW_MESSAGE("manifest the package doesn't", reader.getManifest());
+  }
+
+  {
+    // A signature made with a different key.
+    capnp::MallocMessageBuilder otherKeyMessage;
+    auto otherKey = otherKeyMessage.getRoot<spk::KeyFile>();
+    initKey(otherKey);
+    otherKey.setPublicKey(key.getPublicKey());
+
+    capnp::MallocMessageBuilder indexMessage;
+    indexMessage.getRoot<spk::PackageIndex>().setBlockSize(1 << 20);
+    auto fd = openTempFile();
+    writeSigned(fd, otherKey, indexMessage);
+    KJ_EXPECT_THROW_MESSAGE("Invalid signature", IndexedSpkReader(reopen(fd)));
+  }
+}
+
+KJ_TEST("indexed spk detects a manifest copy that doesn't match") {
+  capnp::MallocMessageBuilder keyMessage;
+  auto key = keyMessage.getRoot<spk::KeyFile>();
+  initKey(key);
+
+  auto manifest = makeManifest("1.0");
+  capnp::MallocMessageBuilder archiveMessage;
+  auto files = archiveMessage.getRoot<spk::Archive>().initFiles(1);
+  files[0].setName("sandstorm-manifest");
+  files[0].setRegular(asBytes(manifest));
+
+  auto fd = openTempFile();
+  writeIndexedSpk(fd, archiveMessage.getRoot<spk::Archive>().asReader(), key.asReader(), 1);
+
+  // Re-sign the same index and blocks, but with a different manifest copy.
+  IndexedSpkReader original(reopen(fd));
+  capnp::MallocMessageBuilder indexMessage;
+  indexMessage.setRoot(original.getIndex());
+  indexMessage.getRoot<spk::PackageIndex>().setManifest(asBytes(makeManifest("6.6.6")));
+
+  // Cut off the old trailer and append the new one.
+  off_t blocksEnd = 0;
+  for (auto block: original.getIndex().getBlocks()) {
+    blocksEnd = kj::max(blocksEnd, off_t(block.getOffset() + block.getSize()));
+  }
+  KJ_SYSCALL(ftruncate(fd, blocksEnd));
+  KJ_SYSCALL(lseek(fd, blocksEnd, SEEK_SET));
+  writeTrailer(fd, key, indexMessage);
+
+  IndexedSpkReader reader(reopen(fd));
+  KJ_EXPECT_THROW_MESSAGE("doesn't match", reader.getManifest());
+}
+
+}  // namespace
+}  // namespace sandstorm
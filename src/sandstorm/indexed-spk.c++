@@ -0,0 +1,410 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "indexed-spk.h"
+#include <kj/debug.h>
+#include <sodium/crypto_sign.h>
+#include <sodium/crypto_hash.h>
+#include <lzma.h>
+#include <unistd.h>
+#include <string.h>
+
+namespace sandstorm {
+
+namespace {
+
+static const uint32_t BLOCK_SIZE = 1 << 20;
+// Uncompressed size of each block. Smaller blocks make reading a single small file cheaper, at
+// some cost in compression ratio.
+
+static const uint64_t MAX_TRAILER_SIZE = 64ull << 20;
+// Refuse to allocate more than this for the signature and index.
+
+void preadAll(int fd, void* buffer, size_t size, uint64_t offset) {
+  byte* pos = reinterpret_cast<byte*>(buffer);
+  while (size > 0) {
+    ssize_t n;
+    KJ_SYSCALL(n = pread(fd, pos, size, offset));
+    KJ_REQUIRE(n > 0, "package is truncated");
+    pos += n;
+    size -= n;
+    offset += n;
+  }
+}
+
+void setExtent(spk::PackageIndex::Extent::Builder extent, kj::ArrayPtr<const byte> content,
+               kj::Vector<kj::ArrayPtr<const byte>>& pieces, uint64_t& contentSize) {
+  extent.setOffset(contentSize);
+  extent.setSize(content.size());
+  if (content.size() > 0) {
+    pieces.add(content);
+    contentSize += content.size();
+  }
+}
+
+void layOut(capnp::List<spk::Archive::File>::Reader files,
+            capnp::List<spk::PackageIndex::File>::Builder entries,
+            kj::Vector<kj::ArrayPtr<const byte>>& pieces, uint64_t& contentSize) {
+  // Mirror the archive tree into `entries`, assigning each file's content an extent in tree order.
+
+  for (uint i: kj::indices(files)) {
+    auto file = files[i];
+    auto entry = entries[i];
+    entry.setName(file.getName());
+    entry.setLastModificationTimeNs(file.getLastModificationTimeNs());
+
+    switch (file.which()) {
+      case spk::Archive::File::REGULAR:
+        setExtent(entry.initRegular(), file.getRegular(), pieces, contentSize);
+        break;
+      case spk::Archive::File::EXECUTABLE:
+        setExtent(entry.initExecutable(), file.getExecutable(), pieces, contentSize);
+        break;
+      case spk::Archive::File::SYMLINK:
+        entry.setSymlink(file.getSymlink());
+        break;
+      case spk::Archive::File::DIRECTORY: {
+        auto children = file.getDirectory();
+        layOut(children, entry.initDirectory(children.size()), pieces, contentSize);
+        break;
+      }
+      default:
+        KJ_FAIL_REQUIRE("Unknown file type in archive.");
+    }
+  }
+}
+
+}  // namespace
+
+bool isIndexedSpk(int fd) {
+  auto expected = spk::INDEXED_MAGIC_NUMBER.get();
+  byte magic[expected.size()];
+  ssize_t n;
+  KJ_SYSCALL(n = pread(fd, magic, sizeof(magic), 0));
+  return size_t(n) == sizeof(magic) && memcmp(magic, expected.begin(), sizeof(magic)) == 0;
+}
+
+void writeIndexedSpk(int fd, spk::Archive::Reader archive, spk::KeyFile::Reader key,
+                     uint threadCount) {
+  kj::FdOutputStream out(fd);
+
+  capnp::MallocMessageBuilder indexMessage;
+  auto index = indexMessage.getRoot<spk::PackageIndex>();
+
+  kj::Vector<kj::ArrayPtr<const byte>> pieces;
+  uint64_t contentSize = 0;
+  auto files = archive.getFiles();
+  layOut(files, index.initFiles(files.size()), pieces, contentSize);
+  for (auto file: files) {
+    if (file.getName() == "sandstorm-manifest" && file.isRegular()) {
+      index.setManifest(file.getRegular());
+    }
+  }
+  index.setContentSize(contentSize);
+  index.setBlockSize(BLOCK_SIZE);
+
+  auto magic = spk::INDEXED_MAGIC_NUMBER.get();
+  out.write(magic.begin(), magic.size());
+  uint64_t offset = magic.size();
+
+  uint blockCount = (contentSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  auto blocks = index.initBlocks(blockCount);
+
+  // Compress a few blocks per thread at a time, copying each block's content out of the files it
+  // spans.
+  size_t pieceIndex = 0;
+  size_t pieceOffset = 0;
+  uint window = kj::max(threadCount, 1u) * 4;
+  for (uint start = 0; start < blockCount; start += window) {
+    uint count = kj::min(window, blockCount - start);
+
+    auto builder = kj::heapArrayBuilder<kj::Array<byte>>(count);
+    for (uint i = 0; i < count; i++) {
+      uint64_t blockStart = uint64_t(start + i) * BLOCK_SIZE;
+      size_t size = kj::min(uint64_t(BLOCK_SIZE), contentSize - blockStart);
+      auto content = kj::heapArray<byte>(size);
+      size_t filled = 0;
+      while (filled < size) {
+        auto piece = pieces[pieceIndex];
+        size_t n = kj::min(size - filled, piece.size() - pieceOffset);
+        memcpy(content.begin() + filled, piece.begin() + pieceOffset, n);
+        filled += n;
+        pieceOffset += n;
+        if (pieceOffset == piece.size()) {
+          ++pieceIndex;
+          pieceOffset = 0;
+        }
+      }
+      builder.add(kj::mv(content));
+    }
+    auto contents = builder.finish();
+
+    // Message builders aren't thread-safe, so the workers produce plain arrays.
+    auto hashes = kj::heapArray<byte>(count * crypto_hash_BYTES);
+    auto compressed = kj::heapArray<kj::Array<byte>>(count);
+    parallelFor(count, threadCount, [&](size_t i) {
+      crypto_hash(hashes.begin() + i * crypto_hash_BYTES, contents[i].begin(), contents[i].size());
+
+      // We check our own hashes, so xz's integrity check would be redundant.
+      auto buffer = kj::heapArray<byte>(lzma_stream_buffer_bound(contents[i].size()));
+      size_t pos = 0;
+      lzma_ret ret = lzma_easy_buffer_encode(LZMA_PRESET_DEFAULT, LZMA_CHECK_NONE, nullptr,
+          contents[i].begin(), contents[i].size(), buffer.begin(), &pos, buffer.size());
+      KJ_REQUIRE(ret == LZMA_OK, "xz compression failed", (int)ret);
+      compressed[i] = kj::heapArray<byte>(buffer.begin(), pos);
+    });
+
+    for (uint i = 0; i < count; i++) {
+      auto block = blocks[start + i];
+      block.setOffset(offset);
+      block.setSize(compressed[i].size());
+      block.setHash(kj::arrayPtr(hashes.begin() + i * crypto_hash_BYTES, crypto_hash_BYTES));
+      out.write(compressed[i].begin(), compressed[i].size());
+      offset += compressed[i].size();
+    }
+  }
+
+  // Sign the index.
+  auto indexWords = capnp::messageToFlatArray(indexMessage);
+  auto indexBytes = kj::arrayPtr(reinterpret_cast<const byte*>(indexWords.begin()),
+                                 indexWords.size() * sizeof(capnp::word));
+  byte hash[crypto_hash_BYTES];
+  crypto_hash(hash, indexBytes.begin(), indexBytes.size());
+
+  capnp::MallocMessageBuilder trailerMessage;
+  auto trailer = trailerMessage.getRoot<spk::IndexedPackage>();
+  trailer.setPublicKey(key.getPublicKey());
+  unsigned long long siglen = crypto_hash_BYTES + crypto_sign_BYTES;
+  crypto_sign(trailer.initSignature(siglen).begin(), &siglen,
+              hash, sizeof(hash), key.getPrivateKey().begin());
+  trailer.setIndex(indexBytes);
+
+  auto trailerWords = capnp::messageToFlatArray(trailerMessage);
+  uint64_t trailerSize = trailerWords.size() * sizeof(capnp::word);
+  out.write(trailerWords.begin(), trailerSize);
+
+  byte sizeBytes[8];
+  for (uint i = 0; i < 8; i++) {
+    sizeBytes[i] = trailerSize >> (i * 8);
+  }
+  out.write(sizeBytes, sizeof(sizeBytes));
+}
+
+// =======================================================================================
+
+IndexedSpkReader::IndexedSpkReader(kj::AutoCloseFd fdParam): fd(kj::mv(fdParam)) {
+  auto magic = spk::INDEXED_MAGIC_NUMBER.get();
+  fileSize = getFileSize(fd, "(package)");
+  KJ_REQUIRE(fileSize >= magic.size() + 8 && isIndexedSpk(fd), "Not an indexed package.");
+
+  // Read the trailer.
+  byte sizeBytes[8];
+  preadAll(fd, sizeBytes, sizeof(sizeBytes), fileSize - 8);
+  uint64_t trailerSize = 0;
+  for (uint i = 0; i < 8; i++) {
+    trailerSize |= uint64_t(sizeBytes[i]) << (i * 8);
+  }
+  KJ_REQUIRE(trailerSize % sizeof(capnp::word) == 0 && trailerSize <= MAX_TRAILER_SIZE &&
+             trailerSize <= fileSize - 8 - magic.size(), "Package trailer is corrupt.");
+  uint64_t blocksEnd = fileSize - 8 - trailerSize;
+
+  trailerWords = kj::heapArray<capnp::word>(trailerSize / sizeof(capnp::word));
+  preadAll(fd, trailerWords.begin(), trailerSize, blocksEnd);
+
+  capnp::ReaderOptions options;
+  options.traversalLimitInWords = trailerWords.size();
+  trailerMessage = kj::heap<capnp::FlatArrayMessageReader>(trailerWords, options);
+  trailer = trailerMessage->getRoot<spk::IndexedPackage>();
+
+  // Check the signature over the index.
+  auto publicKey = trailer.getPublicKey();
+  KJ_REQUIRE(publicKey.size() == crypto_sign_PUBLICKEYBYTES, "Invalid public key.");
+  auto signature = trailer.getSignature();
+  KJ_REQUIRE(signature.size() == crypto_hash_BYTES + crypto_sign_BYTES,
+             "Invalid signature format.");
+
+  byte expectedHash[crypto_hash_BYTES + crypto_sign_BYTES];
+  unsigned long long hashLength = 0;  // will be overwritten later
+  KJ_REQUIRE(crypto_sign_open(expectedHash, &hashLength, signature.begin(), signature.size(),
+                              publicKey.begin()) == 0, "Invalid signature.");
+  KJ_REQUIRE(hashLength == crypto_hash_BYTES, "Wrong signature size.");
+
+  auto indexBytes = trailer.getIndex();
+  byte hash[crypto_hash_BYTES];
+  crypto_hash(hash, indexBytes.begin(), indexBytes.size());
+  KJ_REQUIRE(memcmp(expectedHash, hash, crypto_hash_BYTES) == 0,
+             "Signature didn't match package index.");
+
+  // Blob contents are word-aligned within the message, so the index can be read in place.
+  KJ_REQUIRE(indexBytes.size() % sizeof(capnp::word) == 0, "Package index is corrupt.");
+  auto indexWords = kj::arrayPtr(reinterpret_cast<const capnp::word*>(indexBytes.begin()),
+                                 indexBytes.size() / sizeof(capnp::word));
+  options.traversalLimitInWords = indexWords.size();
+  indexMessage = kj::heap<capnp::FlatArrayMessageReader>(indexWords, options);
+  index = indexMessage->getRoot<spk::PackageIndex>();
+
+  // The index is signed, but by a key anyone can generate, so check it's sane before relying on
+  // it. Bounding the sizes also keeps the block arithmetic below from overflowing.
+  uint64_t blockSize = index.getBlockSize();
+  uint64_t contentSize = index.getContentSize();
+  auto blocks = index.getBlocks();
+  KJ_REQUIRE(blockSize > 0 && blockSize <= MAX_INDEXED_BLOCK_SIZE, "Package index is corrupt.");
+  KJ_REQUIRE(contentSize <= APP_SIZE_LIMIT, "App too big after decompress.");
+  KJ_REQUIRE(blocks.size() == (contentSize + blockSize - 1) / blockSize,
+             "Package index is corrupt.");
+  for (auto block: blocks) {
+    KJ_REQUIRE(block.getOffset() >= magic.size() && block.getOffset() <= blocksEnd &&
+               block.getSize() <= blocksEnd - block.getOffset() &&
+               block.getHash().size() == crypto_hash_BYTES,
+               "Package index is corrupt.");
+  }
+}
+
+kj::Maybe<spk::Manifest::Reader> IndexedSpkReader::getManifest() {
+  KJ_IF_MAYBE(message, manifestMessage) {
+    return (*message)->getRoot<spk::Manifest>();
+  }
+
+  // The index's copy of the manifest is signed along with everything else, but nothing else
+  // ties it to the manifest that actually gets installed, so read that and check they agree.
+  kj::Array<byte> bytes;
+  KJ_IF_MAYBE(file, find("sandstorm-manifest")) {
+    KJ_REQUIRE(file->isRegular(), "Package manifest is not a regular file.");
+    bytes = read(file->getRegular());
+  } else {
+    KJ_REQUIRE(!index.hasManifest(), "Package index has a manifest the package doesn't.");
+    return nullptr;
+  }
+
+  if (index.hasManifest()) {
+    auto copy = index.getManifest();
+    KJ_REQUIRE(copy.size() == bytes.size() &&
+               memcmp(copy.begin(), bytes.begin(), bytes.size()) == 0,
+               "Package index's manifest doesn't match the package's.");
+  }
+
+  KJ_REQUIRE(bytes.size() % sizeof(capnp::word) == 0, "Package manifest is corrupt.");
+  manifestWords = kj::heapArray<capnp::word>(bytes.size() / sizeof(capnp::word));
+  memcpy(manifestWords.begin(), bytes.begin(), bytes.size());
+  auto message = kj::heap<capnp::FlatArrayMessageReader>(manifestWords);
+  auto result = message->getRoot<spk::Manifest>();
+  manifestMessage = kj::mv(message);
+  return result;
+}
+
+kj::Maybe<spk::PackageIndex::File::Reader> IndexedSpkReader::find(kj::StringPtr path) {
+  auto files = index.getFiles();
+
+  for (;;) {
+    kj::ArrayPtr<const char> name;
+    kj::StringPtr rest = nullptr;
+    KJ_IF_MAYBE(slashPos, path.findFirst('/')) {
+      name = path.slice(0, *slashPos);
+      rest = path.slice(*slashPos + 1);
+    } else {
+      name = path;
+    }
+
+    kj::Maybe<spk::PackageIndex::File::Reader> match;
+    for (auto file: files) {
+      auto fileName = file.getName();
+      if (fileName.size() == name.size() &&
+          memcmp(fileName.begin(), name.begin(), name.size()) == 0) {
+        match = file;
+        break;
+      }
+    }
+
+    KJ_IF_MAYBE(file, match) {
+      if (rest == nullptr) return *file;
+      if (!file->isDirectory()) return nullptr;
+      files = file->getDirectory();
+      path = rest;
+    } else {
+      return nullptr;
+    }
+  }
+}
+
+kj::Array<byte> IndexedSpkReader::read(spk::PackageIndex::Extent::Reader extent) {
+  uint64_t offset = extent.getOffset();
+  uint64_t size = extent.getSize();
+  uint64_t contentSize = index.getContentSize();
+  KJ_REQUIRE(offset <= contentSize && size <= contentSize - offset, "Extent out of range.");
+
+  auto result = kj::heapArray<byte>(size);
+  if (size == 0) return result;
+
+  uint64_t blockSize = index.getBlockSize();
+  uint64_t first = offset / blockSize;
+  uint64_t last = (offset + size - 1) / blockSize;
+
+  kj::Array<byte> scratch;
+  for (uint64_t i = first; i <= last; i++) {
+    uint64_t blockStart = i * blockSize;
+    uint64_t blockEnd = kj::min(blockStart + blockSize, contentSize);
+    uint64_t from = kj::max(offset, blockStart);
+    uint64_t to = kj::min(offset + size, blockEnd);
+
+    auto target = result.slice(from - offset, to - offset);
+    if (from == blockStart && to == blockEnd) {
+      // We want the whole block; decompress it in place.
+      readBlock(i, target);
+    } else {
+      if (scratch == nullptr) scratch = kj::heapArray<byte>(blockSize);
+      auto whole = scratch.slice(0, blockEnd - blockStart);
+      readBlock(i, whole);
+      memcpy(target.begin(), whole.begin() + (from - blockStart), target.size());
+    }
+  }
+
+  return result;
+}
+
+void IndexedSpkReader::readAll(kj::ArrayPtr<byte> out, uint threadCount) {
+  uint64_t contentSize = index.getContentSize();
+  uint64_t blockSize = index.getBlockSize();
+  KJ_REQUIRE(out.size() == contentSize);
+
+  parallelFor(index.getBlocks().size(), threadCount, [&](size_t i) {
+    uint64_t start = i * blockSize;
+    readBlock(i, out.slice(start, kj::min(start + blockSize, contentSize)));
+  });
+}
+
+void IndexedSpkReader::readBlock(uint i, kj::ArrayPtr<byte> out) {
+  auto block = index.getBlocks()[i];
+
+  auto compressed = kj::heapArray<byte>(block.getSize());
+  preadAll(fd, compressed.begin(), compressed.size(), block.getOffset());
+
+  // Blocks are untrusted input too, so bound what the decoder may allocate: enough for the
+  // default preset's dictionary, or for one as large as the block, but no more.
+  uint64_t memlimit = index.getBlockSize() + (16 << 20);
+  size_t inPos = 0;
+  size_t outPos = 0;
+  lzma_ret ret = lzma_stream_buffer_decode(&memlimit, 0, nullptr,
+      compressed.begin(), &inPos, compressed.size(), out.begin(), &outPos, out.size());
+  KJ_REQUIRE(ret == LZMA_OK && inPos == compressed.size() && outPos == out.size(),
+             "Package block is corrupt.", i, (int)ret);
+
+  byte hash[crypto_hash_BYTES];
+  crypto_hash(hash, out.begin(), out.size());
+  KJ_REQUIRE(memcmp(hash, block.getHash().begin(), crypto_hash_BYTES) == 0,
+             "Package block doesn't match its signed hash.", i);
+}
+
+}  // namespace sandstorm
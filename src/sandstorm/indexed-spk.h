@@ -0,0 +1,89 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_INDEXED_SPK_H_
+#define SANDSTORM_INDEXED_SPK_H_
+// Reading and writing packages in the indexed format described by `IndexedPackage` in
+// package.capnp, which lets a single file -- or just the manifest -- be read and verified without
+// decompressing the whole package.
+
+#include <sandstorm/package.capnp.h>
+#include <capnp/serialize.h>
+#include "util.h"
+
+namespace sandstorm {
+
+constexpr uint64_t APP_SIZE_LIMIT = 1ull << 30;
+// For now, we will refuse to unpack an app over 1 GB (decompressed size).
+
+constexpr uint32_t MAX_INDEXED_BLOCK_SIZE = 1 << 24;
+// Largest `PackageIndex.blockSize` a reader accepts. Packing always uses 1 MiB.
+
+bool isIndexedSpk(int fd);
+// Checks whether the package open as `fd` starts with `indexedMagicNumber`. Doesn't move the file
+// position.
+
+void writeIndexedSpk(int fd, spk::Archive::Reader archive, spk::KeyFile::Reader key,
+                     uint threadCount);
+// Writes `archive` to `fd` as an indexed package signed with `key`, compressing blocks on up to
+// `threadCount` threads.
+
+class IndexedSpkReader {
+  // Reads an indexed package. The constructor checks the signature over the index, so everything
+  // reachable from getIndex() can be trusted; file contents are checked block by block as they
+  // are read.
+
+public:
+  explicit IndexedSpkReader(kj::AutoCloseFd fd);
+  // Throws if `fd` isn't a validly-signed indexed package.
+
+  KJ_DISALLOW_COPY(IndexedSpkReader);
+
+  inline kj::ArrayPtr<const byte> getPublicKey() { return trailer.getPublicKey(); }
+  inline spk::PackageIndex::Reader getIndex() { return index; }
+
+  kj::Maybe<spk::Manifest::Reader> getManifest();
+  // The package's manifest, read from the archived `sandstorm-manifest`. Throws if the index's
+  // copy of the manifest doesn't match it.
+
+  kj::Maybe<spk::PackageIndex::File::Reader> find(kj::StringPtr path);
+  // Look up a slash-separated path relative to the package root.
+
+  kj::Array<byte> read(spk::PackageIndex::Extent::Reader extent);
+  // Decompress and verify just the blocks covering `extent` and return its content.
+
+  void readAll(kj::ArrayPtr<byte> out, uint threadCount);
+  // Decompress and verify every block into `out`, which must be exactly `contentSize` bytes, using
+  // up to `threadCount` threads.
+
+private:
+  kj::AutoCloseFd fd;
+  uint64_t fileSize;
+  kj::Array<capnp::word> trailerWords;
+  kj::Own<capnp::FlatArrayMessageReader> trailerMessage;
+  spk::IndexedPackage::Reader trailer;
+  kj::Own<capnp::FlatArrayMessageReader> indexMessage;
+  spk::PackageIndex::Reader index;
+  kj::Array<capnp::word> manifestWords;
+  kj::Maybe<kj::Own<capnp::FlatArrayMessageReader>> manifestMessage;
+
+  void readBlock(uint i, kj::ArrayPtr<byte> out);
+  // Decompress block `i` into `out`, whose size must match the block's, and check its hash.
+};
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_INDEXED_SPK_H_
@@ -0,0 +1,260 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "response-cache.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace sandstorm {
+namespace {
+
+class FakeResponse final: public ResponseCache::AppResponse {
+public:
+  explicit FakeResponse(kj::StringPtr body, uint statusCode = 200)
+      : body(body), statusCode(statusCode) {}
+
+  FakeResponse& header(kj::StringPtr name, kj::StringPtr value) {
+    headers.add(Header { name, value });
+    return *this;
+  }
+
+  bool cookies = false;
+
+  uint getStatusCode() override { return statusCode; }
+  bool setsCookies() override { return cookies; }
+
+  kj::Maybe<kj::StringPtr> findHeader(kj::StringPtr name) override {
+    for (auto& h: headers) {
+      if (h.name == name) return h.value;
+    }
+    return nullptr;
+  }
+
+  void buildCached(WebSession::Response::Builder builder) override {
+    auto content = builder.initContent();
+    content.setMimeType("text/plain");
+    content.initBody().setBytes(body.asBytes());
+  }
+
+private:
+  struct Header {
+    kj::StringPtr name;
+    kj::StringPtr value;
+  };
+
+  kj::StringPtr body;
+  uint statusCode;
+  kj::Vector<Header> headers;
+};
+
+kj::StringPtr REQUEST = "GET /foo HTTP/1.1\r\nAccept-Language: en\r\n\r\n";
+kj::StringPtr GERMAN_REQUEST = "GET /foo HTTP/1.1\r\nAccept-Language: de\r\n\r\n";
+kj::StringPtr AUTHORIZED_REQUEST = "GET /foo HTTP/1.1\r\nAuthorization: Basic Zm9vOmJhcg==\r\n\r\n";
+
+bool store(ResponseCache& cache, kj::StringPtr basePath, kj::StringPtr path,
+           kj::StringPtr request, FakeResponse& response) {
+  KJ_IF_MAYBE(policy, ResponseCache::getStorablePolicy(request, response)) {
+    cache.insert(basePath, path, request, kj::mv(*policy), response);
+    return true;
+  }
+  return false;
+}
+
+kj::Own<ResponseCache::Entry> get(ResponseCache& cache, kj::StringPtr basePath,
+                                  kj::StringPtr path, kj::StringPtr request) {
+  return kj::mv(KJ_ASSERT_NONNULL(cache.find(basePath, path, request)));
+}
+
+kj::String bodyOf(ResponseCache& cache, ResponseCache::Entry& entry) {
+  return kj::heapString(cache.load(entry).getContent().getBody().getBytes().asChars());
+}
+
+KJ_TEST("ResponseCache stores only what a shared cache may") {
+  ResponseCache cache(1 << 20, 0, nullptr);
+
+  KJ_EXPECT(store(cache, "https://a", "foo", REQUEST,
+      FakeResponse("x").header("cache-control", "public, max-age=60")));
+  KJ_EXPECT(store(cache, "https://a", "foo", REQUEST,
+      FakeResponse("x").header("cache-control", "public").header("etag", "\"1\"")));
+  KJ_EXPECT(store(cache, "https://a", "foo", REQUEST, FakeResponse("x")
+      .header("cache-control", "public, no-cache")
+      .header("last-modified", "Wed, 15 Nov 1995 06:25:24 GMT")));
+
+  // Not explicitly public, so possibly meant for this user only.
+  KJ_EXPECT(!store(cache, "https://a", "foo", REQUEST,
+      FakeResponse("x").header("cache-control", "max-age=60")));
+  KJ_EXPECT(!store(cache, "https://a", "foo", REQUEST,
+      FakeResponse("x").header("etag", "\"1\"")));
+  KJ_EXPECT(!store(cache, "https://a", "foo", REQUEST,
+      FakeResponse("x").header("last-modified", "Wed, 15 Nov 1995 06:25:24 GMT")));
+  KJ_EXPECT(!store(cache, "https://a", "foo", AUTHORIZED_REQUEST,
+      FakeResponse("x").header("cache-control", "public, max-age=60")));
+
+  KJ_EXPECT(!store(cache, "https://a", "foo", REQUEST,
+      FakeResponse("x", 404).header("cache-control", "public, max-age=60")));
+  KJ_EXPECT(!store(cache, "https://a", "foo", REQUEST,
+      FakeResponse("x").header("cache-control", "private, max-age=60")));
+  KJ_EXPECT(!store(cache, "https://a", "foo", REQUEST,
+      FakeResponse("x").header("cache-control", "public, no-store, max-age=60")));
+  KJ_EXPECT(!store(cache, "https://a", "foo", REQUEST,
+      FakeResponse("x").header("cache-control", "public, max-age=60").header("vary", "*")));
+  KJ_EXPECT(!store(cache, "https://a", "foo", REQUEST,
+      FakeResponse("x").header("cache-control", "public")));
+
+  FakeResponse withCookie("x");
+  withCookie.header("cache-control", "public, max-age=60");
+  withCookie.cookies = true;
+  KJ_EXPECT(!store(cache, "https://a", "foo", REQUEST, withCookie));
+}
+
+KJ_TEST("ResponseCache keeps responses per base path") {
+  ResponseCache cache(1 << 20, 0, nullptr);
+
+  KJ_ASSERT(store(cache, "https://a", "foo", REQUEST,
+      FakeResponse("from a").header("cache-control", "public, max-age=60")));
+
+  auto entry = get(cache, "https://a", "foo", REQUEST);
+  KJ_EXPECT(ResponseCache::isFresh(*entry));
+  KJ_EXPECT(bodyOf(cache, *entry) == "from a");
+
+  KJ_EXPECT(cache.find("https://b", "foo", REQUEST) == nullptr);
+  KJ_EXPECT(cache.find("https://a", "bar", REQUEST) == nullptr);
+}
+
+KJ_TEST("ResponseCache uses the app's clock for Expires") {
+  ResponseCache cache(1 << 20, 0, nullptr);
+
+  // Long expired by our clock, but the app says it's good for two more minutes.
+  KJ_ASSERT(store(cache, "https://a", "foo", REQUEST, FakeResponse("x")
+      .header("cache-control", "public")
+      .header("date", "Wed, 15 Nov 1995 06:25:24 GMT")
+      .header("expires", "Wed, 15 Nov 1995 06:27:24 GMT")));
+  KJ_EXPECT(ResponseCache::isFresh(*get(cache, "https://a", "foo", REQUEST)));
+}
+
+KJ_TEST("ResponseCache matches Vary") {
+  ResponseCache cache(1 << 20, 0, nullptr);
+
+  KJ_ASSERT(store(cache, "https://a", "foo", REQUEST, FakeResponse("hello")
+      .header("cache-control", "public, max-age=60")
+      .header("vary", "Accept-Language")));
+  KJ_EXPECT(cache.find("https://a", "foo", REQUEST) != nullptr);
+  KJ_EXPECT(cache.find("https://a", "foo", GERMAN_REQUEST) == nullptr);
+
+  KJ_ASSERT(store(cache, "https://a", "foo", GERMAN_REQUEST, FakeResponse("hallo")
+      .header("cache-control", "public, max-age=60")
+      .header("vary", "Accept-Language")));
+  KJ_EXPECT(bodyOf(cache, *get(cache, "https://a", "foo", REQUEST)) == "hello");
+  KJ_EXPECT(bodyOf(cache, *get(cache, "https://a", "foo", GERMAN_REQUEST)) == "hallo");
+}
+
+KJ_TEST("ResponseCache revalidates, refreshes, and discards") {
+  ResponseCache cache(1 << 20, 0, nullptr);
+
+  KJ_ASSERT(store(cache, "https://a", "foo", REQUEST,
+      FakeResponse("x").header("cache-control", "public").header("etag", "\"1\"")));
+  auto entry = get(cache, "https://a", "foo", REQUEST);
+  KJ_EXPECT(!ResponseCache::isFresh(*entry));
+
+  auto conditional = ResponseCache::addValidators(REQUEST, *entry);
+  KJ_EXPECT(conditional ==
+      "GET /foo HTTP/1.1\r\nAccept-Language: en\r\nIf-None-Match: \"1\"\r\n\r\n", conditional);
+
+  cache.refresh(*entry, FakeResponse("", 304).header("cache-control", "public, max-age=60"));
+  KJ_EXPECT(ResponseCache::isFresh(*entry));
+
+  cache.discard(*entry);
+  KJ_EXPECT(cache.find("https://a", "foo", REQUEST) == nullptr);
+  cache.discard(*entry);  // Already gone; no-op.
+  KJ_EXPECT(bodyOf(cache, *entry) == "x");  // Still usable by whoever holds it.
+}
+
+KJ_TEST("ResponseCache keeps a weakened ETag weak across revalidation") {
+  ResponseCache cache(1 << 20, 0, nullptr);
+
+  // As the bridge stores a body it compressed.
+  KJ_ASSERT(store(cache, "https://a", "foo", REQUEST,
+      FakeResponse("x").header("cache-control", "public").header("etag", "W/\"1\"")));
+  auto entry = get(cache, "https://a", "foo", REQUEST);
+
+  cache.refresh(*entry, FakeResponse("", 304).header("etag", "\"1\""));
+  auto conditional = ResponseCache::addValidators(REQUEST, *entry);
+  KJ_EXPECT(conditional ==
+      "GET /foo HTTP/1.1\r\nAccept-Language: en\r\nIf-None-Match: W/\"1\"\r\n\r\n", conditional);
+}
+
+KJ_TEST("ResponseCache invalidates a path under every base path") {
+  ResponseCache cache(1 << 20, 0, nullptr);
+
+  for (auto basePath: {"https://a", "https://b"}) {
+    for (auto path: {"foo", "foo/bar"}) {
+      KJ_ASSERT(store(cache, basePath, path, REQUEST,
+          FakeResponse("x").header("cache-control", "public, max-age=60")));
+    }
+  }
+
+  cache.invalidate("foo");
+  KJ_EXPECT(cache.find("https://a", "foo", REQUEST) == nullptr);
+  KJ_EXPECT(cache.find("https://b", "foo", REQUEST) == nullptr);
+  KJ_EXPECT(cache.find("https://a", "foo/bar", REQUEST) != nullptr);
+  KJ_EXPECT(cache.find("https://b", "foo/bar", REQUEST) != nullptr);
+}
+
+KJ_TEST("ResponseCache evicts the least recently used") {
+  auto body = kj::heapString(600);
+  memset(body.begin(), 'x', body.size());
+  kj::Vector<kj::String> paths;
+  for (uint i = 0; i < 20; i++) {
+    paths.add(kj::str("file", i));
+  }
+
+  {
+    // Only about a dozen fit in memory, and there's no disk.
+    ResponseCache cache(8192, 0, nullptr);
+    for (auto& path: paths) {
+      KJ_ASSERT(store(cache, "https://a", path, REQUEST,
+          FakeResponse(body).header("cache-control", "public, max-age=60")));
+      KJ_EXPECT(cache.find("https://a", paths[0], REQUEST) != nullptr);
+    }
+    KJ_EXPECT(cache.find("https://a", paths[0], REQUEST) != nullptr);
+    KJ_EXPECT(cache.find("https://a", paths[1], REQUEST) == nullptr);
+    KJ_EXPECT(cache.find("https://a", paths[19], REQUEST) != nullptr);
+  }
+
+  {
+    // With a disk, the rest spill over there instead.
+    char dirTemplate[] = "/tmp/response-cache-test.XXXXXX";
+    KJ_ASSERT(mkdtemp(dirTemplate) != nullptr);
+    kj::StringPtr dir = dirTemplate;
+    KJ_DEFER(recursivelyDelete(dir));
+
+    ResponseCache cache(8192, 1 << 20, dir);
+    for (auto& path: paths) {
+      KJ_ASSERT(store(cache, "https://a", path, REQUEST,
+          FakeResponse(body).header("cache-control", "public, max-age=60")));
+    }
+    KJ_EXPECT(listDirectory(dir).size() > 0);
+    for (auto& path: paths) {
+      auto entry = get(cache, "https://a", path, REQUEST);
+      KJ_EXPECT(bodyOf(cache, *entry) == body);
+    }
+  }
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -0,0 +1,386 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "response-cache.h"
+#include <kj/debug.h>
+#include <capnp/serialize.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace sandstorm {
+
+ResponseCache::ResponseCache(size_t memoryLimit, size_t diskLimit, kj::StringPtr diskDir)
+    : memoryLimit(memoryLimit), diskLimit(diskLimit), diskDir(kj::heapString(diskDir)) {
+  if (diskLimit > 0) {
+    // Anything left over from a previous run is useless, since the index was only in memory.
+    if (access(diskDir.cStr(), F_OK) == 0) {
+      recursivelyDelete(diskDir);
+    }
+    KJ_SYSCALL(mkdir(diskDir.cStr(), 0700), diskDir);
+  }
+}
+
+ResponseCache::Entry::~Entry() noexcept(false) {
+  KJ_IF_MAYBE(f, file) {
+    unlink(f->cStr());
+  }
+}
+
+kj::Maybe<kj::Own<ResponseCache::Entry>> ResponseCache::find(
+    kj::StringPtr basePath, kj::StringPtr path, kj::StringPtr request) {
+  auto iter = resources.find(kj::str(basePath, '/', path));
+  if (iter == resources.end()) {
+    return nullptr;
+  }
+
+  auto values = getVaryValues(iter->second->vary, request);
+  for (auto& entry: iter->second->variants) {
+    if (sameStrings(entry->varyValues, values)) {
+      touch(*entry);
+      return kj::addRef(*entry);
+    }
+  }
+  return nullptr;
+}
+
+bool ResponseCache::isFresh(Entry& entry) {
+  return entry.freshUntil > time(nullptr);
+}
+
+kj::String ResponseCache::addValidators(kj::StringPtr request, Entry& entry) {
+  kj::Vector<kj::String> lines;
+  KJ_IF_MAYBE(e, entry.etag) {
+    lines.add(kj::str("If-None-Match: ", *e));
+  }
+  KJ_IF_MAYBE(m, entry.lastModified) {
+    lines.add(kj::str("If-Modified-Since: ", *m));
+  }
+  if (lines.size() == 0) {
+    return kj::heapString(request);
+  }
+  return kj::str(request.slice(0, request.size() - 2), kj::strArray(lines, "\r\n"), "\r\n\r\n");
+}
+
+WebSession::Response::Reader ResponseCache::load(Entry& entry) {
+  if (entry.message == nullptr) {
+    auto path = kj::mv(KJ_ASSERT_NONNULL(entry.file));
+    entry.file = nullptr;
+    KJ_DEFER(unlink(path.cStr()));
+
+    capnp::ReaderOptions options;
+    options.traversalLimitInWords = kj::maxValue;
+    capnp::StreamFdMessageReader reader(raiiOpen(path, O_RDONLY | O_CLOEXEC), options);
+    auto message = kj::heap<capnp::MallocMessageBuilder>();
+    message->setRoot(reader.getRoot<WebSession::Response>());
+    entry.message = kj::mv(message);
+
+    if (entry.resource != nullptr) {
+      diskLru.erase(entry.lruPosition);
+      entry.lruPosition = memoryLru.insert(memoryLru.end(), &entry);
+      diskUsed -= entry.size;
+      memoryUsed += entry.size;
+      evict();  // Won't pick `entry`, having just used it.
+    }
+  }
+
+  return KJ_ASSERT_NONNULL(entry.message)->getRoot<WebSession::Response>().asReader();
+}
+
+void ResponseCache::refresh(Entry& entry, AppResponse& notModified) {
+  KJ_IF_MAYBE(policy, getPolicy(notModified)) {
+    entry.freshUntil = policy->freshUntil;
+    KJ_IF_MAYBE(e, policy->etag) {
+      // A 304 isn't compressed, so its ETag may be the strong form of one the bridge weakened
+      // for the compressed body we stored. Keep ours weak in that case.
+      bool weak = false;
+      KJ_IF_MAYBE(old, entry.etag) {
+        weak = old->startsWith("W/") && !e->startsWith("W/");
+      }
+      entry.etag = weak ? kj::str("W/", *e) : kj::mv(*e);
+    }
+    KJ_IF_MAYBE(m, policy->lastModified) {
+      entry.lastModified = kj::mv(*m);
+    }
+  } else {
+    entry.freshUntil = 0;
+  }
+  if (entry.resource != nullptr) {
+    touch(entry);
+  }
+}
+
+void ResponseCache::discard(Entry& entry) {
+  if (entry.resource != nullptr) {
+    remove(entry);
+  }
+}
+
+void ResponseCache::invalidate(kj::StringPtr path) {
+  kj::Vector<Resource*> matches;
+  for (auto& resource: resources) {
+    if (resource.second->path == path) {
+      matches.add(resource.second.get());
+    }
+  }
+  for (auto resource: matches) {
+    removeResource(*resource);
+  }
+}
+
+kj::Maybe<ResponseCache::Policy> ResponseCache::getStorablePolicy(
+    kj::StringPtr request, AppResponse& response) {
+  if (response.getStatusCode() != 200 || response.setsCookies() ||
+      findRequestHeader(request, "authorization").size() > 0) {
+    return nullptr;
+  }
+
+  KJ_IF_MAYBE(policy, getPolicy(response)) {
+    if (policy->isPublic && (policy->freshUntil > time(nullptr) ||
+        policy->etag != nullptr || policy->lastModified != nullptr)) {
+      return kj::mv(*policy);
+    }
+  }
+  return nullptr;
+}
+
+void ResponseCache::insert(kj::StringPtr basePath, kj::StringPtr path, kj::StringPtr request,
+                           Policy&& policy, AppResponse& response) {
+  auto message = kj::heap<capnp::MallocMessageBuilder>();
+  response.buildCached(message->initRoot<WebSession::Response>());
+  size_t size = capnp::computeSerializedSizeInWords(*message) * sizeof(capnp::word);
+  if (size > getMaxEntrySize()) {
+    return;
+  }
+
+  auto url = kj::str(basePath, '/', path);
+  auto iter = resources.find(url);
+  if (iter != resources.end() && !sameStrings(iter->second->vary, policy.vary)) {
+    // The app changed which headers matter, so the other variants can't be matched anymore.
+    removeResource(*iter->second);
+    iter = resources.end();
+  }
+  if (iter == resources.end()) {
+    auto resource = kj::heap<Resource>();
+    resource->url = kj::mv(url);
+    resource->path = kj::heapString(path);
+    resource->vary = kj::mv(policy.vary);
+    kj::StringPtr key = resource->url;
+    iter = resources.insert(std::make_pair(key, kj::mv(resource))).first;
+  }
+  auto& resource = *iter->second;
+
+  auto entry = kj::refcounted<Entry>();
+  entry->resource = &resource;
+  entry->varyValues = getVaryValues(resource.vary, request);
+  entry->etag = kj::mv(policy.etag);
+  entry->lastModified = kj::mv(policy.lastModified);
+  entry->freshUntil = policy.freshUntil;
+  entry->size = size;
+  entry->message = kj::mv(message);
+  entry->lruPosition = memoryLru.insert(memoryLru.end(), entry.get());
+
+  for (auto& other: resource.variants) {
+    if (sameStrings(other->varyValues, entry->varyValues)) {
+      remove(*other, false);  // Replaced.
+      break;
+    }
+  }
+  if (resource.variants.size() >= MAX_VARIANTS) {
+    remove(*resource.variants[0], false);  // Oldest.
+  }
+
+  resource.variants.add(kj::mv(entry));
+  memoryUsed += size;
+  evict();
+}
+
+constexpr size_t ResponseCache::MAX_VARIANTS;
+
+kj::Maybe<ResponseCache::Policy> ResponseCache::getPolicy(AppResponse& response) {
+  bool isPublic = false;
+  bool noCache = false;
+  kj::Maybe<uint> maxAge;
+  kj::Maybe<uint> sharedMaxAge;
+  KJ_IF_MAYBE(cacheControl, response.findHeader("cache-control")) {
+    for (auto part: split(*cacheControl, ',')) {
+      kj::String name;
+      kj::String value;
+      KJ_IF_MAYBE(n, splitFirst(part, '=')) {
+        name = trim(*n);
+        value = trim(part);
+      } else {
+        name = trim(part);
+      }
+      toLower(name);
+
+      if (name == "no-store" || name == "private") {
+        return nullptr;
+      } else if (name == "public") {
+        isPublic = true;
+      } else if (name == "no-cache") {
+        noCache = true;
+      } else if (name == "max-age") {
+        maxAge = parseUInt(value, 10);
+      } else if (name == "s-maxage") {
+        sharedMaxAge = parseUInt(value, 10);
+      }
+    }
+  }
+
+  time_t now = time(nullptr);
+  time_t freshUntil = 0;
+  if (isPublic && !noCache) {
+    KJ_IF_MAYBE(age, sharedMaxAge) {
+      freshUntil = now + *age;
+    } else KJ_IF_MAYBE(age, maxAge) {
+      freshUntil = now + *age;
+    } else KJ_IF_MAYBE(expiresHeader, response.findHeader("expires")) {
+      KJ_IF_MAYBE(expires, parseHttpDate(*expiresHeader)) {
+        // Use the app's idea of the current time, in case its clock differs from ours.
+        time_t date = now;
+        KJ_IF_MAYBE(dateHeader, response.findHeader("date")) {
+          KJ_IF_MAYBE(d, parseHttpDate(*dateHeader)) {
+            date = *d;
+          }
+        }
+        freshUntil = now + (*expires - date);
+      }
+    }
+  }
+
+  kj::Vector<kj::String> vary;
+  KJ_IF_MAYBE(varyHeader, response.findHeader("vary")) {
+    for (auto part: split(*varyHeader, ',')) {
+      auto name = trim(part);
+      toLower(name);
+      if (name == "*") {
+        return nullptr;
+      } else if (name.size() > 0) {
+        vary.add(kj::mv(name));
+      }
+    }
+  }
+
+  Policy result;
+  result.isPublic = isPublic;
+  result.freshUntil = freshUntil;
+  result.vary = vary.releaseAsArray();
+  KJ_IF_MAYBE(e, response.findHeader("etag")) {
+    result.etag = kj::heapString(*e);
+  }
+  KJ_IF_MAYBE(m, response.findHeader("last-modified")) {
+    result.lastModified = kj::heapString(*m);
+  }
+  return kj::mv(result);
+}
+
+kj::String ResponseCache::findRequestHeader(kj::StringPtr request, kj::StringPtr name) {
+  for (auto line: split(request, '\n')) {
+    KJ_IF_MAYBE(lineName, splitFirst(line, ':')) {
+      auto lowerName = trim(*lineName);
+      toLower(lowerName);
+      if (lowerName == name) {
+        return trim(line);
+      }
+    }
+  }
+  return kj::heapString("");
+}
+
+kj::Array<kj::String> ResponseCache::getVaryValues(kj::ArrayPtr<const kj::String> vary,
+                                                   kj::StringPtr request) {
+  return KJ_MAP(name, vary) { return findRequestHeader(request, name); };
+}
+
+bool ResponseCache::sameStrings(kj::ArrayPtr<const kj::String> a,
+                                kj::ArrayPtr<const kj::String> b) {
+  if (a.size() != b.size()) return false;
+  for (auto i: kj::indices(a)) {
+    if (a[i] != b[i]) return false;
+  }
+  return true;
+}
+
+void ResponseCache::touch(Entry& entry) {
+  auto& lru = entry.message != nullptr ? memoryLru : diskLru;
+  lru.splice(lru.end(), lru, entry.lruPosition);
+}
+
+void ResponseCache::evict() {
+  while (memoryUsed > memoryLimit) {
+    Entry& victim = *memoryLru.front();
+    if (diskLimit == 0 || !spill(victim)) {
+      remove(victim);
+    }
+  }
+  while (diskUsed > diskLimit) {
+    remove(*diskLru.front());
+  }
+}
+
+bool ResponseCache::spill(Entry& entry) {
+  auto path = kj::str(diskDir, '/', ++fileCounter);
+  KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+    auto fd = raiiOpen(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    capnp::writeMessageToFd(fd, *KJ_ASSERT_NONNULL(entry.message));
+  })) {
+    KJ_LOG(WARNING, "couldn't write response to cache directory", *exception);
+    unlink(path.cStr());
+    return false;
+  }
+
+  entry.message = nullptr;
+  entry.file = kj::mv(path);
+  memoryLru.erase(entry.lruPosition);
+  entry.lruPosition = diskLru.insert(diskLru.end(), &entry);
+  memoryUsed -= entry.size;
+  diskUsed += entry.size;
+  return true;
+}
+
+void ResponseCache::remove(Entry& entry, bool eraseEmptyResource) {
+  auto& resource = *entry.resource;
+  if (entry.message != nullptr) {
+    memoryLru.erase(entry.lruPosition);
+    memoryUsed -= entry.size;
+  } else {
+    diskLru.erase(entry.lruPosition);
+    diskUsed -= entry.size;
+  }
+  entry.resource = nullptr;
+
+  // Careful: `entry` may be destroyed once removed from `variants`.
+  kj::Vector<kj::Own<Entry>> rest(resource.variants.size());
+  for (auto& other: resource.variants) {
+    if (other.get() != &entry) {
+      rest.add(kj::mv(other));
+    }
+  }
+  resource.variants = kj::mv(rest);
+
+  if (eraseEmptyResource && resource.variants.size() == 0) {
+    resources.erase(resources.find(resource.url));
+  }
+}
+
+void ResponseCache::removeResource(Resource& resource) {
+  while (resource.variants.size() > 0) {
+    remove(*resource.variants[0], false);
+  }
+  resources.erase(resources.find(resource.url));
+}
+
+}  // namespace sandstorm
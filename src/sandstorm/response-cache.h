@@ -0,0 +1,180 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_RESPONSE_CACHE_H_
+#define SANDSTORM_RESPONSE_CACHE_H_
+// The HTTP bridge's cache of app responses.
+
+#include <sandstorm/web-session.capnp.h>
+#include <capnp/message.h>
+#include <kj/refcount.h>
+#include <list>
+#include <map>
+#include <time.h>
+#include "util.h"
+
+namespace sandstorm {
+
+class ResponseCache {
+  // Keeps app responses to GET requests so that, for example, static assets needn't be fetched
+  // from the app on every page load. All users of the grain share the cache, so it follows the
+  // HTTP rules for shared caches:
+  // * Only 200 responses that the app explicitly marked "public" are kept, and never those that
+  //   set cookies, are marked "no-store" or "private", vary on "*", or answer a request carrying
+  //   Authorization. Everything else might be meant for one user only.
+  // * Responses with a lifetime (s-maxage, max-age, or Expires) are served without asking the app
+  //   until they expire. Those without one but with an ETag or Last-Modified are revalidated with
+  //   the app on each use, which at least saves transferring the body again.
+  // * A response is only used for requests matching the headers named in its Vary.
+  // * Responses are kept per base path, since sessions on different hosts send the app different
+  //   Host headers.
+  // * Once the app is sent a request that may change a path, such as a POST, invalidate() drops
+  //   everything stored for that path under every base path.
+  //
+  // Entries stay in memory up to `memoryLimit` bytes. Beyond that the least-recently-used ones
+  // move to files under `diskDir`, up to `diskLimit` bytes, and are dropped after that.
+
+public:
+  ResponseCache(size_t memoryLimit, size_t diskLimit, kj::StringPtr diskDir);
+  KJ_DISALLOW_COPY(ResponseCache);
+
+  class AppResponse {
+    // The parts of a response from the app that the cache looks at.
+
+  public:
+    virtual uint getStatusCode() = 0;
+    virtual bool setsCookies() = 0;
+
+    virtual kj::Maybe<kj::StringPtr> findHeader(kj::StringPtr name) = 0;
+    // `name` must be lower-case.
+
+    virtual void buildCached(WebSession::Response::Builder builder) = 0;
+    // Build the response with the entire body inline.
+  };
+
+  struct Resource;
+
+  class Entry: public kj::Refcounted {
+  public:
+    ~Entry() noexcept(false);
+
+  private:
+    friend class ResponseCache;
+
+    Resource* resource;  // Null once removed from the cache.
+    kj::Array<kj::String> varyValues;
+    kj::Maybe<kj::String> etag;
+    kj::Maybe<kj::String> lastModified;
+    time_t freshUntil;  // Zero if every use must be revalidated.
+    size_t size;
+    std::list<Entry*>::iterator lruPosition;  // In `memoryLru` or `diskLru`; valid if `resource`.
+    kj::Maybe<kj::Own<capnp::MallocMessageBuilder>> message;  // If in memory.
+    kj::Maybe<kj::String> file;  // If on disk.
+  };
+
+  struct Resource {
+    kj::String url;  // `basePath` + '/' + `path`.
+    kj::String path;
+    kj::Array<kj::String> vary;  // Lower-case request header names.
+    kj::Vector<kj::Own<Entry>> variants;
+  };
+
+  struct Policy {
+    bool isPublic;
+    time_t freshUntil;
+    kj::Array<kj::String> vary;
+    kj::Maybe<kj::String> etag;
+    kj::Maybe<kj::String> lastModified;
+  };
+
+  size_t getMaxEntrySize() { return memoryLimit / 8; }
+
+  kj::Maybe<kj::Own<Entry>> find(kj::StringPtr basePath, kj::StringPtr path,
+                                 kj::StringPtr request);
+  // Find the stored response for a GET of `path` in a session with the given `basePath`, with the
+  // request headers in `request`.
+
+  static bool isFresh(Entry& entry);
+
+  static kj::String addValidators(kj::StringPtr request, Entry& entry);
+  // Make `request`, which ends with the blank line after the headers, conditional on `entry`
+  // still being current.
+
+  WebSession::Response::Reader load(Entry& entry);
+  // Get the stored response, reading it back into memory if it was moved to disk. The result is
+  // only valid until the next call into the cache.
+
+  void refresh(Entry& entry, AppResponse& notModified);
+  // The app answered a revalidation of `entry` with 304 Not Modified, whose headers may update
+  // the lifetime and validators.
+
+  void discard(Entry& entry);
+  // Drop `entry`, e.g. because revalidating it got a new response. Does nothing if it is already
+  // gone.
+
+  void invalidate(kj::StringPtr path);
+  // Drop everything stored for `path`, under every base path, because a request that may have
+  // changed it was sent to the app.
+
+  static kj::Maybe<Policy> getStorablePolicy(kj::StringPtr request, AppResponse& response);
+  // Decide whether `response`, to the request whose headers are in `request`, may be stored at
+  // all.
+
+  void insert(kj::StringPtr basePath, kj::StringPtr path, kj::StringPtr request,
+              Policy&& policy, AppResponse& response);
+  // Store the complete `response` to a GET of `path` in a session with the given `basePath`, with
+  // the request headers in `request`.
+
+private:
+  static constexpr size_t MAX_VARIANTS = 8;
+
+  size_t memoryLimit;
+  size_t diskLimit;
+  kj::String diskDir;
+  std::map<kj::StringPtr, kj::Own<Resource>> resources;  // Keyed by URL.
+  size_t memoryUsed = 0;
+  size_t diskUsed = 0;
+  std::list<Entry*> memoryLru;  // Entries held in memory, least recently used first.
+  std::list<Entry*> diskLru;  // Entries moved to disk, least recently used first.
+  uint fileCounter = 0;
+
+  static kj::Maybe<Policy> getPolicy(AppResponse& response);
+  // Interpret the caching headers of `response`, or return null if they forbid storing it.
+
+  static kj::String findRequestHeader(kj::StringPtr request, kj::StringPtr name);
+  // Get the value of the header `name` (lower-case) in `request`, or an empty string.
+
+  static kj::Array<kj::String> getVaryValues(kj::ArrayPtr<const kj::String> vary,
+                                             kj::StringPtr request);
+  static bool sameStrings(kj::ArrayPtr<const kj::String> a, kj::ArrayPtr<const kj::String> b);
+
+  void touch(Entry& entry);
+  // Mark `entry`, which must still be in the cache, as most recently used.
+
+  void evict();
+
+  bool spill(Entry& entry);
+  // Move `entry` from memory to disk. Returns false if that failed.
+
+  void remove(Entry& entry, bool eraseEmptyResource = true);
+  // Drop `entry` from the cache. Anyone still holding a reference to it can keep using it.
+
+  void removeResource(Resource& resource);
+};
+
+}  // namespace sandstorm
+
+#endif // SANDSTORM_RESPONSE_CACHE_H_
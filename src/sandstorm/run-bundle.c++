@@ -1049,7 +1049,13 @@ public:
     sendFd(sock, STDOUT_FILENO);
     sendFd(sock, STDERR_FILENO);
 
-    // Send supervisor args.
+    // Send supervisor args, putting each grain in its own cgroup if the server is configured to.
+    // (Options must come before the app's command.)
+    const Config config = readConfig();
+    if (config.grainCgroupParent != nullptr) {
+      auto arg = kj::str("--cgroup=", config.grainCgroupParent);
+      kj::FdOutputStream((int)sock).write(arg.cStr(), arg.size() + 1);
+    }
     kj::FdOutputStream((int)sock).write(superviseArgs.begin(), superviseArgs.size());
 
     // Send EOF.
@@ -1095,6 +1101,9 @@ private:
     kj::String updateChannel = nullptr;
     bool allowDemoAccounts = false;
     bool isTesting = false;
+    kj::String grainCgroupParent = nullptr;
+    // cgroup v2 directory, delegated to SERVER_USER, under which each grain gets its own cgroup
+    // for resource accounting and limits. See the supervisor's --cgroup option.
   };
 
   kj::String updateFile;
@@ -1436,6 +1445,8 @@ private:
         config.allowDemoAccounts = value == "true" || value == "yes";
       } else if (key == "IS_TESTING") {
         config.isTesting = value == "true" || value == "yes";
+      } else if (key == "GRAIN_CGROUP_PARENT") {
+        config.grainCgroupParent = kj::mv(value);
       }
     }
 
@@ -31,11 +31,13 @@
 #include <capnp/serialize.h>
 #include <unistd.h>
 #include <map>
+#include <list>
 #include <unordered_map>
 #include <time.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <fcntl.h>
@@ -48,9 +50,11 @@
 #include <sandstorm/hack-session.capnp.h>
 #include <sandstorm/package.capnp.h>
 #include <joyent-http/http_parser.h>
+#include <zlib.h>
 
 #include "version.h"
 #include "util.h"
+#include "response-cache.h"
 
 namespace sandstorm {
 
@@ -152,12 +156,171 @@ std::unordered_map<uint, HttpStatusInfo> makeStatusCodes() {
 const std::unordered_map<uint, HttpStatusInfo> HTTP_STATUS_CODES = makeStatusCodes();
 #pragma clang diagnostic pop
 
+template <typename T>
+void removePrefix(kj::Vector<T>& vec, size_t n) {
+  // Remove the first `n` elements of `vec`, which kj::Vector can't do in place.
+
+  if (n == vec.size()) {
+    vec.resize(0);
+  } else {
+    kj::Vector<T> rest(vec.size() - n);
+    rest.addAll(vec.begin() + n, vec.end());
+    vec = kj::mv(rest);
+  }
+}
+
+struct StreamOptions {
+  // How response bodies and WebSocket traffic are forwarded between the app and the front-end.
+
+  size_t windowBytes = 256 * 1024;
+  // We stop reading from the app while this many bytes have been read but not yet acknowledged by
+  // the front-end, so that a slow client applies backpressure to the app rather than making us
+  // (or the front-end) buffer the whole response. Likewise, a WebSocket stops accepting messages
+  // from the client while this many bytes are waiting to be written to the app.
+
+  size_t writeBytes = 64 * 1024;
+  // Small reads from the app are coalesced into write() (or sendBytes()) calls of up to this size.
+
+  int compressionLevel = 6;
+  // zlib level (1-9) at which to gzip compressible responses that the app didn't compress itself,
+  // or 0 to leave them alone.
+};
+
+class GzipCompressor {
+  // Incremental gzip compression using zlib.
+
+public:
+  explicit GzipCompressor(int level) {
+    memset(&stream, 0, sizeof(stream));
+    // 16 added to the window bits selects the gzip wrapper rather than zlib's own.
+    int result = deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    KJ_ASSERT(result == Z_OK, "deflateInit2() failed", result);
+  }
+  ~GzipCompressor() {
+    deflateEnd(&stream);
+  }
+  KJ_DISALLOW_COPY(GzipCompressor);
+
+  void add(kj::ArrayPtr<const char> input, kj::Vector<char>& output, int flush = Z_NO_FLUSH) {
+    // Compress `input`, appending whatever output zlib has ready to `output`. Pass Z_SYNC_FLUSH to
+    // force out everything so far, or Z_FINISH to end the stream.
+
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.begin()));
+    stream.avail_in = input.size();
+    do {
+      char chunk[8192];
+      stream.next_out = reinterpret_cast<Bytef*>(chunk);
+      stream.avail_out = sizeof(chunk);
+      int result = deflate(&stream, flush);
+      KJ_ASSERT(result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR,
+                "deflate() failed", result);
+      output.addAll(chunk, chunk + sizeof(chunk) - stream.avail_out);
+    } while (stream.avail_out == 0);
+  }
+
+private:
+  z_stream stream;
+};
+
+bool isCompressibleType(kj::StringPtr contentType) {
+  // Whether a response of this Content-Type is worth compressing: text of any kind, but not
+  // images (other than SVG), video, archives, etc., which are typically compressed already.
+
+  auto parts = split(contentType, ';');
+  auto type = trim(parts[0]);
+  toLower(type);
+  return type.startsWith("text/") ||
+         type == "application/json" ||
+         type == "application/javascript" ||
+         type == "application/x-javascript" ||
+         type == "application/ecmascript" ||
+         type == "application/xml" ||
+         type == "image/svg+xml" ||
+         type.endsWith("+json") ||
+         type.endsWith("+xml");
+}
+
+class AppConnectionPool {
+  // Keeps idle HTTP/1.1 keep-alive connections to the app, so that a request doesn't need to set
+  // up a new connection every time.
+
+public:
+  AppConnectionPool(kj::NetworkAddress& address, kj::Timer& timer)
+      : address(address), timer(timer) {}
+
+  struct Connection {
+    kj::Own<kj::AsyncIoStream> stream;
+    bool reused;
+    // True if the connection came from the pool, in which case the app may have closed it just
+    // as we took it.
+  };
+
+  kj::Promise<Connection> connect(bool allowReuse = true) {
+    if (allowReuse) {
+      // Prefer the most recently used connection, the least likely to be about to time out.
+      while (!idle.empty()) {
+        auto stream = kj::mv(idle.back().stream);
+        idle.pop_back();
+        if (stream.get() != nullptr) {
+          return Connection { kj::mv(stream), true };
+        }
+      }
+    }
+
+    return address.connect().then([](kj::Own<kj::AsyncIoStream>&& stream) {
+      return Connection { kj::mv(stream), false };
+    });
+  }
+
+  void release(kj::Own<kj::AsyncIoStream> stream) {
+    // Return a connection whose last response has been read completely and which the app agreed
+    // to keep alive.
+
+    idle.remove_if([](IdleConnection& c) { return c.stream.get() == nullptr; });
+    while (idle.size() >= MAX_IDLE) {
+      idle.pop_front();
+    }
+
+    idle.emplace_back();
+    auto& entry = idle.back();
+    entry.stream = kj::mv(stream);
+
+    // The connection is no good once the app closes it (or, wrongly, sends more data), and we
+    // give up on it after a while regardless. Either way, close it right away; the entry itself
+    // is cleaned up later.
+    entry.watch = entry.stream->tryRead(&entry.probe, 1, 1)
+        .then([](size_t n) {}, [](kj::Exception&& e) {})
+        .exclusiveJoin(timer.afterDelay(IDLE_TIMEOUT))
+        .then([&entry]() { entry.stream = nullptr; })
+        .eagerlyEvaluate(nullptr);
+  }
+
+private:
+  static constexpr size_t MAX_IDLE = 16;
+  static constexpr kj::Duration IDLE_TIMEOUT = 30 * kj::SECONDS;
+
+  struct IdleConnection {
+    kj::Own<kj::AsyncIoStream> stream;  // Null once closed.
+    kj::Promise<void> watch = nullptr;  // Declared after `stream` so it is destroyed first.
+    byte probe;
+  };
+
+  kj::NetworkAddress& address;
+  kj::Timer& timer;
+  std::list<IdleConnection> idle;  // Oldest first.
+};
+
+constexpr size_t AppConnectionPool::MAX_IDLE;
+constexpr kj::Duration AppConnectionPool::IDLE_TIMEOUT;
+
 class HttpParser: public sandstorm::Handle::Server,
+                  public ResponseCache::AppResponse,
                   private http_parser,
                   private kj::TaskSet::ErrorHandler {
 public:
-  HttpParser(sandstorm::ByteStream::Client responseStream)
+  HttpParser(sandstorm::ByteStream::Client responseStream, const StreamOptions& options)
     : responseStream(responseStream),
+      options(options),
       taskSet(*this) {
     memset(&settings, 0, sizeof(settings));
     settings.on_status = &on_status;
@@ -165,29 +328,38 @@ public:
     settings.on_header_value = &on_header_value;
     settings.on_body = &on_body;
     settings.on_headers_complete = &on_headers_complete;
+    settings.on_message_complete = &on_message_complete;
     http_parser_init(this, HTTP_RESPONSE);
   }
 
   kj::Promise<kj::ArrayPtr<byte>> readResponse(kj::AsyncIoStream& stream) {
     // Read from the stream until we have enough data to forward the response. If the response
-    // is streaming or an upgrade, then just read the headers; otherwise read the entire stream.
+    // is streaming or an upgrade, then just read the headers; otherwise read the entire response.
     // If the response is an upgrade, return any remainder bytes that should be forwarded to the
     // new web socket; otherwise return an empty array.
 
     return stream.tryRead(buffer, 1, sizeof(buffer)).then(
         [this, &stream](size_t actual) mutable -> kj::Promise<kj::ArrayPtr<byte>> {
-      size_t nread = http_parser_execute(this, &settings, reinterpret_cast<char*>(buffer), actual);
-      if (nread != actual && !upgrade) {
-        const char* error = http_errno_description(HTTP_PARSER_ERRNO(this));
-        KJ_FAIL_ASSERT("Failed to parse HTTP response from sandboxed app.", error);
-      } else if (upgrade) {
+      size_t nread = parse(actual);
+      if (upgrade) {
         KJ_ASSERT(nread <= actual && nread >= 0);
         return kj::arrayPtr(buffer + nread, actual - nread);
-      } else if (actual == 0) {
-        // EOF
+      } else if (actual == 0 || messageComplete) {
+        // EOF, or we have the whole response already, in which case there's no point streaming.
+        // Settle compression now, since it changes the headers the cache looks at.
+        compressBufferedBody();
         return kj::arrayPtr(buffer, 0);
       } else if (headersComplete && status_code / 100 == 2) {
         isStreaming = true;
+        if (wantsCompression()) {
+          // Compress the body as it goes, starting with what we have so far.
+          auto compressor = kj::heap<GzipCompressor>(options.compressionLevel);
+          auto raw = kj::mv(body);
+          body = kj::Vector<char>();
+          compressor->add(raw.asPtr(), body);
+          this->compressor = kj::mv(compressor);
+          setCompressed();
+        }
         return kj::arrayPtr(buffer,0);
       } else {
         return readResponse(stream);
@@ -195,21 +367,352 @@ public:
     });
   }
 
-  void pumpStream(kj::Own<kj::AsyncIoStream>&& stream) {
+  bool hasStarted() { return started; }
+  // Whether any of the response has been received.
+
+  bool isComplete() { return messageComplete; }
+  // Whether the whole response has been received.
+
+  bool isStreamingResponse() { return isStreaming; }
+  uint getStatusCode() override { return status_code; }
+  bool setsCookies() override { return cookies.size() > 0; }
+
+  kj::Maybe<kj::StringPtr> findHeader(kj::StringPtr name) override {
+    // `name` must be lower-case.
+    auto iter = headers.find(name);
+    if (iter == headers.end()) {
+      return nullptr;
+    } else {
+      return kj::StringPtr(iter->second.value);
+    }
+  }
+
+  void captureBody(size_t limit, kj::Function<void()> onComplete) {
+    // Keep a copy of a streaming response's body, as long as it doesn't exceed `limit` bytes, and
+    // call `onComplete` if the whole response arrives, at which point buildCached() can be used.
+    // Call before pumpStream().
+
+    Capture c { limit, kj::Vector<char>(), kj::mv(onComplete) };
+    c.data.addAll(body);
+    capture = kj::mv(c);
+  }
+
+  void pumpStream(kj::Own<kj::AsyncIoStream>&& stream,
+                  kj::Maybe<AppConnectionPool&> pool = nullptr) {
+    // Forward the rest of a streaming response. Once the response is complete, `stream` goes back
+    // to `pool`, if given and the connection can be kept alive.
+
+    if (isStreaming) {
+      // Send everything read along with the headers now, so that none of it is left in `body` for
+      // build() to find.
+      compressorFlush(Z_SYNC_FLUSH);
+      flushBody(true);
+      taskSet.add(pumpStreamInternal(kj::mv(stream), pool));
+    } else {
+      maybeReuse(kj::mv(stream), pool);
+    }
+  }
+
+  void build(WebSession::Response::Builder builder, sandstorm::Handle::Client handle) {
     if (isStreaming) {
-      if (body.size() > 0) {
-        auto request = responseStream.writeRequest();
-        auto dst = request.initData(body.size());
-        memcpy(dst.begin(), body.begin(), body.size());
-        taskSet.add(request.send().then([](auto x){}));
-        body.resize(0);
+      KJ_ASSERT(body.size() == 0);
+      buildResponse(builder, handle, nullptr);
+    } else {
+      compressBufferedBody();
+      buildResponse(builder, nullptr, body.asPtr());
+    }
+  }
+
+  void buildCached(WebSession::Response::Builder builder) override {
+    // Build the response with the entire body inline, for ResponseCache. For a streaming response,
+    // only valid once captureBody()'s callback has been called.
+
+    KJ_IF_MAYBE(c, capture) {
+      buildResponse(builder, nullptr, c->data.asPtr());
+    } else {
+      KJ_ASSERT(!isStreaming);
+      compressBufferedBody();
+      buildResponse(builder, nullptr, body.asPtr());
+    }
+  }
+
+  void buildForWebSocket(WebSession::OpenWebSocketResults::Builder builder) {
+    // TODO(soon):  If the app returned a normal response without upgrading, we should forward that
+    //   through, as it's perfectly valid HTTP.  The WebSession interface currently does not
+    //   support this.
+    KJ_ASSERT(status_code == 101, "Sandboxed app does not support WebSocket.",
+              (int)upgrade, (int)status_code, statusString);
+
+    KJ_IF_MAYBE(protocol, findHeader("sec-websocket-protocol")) {
+      auto parts = split(*protocol, ',');
+      auto list = builder.initProtocol(parts.size());
+      for (auto i: kj::indices(parts)) {
+        auto trimmed = trim(parts[i]);
+        memcpy(list.init(i, trimmed.size()).begin(), trimmed.begin(), trimmed.size());
+      }
+    }
+
+    // TODO(soon):  Should we do more validation here, like checking the exact value of the Upgrade
+    //   header or Sec-WebSocket-Accept?
+  }
+
+private:
+  enum HeaderElementType { NONE, FIELD, VALUE };
+
+  struct RawHeader {
+    kj::Vector<char> name;
+    kj::Vector<char> value;
+  };
+
+  struct Header {
+    kj::String name;
+    kj::String value;
+  };
+
+  struct Cookie {
+    kj::String name;
+    kj::String value;
+    kj::String path;
+    int64_t expires;
+
+    enum ExpirationType {
+      NONE, RELATIVE, ABSOLUTE
+    };
+    ExpirationType expirationType = NONE;
+
+    bool httpOnly = false;
+  };
+
+  sandstorm::ByteStream::Client responseStream;
+  const StreamOptions& options;
+  kj::TaskSet taskSet;
+  bool headersComplete = false;
+  byte buffer[4096];
+  http_parser_settings settings;
+  kj::Vector<RawHeader> rawHeaders;
+  kj::Vector<char> rawStatusString;
+  HeaderElementType lastHeaderElement = NONE;
+  std::map<kj::StringPtr, Header> headers;
+  kj::Vector<char> body;
+  kj::Vector<Cookie> cookies;
+  kj::String statusString;
+  bool isStreaming = false;
+  bool started = false;
+  bool messageComplete = false;
+  bool keepAlive = false;
+  size_t inFlightBytes = 0;  // Sent to the front-end but not yet acknowledged.
+
+  struct Capture {
+    size_t limit;
+    kj::Vector<char> data;
+    kj::Function<void()> onComplete;
+  };
+  kj::Maybe<Capture> capture;  // See captureBody().
+
+  kj::Maybe<kj::Own<GzipCompressor>> compressor;
+  // Compresses a streaming body on its way into `body`; see wantsCompression().
+
+  bool compressed = false;  // Whether we gzipped the body, so must set the encoding.
+  bool compressionChecked = false;  // Whether compressBufferedBody() has run.
+
+  static constexpr size_t MIN_COMPRESS_SIZE = 256;
+  // Smaller bodies aren't worth compressing.
+
+  bool wantsCompression() {
+    // Whether to compress this response's body, because it's text that the app didn't compress.
+
+    if (options.compressionLevel <= 0) return false;
+    auto iter = HTTP_STATUS_CODES.find(status_code);
+    if (iter == HTTP_STATUS_CODES.end() || iter->second.type != WebSession::Response::CONTENT) {
+      return false;
+    }
+    if (findHeader("content-encoding") != nullptr) return false;
+    KJ_IF_MAYBE(type, findHeader("content-type")) {
+      return isCompressibleType(*type);
+    } else {
+      return false;
+    }
+  }
+
+  void compressBufferedBody() {
+    if (compressionChecked) return;
+    compressionChecked = true;
+
+    if (body.size() >= MIN_COMPRESS_SIZE && wantsCompression()) {
+      GzipCompressor compressor(options.compressionLevel);
+      kj::Vector<char> result(body.size() / 2 + 64);
+      compressor.add(body.asPtr(), result, Z_FINISH);
+      if (result.size() < body.size()) {
+        body = kj::mv(result);
+        setCompressed();
       }
+    }
+  }
+
+  void setCompressed() {
+    // The body we send is now our gzipped version of the app's, which is a different
+    // representation: the app's ETag can only be a weak validator for it (RFC 7232 section 2.1),
+    // and caches must tell it apart by Accept-Encoding.
+
+    compressed = true;
 
-      taskSet.add(pumpStreamInternal(kj::mv(stream)));
+    auto etag = headers.find("etag");
+    if (etag != headers.end() && !etag->second.value.startsWith("W/")) {
+      etag->second.value = kj::str("W/", etag->second.value);
+    }
+
+    auto& vary = headers["vary"];
+    if (vary.name == nullptr) {
+      vary = Header { kj::heapString("vary"), kj::heapString("Accept-Encoding") };
+    } else {
+      vary.value = kj::str(kj::mv(vary.value), ", Accept-Encoding");
     }
   }
 
-  void build(WebSession::Response::Builder builder, sandstorm::Handle::Client handle) {
+  void compressorFlush(int flush) {
+    // Get output out of the streaming compressor, if any.
+    KJ_IF_MAYBE(c, compressor) {
+      size_t oldSize = body.size();
+      c->get()->add(nullptr, body, flush);
+      captureSince(oldSize);
+    }
+  }
+
+  void captureSince(size_t oldSize) {
+    // Add what's been appended to `body` since it was `oldSize` long to `capture`.
+
+    KJ_IF_MAYBE(c, capture) {
+      size_t added = body.size() - oldSize;
+      if (c->data.size() + added > c->limit) {
+        capture = nullptr;
+      } else {
+        c->data.addAll(body.begin() + oldSize, body.end());
+      }
+    }
+  }
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> windowOpen;  // Fulfilled when there is room.
+
+  size_t parse(size_t actual) {
+    // Feed the first `actual` bytes of `buffer` to the parser, returning how many it consumed,
+    // which is fewer only at the end of the response.
+
+    if (actual > 0) started = true;
+    size_t nread = http_parser_execute(this, &settings, reinterpret_cast<char*>(buffer), actual);
+    if (HTTP_PARSER_ERRNO(this) == HPE_PAUSED) {
+      // onMessageComplete() stopped the parser. We don't pipeline requests, so anything after the
+      // response is garbage, and the connection can't be trusted for another request.
+      if (nread != actual && !upgrade) {
+        keepAlive = false;
+      }
+    } else if (nread != actual && !upgrade) {
+      const char* error = http_errno_description(HTTP_PARSER_ERRNO(this));
+      KJ_FAIL_ASSERT("Failed to parse HTTP response from sandboxed app.", error);
+    }
+    return nread;
+  }
+
+  void maybeReuse(kj::Own<kj::AsyncIoStream>&& stream, kj::Maybe<AppConnectionPool&> pool) {
+    KJ_IF_MAYBE(p, pool) {
+      if (messageComplete && keepAlive && !upgrade) {
+        p->release(kj::mv(stream));
+      }
+    }
+  }
+
+  kj::Promise<void> pumpStreamInternal(kj::Own<kj::AsyncIoStream>&& stream,
+                                       kj::Maybe<AppConnectionPool&> pool) {
+    if (inFlightBytes + body.size() >= options.windowBytes) {
+      // The front-end hasn't caught up; don't read any more until it does.
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      windowOpen = kj::mv(paf.fulfiller);
+      return paf.promise.then([this, KJ_MVCAP(stream), pool]() mutable {
+        taskSet.add(pumpStreamInternal(kj::mv(stream), pool));
+      });
+    }
+
+    return stream->tryRead(buffer, 1, sizeof(buffer)).then(
+        [this, KJ_MVCAP(stream), pool](size_t actual) mutable -> kj::Promise<void> {
+      parse(actual);
+      if (messageComplete) {
+        // The end of the response. (If the response is delimited by the app closing the
+        // connection, parse() of the EOF completes it.)
+        compressorFlush(Z_FINISH);
+        flushBody(true);
+        taskSet.add(responseStream.doneRequest().send().then([](auto x){}));
+        KJ_IF_MAYBE(c, capture) {
+          c->onComplete();
+        }
+        maybeReuse(kj::mv(stream), pool);
+        return kj::READY_NOW;
+      } else if (actual == 0) {
+        // The app went away partway through the response. Don't end the gzip stream or call
+        // done(), which would pass off a truncated body as complete; dropping the stream without
+        // done() tells the receiver that the data is incomplete.
+        KJ_LOG(ERROR, "Sandboxed app closed connection before finishing its response.");
+        body.clear();
+        capture = nullptr;
+        responseStream = nullptr;
+        return kj::READY_NOW;
+      } else {
+        if (inFlightBytes == 0) {
+          // flushBody() will send right away, so let it send everything we have. Otherwise, let
+          // the compressor accumulate more, which compresses better.
+          compressorFlush(Z_SYNC_FLUSH);
+        }
+        flushBody(false);
+        taskSet.add(pumpStreamInternal(kj::mv(stream), pool));
+        return kj::READY_NOW;
+      }
+    });
+  }
+
+  void flushBody(bool force) {
+    // Send buffered body bytes to the front-end. Like Nagle's algorithm, a partial write is held
+    // back while earlier writes are in flight, so that a trickle of small reads from the app turns
+    // into a few large write() calls; it goes out once a full write's worth has accumulated, when
+    // the earlier writes complete, or when `force` is true.
+
+    while (body.size() > 0 &&
+           (force || inFlightBytes == 0 || body.size() >= options.writeBytes)) {
+      size_t n = kj::min(body.size(), options.writeBytes);
+      auto request = responseStream.writeRequest(
+          capnp::MessageSize { n / sizeof(capnp::word) + 4, 0 });
+      memcpy(request.initData(n).begin(), body.begin(), n);
+      removePrefix(body, n);
+
+      inFlightBytes += n;
+      taskSet.add(request.send().then([this, n](auto x) {
+        writeDone(n);
+      }, [this, n](kj::Exception&& e) {
+        writeDone(n);
+        kj::throwFatalException(kj::mv(e));
+      }));
+    }
+  }
+
+  void writeDone(size_t n) {
+    inFlightBytes -= n;
+    if (inFlightBytes == 0) {
+      flushBody(false);
+    }
+    if (inFlightBytes + body.size() < options.windowBytes) {
+      KJ_IF_MAYBE(f, windowOpen) {
+        f->get()->fulfill();
+        windowOpen = nullptr;
+      }
+    }
+  }
+
+  void taskFailed(kj::Exception&& exception) override {
+    KJ_LOG(ERROR, exception);
+  }
+
+  void buildResponse(WebSession::Response::Builder builder,
+                     kj::Maybe<sandstorm::Handle::Client> stream,
+                     kj::ArrayPtr<const char> bodyBytes) {
+    // Fill in `builder` from the parsed response. If `stream` is given, the body is streamed via
+    // the handle; otherwise it is `bodyBytes`.
+
     KJ_ASSERT(!upgrade,
         "Sandboxed app attempted to upgrade protocol when client did not request this.");
 
@@ -255,7 +758,9 @@ public:
         auto content = builder.initContent();
         content.setStatusCode(statusInfo.successCode);
 
-        KJ_IF_MAYBE(encoding, findHeader("content-encoding")) {
+        if (compressed) {
+          content.setEncoding("gzip");
+        } else KJ_IF_MAYBE(encoding, findHeader("content-encoding")) {
           content.setEncoding(*encoding);
         }
         KJ_IF_MAYBE(language, findHeader("content-language")) {
@@ -312,12 +817,11 @@ public:
           }
         }
 
-        if (isStreaming) {
-          KJ_ASSERT(body.size() == 0);
-          content.initBody().setStream(handle);
+        KJ_IF_MAYBE(s, stream) {
+          content.initBody().setStream(*s);
         } else {
-          auto data = content.initBody().initBytes(body.size());
-          memcpy(data.begin(), body.begin(), body.size());
+          auto data = content.initBody().initBytes(bodyBytes.size());
+          memcpy(data.begin(), bodyBytes.begin(), bodyBytes.size());
         }
         break;
       }
@@ -337,110 +841,18 @@ public:
       case WebSession::Response::CLIENT_ERROR: {
         auto error = builder.initClientError();
         error.setStatusCode(statusInfo.clientErrorCode);
-        auto text = error.initDescriptionHtml(body.size());
-        memcpy(text.begin(), body.begin(), body.size());
+        auto text = error.initDescriptionHtml(bodyBytes.size());
+        memcpy(text.begin(), bodyBytes.begin(), bodyBytes.size());
         break;
       }
       case WebSession::Response::SERVER_ERROR: {
-        auto text = builder.initServerError().initDescriptionHtml(body.size());
-        memcpy(text.begin(), body.begin(), body.size());
+        auto text = builder.initServerError().initDescriptionHtml(bodyBytes.size());
+        memcpy(text.begin(), bodyBytes.begin(), bodyBytes.size());
         break;
       }
     }
   }
 
-  void buildForWebSocket(WebSession::OpenWebSocketResults::Builder builder) {
-    // TODO(soon):  If the app returned a normal response without upgrading, we should forward that
-    //   through, as it's perfectly valid HTTP.  The WebSession interface currently does not
-    //   support this.
-    KJ_ASSERT(status_code == 101, "Sandboxed app does not support WebSocket.",
-              (int)upgrade, (int)status_code, statusString);
-
-    KJ_IF_MAYBE(protocol, findHeader("sec-websocket-protocol")) {
-      auto parts = split(*protocol, ',');
-      auto list = builder.initProtocol(parts.size());
-      for (auto i: kj::indices(parts)) {
-        auto trimmed = trim(parts[i]);
-        memcpy(list.init(i, trimmed.size()).begin(), trimmed.begin(), trimmed.size());
-      }
-    }
-
-    // TODO(soon):  Should we do more validation here, like checking the exact value of the Upgrade
-    //   header or Sec-WebSocket-Accept?
-  }
-
-private:
-  enum HeaderElementType { NONE, FIELD, VALUE };
-
-  struct RawHeader {
-    kj::Vector<char> name;
-    kj::Vector<char> value;
-  };
-
-  struct Header {
-    kj::String name;
-    kj::String value;
-  };
-
-  struct Cookie {
-    kj::String name;
-    kj::String value;
-    kj::String path;
-    int64_t expires;
-
-    enum ExpirationType {
-      NONE, RELATIVE, ABSOLUTE
-    };
-    ExpirationType expirationType = NONE;
-
-    bool httpOnly = false;
-  };
-
-  sandstorm::ByteStream::Client responseStream;
-  kj::TaskSet taskSet;
-  bool headersComplete = false;
-  byte buffer[4096];
-  http_parser_settings settings;
-  kj::Vector<RawHeader> rawHeaders;
-  kj::Vector<char> rawStatusString;
-  HeaderElementType lastHeaderElement = NONE;
-  std::map<kj::StringPtr, Header> headers;
-  kj::Vector<char> body;
-  kj::Vector<Cookie> cookies;
-  kj::String statusString;
-  bool isStreaming = false;
-
-  kj::Promise<void> pumpStreamInternal(kj::Own<kj::AsyncIoStream>&& stream) {
-    return stream->tryRead(buffer, 1, sizeof(buffer)).then(
-        [this, KJ_MVCAP(stream)](size_t actual) mutable -> kj::Promise<void> {
-      size_t nread = http_parser_execute(this, &settings, reinterpret_cast<char*>(buffer), actual);
-      if (nread != actual) {
-        const char* error = http_errno_description(HTTP_PARSER_ERRNO(this));
-        KJ_FAIL_ASSERT("Failed to parse HTTP response from sandboxed app.", error);
-      } else if (actual == 0) {
-        // EOF
-        taskSet.add(responseStream.doneRequest().send().then([](auto x){}));
-        return kj::READY_NOW;
-      } else {
-        taskSet.add(pumpStreamInternal(kj::mv(stream)));
-        return kj::READY_NOW;
-      }
-    });
-  }
-
-  void taskFailed(kj::Exception&& exception) override {
-    KJ_LOG(ERROR, exception);
-  }
-
-  kj::Maybe<kj::StringPtr> findHeader(kj::StringPtr name) {
-    auto iter = headers.find(name);
-    if (iter == headers.end()) {
-      return nullptr;
-    } else {
-      return kj::StringPtr(iter->second.value);
-    }
-  }
-
   void onStatus(kj::ArrayPtr<const char> status) {
     rawStatusString.addAll(status);
   }
@@ -479,28 +891,8 @@ private:
           toLower(prop);
           if (prop == "expires") {
             auto value = trim(part);
-            // Wed, 15 Nov 1995 06:25:24 GMT
-            struct tm t;
-            memset(&t, 0, sizeof(t));
-
-            // There are three allowed formats for HTTP dates.  Ugh.
-            char* end = strptime(value.cStr(), "%a, %d %b %Y %T GMT", &t);
-            if (end == nullptr) {
-              end = strptime(value.cStr(), "%a, %d-%b-%y %T GMT", &t);
-              if (end == nullptr) {
-                end = strptime(value.cStr(), "%a %b %d %T %Y", &t);
-                if (end == nullptr) {
-                  // Not valid per HTTP spec, but MediaWiki seems to return this format sometimes.
-                  end = strptime(value.cStr(), "%a, %d-%b-%Y %T GMT", &t);
-                  if (end == nullptr) {
-                    // Not valid per HTTP spec, but used by Rack.
-                    end = strptime(value.cStr(), "%a, %d %b %Y %T -0000", &t);
-                  }
-                }
-              }
-            }
-            KJ_ASSERT(end != nullptr && *end == '\0', "Invalid HTTP date from app.", value);
-            cookie.expires = timegm(&t);
+            cookie.expires = KJ_ASSERT_NONNULL(parseHttpDate(value),
+                                               "Invalid HTTP date from app.", value);
             cookie.expirationType = Cookie::ExpirationType::ABSOLUTE;
           } else if (prop == "max-age") {
             auto value = trim(part);
@@ -543,20 +935,22 @@ private:
 
 
   void onBody(kj::ArrayPtr<const char> data) {
-    if (isStreaming) {
-      // TODO(soon): Pause the input whenever too many write requests are in-flight at once.
-      //   Otherwise, a large file download may end up entirely buffered in RAM.
-      // TODO(security): Cap'n Proto itself should stop processing inbound messages when too many
-      //   requests are in-flight, measured by the size of the requests. Otherwise the queuing
-      //   described above will actually happen at the front-end and not even be charged to the
-      //   user. Watch out for deadlock, though.
-      auto request = responseStream.writeRequest();
-      auto dst = request.initData(data.size());
-      memcpy(dst.begin(), data.begin(), data.size());
-      taskSet.add(request.send().then([](auto x){}));
+    // When streaming, `body` only holds what flushBody() hasn't sent yet, which is bounded by
+    // `options.windowBytes` (plus one read) since pumpStreamInternal() stops reading at that point.
+    // TODO(security): Cap'n Proto itself should stop processing inbound messages when too many
+    //   requests are in-flight, measured by the size of the requests. Otherwise a front-end that
+    //   acknowledges writes before delivering them will still end up queuing the data, without
+    //   even charging it to the user. Watch out for deadlock, though.
+    size_t oldSize = body.size();
+    KJ_IF_MAYBE(c, compressor) {
+      c->get()->add(data, body);
     } else {
       body.addAll(data);
     }
+
+    if (isStreaming) {
+      captureSince(oldSize);
+    }
   }
 
   void onHeadersComplete() {
@@ -570,6 +964,14 @@ private:
     KJ_ASSERT(status_code >= 100, (int)status_code);
   }
 
+  void onMessageComplete() {
+    messageComplete = true;
+    keepAlive = http_should_keep_alive(this);
+
+    // Stop here rather than parse whatever follows as another response.
+    http_parser_pause(this, 1);
+  }
+
 #define ON_DATA(lower, title) \
   static int on_##lower(http_parser* p, const char* d, size_t s) { \
     static_cast<HttpParser*>(p)->on##title(kj::arrayPtr(d, s)); \
@@ -586,66 +988,225 @@ private:
   ON_DATA(header_value, HeaderValue)
   ON_DATA(body, Body)
   ON_EVENT(headers_complete, HeadersComplete)
+  ON_EVENT(message_complete, MessageComplete)
 #undef ON_DATA
 #undef ON_EVENT
 
 };
 
+constexpr size_t HttpParser::MIN_COMPRESS_SIZE;
+
 class WebSocketPump final: public WebSession::WebSocketStream::Server,
                            private kj::TaskSet::ErrorHandler {
 public:
   WebSocketPump(kj::Own<kj::AsyncIoStream> serverStream,
-                WebSession::WebSocketStream::Client clientStream)
+                WebSession::WebSocketStream::Client clientStream,
+                const StreamOptions& options)
       : serverStream(kj::mv(serverStream)),
         clientStream(kj::mv(clientStream)),
-        upstreamOp(kj::READY_NOW),
+        options(options),
+        readBuffer(kj::heapArray<byte>(MIN_READ)),
         tasks(*this) {}
 
+  ~WebSocketPump() noexcept(false) {
+    KJ_LOG(INFO, "WebSocket closed",
+           stats.downstreamBytes, stats.downstreamCalls,
+           stats.upstreamBytes, stats.upstreamCalls, stats.upstreamWrites,
+           stats.peakQueuedBytes);
+  }
+
+  struct Stats {
+    uint64_t downstreamBytes = 0;  // Read from the app.
+    uint64_t downstreamCalls = 0;  // sendBytes() calls made to the client.
+    uint64_t upstreamBytes = 0;    // Received from the client.
+    uint64_t upstreamCalls = 0;    // sendBytes() calls received from the client.
+    uint64_t upstreamWrites = 0;   // Writes to the app.
+    size_t peakQueuedBytes = 0;    // Most bytes buffered or in flight, both directions together.
+  };
+
+  const Stats& getStats() { return stats; }
+
+  size_t queuedBytes() {
+    // Bytes currently buffered or in flight, in both directions.
+    return downstream.size() + downstreamInFlight + upstream.size() + upstreamInFlight;
+  }
+
   void pump() {
-    // Repeatedly read from serverStream and write to clientStream.
-    tasks.add(serverStream->tryRead(buffer, 1, sizeof(buffer))
+    // Repeatedly read from serverStream and write to clientStream, pausing whenever the client
+    // falls too far behind.
+
+    if (downstream.size() + downstreamInFlight >= options.windowBytes) {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      downstreamWindowOpen = kj::mv(paf.fulfiller);
+      tasks.add(paf.promise.then([this]() { pump(); }));
+      return;
+    }
+
+    tasks.add(serverStream->tryRead(readBuffer.begin(), 1, readBuffer.size())
         .then([this](size_t amount) {
       if (amount > 0) {
-        sendData(kj::arrayPtr(buffer, amount));
+        sendData(readBuffer.slice(0, amount));
+        adjustReadSize(amount);
         pump();
       } else {
         // EOF.
+        flushDownstream(true);
         clientStream = nullptr;
       }
     }));
   }
 
   void sendData(kj::ArrayPtr<byte> data) {
-    // Write the given bytes to clientStream.
-    auto request = clientStream.sendBytesRequest(
-        capnp::MessageSize { data.size() / sizeof(capnp::word) + 8, 0 });
-    request.setMessage(data);
-    tasks.add(request.send().then([](auto response) {}));
+    // Write the given bytes to clientStream, possibly batched with adjacent data.
+    downstream.addAll(data);
+    stats.downstreamBytes += data.size();
+    stats.peakQueuedBytes = kj::max(stats.peakQueuedBytes, queuedBytes());
+    flushDownstream(false);
   }
 
 protected:
   kj::Promise<void> sendBytes(SendBytesContext context) override {
-    // Received bytes from the client.  Write them to serverStream.
-    auto forked = upstreamOp.then([context,this]() mutable {
-      auto message = context.getParams().getMessage();
-      return serverStream->write(message.begin(), message.size());
-    }).fork();
-    upstreamOp = forked.addBranch();
-    return forked.addBranch();
+    // Received bytes from the client. Queue them to be written to serverStream, together with any
+    // other messages that arrive while a write is in progress. If the app has fallen too far
+    // behind, don't return until it catches up, as a hint to the client to hold off.
+
+    KJ_IF_MAYBE(e, upstreamError) {
+      kj::throwFatalException(kj::Exception(*e));
+    }
+
+    auto message = context.getParams().getMessage();
+    upstream.addAll(message);
+    stats.upstreamBytes += message.size();
+    ++stats.upstreamCalls;
+    stats.peakQueuedBytes = kj::max(stats.peakQueuedBytes, queuedBytes());
+    context.releaseParams();
+
+    if (!upstreamWriting) {
+      writeUpstream();
+    }
+
+    if (upstream.size() + upstreamInFlight < options.windowBytes) {
+      return kj::READY_NOW;
+    } else {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      upstreamWaiters.add(kj::mv(paf.fulfiller));
+      return kj::mv(paf.promise);
+    }
   }
 
 private:
+  static constexpr size_t MIN_READ = 4096;
+
   kj::Own<kj::AsyncIoStream> serverStream;
   WebSession::WebSocketStream::Client clientStream;
+  const StreamOptions& options;
+
+  kj::Array<byte> readBuffer;
+  // Sized adaptively; see adjustReadSize().
+
+  kj::Vector<byte> downstream;
+  // Read from serverStream but not yet sent to clientStream.
+
+  size_t downstreamInFlight = 0;
+  // Bytes sent to clientStream whose sendBytes() calls haven't returned yet.
+
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> downstreamWindowOpen;
+  // Fulfilled to resume pump() once the client catches up.
 
-  kj::Promise<void> upstreamOp;
-  // The promise working on writing data to serverStream.  AsyncIoStream wants only one write() at
-  // a time, so new writes have to wait for the previous write to finish.
+  kj::Vector<byte> upstream;
+  // Received from the client but not yet being written to serverStream. AsyncIoStream wants only
+  // one write() at a time, so this accumulates while a write is in progress.
+
+  size_t upstreamInFlight = 0;
+  bool upstreamWriting = false;
+  kj::Maybe<kj::Exception> upstreamError;
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> upstreamWaiters;
+  // sendBytes() calls waiting for the app to catch up.
+
+  Stats stats;
 
   kj::TaskSet tasks;
-  // Pending calls to clientStream.sendBytes() and serverStream.read().
+  // Pending calls to clientStream.sendBytes() and serverStream.read() / write().
+
+  void flushDownstream(bool force) {
+    // Like HttpParser::flushBody(): batch small reads into one sendBytes() while an earlier one is
+    // still in flight.
+
+    while (downstream.size() > 0 &&
+           (force || downstreamInFlight == 0 || downstream.size() >= options.writeBytes)) {
+      size_t n = kj::min(downstream.size(), options.writeBytes);
+      auto request = clientStream.sendBytesRequest(
+          capnp::MessageSize { n / sizeof(capnp::word) + 8, 0 });
+      request.setMessage(kj::arrayPtr(downstream.begin(), n));
+      removePrefix(downstream, n);
+
+      downstreamInFlight += n;
+      ++stats.downstreamCalls;
+      tasks.add(request.send().then([this, n](auto response) {
+        downstreamDone(n);
+      }, [this, n](kj::Exception&& e) {
+        downstreamDone(n);
+        kj::throwFatalException(kj::mv(e));
+      }));
+    }
+  }
 
-  byte buffer[4096];
+  void downstreamDone(size_t n) {
+    downstreamInFlight -= n;
+    if (downstreamInFlight == 0) {
+      flushDownstream(false);
+    }
+    if (downstream.size() + downstreamInFlight < options.windowBytes) {
+      KJ_IF_MAYBE(f, downstreamWindowOpen) {
+        f->get()->fulfill();
+        downstreamWindowOpen = nullptr;
+      }
+    }
+  }
+
+  void adjustReadSize(size_t amount) {
+    // Grow the read buffer while the app keeps filling it, so that bulk transfers take fewer
+    // reads and calls, and shrink it again when traffic is light.
+
+    size_t maxRead = kj::max(options.writeBytes, MIN_READ);
+    if (amount == readBuffer.size() && readBuffer.size() < maxRead) {
+      readBuffer = kj::heapArray<byte>(kj::min(readBuffer.size() * 2, maxRead));
+    } else if (amount < readBuffer.size() / 4 && readBuffer.size() > MIN_READ) {
+      readBuffer = kj::heapArray<byte>(kj::max(readBuffer.size() / 2, MIN_READ));
+    }
+  }
+
+  void writeUpstream() {
+    upstreamWriting = true;
+    auto data = kj::mv(upstream);
+    upstream = kj::Vector<byte>();
+    upstreamInFlight = data.size();
+    ++stats.upstreamWrites;
+
+    auto promise = serverStream->write(data.begin(), data.size());
+    tasks.add(promise.attach(kj::mv(data)).then([this]() {
+      upstreamInFlight = 0;
+      if (upstream.size() > 0) {
+        writeUpstream();
+      } else {
+        upstreamWriting = false;
+      }
+      if (upstream.size() + upstreamInFlight < options.windowBytes) {
+        for (auto& waiter: upstreamWaiters) {
+          waiter->fulfill();
+        }
+        upstreamWaiters.resize(0);
+      }
+    }, [this](kj::Exception&& e) {
+      // Leave `upstreamWriting` set, since there's no point writing anything else.
+      for (auto& waiter: upstreamWaiters) {
+        waiter->reject(kj::Exception(e));
+      }
+      upstreamWaiters.resize(0);
+      upstreamError = kj::Exception(e);
+      kj::throwFatalException(kj::mv(e));
+    }));
+  }
 
   void taskFailed(kj::Exception&& exception) override {
     // TODO(soon):  What do we do when a server -> client send throws?  Probably just ignore it;
@@ -656,6 +1217,8 @@ private:
   }
 };
 
+constexpr size_t WebSocketPump::MIN_READ;
+
 class RefcountedAsyncIoStream: public kj::AsyncIoStream, public kj::Refcounted {
 public:
   RefcountedAsyncIoStream(kj::Own<kj::AsyncIoStream>&& stream)
@@ -685,9 +1248,11 @@ class RequestStreamImpl final: public WebSession::RequestStream::Server {
 public:
   RequestStreamImpl(kj::String httpRequest,
                     kj::Own<kj::AsyncIoStream> stream,
-                    sandstorm::ByteStream::Client responseStream)
+                    sandstorm::ByteStream::Client responseStream,
+                    const StreamOptions& options)
       : stream(kj::refcounted<RefcountedAsyncIoStream>(kj::mv(stream))),
         responseStream(responseStream),
+        options(options),
         httpRequest(kj::mv(httpRequest)) {}
 
   kj::Promise<void> getResponse(GetResponseContext context) override {
@@ -698,7 +1263,7 @@ public:
     // application can start sending back data before it has received the entire request if it so
     // desires.
 
-    auto parser = kj::heap<HttpParser>(responseStream);
+    auto parser = kj::heap<HttpParser>(responseStream, options);
     auto results = context.getResults();
 
     return parser->readResponse(*stream).then(
@@ -776,6 +1341,7 @@ public:
 private:
   kj::Own<RefcountedAsyncIoStream> stream;
   sandstorm::ByteStream::Client responseStream;
+  const StreamOptions& options;
   bool doneCalled = false;
   bool getResponseCalled = false;
   bool isChunked = true; // chunked unless we get expectSize() before we write the headers
@@ -814,10 +1380,14 @@ private:
 
 class WebSessionImpl final: public WebSession::Server {
 public:
-  WebSessionImpl(kj::NetworkAddress& serverAddr,
+  WebSessionImpl(kj::NetworkAddress& serverAddr, AppConnectionPool& connectionPool,
+                 const StreamOptions& streamOptions, kj::Maybe<ResponseCache&> cache,
                  UserInfo::Reader userInfo, SessionContext::Client context,
                  WebSession::Params::Reader params, kj::String&& permissions)
       : serverAddr(serverAddr),
+        connectionPool(connectionPool),
+        streamOptions(streamOptions),
+        cache(cache),
         context(kj::mv(context)),
         userDisplayName(percentEncode(userInfo.getDisplayName().getDefaultText())),
         permissions(kj::mv(permissions)),
@@ -836,22 +1406,28 @@ public:
   kj::Promise<void> get(GetContext context) override {
     GetParams::Reader params = context.getParams();
     kj::String httpRequest = makeHeaders("GET", params.getPath(), params.getContext());
+    KJ_IF_MAYBE(c, cache) {
+      return getCached(*c, kj::heapString(params.getPath()), kj::mv(httpRequest), context);
+    }
     return sendRequest(toBytes(httpRequest), context);
   }
 
   kj::Promise<void> post(PostContext context) override {
     PostParams::Reader params = context.getParams();
     auto content = params.getContent();
+    invalidateCached(params.getPath());
     kj::String httpRequest = makeHeaders("POST", params.getPath(), params.getContext(),
       kj::str("Content-Type: ", content.getMimeType()),
       kj::str("Content-Length: ", content.getContent().size()),
       content.hasEncoding() ? kj::str("Content-Encoding: ", content.getEncoding()) : nullptr);
-    return sendRequest(toBytes(httpRequest, content.getContent()), context);
+    // Not idempotent, so sent on a fresh connection rather than a pooled one; see exchange().
+    return sendRequest(toBytes(httpRequest, content.getContent()), context, false);
   }
 
   kj::Promise<void> put(PutContext context) override {
     PutParams::Reader params = context.getParams();
     auto content = params.getContent();
+    invalidateCached(params.getPath());
     kj::String httpRequest = makeHeaders("PUT", params.getPath(), params.getContext(),
       kj::str("Content-Type: ", content.getMimeType()),
       kj::str("Content-Length: ", content.getContent().size()),
@@ -861,23 +1437,28 @@ public:
 
   kj::Promise<void> delete_(DeleteContext context) override {
     DeleteParams::Reader params = context.getParams();
+    invalidateCached(params.getPath());
     kj::String httpRequest = makeHeaders("DELETE", params.getPath(), params.getContext());
     return sendRequest(toBytes(httpRequest), context);
   }
 
   kj::Promise<void> postStreaming(PostStreamingContext context) override {
     PostStreamingParams::Reader params = context.getParams();
+    invalidateCached(params.getPath());
     kj::String httpRequest = makeHeaders("POST", params.getPath(), params.getContext(),
         kj::str("Content-Type: ", params.getMimeType()),
-        params.hasEncoding() ? kj::str("Content-Encoding: ", params.getEncoding()) : nullptr);
+        params.hasEncoding() ? kj::str("Content-Encoding: ", params.getEncoding()) : nullptr,
+        kj::str("Connection: close"));
     return sendRequestStreaming(kj::mv(httpRequest), context);
   }
 
   kj::Promise<void> putStreaming(PutStreamingContext context) override {
     PutStreamingParams::Reader params = context.getParams();
+    invalidateCached(params.getPath());
     kj::String httpRequest = makeHeaders("PUT", params.getPath(), params.getContext(),
         kj::str("Content-Type: ", params.getMimeType()),
-        params.hasEncoding() ? kj::str("Content-Encoding: ", params.getEncoding()) : nullptr);
+        params.hasEncoding() ? kj::str("Content-Encoding: ", params.getEncoding()) : nullptr,
+        kj::str("Connection: close"));
     return sendRequestStreaming(kj::mv(httpRequest), context);
   }
 
@@ -914,15 +1495,16 @@ public:
       auto& streamRef = *stream;
       return streamRef.write(httpRequestRef.begin(), httpRequestRef.size())
           .attach(kj::mv(httpRequest))
-          .then([KJ_MVCAP(stream), KJ_MVCAP(clientStream), responseStream, context]
+          .then([this, KJ_MVCAP(stream), KJ_MVCAP(clientStream), responseStream, context]
                 () mutable {
-            auto parser = kj::heap<HttpParser>(responseStream);
+            auto parser = kj::heap<HttpParser>(responseStream, streamOptions);
             auto results = context.getResults();
 
             return parser->readResponse(*stream).then(
-                [results, KJ_MVCAP(stream), KJ_MVCAP(clientStream), KJ_MVCAP(parser)]
+                [this, results, KJ_MVCAP(stream), KJ_MVCAP(clientStream), KJ_MVCAP(parser)]
                 (kj::ArrayPtr<byte> remainder) mutable {
-              auto pump = kj::heap<WebSocketPump>(kj::mv(stream), kj::mv(clientStream));
+              auto pump = kj::heap<WebSocketPump>(kj::mv(stream), kj::mv(clientStream),
+                                                  streamOptions);
               parser->buildForWebSocket(results);
               if (remainder.size() > 0) {
                 pump->sendData(remainder);
@@ -936,6 +1518,9 @@ public:
 
 private:
   kj::NetworkAddress& serverAddr;
+  AppConnectionPool& connectionPool;
+  const StreamOptions& streamOptions;
+  kj::Maybe<ResponseCache&> cache;
   SessionContext::Client context;
   kj::String userDisplayName;
   kj::Maybe<kj::String> userId;
@@ -953,7 +1538,6 @@ private:
     kj::Vector<kj::String> lines(16);
 
     lines.add(kj::str(method, " /", path, " HTTP/1.1"));
-    lines.add(kj::str("Connection: close"));
     if (extraHeader1 != nullptr) {
       lines.add(kj::mv(extraHeader1));
     }
@@ -1008,47 +1592,149 @@ private:
   }
 
   template <typename Context>
-  kj::Promise<void> sendRequest(kj::Array<byte> httpRequest, Context& context) {
+  kj::Promise<void> sendRequest(kj::Array<byte> httpRequest, Context& context,
+                                bool idempotent = true) {
     sandstorm::ByteStream::Client responseStream =
         context.getParams().getContext().getResponseStream();
     context.releaseParams();
-    return serverAddr.connect().then(
-        [KJ_MVCAP(httpRequest), responseStream, context]
-        (kj::Own<kj::AsyncIoStream>&& stream) mutable {
+    auto parser = kj::heap<HttpParser>(responseStream, streamOptions);
+    auto promise = exchange(kj::mv(httpRequest), *parser, idempotent);
+    return promise.then([this, KJ_MVCAP(parser), context]
+                        (kj::Own<kj::AsyncIoStream>&& stream) mutable {
+      auto results = context.getResults();
+      parser->pumpStream(kj::mv(stream), connectionPool);
+      auto &parserRef = *parser;
+      sandstorm::Handle::Client handle = kj::mv(parser);
+      parserRef.build(results, handle);
+    });
+  }
+
+  kj::Promise<kj::Own<kj::AsyncIoStream>> exchange(
+      kj::Array<byte> httpRequest, HttpParser& parser, bool retryIfStale) {
+    // Send `httpRequest` and read the response into `parser`, returning the connection to pump the
+    // rest of the response from. If `retryIfStale`, the request goes on a pooled connection; an
+    // idle connection may turn out to have been closed by the app before it answered, in which
+    // case we try once more on a new connection. Non-idempotent requests pass
+    // `retryIfStale = false` and always get a new connection, since if a stale one failed we
+    // couldn't tell whether the app acted on the request before closing.
+
+    return connectionPool.connect(retryIfStale).then(
+        [this, KJ_MVCAP(httpRequest), &parser, retryIfStale]
+        (AppConnectionPool::Connection&& connection) mutable {
       kj::ArrayPtr<const byte> httpRequestRef = httpRequest;
-      auto& streamRef = *stream;
-      return streamRef.write(httpRequestRef.begin(), httpRequestRef.size())
-          .attach(kj::mv(httpRequest))
-          .then([KJ_MVCAP(stream), responseStream, context]() mutable {
-        // Note:  Do not do stream->shutdownWrite() as some HTTP servers will decide to close the
-        // socket immediately on EOF, even if they have not actually responded to previous requests
-        // yet.
-        auto parser = kj::heap<HttpParser>(responseStream);
-        auto results = context.getResults();
-
-        return parser->readResponse(*stream).then(
-            [results, KJ_MVCAP(stream), KJ_MVCAP(parser)]
-            (kj::ArrayPtr<byte> remainder) mutable {
-          KJ_ASSERT(remainder.size() == 0);
-          parser->pumpStream(kj::mv(stream));
-          auto &parserRef = *parser;
-          sandstorm::Handle::Client handle = kj::mv(parser);
-          parserRef.build(results, handle);
-        });
+      auto& streamRef = *connection.stream;
+
+      // Note:  Do not do stream->shutdownWrite() as some HTTP servers will decide to close the
+      // socket immediately on EOF, even if they have not actually responded to previous requests
+      // yet.
+      auto promise = streamRef.write(httpRequestRef.begin(), httpRequestRef.size())
+          .then([&parser, &streamRef]() {
+        return parser.readResponse(streamRef);
+      }).then([](kj::ArrayPtr<byte> remainder) -> kj::Maybe<kj::Exception> {
+        KJ_ASSERT(remainder.size() == 0);
+        return nullptr;
+      }, [](kj::Exception&& exception) -> kj::Maybe<kj::Exception> {
+        return kj::mv(exception);
+      });
+
+      return promise.then(
+          [this, KJ_MVCAP(httpRequest), KJ_MVCAP(connection), &parser, retryIfStale]
+          (kj::Maybe<kj::Exception>&& error) mutable
+          -> kj::Promise<kj::Own<kj::AsyncIoStream>> {
+        if (connection.reused && retryIfStale && !parser.hasStarted()) {
+          return exchange(kj::mv(httpRequest), parser, false);
+        }
+        KJ_IF_MAYBE(e, error) {
+          kj::throwFatalException(kj::mv(*e));
+        }
+        return kj::mv(connection.stream);
       });
     });
   }
 
+  void invalidateCached(kj::StringPtr path) {
+    // A POST, PUT, or DELETE of `path` may change it, so stop serving stored copies (RFC 7234
+    // section 4.4). We do this as the request goes out, rather than on a successful response as
+    // the RFC says, so that it covers streaming requests too, whose response we don't see here.
+
+    KJ_IF_MAYBE(c, cache) {
+      c->invalidate(path);
+    }
+  }
+
+  kj::Promise<void> getCached(ResponseCache& cache, kj::String path, kj::String httpRequest,
+                              GetContext& context) {
+    // Like sendRequest(), but answer from `cache` if possible, or else revalidate what's in the
+    // cache, and store the response if it's cacheable.
+
+    auto found = cache.find(basePath, path, httpRequest);
+    kj::String requestToSend;
+    KJ_IF_MAYBE(entry, found) {
+      if (ResponseCache::isFresh(**entry)) {
+        context.releaseParams();
+        context.setResults(cache.load(**entry));
+        return kj::READY_NOW;
+      }
+      requestToSend = ResponseCache::addValidators(httpRequest, **entry);
+    } else {
+      requestToSend = kj::heapString(httpRequest);
+    }
+
+    sandstorm::ByteStream::Client responseStream =
+        context.getParams().getContext().getResponseStream();
+    context.releaseParams();
+    auto parser = kj::heap<HttpParser>(responseStream, streamOptions);
+    auto promise = exchange(toBytes(requestToSend), *parser, true);
+    return promise.then(
+        [this, &cache, KJ_MVCAP(path), KJ_MVCAP(httpRequest), KJ_MVCAP(found), KJ_MVCAP(parser),
+         context](kj::Own<kj::AsyncIoStream>&& stream) mutable {
+      KJ_IF_MAYBE(entry, found) {
+        if (parser->getStatusCode() == 304) {
+          // Not modified; use what we have.
+          parser->pumpStream(kj::mv(stream), connectionPool);
+          cache.refresh(**entry, *parser);
+          context.setResults(cache.load(**entry));
+          return;
+        }
+
+        // The app has something else to say now. If the new response is storable it replaces the
+        // old one below, but either way the old one mustn't be served again.
+        cache.discard(**entry);
+      }
+
+      auto results = context.getResults();
+      auto& parserRef = *parser;
+      KJ_IF_MAYBE(policy, ResponseCache::getStorablePolicy(httpRequest, parserRef)) {
+        if (!parserRef.isStreamingResponse()) {
+          if (parserRef.isComplete()) {
+            cache.insert(basePath, path, httpRequest, kj::mv(*policy), parserRef);
+          }
+        } else {
+          parserRef.captureBody(cache.getMaxEntrySize(),
+              [&cache, &parserRef, base = kj::heapString(basePath), KJ_MVCAP(path),
+               KJ_MVCAP(httpRequest), storePolicy = kj::mv(*policy)]() mutable {
+            // The session may be gone by now, hence the copy of `basePath`.
+            cache.insert(base, path, httpRequest, kj::mv(storePolicy), parserRef);
+          });
+        }
+      }
+
+      parserRef.pumpStream(kj::mv(stream), connectionPool);
+      sandstorm::Handle::Client handle = kj::mv(parser);
+      parserRef.build(results, handle);
+    });
+  }
+
   template <typename Context>
   kj::Promise<void> sendRequestStreaming(kj::String httpRequest, Context& context) {
     sandstorm::ByteStream::Client responseStream =
       context.getParams().getContext().getResponseStream();
     context.releaseParams();
     return serverAddr.connect().then(
-        [KJ_MVCAP(httpRequest), responseStream, context]
+        [this, KJ_MVCAP(httpRequest), responseStream, context]
         (kj::Own<kj::AsyncIoStream>&& stream) mutable {
       auto requestStream = kj::heap<RequestStreamImpl>(
-          kj::mv(httpRequest), kj::mv(stream), responseStream);
+          kj::mv(httpRequest), kj::mv(stream), responseStream, streamOptions);
       context.getResults().setStream(kj::mv(requestStream));
     });
   }
@@ -1238,9 +1924,13 @@ private:
 class UiViewImpl final: public UiView::Server {
 public:
   explicit UiViewImpl(kj::NetworkAddress& serverAddress,
+                      AppConnectionPool& connectionPool,
+                      const StreamOptions& streamOptions,
+                      kj::Maybe<ResponseCache&> cache,
                       RedirectableCapability& contextCap,
                       spk::BridgeConfig::Reader config)
-      : serverAddress(serverAddress), contextCap(contextCap), config(config) {}
+      : serverAddress(serverAddress), connectionPool(connectionPool), streamOptions(streamOptions),
+        cache(cache), contextCap(contextCap), config(config) {}
 
   kj::Promise<void> getViewInfo(GetViewInfoContext context) override {
     context.setResults(config.getViewInfo());
@@ -1267,7 +1957,8 @@ public:
       auto permissions = kj::strArray(permissionVec, ",");
 
       context.getResults(capnp::MessageSize {2, 1}).setSession(
-          kj::heap<WebSessionImpl>(serverAddress, params.getUserInfo(), params.getContext(),
+          kj::heap<WebSessionImpl>(serverAddress, connectionPool, streamOptions, cache,
+                                   params.getUserInfo(), params.getContext(),
                                    params.getSessionParams().getAs<WebSession::Params>(), kj::mv(permissions)));
     } else if (params.getSessionType() == capnp::typeId<HackEmailSession>()) {
       context.getResults(capnp::MessageSize {2, 1}).setSession(kj::heap<EmailSessionImpl>());
@@ -1280,6 +1971,9 @@ public:
 
 private:
   kj::NetworkAddress& serverAddress;
+  AppConnectionPool& connectionPool;
+  const StreamOptions& streamOptions;
+  kj::Maybe<ResponseCache&> cache;
   RedirectableCapability& contextCap;
   spk::BridgeConfig::Reader config;
 };
@@ -1301,6 +1995,23 @@ public:
                            "Acts as a Sandstorm init application.  Runs <command>, then tries to "
                            "connect to it as an HTTP server at the given address (typically, "
                            "'127.0.0.1:<port>') in order to handle incoming requests.")
+        .addOptionWithArg({"stream-window"}, KJ_BIND_METHOD(*this, setStreamWindow), "<bytes>",
+            "When forwarding a streaming response, stop reading from the app while <bytes> have "
+            "not yet been acknowledged by the client. Similarly, stop accepting WebSocket "
+            "messages while <bytes> are waiting to be written to the app. Default: 262144.")
+        .addOptionWithArg({"stream-write-size"}, KJ_BIND_METHOD(*this, setStreamWriteSize),
+            "<bytes>", "Coalesce a streaming response or WebSocket traffic from the app into "
+            "writes of up to <bytes> each. Default: 65536.")
+        .addOptionWithArg({"compression-level"}, KJ_BIND_METHOD(*this, setCompressionLevel),
+            "<level>", "gzip text responses (HTML, CSS, JavaScript, JSON, SVG, etc.) that the app "
+            "didn't compress, at zlib level <level> from 1 (fastest) to 9 (smallest), or 0 to "
+            "disable. Default: 6.")
+        .addOptionWithArg({"cache-size"}, KJ_BIND_METHOD(*this, setCacheSize), "<bytes>",
+            "Keep up to <bytes> of responses that the app marks public in memory, to answer "
+            "repeated requests without asking the app. Default: 0, which disables the cache.")
+        .addOptionWithArg({"cache-disk-size"}, KJ_BIND_METHOD(*this, setCacheDiskSize),
+            "<bytes>", "Move cached responses that don't fit in memory to files under /tmp, up to "
+            "<bytes>. Default: 0.")
         .expectArg("<port>", KJ_BIND_METHOD(*this, setPort))
         .expectOneOrMoreArgs("<command>", KJ_BIND_METHOD(*this, addCommandArg))
         .callAfterParsing(KJ_BIND_METHOD(*this, run))
@@ -1317,6 +2028,54 @@ public:
     }).wait(ioContext.waitScope);
   }
 
+  kj::MainBuilder::Validity setStreamWindow(kj::StringPtr arg) {
+    KJ_IF_MAYBE(i, parseUInt(arg, 10)) {
+      if (*i == 0) return "window must be positive";
+      streamOptions.windowBytes = *i;
+      return true;
+    } else {
+      return "invalid byte count";
+    }
+  }
+
+  kj::MainBuilder::Validity setStreamWriteSize(kj::StringPtr arg) {
+    KJ_IF_MAYBE(i, parseUInt(arg, 10)) {
+      if (*i == 0) return "write size must be positive";
+      streamOptions.writeBytes = *i;
+      return true;
+    } else {
+      return "invalid byte count";
+    }
+  }
+
+  kj::MainBuilder::Validity setCompressionLevel(kj::StringPtr arg) {
+    KJ_IF_MAYBE(i, parseUInt(arg, 10)) {
+      if (*i > 9) return "level must be 0 through 9";
+      streamOptions.compressionLevel = *i;
+      return true;
+    } else {
+      return "invalid level";
+    }
+  }
+
+  kj::MainBuilder::Validity setCacheSize(kj::StringPtr arg) {
+    KJ_IF_MAYBE(i, parseUInt(arg, 10)) {
+      cacheMemoryLimit = *i;
+      return true;
+    } else {
+      return "invalid byte count";
+    }
+  }
+
+  kj::MainBuilder::Validity setCacheDiskSize(kj::StringPtr arg) {
+    KJ_IF_MAYBE(i, parseUInt(arg, 10)) {
+      cacheDiskLimit = *i;
+      return true;
+    } else {
+      return "invalid byte count";
+    }
+  }
+
   kj::MainBuilder::Validity addCommandArg(kj::StringPtr arg) {
     command.add(kj::heapString(arg));
     return true;
@@ -1443,6 +2202,17 @@ public:
           raiiOpen("/sandstorm-http-bridge-config", O_RDONLY), options);
       auto config = reader.getRoot<spk::BridgeConfig>();
 
+      // Shared by all sessions, so that requests reuse idle connections to the app.
+      AppConnectionPool connectionPool(*address, ioContext.provider->getTimer());
+
+      kj::Own<ResponseCache> ownCache;
+      kj::Maybe<ResponseCache&> cache;
+      if (cacheMemoryLimit > 0) {
+        ownCache = kj::heap<ResponseCache>(
+            cacheMemoryLimit, cacheDiskLimit, "/tmp/sandstorm-http-bridge-cache");
+        cache = *ownCache;
+      }
+
       // Make a redirecting capability that will point to the most-recent SessionContext, which
       // we dub the "hack context" since it may or may not actually be the right one to be calling.
       // See the TODO in ApiRestorer::restore().
@@ -1454,7 +2224,8 @@ public:
       auto stream = ioContext.lowLevelProvider->wrapSocketFd(3);
       capnp::TwoPartyVatNetwork network(*stream, capnp::rpc::twoparty::Side::CLIENT);
       auto rpcSystem = capnp::makeRpcServer(network,
-          kj::heap<UiViewImpl>(*address, hackContext, config));
+          kj::heap<UiViewImpl>(*address, connectionPool, streamOptions, cache,
+                               hackContext, config));
 
       // Get the SandstormApi by restoring a null SturdyRef.
       capnp::MallocMessageBuilder message;
@@ -1486,6 +2257,9 @@ private:
   kj::AsyncIoContext ioContext;
   kj::Own<kj::NetworkAddress> address;
   kj::Vector<kj::String> command;
+  StreamOptions streamOptions;
+  size_t cacheMemoryLimit = 0;
+  size_t cacheDiskLimit = 0;
 
   kj::Promise<int> onChildExit(pid_t pid) {
     int status;
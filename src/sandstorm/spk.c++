@@ -22,6 +22,9 @@
 #include <capnp/serialize.h>
 #include <sodium/crypto_sign.h>
 #include <sodium/crypto_hash.h>
+#include <sodium/crypto_hash_sha512.h>
+#include <sodium/crypto_hash_sha256.h>
+#include <lzma.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -29,11 +32,13 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <errno.h>
 #include <sandstorm/package.capnp.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <set>
+#include <algorithm>
 #include <map>
 #include <sys/xattr.h>
 #include <capnp/schema-parser.h>
@@ -43,19 +48,28 @@
 #include <kj/async-unix.h>
 #include <ctype.h>
 #include <time.h>
+#include <linux/falloc.h>
+#include <atomic>
 
 #include "version.h"
 #include "fuse.h"
 #include "union-fs.h"
 #include "send-fd.h"
 #include "util.h"
+#include "indexed-spk.h"
 
 namespace sandstorm {
 
 typedef kj::byte byte;
 
-static const uint64_t APP_SIZE_LIMIT = 1ull << 30;
-// For now, we will refuse to unpack an app over 1 GB (decompressed size).
+static const uint64_t XZ_DECODER_MEMLIMIT = APP_SIZE_LIMIT / 4;
+// Packages are untrusted, so don't let a crafted dictionary or block size make the decoder
+// allocate without bound. Legitimately-packed apps need a small fraction of this even at the
+// highest preset; multithreaded decoding falls back to fewer threads before hitting it.
+
+static const char PACK_CACHE_NAME[] = ".spk-pack-cache";
+// Name of the directory, next to the package definition, where `spk pack` caches compressed
+// blocks.
 
 // =======================================================================================
 // base32 encode/decode derived from google-authenticator code, Apache 2.0 license:
@@ -222,140 +236,805 @@ private:
   bool committed = false;
 };
 
-size_t getFileSize(int fd, kj::StringPtr filename) {
-  struct stat stats;
-  KJ_SYSCALL(fstat(fd, &stats));
-  KJ_REQUIRE(S_ISREG(stats.st_mode), "Not a regular file.", filename);
-  return stats.st_size;
+uint defaultThreadCount() {
+  // liblzma's multithreaded encoder at the default preset needs on the order of 100MB per
+  // thread, so don't scale all the way up on very wide machines unless asked to.
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : kj::min(n, 8L);
 }
 
-class MemoryMapping {
-public:
-  MemoryMapping(): content(nullptr) {}
+kj::String lzmaError(lzma_ret ret) {
+  switch (ret) {
+    case LZMA_MEM_ERROR: return kj::heapString("out of memory");
+    case LZMA_MEMLIMIT_ERROR: return kj::heapString("memory limit reached");
+    case LZMA_FORMAT_ERROR: return kj::heapString("not in xz format");
+    case LZMA_OPTIONS_ERROR: return kj::heapString("unsupported compression options");
+    case LZMA_DATA_ERROR: return kj::heapString("compressed data is corrupt");
+    case LZMA_BUF_ERROR: return kj::heapString("compressed data is truncated");
+    default: return kj::str("error code ", (int)ret);
+  }
+}
 
-  explicit MemoryMapping(int fd, kj::StringPtr filename): content(nullptr) {
-    size_t size = getFileSize(fd, filename);
+class XzBlockWriter {
+  // Writes an xz stream made of independently-compressed blocks, which lets blocks be compressed
+  // in parallel and -- given a cache directory -- lets blocks whose content was compressed by an
+  // earlier run be copied over verbatim instead of being compressed again.
+  //
+  // Small pieces of input passed to write() are gathered into shared blocks, which end at
+  // content-defined points so that inserting or removing a small file only disturbs the blocks
+  // around it. Large pieces passed to writeStandalone() always get blocks of their own, so an
+  // unchanged large file always maps to the same cached blocks.
+  //
+  // Cache entries are named after the SHA-256 of the block's uncompressed content; each holds the
+  // block's unpadded size (8 bytes, little-endian) followed by the encoded block. Entries not used
+  // by the current stream are deleted by finish(), so the cache tracks the latest output. Entries
+  // are decoded and compared against the content before being reused, so a damaged entry costs
+  // only a recompression.
 
-    if (size != 0) {
-      void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
-      if (ptr == MAP_FAILED) {
-        KJ_FAIL_SYSCALL("mmap", errno, filename);
+public:
+  static constexpr size_t STANDALONE_THRESHOLD = 256 << 10;
+  // Pieces at least this large are better off in their own blocks.
+
+  XzBlockWriter(kj::AutoCloseFd fdParam, uint threadCount, kj::StringPtr cacheDir)
+      : fd(kj::mv(fdParam)), threads(kj::max(threadCount, 1u)), cacheDir(cacheDir) {
+    // `cacheDir` may be null to disable caching; otherwise it is created if needed.
+
+    if (cacheDir != nullptr) {
+      while (mkdir(cacheDir.cStr(), 0755) < 0) {
+        int error = errno;
+        if (error == EEXIST) break;
+        if (error != EINTR) KJ_FAIL_SYSCALL("mkdir", error, cacheDir);
       }
-
-      content = kj::arrayPtr(reinterpret_cast<byte*>(ptr), size);
     }
+
+    memset(&flags, 0, sizeof(flags));
+    flags.version = 0;
+    flags.check = LZMA_CHECK_CRC64;
+
+    byte header[LZMA_STREAM_HEADER_SIZE];
+    lzma_ret ret = lzma_stream_header_encode(&flags, header);
+    KJ_ASSERT(ret == LZMA_OK, lzmaError(ret));
+    kj::FdOutputStream(fd.get()).write(header, sizeof(header));
+
+    index = lzma_index_init(nullptr);
+    KJ_ASSERT(index != nullptr, "out of memory");
+  }
+
+  ~XzBlockWriter() noexcept(false) {
+    lzma_index_end(index, nullptr);
   }
 
-  ~MemoryMapping() {
-    if (content != nullptr) {
-      KJ_SYSCALL(munmap(content.begin(), content.size()));
+  KJ_DISALLOW_COPY(XzBlockWriter);
+
+  void write(kj::ArrayPtr<const byte> piece) {
+    if (piece.size() == 0) return;
+    group.addAll(piece);
+
+    // Cut after pieces whose tail hashes to a multiple of 8, so cut points follow content rather
+    // than position.
+    uint32_t tailHash = 2166136261u;
+    for (byte b: piece.slice(piece.size() - kj::min(piece.size(), size_t(64)), piece.size())) {
+      tailHash = (tailHash ^ b) * 16777619u;
+    }
+    if ((group.size() >= MIN_GROUP_SIZE && tailHash % 8 == 0) ||
+        group.size() >= MAX_GROUP_SIZE) {
+      endGroup();
     }
   }
 
-  KJ_DISALLOW_COPY(MemoryMapping);
-  inline MemoryMapping(MemoryMapping&& other): content(other.content) {
-    other.content = nullptr;
+  void writeStandalone(kj::ArrayPtr<const byte> piece) {
+    // Like write(), but `piece` gets blocks to itself. `piece` must remain valid until finish().
+
+    endGroup();
+    while (piece.size() > 0) {
+      size_t n = kj::min(piece.size(), size_t(MAX_BLOCK_SIZE));
+      queue(piece.slice(0, n), nullptr);
+      piece = piece.slice(n, piece.size());
+    }
   }
-  inline MemoryMapping& operator=(MemoryMapping&& other) {
-    MemoryMapping old(kj::mv(*this));
-    content = other.content;
-    other.content = nullptr;
-    return *this;
+
+  void finish() {
+    endGroup();
+    flushBlocks();
+
+    // Write the index and stream footer.
+    size_t indexSize = lzma_index_size(index);
+    auto indexBytes = kj::heapArray<byte>(indexSize);
+    size_t pos = 0;
+    lzma_ret ret = lzma_index_buffer_encode(index, indexBytes.begin(), &pos, indexBytes.size());
+    KJ_ASSERT(ret == LZMA_OK, lzmaError(ret));
+    kj::FdOutputStream(fd.get()).write(indexBytes.begin(), pos);
+
+    flags.backward_size = indexSize;
+    byte footer[LZMA_STREAM_HEADER_SIZE];
+    ret = lzma_stream_footer_encode(&flags, footer);
+    KJ_ASSERT(ret == LZMA_OK, lzmaError(ret));
+    kj::FdOutputStream(fd.get()).write(footer, sizeof(footer));
+
+    // Drop cache entries we didn't use. Leave recent temp files alone: they may belong to a
+    // concurrent run, which will rename them into place shortly. Older ones were left behind by
+    // interrupted runs.
+    if (cacheDir != nullptr) {
+      time_t now = time(nullptr);
+      for (auto& name: listDirectory(cacheDir)) {
+        if (usedEntries.count(name) > 0) continue;
+        auto path = kj::str(cacheDir, '/', name);
+        struct stat stats;
+        bool garbage = strstr(name.cStr(), ".tmp-") == nullptr ||
+            (lstat(path.cStr(), &stats) == 0 && stats.st_ctime < now - 3600);
+        if (garbage) {
+          if (unlink(path.cStr()) < 0) {
+            int error = errno;
+            if (error != ENOENT) KJ_FAIL_SYSCALL("unlink", error, path);
+          }
+        }
+      }
+    }
   }
 
-  inline operator kj::ArrayPtr<const byte>() const {
-    return content;
+private:
+  static constexpr size_t MIN_GROUP_SIZE = 128 << 10;
+  static constexpr size_t MAX_GROUP_SIZE = 2 << 20;
+  static constexpr size_t MAX_BLOCK_SIZE = 8 << 20;
+
+  struct Block {
+    kj::ArrayPtr<const byte> content;
+    kj::Array<byte> ownContent;  // Backs `content` for grouped blocks.
+    kj::String cacheName;        // Hex SHA-256 of `content`.
+    kj::Array<byte> encoded;
+    lzma_vli unpaddedSize = 0;
+    bool fromCache = false;
+  };
+
+  kj::AutoCloseFd fd;
+  uint threads;
+  kj::StringPtr cacheDir;
+  lzma_stream_flags flags;
+  lzma_index* index;
+
+  kj::Vector<byte> group;
+  kj::Vector<Block> pending;
+  std::set<kj::String> usedEntries;
+  uint tmpCounter = 0;
+
+  void endGroup() {
+    if (group.size() == 0) return;
+    auto content = kj::heapArray<byte>(group.begin(), group.size());
+    group.resize(0);
+    auto ptr = content.asPtr();
+    queue(ptr, kj::mv(content));
+  }
+
+  void queue(kj::ArrayPtr<const byte> content, kj::Array<byte> ownContent) {
+    Block block;
+    block.content = content;
+    block.ownContent = kj::mv(ownContent);
+    pending.add(kj::mv(block));
+
+    // Bound memory use by compressing a few blocks per thread at a time.
+    if (pending.size() >= threads * 4) {
+      flushBlocks();
+    }
   }
 
-  inline operator capnp::Data::Reader() const {
-    return content;
+  void flushBlocks() {
+    // Hash, fetch from cache or compress, and write out all pending blocks.
+
+    if (pending.size() == 0) return;
+
+    parallelFor(pending.size(), threads, [this](size_t i) { prepare(pending[i]); });
+
+    for (auto& block: pending) {
+      kj::FdOutputStream(fd.get()).write(block.encoded.begin(), block.encoded.size());
+      lzma_ret ret = lzma_index_append(index, nullptr, block.unpaddedSize, block.content.size());
+      KJ_ASSERT(ret == LZMA_OK, lzmaError(ret));
+
+      if (cacheDir != nullptr) {
+        if (!block.fromCache) saveToCache(block);
+        usedEntries.insert(kj::mv(block.cacheName));
+      }
+    }
+
+    pending.resize(0);
   }
 
-  inline operator kj::ArrayPtr<const capnp::word>() const {
-    return kj::arrayPtr(reinterpret_cast<const capnp::word*>(content.begin()),
-                        content.size() / sizeof(capnp::word));
+  void prepare(Block& block) {
+    // Runs on a worker thread.
+
+    if (cacheDir != nullptr) {
+      byte hash[crypto_hash_sha256_BYTES];
+      crypto_hash_sha256(hash, block.content.begin(), block.content.size());
+      block.cacheName = hexEncode(hash);
+
+      KJ_IF_MAYBE(cached, readCacheEntry(block)) {
+        block.encoded = kj::mv(*cached);
+        block.fromCache = true;
+        return;
+      }
+    }
+
+    lzma_options_lzma options;
+    KJ_ASSERT(!lzma_lzma_preset(&options, LZMA_PRESET_DEFAULT));
+    lzma_filter filters[2];
+    filters[0].id = LZMA_FILTER_LZMA2;
+    filters[0].options = &options;
+    filters[1].id = LZMA_VLI_UNKNOWN;
+    filters[1].options = nullptr;
+
+    lzma_block header;
+    memset(&header, 0, sizeof(header));
+    header.version = 0;
+    header.check = flags.check;
+    header.filters = filters;
+
+    auto buffer = kj::heapArray<byte>(lzma_block_buffer_bound(block.content.size()));
+    size_t pos = 0;
+    lzma_ret ret = lzma_block_buffer_encode(&header, nullptr,
+        block.content.begin(), block.content.size(), buffer.begin(), &pos, buffer.size());
+    KJ_REQUIRE(ret == LZMA_OK, "xz compression failed", lzmaError(ret));
+
+    block.unpaddedSize = lzma_block_unpadded_size(&header);
+    block.encoded = kj::heapArray<byte>(buffer.begin(), pos);
+  }
+
+  kj::Maybe<kj::Array<byte>> readCacheEntry(Block& block) {
+    auto path = kj::str(cacheDir, '/', block.cacheName);
+    int rawFd = open(path.cStr(), O_RDONLY | O_CLOEXEC);
+    if (rawFd < 0) return nullptr;
+    kj::AutoCloseFd entryFd(rawFd);
+
+    auto entry = readAllBytes(entryFd);
+    if (entry.size() < 8) return nullptr;
+
+    uint64_t unpaddedSize = 0;
+    for (uint i = 0; i < 8; i++) {
+      unpaddedSize |= uint64_t(entry[i]) << (i * 8);
+    }
+
+    // An encoded block is its unpadded size rounded up to a multiple of four. Anything else means
+    // the entry is damaged; just compress again.
+    size_t encodedSize = entry.size() - 8;
+    if (unpaddedSize == 0 || (unpaddedSize + 3) / 4 * 4 != encodedSize) return nullptr;
+    auto encoded = entry.slice(8, entry.size());
+
+    // Don't splice in a block we haven't checked: decode it, which verifies its header and
+    // integrity check, and make sure it reproduces exactly the content we want.
+    if (!decodesTo(encoded, unpaddedSize, block.content)) return nullptr;
+
+    block.unpaddedSize = unpaddedSize;
+    return kj::heapArray<byte>(encoded);
+  }
+
+  bool decodesTo(kj::ArrayPtr<const byte> encoded, uint64_t unpaddedSize,
+                 kj::ArrayPtr<const byte> content) {
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block header;
+    memset(&header, 0, sizeof(header));
+    header.version = 0;
+    header.check = flags.check;
+    header.filters = filters;
+    header.header_size = lzma_block_header_size_decode(encoded[0]);
+    if (encoded[0] == 0 || header.header_size > encoded.size()) return false;
+    if (lzma_block_header_decode(&header, nullptr, encoded.begin()) != LZMA_OK) return false;
+
+    auto decoded = kj::heapArray<byte>(content.size());
+    size_t inPos = header.header_size;
+    size_t outPos = 0;
+    lzma_ret ret = lzma_block_buffer_decode(&header, nullptr,
+        encoded.begin(), &inPos, encoded.size(), decoded.begin(), &outPos, decoded.size());
+    for (uint i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++) {
+      free(filters[i].options);
+    }
+
+    return ret == LZMA_OK && inPos == encoded.size() && outPos == content.size() &&
+           lzma_block_unpadded_size(&header) == unpaddedSize &&
+           memcmp(decoded.begin(), content.begin(), content.size()) == 0;
   }
 
-  inline size_t size() const { return content.size(); }
+  void saveToCache(const Block& block) {
+    byte sizeBytes[8];
+    for (uint i = 0; i < 8; i++) {
+      sizeBytes[i] = block.unpaddedSize >> (i * 8);
+    }
 
-private:
-  kj::ArrayPtr<byte> content;
+    // Write under a temporary name so that an interrupted run never leaves a partial entry. The
+    // name is unique to this run so that concurrent runs sharing the cache don't collide.
+    auto path = kj::str(cacheDir, '/', block.cacheName);
+    auto tmpPath = kj::str(path, ".tmp-", getpid(), '-', tmpCounter++);
+    {
+      kj::FdOutputStream out(raiiOpen(tmpPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC));
+      out.write(sizeBytes, sizeof(sizeBytes));
+      out.write(block.encoded.begin(), block.encoded.size());
+    }
+    KJ_SYSCALL(rename(tmpPath.cStr(), path.cStr()), path);
+  }
+
+  static kj::Array<byte> readAllBytes(int input) {
+    kj::Vector<byte> result;
+    byte buffer[65536];
+    for (;;) {
+      ssize_t n;
+      KJ_SYSCALL(n = read(input, buffer, sizeof(buffer)));
+      if (n == 0) break;
+      result.addAll(buffer, buffer + n);
+    }
+    return result.releaseAsArray();
+  }
 };
 
-class ChildProcess {
+class XzInputStream final: public kj::InputStream {
+  // Decompresses xz data read from `fd`, which should be positioned at the start of the
+  // compressed stream. With liblzma 5.4 or newer, blocks are decoded in parallel; older versions
+  // fall back to the single-threaded decoder, which reads the same format.
+
 public:
-  enum Direction {
-    OUTPUT,
-    INPUT
-  };
+  XzInputStream(int fd, uint threads): fd(fd) {
+#if LZMA_VERSION >= 50040002
+    lzma_mt mt;
+    memset(&mt, 0, sizeof(mt));
+    mt.threads = threads;
+    mt.memlimit_threading = XZ_DECODER_MEMLIMIT;
+    mt.memlimit_stop = XZ_DECODER_MEMLIMIT;
+    lzma_ret ret = lzma_stream_decoder_mt(&stream, &mt);
+#else
+    (void)threads;
+    lzma_ret ret = lzma_stream_decoder(&stream, XZ_DECODER_MEMLIMIT, 0);
+#endif
+    KJ_REQUIRE(ret == LZMA_OK, "couldn't initialize xz decompressor", lzmaError(ret));
+  }
+
+  ~XzInputStream() noexcept(false) {
+    lzma_end(&stream);
+  }
+
+  KJ_DISALLOW_COPY(XzInputStream);
+
+  size_t tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    stream.next_out = reinterpret_cast<byte*>(buffer);
+    stream.avail_out = maxBytes;
+
+    while (!done && maxBytes - stream.avail_out < minBytes) {
+      if (stream.avail_in == 0 && !eof) {
+        ssize_t n;
+        KJ_SYSCALL(n = read(fd, inBuffer, sizeof(inBuffer)));
+        stream.next_in = inBuffer;
+        stream.avail_in = n;
+        eof = n == 0;
+      }
 
-  ChildProcess(kj::StringPtr command, kj::StringPtr flags,
-               kj::AutoCloseFd wrappedFd, Direction direction) {
-    int pipeFds[2];
-    KJ_SYSCALL(pipe(pipeFds));
-    kj::AutoCloseFd pipeInput(pipeFds[0]), pipeOutput(pipeFds[1]);
-
-    KJ_SYSCALL(pid = fork());
-    if (pid == 0) {
-      if (direction == OUTPUT) {
-        KJ_SYSCALL(dup2(pipeInput, STDIN_FILENO));
-        KJ_SYSCALL(dup2(wrappedFd, STDOUT_FILENO));
+      lzma_ret ret = lzma_code(&stream, eof ? LZMA_FINISH : LZMA_RUN);
+      if (ret == LZMA_STREAM_END) {
+        done = true;
       } else {
-        KJ_SYSCALL(dup2(wrappedFd, STDIN_FILENO));
-        KJ_SYSCALL(dup2(pipeOutput, STDOUT_FILENO));
+        KJ_REQUIRE(ret == LZMA_OK, "xz decompression failed", lzmaError(ret));
       }
-      pipeInput = nullptr;
-      pipeOutput = nullptr;
-      wrappedFd = nullptr;
+    }
 
-      KJ_SYSCALL(execlp(command.cStr(), command.cStr(), flags.cStr(), (const char*)nullptr),
-                 command);
-      KJ_UNREACHABLE;
-    } else {
-      if (direction == OUTPUT) {
-        pipeFd = kj::mv(pipeOutput);
+    return maxBytes - stream.avail_out;
+  }
+
+private:
+  int fd;
+  lzma_stream stream = LZMA_STREAM_INIT;
+  bool eof = false;
+  bool done = false;
+  byte inBuffer[1 << 16];
+};
+
+struct timespec toTimespec(int64_t ns) {
+  struct timespec result;
+  result.tv_sec = ns / 1000000000ll;
+  result.tv_nsec = ns % 1000000000ll;
+  if (result.tv_nsec < 0) {
+    // C division rounds towards zero. :(
+    --result.tv_sec;
+    result.tv_nsec += 1000000000ll;
+  }
+  return result;
+}
+
+bool renameNoReplace(kj::StringPtr from, kj::StringPtr to) {
+  // Like rename(), but returns false rather than replacing anything already at `to` -- including
+  // an empty directory, which plain rename() would silently replace.
+
+#ifdef SYS_renameat2
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+  for (;;) {
+    if (syscall(SYS_renameat2, AT_FDCWD, from.cStr(), AT_FDCWD, to.cStr(),
+                RENAME_NOREPLACE) == 0) {
+      return true;
+    }
+    int error = errno;
+    if (error == EEXIST) return false;
+    if (error == EINTR) continue;
+    if (error == ENOSYS || error == EINVAL) break;  // Kernel or filesystem lacks renameat2().
+    KJ_FAIL_SYSCALL("renameat2", error, from, to);
+  }
+#endif
+
+  // Fallback: check first. This can race with another process creating `to`, but only on
+  // kernels too old for renameat2().
+  if (access(to.cStr(), F_OK) == 0) return false;
+  KJ_SYSCALL(rename(from.cStr(), to.cStr()), to);
+  return true;
+}
+
+static constexpr uint32_t SIGNATURE_CHUNK_SIZE = 1 << 20;
+static constexpr uint32_t MIN_SIGNATURE_CHUNK_SIZE = 1 << 12;
+static constexpr uint32_t MAX_SIGNATURE_CHUNK_SIZE = 1 << 24;
+// Bounds on `Signature.chunkSize`. Packing always uses SIGNATURE_CHUNK_SIZE; the limits keep a
+// hostile package from making us buffer huge chunks or hash absurd numbers of tiny ones.
+
+void hashChunk(byte (&out)[crypto_hash_BYTES],
+               kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) {
+  // Computes the Merkle leaf for one chunk, given as the concatenation of `pieces`. See
+  // `Signature.chunkSize` in package.capnp.
+
+  static_assert(crypto_hash_BYTES == crypto_hash_sha512_BYTES,
+                "crypto_hash is expected to be SHA-512");
+  const byte tag = 0;
+  crypto_hash_sha512_state state;
+  crypto_hash_sha512_init(&state);
+  crypto_hash_sha512_update(&state, &tag, 1);
+  for (auto piece: pieces) {
+    crypto_hash_sha512_update(&state, piece.begin(), piece.size());
+  }
+  crypto_hash_sha512_final(&state, out);
+}
+
+void merkleRoot(byte (&out)[crypto_hash_BYTES], kj::ArrayPtr<const byte> leaves) {
+  // Computes the root of the Merkle tree whose leaves are the concatenated hashes `leaves`.
+
+  KJ_REQUIRE(leaves.size() > 0 && leaves.size() % crypto_hash_BYTES == 0);
+
+  // Each level is computed in place over the previous one; node `i` only ever reads nodes `2i`
+  // and `2i+1`, which haven't been overwritten yet.
+  auto level = kj::heapArray<byte>(leaves.begin(), leaves.size());
+  size_t count = leaves.size() / crypto_hash_BYTES;
+  while (count > 1) {
+    size_t next = 0;
+    for (size_t i = 0; i < count; i += 2) {
+      byte* node = level.begin() + next++ * crypto_hash_BYTES;
+      byte* children = level.begin() + i * crypto_hash_BYTES;
+      if (i + 1 < count) {
+        const byte tag = 1;
+        crypto_hash_sha512_state state;
+        crypto_hash_sha512_init(&state);
+        crypto_hash_sha512_update(&state, &tag, 1);
+        crypto_hash_sha512_update(&state, children, crypto_hash_BYTES * 2);
+        crypto_hash_sha512_final(&state, node);
       } else {
-        pipeFd = kj::mv(pipeInput);
+        memmove(node, children, crypto_hash_BYTES);
       }
     }
+    count = next;
   }
+  memcpy(out, level.begin(), crypto_hash_BYTES);
+}
 
-  ~ChildProcess() {
-    if (pid == 0) return;
+kj::Array<byte> hashChunks(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces,
+                           uint32_t chunkSize, uint threadCount) {
+  // Splits the concatenation of `pieces` into `chunkSize`-byte chunks (the last one possibly
+  // short) and returns their concatenated Merkle leaves, hashing chunks on up to `threadCount`
+  // threads without copying the input.
+
+  auto starts = kj::heapArray<uint64_t>(pieces.size() + 1);
+  starts[0] = 0;
+  for (uint i: kj::indices(pieces)) {
+    starts[i + 1] = starts[i] + pieces[i].size();
+  }
+  uint64_t total = starts[pieces.size()];
+  size_t chunkCount = kj::max((total + chunkSize - 1) / chunkSize, uint64_t(1));
+
+  auto result = kj::heapArray<byte>(chunkCount * crypto_hash_BYTES);
+  parallelFor(chunkCount, threadCount, [&](size_t chunk) {
+    uint64_t begin = chunk * uint64_t(chunkSize);
+    uint64_t end = kj::min(begin + chunkSize, total);
+
+    // Find the first piece overlapping the chunk, then gather slices until the chunk is covered.
+    size_t i = std::upper_bound(starts.begin(), starts.end(), begin) - starts.begin() - 1;
+    kj::Vector<kj::ArrayPtr<const byte>> slices;
+    for (; i < pieces.size() && starts[i] < end; i++) {
+      uint64_t from = kj::max(begin, starts[i]) - starts[i];
+      uint64_t to = kj::min(end, starts[i + 1]) - starts[i];
+      slices.add(pieces[i].slice(from, to));
+    }
 
-    if (unwindDetector.isUnwinding()) {
-      // An exception was thrown, so force-kill the child.
-      int status;
-      while (kill(pid, SIGKILL) < 0 && errno == EINTR) {}
-      while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
-    } else {
-      // Close the pipe first, in case the child is waiting for that.
-      pipeFd = nullptr;
-
-      int status;
-      KJ_SYSCALL(waitpid(pid, &status, 0)) { return; }
-      if (status != 0) {
-        if (WIFEXITED(status)) {
-          int exitCode = WEXITSTATUS(status);
-          KJ_FAIL_ASSERT("child process failed", exitCode) { return; }
-        } else if (WIFSIGNALED(status)) {
-          int signalNumber = WTERMSIG(status);
-          KJ_FAIL_ASSERT("child process crashed", signalNumber) { return; }
-        } else {
-          KJ_FAIL_ASSERT("child process failed") { return; }
-        }
+    byte leaf[crypto_hash_BYTES];
+    hashChunk(leaf, slices.asPtr());
+    memcpy(result.begin() + chunk * crypto_hash_BYTES, leaf, crypto_hash_BYTES);
+  });
+  return result;
+}
+
+class ArchiveExtractor {
+  // Writes the contents of a verified archive out under a directory using a pool of threads.
+  //
+  // Directories and symlinks are created up front on the calling thread, since they are cheap and
+  // everything else depends on them. Regular files -- where the time actually goes -- are then
+  // written in parallel, each opened relative to the root directory's fd. As each file is
+  // written, the pages backing it in the decompressed archive's temp file are deallocated, so
+  // peak disk usage stays close to the size of the app rather than twice it.
+
+public:
+  ArchiveExtractor(kj::ArrayPtr<const byte> archive, int archiveFd, int rootFd)
+      : archive(archive), archiveFd(archiveFd), rootFd(rootFd) {}
+  // `archiveFd` is the temp file `archive` is mapped from, or -1 if its space shouldn't be
+  // reclaimed.
+
+  KJ_DISALLOW_COPY(ArchiveExtractor);
+
+  void setStore(int fd) { storeFd = fd; }
+  // Deduplicate regular files against the content-addressed object store open as `fd`: each file
+  // is hardlinked to the store's copy of its content, which is added if not already present.
+  // Objects are named "<first two hex digits>/<rest of hex>[.x]" after the SHA-256 of their
+  // content, ".x" marking executables. An object's link count is its reference count, so an
+  // object whose only remaining link is the store's own is garbage (see `spk gc-store`).
+  //
+  // Linked files share one inode, so they are read-only and their modification time is that of
+  // whichever package first added the content.
+
+  void addDirectory(capnp::List<spk::Archive::File>::Reader files, kj::StringPtr path) {
+    // Validate `files` and create the directory structure they describe under `path` (relative to
+    // the root; empty for the root itself), queueing regular files to be written by run().
+
+    std::set<kj::StringPtr> seen;
+
+    for (auto file: files) {
+      kj::StringPtr name = file.getName();
+      KJ_REQUIRE(name.size() != 0 && name != "." && name != ".." &&
+                 name.findFirst('/') == nullptr && name.findFirst('\0') == nullptr,
+                 "Archive contained invalid file name.", name);
+
+      KJ_REQUIRE(seen.insert(name).second, "Archive contained duplicate file name.", name);
+
+      auto childPath = path.size() == 0 ? kj::heapString(name) : kj::str(path, '/', name);
+      auto mtime = toTimespec(file.getLastModificationTimeNs());
+
+      switch (file.which()) {
+        case spk::Archive::File::REGULAR:
+          fileJobs.add(FileJob { kj::mv(childPath), file.getRegular(), 0666, mtime });
+          break;
+
+        case spk::Archive::File::EXECUTABLE:
+          fileJobs.add(FileJob { kj::mv(childPath), file.getExecutable(), 0777, mtime });
+          break;
+
+        case spk::Archive::File::SYMLINK:
+          KJ_SYSCALL(symlinkat(file.getSymlink().cStr(), rootFd, childPath.cStr()), childPath);
+          setTime(childPath, mtime);
+          break;
+
+        case spk::Archive::File::DIRECTORY:
+          KJ_SYSCALL(mkdirat(rootFd, childPath.cStr(), 0777), childPath);
+          addDirectory(file.getDirectory(), childPath);
+          // Writing files into the directory would bump its mtime, so set it at the very end.
+          directories.add(DirectoryTime { kj::mv(childPath), mtime });
+          break;
+
+        default:
+          KJ_FAIL_REQUIRE("Unknown file type in archive.");
+      }
+    }
+  }
+
+  void addDirectory(capnp::List<spk::PackageIndex::File>::Reader files, kj::StringPtr path) {
+    // Like the above, but for an indexed package, with `archive` holding the package's
+    // concatenated file contents.
+
+    std::set<kj::StringPtr> seen;
+
+    for (auto file: files) {
+      kj::StringPtr name = file.getName();
+      KJ_REQUIRE(name.size() != 0 && name != "." && name != ".." &&
+                 name.findFirst('/') == nullptr && name.findFirst('\0') == nullptr,
+                 "Archive contained invalid file name.", name);
+
+      KJ_REQUIRE(seen.insert(name).second, "Archive contained duplicate file name.", name);
+
+      auto childPath = path.size() == 0 ? kj::heapString(name) : kj::str(path, '/', name);
+      auto mtime = toTimespec(file.getLastModificationTimeNs());
+
+      switch (file.which()) {
+        case spk::PackageIndex::File::REGULAR:
+          fileJobs.add(FileJob { kj::mv(childPath), extent(file.getRegular()), 0666, mtime });
+          break;
+
+        case spk::PackageIndex::File::EXECUTABLE:
+          fileJobs.add(FileJob { kj::mv(childPath), extent(file.getExecutable()), 0777, mtime });
+          break;
+
+        case spk::PackageIndex::File::SYMLINK:
+          KJ_SYSCALL(symlinkat(file.getSymlink().cStr(), rootFd, childPath.cStr()), childPath);
+          setTime(childPath, mtime);
+          break;
+
+        case spk::PackageIndex::File::DIRECTORY:
+          KJ_SYSCALL(mkdirat(rootFd, childPath.cStr(), 0777), childPath);
+          addDirectory(file.getDirectory(), childPath);
+          directories.add(DirectoryTime { kj::mv(childPath), mtime });
+          break;
+
+        default:
+          KJ_FAIL_REQUIRE("Unknown file type in archive.");
       }
     }
   }
 
-  int getPipe() { return pipeFd; }
+  void run(uint threadCount) {
+    // Write out all queued files using up to `threadCount` threads (including the calling one),
+    // then fix up directory modification times.
 
-  KJ_DISALLOW_COPY(ChildProcess);
+    if (archiveFd >= 0) checkDisjoint();
+
+    // Small files go quickly, so don't bother starting threads that would barely be used.
+    parallelFor(fileJobs.size(), kj::min(threadCount, fileJobs.size() / 16 + 1),
+                [this](size_t i) { writeFile(fileJobs[i]); });
+
+    for (auto& dir: directories) {
+      setTime(dir.path, dir.mtime);
+    }
+  }
 
 private:
-  kj::AutoCloseFd pipeFd;
-  pid_t pid;
-  kj::UnwindDetector unwindDetector;
+  struct FileJob {
+    kj::String path;
+    kj::ArrayPtr<const byte> content;
+    mode_t mode;
+    struct timespec mtime;
+  };
+
+  struct DirectoryTime {
+    kj::String path;
+    struct timespec mtime;
+  };
+
+  kj::ArrayPtr<const byte> archive;
+  int archiveFd;
+  int rootFd;
+  int storeFd = -1;
+  std::atomic<uint> tmpCounter { 0 };
+  kj::Vector<FileJob> fileJobs;
+  kj::Vector<DirectoryTime> directories;
+
+  void writeFile(const FileJob& job) {
+    if (storeFd >= 0 && linkFromStore(job)) {
+      release(job.content);
+      return;
+    }
+
+    int fd;
+    KJ_SYSCALL(fd = openat(rootFd, job.path.cStr(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                           job.mode), job.path);
+    kj::AutoCloseFd ownFd(fd);
+    kj::FdOutputStream(ownFd.get()).write(job.content.begin(), job.content.size());
+
+    struct timespec times[2] = { job.mtime, job.mtime };  // Also use mtime as atime.
+    KJ_SYSCALL(futimens(ownFd, times), job.path);
+
+    release(job.content);
+  }
+
+  bool linkFromStore(const FileJob& job) {
+    // Hardlink `job.path` to the store's copy of its content, adding the content to the store if
+    // needed. Returns false if the file can't be shared (e.g. the object has hit the filesystem's
+    // link limit, or the store is on another filesystem) and should just be written out.
+
+    byte hash[crypto_hash_sha256_BYTES];
+    crypto_hash_sha256(hash, job.content.begin(), job.content.size());
+
+    auto hex = hexEncode(hash);
+    bool executable = job.mode & S_IXUSR;
+    auto prefix = kj::heapString(hex.slice(0, 2));
+    auto object = kj::str(prefix, '/', hex.slice(2), executable ? ".x" : "");
+
+    for (uint attempt = 0;; attempt++) {
+      if (linkat(storeFd, object.cStr(), rootFd, job.path.cStr(), 0) == 0) {
+        return true;
+      }
+
+      int error = errno;
+      switch (error) {
+        case EINTR:
+          break;
+        case ENOENT:
+          // Not in the store yet (or collected concurrently). Add it and try again.
+          if (attempt > 0) return false;
+          addToStore(job, prefix, object);
+          break;
+        case EMLINK:
+        case EXDEV:
+        case EPERM:
+          return false;
+        default:
+          KJ_FAIL_SYSCALL("linkat", error, object, job.path);
+      }
+    }
+  }
+
+  void addToStore(const FileJob& job, kj::StringPtr prefix, kj::StringPtr object) {
+    while (mkdirat(storeFd, prefix.cStr(), 0755) < 0) {
+      int error = errno;
+      if (error == EEXIST) break;
+      if (error != EINTR) KJ_FAIL_SYSCALL("mkdirat", error, prefix);
+    }
+
+    // Write to a temporary name and link it into place so that concurrent unpacks never see a
+    // partial object. If someone else got there first, theirs is identical, so just use it.
+    auto tmpName = kj::str(object, ".tmp-", getpid(), '-', tmpCounter++);
+    int fd;
+    KJ_SYSCALL(fd = openat(storeFd, tmpName.cStr(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                           job.mode & S_IXUSR ? 0555 : 0444), tmpName);
+    kj::AutoCloseFd ownFd(fd);
+    KJ_DEFER(unlinkat(storeFd, tmpName.cStr(), 0));
+
+    kj::FdOutputStream(ownFd.get()).write(job.content.begin(), job.content.size());
+    struct timespec times[2] = { job.mtime, job.mtime };  // Also use mtime as atime.
+    KJ_SYSCALL(futimens(ownFd, times), tmpName);
+
+    while (linkat(storeFd, tmpName.cStr(), storeFd, object.cStr(), 0) < 0) {
+      int error = errno;
+      if (error == EEXIST) break;
+      if (error != EINTR) KJ_FAIL_SYSCALL("linkat", error, object);
+    }
+  }
+
+  kj::ArrayPtr<const byte> extent(spk::PackageIndex::Extent::Reader range) {
+    uint64_t offset = range.getOffset();
+    uint64_t size = range.getSize();
+    KJ_REQUIRE(offset <= archive.size() && size <= archive.size() - offset,
+               "Archive contained out-of-range extent.");
+    return archive.slice(offset, offset + size);
+  }
+
+  void setTime(kj::StringPtr path, struct timespec mtime) {
+    struct timespec times[2] = { mtime, mtime };  // Also use mtime as atime.
+    KJ_SYSCALL(utimensat(rootFd, path.cStr(), times, AT_SYMLINK_NOFOLLOW), path);
+  }
+
+  void checkDisjoint() {
+    // Since release() frees each file's pages as soon as it's written, possibly while another
+    // thread is still reading, no two files may share content. Archives we write never do, so
+    // refuse any that does rather than silently extracting zeros.
+
+    kj::Vector<const FileJob*> jobs(fileJobs.size());
+    for (auto& job: fileJobs) {
+      if (job.content.size() > 0) jobs.add(&job);
+    }
+    std::sort(jobs.begin(), jobs.end(), [](const FileJob* a, const FileJob* b) {
+      return a->content.begin() < b->content.begin();
+    });
+    for (size_t i = 1; i < jobs.size(); i++) {
+      KJ_REQUIRE(jobs[i - 1]->content.end() <= jobs[i]->content.begin(),
+                 "Archive contained files with overlapping contents.",
+                 jobs[i - 1]->path, jobs[i]->path);
+    }
+  }
+
+  void release(kj::ArrayPtr<const byte> range) {
+    // We're done with `range` of the archive; give the whole pages it covers back to the
+    // filesystem.
+
+    if (archiveFd < 0 || range.size() == 0) return;
+
+    static const size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t start = range.begin() - archive.begin();
+    size_t end = start + range.size();
+    start = (start + pageSize - 1) / pageSize * pageSize;
+    end = end / pageSize * pageSize;
+    if (end <= start) return;
+
+    // Not all filesystems support punching holes; in that case we just use more disk.
+    while (fallocate(archiveFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     start, end - start) < 0) {
+      int error = errno;
+      if (error == EINTR) continue;
+      if (error == EOPNOTSUPP) break;
+      KJ_FAIL_SYSCALL("fallocate(PUNCH_HOLE)", error) { break; }
+    }
+  }
 };
 
 class SpkTool: public AbstractMain {
@@ -411,6 +1090,12 @@ public:
                        "Create an spk from a directory tree and a signing key.")
         .addSubCommand("unpack", KJ_BIND_METHOD(*this, getUnpackMain),
                        "Unpack an spk to a directory, verifying its signature.")
+        .addSubCommand("cat", KJ_BIND_METHOD(*this, getCatMain),
+                       "Print one file from an spk, verifying its signature.")
+        .addSubCommand("gc-store", KJ_BIND_METHOD(*this, getGcStoreMain),
+                       "Delete unused objects from a package store (see `unpack --store`).")
+        .addSubCommand("mount", KJ_BIND_METHOD(*this, getMountMain),
+                       "Mount an spk read-only without unpacking it, verifying its signature.")
         .addSubCommand("dev", KJ_BIND_METHOD(*this, getDevMain),
                        "Run an app in dev mode."))
         .build();
@@ -923,11 +1608,27 @@ private:
   // =====================================================================================
 
   kj::String spkfile;
+  uint threadCount = defaultThreadCount();
 
   kj::MainFunc getPackMain() {
     return addCommonOptions(OptionSet::ALL_READONLY,
         kj::MainBuilder(context, "Sandstorm version " SANDSTORM_VERSION,
             "Package the app as an spk, writing it to <output>.")
+        .addOptionWithArg({'j', "threads"}, KJ_BIND_METHOD(*this, setThreadCount), "<count>",
+            "Use <count> threads for compression. Defaults to the number of CPUs, up to 8.")
+        .addOption({"indexed"}, KJ_BIND_METHOD(*this, setPackIndexed),
+            "Write the package in the indexed format, which can be read one file at a time "
+            "(e.g. by `spk cat`) instead of only as a whole. Sandstorm versions predating this "
+            "format can't install such packages. The block cache isn't used in this mode.")
+        .addOption({"chunked-signature"}, KJ_BIND_METHOD(*this, setChunkedSignature),
+            "Sign a Merkle tree over fixed-size chunks of the archive rather than a single hash "
+            "of the whole thing, so that installing can verify chunks in parallel as they are "
+            "decompressed. Sandstorm versions predating this option can't install such "
+            "packages. Has no effect with --indexed, which always verifies per block.")
+        .addOption({"no-cache"}, KJ_BIND_METHOD(*this, disablePackCache),
+            "Don't use or update the cache of compressed blocks which is normally kept in "
+            "`.spk-pack-cache` next to the package definition, so that repacking only "
+            "compresses what changed.")
         .expectArg("<output>", KJ_BIND_METHOD(*this, setSpkfile))
         .callAfterParsing(KJ_BIND_METHOD(*this, doPack)))
         .build();
@@ -938,32 +1639,110 @@ private:
     return true;
   }
 
+  bool usePackCache = true;
+  bool chunkedSignature = false;
+  bool packIndexed = false;
+
+  kj::MainBuilder::Validity setPackIndexed() {
+    packIndexed = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setChunkedSignature() {
+    chunkedSignature = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity disablePackCache() {
+    usePackCache = false;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setThreadCount(kj::StringPtr arg) {
+    char* end;
+    unsigned long n = strtoul(arg.cStr(), &end, 10);
+    if (arg.size() == 0 || *end != '\0' || n == 0 || n > 256) {
+      return "Must be a number between 1 and 256.";
+    }
+    threadCount = n;
+    return true;
+  }
+
   kj::MainBuilder::Validity doPack() {
     ensurePackageDefParsed();
 
     spk::KeyFile::Reader key = lookupKey(packageDef.getId());
 
-    kj::AutoCloseFd tmpfile = packToTempFile();
+    ArchiveNode root;
+    capnp::MallocMessageBuilder archiveMessage;
+    buildArchive(root, archiveMessage);
+
+    // Lay out the serialized archive -- a segment table followed by the segments -- without
+    // copying it anywhere. Most segments point straight at the mapped source files.
+    auto segments = archiveMessage.getSegmentsForOutput();
+    auto table = kj::heapArray<uint32_t>((segments.size() + 2) & ~size_t(1));
+    table[0] = segments.size() - 1;
+    for (uint i: kj::indices(segments)) {
+      table[i + 1] = segments[i].size();
+    }
+    if (segments.size() % 2 == 0) {
+      table[segments.size() + 1] = 0;  // padding
+    }
+    auto tableBytes = kj::arrayPtr(reinterpret_cast<const byte*>(table.begin()),
+                                   table.size() * sizeof(uint32_t));
 
-    // Map the temp file back in.
-    MemoryMapping tmpMapping(tmpfile, spkfile);
-    kj::ArrayPtr<const byte> tmpData = tmpMapping;
+    uint64_t totalSize = tableBytes.size();
+    for (auto segment: segments) {
+      totalSize += segment.size() * sizeof(capnp::word);
+    }
 
-    if (tmpData.size() > APP_SIZE_LIMIT) {
+    if (totalSize > APP_SIZE_LIMIT) {
       context.exitError(kj::str(
           "App exceeds uncompressed size limit of ", APP_SIZE_LIMIT >> 30, " GiB. This limit "
           "exists for the safety of hosts, but if you feel there is a strong case for allowing "
           "larger apps, please contact the Sandstorm developers."));
     }
 
+    if (packIndexed) {
+      writeIndexedSpk(raiiOpen(spkfile, O_WRONLY | O_CREAT | O_TRUNC),
+                      archiveMessage.getRoot<spk::Archive>().asReader(), key, threadCount);
+      printAppId(key.getPublicKey());
+      return true;
+    }
+
     // Hash it.
     byte hash[crypto_hash_BYTES];
-    crypto_hash(hash, tmpData.begin(), tmpData.size());
+    kj::Array<byte> chunkHashes;
+    if (chunkedSignature) {
+      auto pieces = kj::heapArrayBuilder<kj::ArrayPtr<const byte>>(segments.size() + 1);
+      pieces.add(tableBytes);
+      for (auto segment: segments) {
+        pieces.add(reinterpret_cast<const byte*>(segment.begin()),
+                   segment.size() * sizeof(capnp::word));
+      }
+      chunkHashes = hashChunks(pieces.finish(), SIGNATURE_CHUNK_SIZE, threadCount);
+      merkleRoot(hash, chunkHashes);
+    } else {
+      static_assert(crypto_hash_BYTES == crypto_hash_sha512_BYTES,
+                    "crypto_hash is expected to be SHA-512");
+      crypto_hash_sha512_state hashState;
+      crypto_hash_sha512_init(&hashState);
+      crypto_hash_sha512_update(&hashState, tableBytes.begin(), tableBytes.size());
+      for (auto segment: segments) {
+        crypto_hash_sha512_update(&hashState, reinterpret_cast<const byte*>(segment.begin()),
+                                  segment.size() * sizeof(capnp::word));
+      }
+      crypto_hash_sha512_final(&hashState, hash);
+    }
 
     // Generate the signature.
     capnp::MallocMessageBuilder signatureMessage;
     spk::Signature::Builder signature = signatureMessage.getRoot<spk::Signature>();
     signature.setPublicKey(key.getPublicKey());
+    if (chunkedSignature) {
+      signature.setChunkSize(SIGNATURE_CHUNK_SIZE);
+      signature.setChunkHashes(chunkHashes);
+    }
     unsigned long long siglen = crypto_hash_BYTES + crypto_sign_BYTES;
     crypto_sign(signature.initSignature(siglen).begin(), &siglen,
                 hash, sizeof(hash), key.getPrivateKey().begin());
@@ -976,13 +1755,27 @@ private:
       auto magic = spk::MAGIC_NUMBER.get();
       kj::FdOutputStream(finalFile.get()).write(magic.begin(), magic.size());
 
-      // Pipe content through xz compressor.
-      ChildProcess child("xz", "-zc", kj::mv(finalFile), ChildProcess::OUTPUT);
-
-      // Write signature and archive out to the pipe.
-      kj::FdOutputStream out(child.getPipe());
-      capnp::writeMessage(out, signatureMessage);
-      out.write(tmpData.begin(), tmpData.size());
+      // Compress the signature and archive into the rest of the file.
+      kj::String cacheDir;
+      if (usePackCache) {
+        cacheDir = getPackCacheDir();
+      }
+      XzBlockWriter out(kj::mv(finalFile), threadCount, cacheDir);
+
+      auto signatureWords = capnp::messageToFlatArray(signatureMessage);
+      out.write(kj::arrayPtr(reinterpret_cast<const byte*>(signatureWords.begin()),
+                             signatureWords.size() * sizeof(capnp::word)));
+      out.write(tableBytes);
+      for (auto segment: segments) {
+        auto bytes = kj::arrayPtr(reinterpret_cast<const byte*>(segment.begin()),
+                                  segment.size() * sizeof(capnp::word));
+        if (bytes.size() >= XzBlockWriter::STANDALONE_THRESHOLD) {
+          out.writeStandalone(bytes);
+        } else {
+          out.write(bytes);
+        }
+      }
+      out.finish();
     }
 
     printAppId(key.getPublicKey());
@@ -990,9 +1783,9 @@ private:
     return true;
   }
 
-  kj::AutoCloseFd packToTempFile() {
-    // Read in the file list.
-    ArchiveNode root;
+  void buildArchive(ArchiveNode& root, capnp::MallocMessageBuilder& archiveMessage) {
+    // Read in the file list and build the archive in `archiveMessage`, which will refer directly
+    // to file contents mapped by the nodes under `root`.
 
     // Set up special files that will be over-mounted by the supervisor.
     root.followPath("dev");
@@ -1000,7 +1793,7 @@ private:
     root.followPath("var");
     root.followPath("proc").followPath("cpuinfo").setData(nullptr);
 
-    auto sourceMap = packageDef.getSourceMap();
+    SourceMapIndex sourceIndex(sourceDir, packageDef.getSourceMap());
 
     if (packageDef.hasFileList()) {
       auto fileListFile = packageDef.getFileList();
@@ -1010,24 +1803,18 @@ private:
       }
 
       for (auto& line: splitLines(readAll(raiiOpen(fileListFile, O_RDONLY)))) {
-        addNode(root, line, sourceMap, false);
+        addNode(root, line, sourceIndex, false);
       }
     }
     for (auto file: packageDef.getAlwaysInclude()) {
-      addNode(root, file, sourceMap, true);
+      addNode(root, file, sourceIndex, true);
     }
 
-    auto tmpfile = openTemporary(spkfile);
-
-    // Write the archive.
-    capnp::MallocMessageBuilder archiveMessage;
+    // Build the archive.
     auto archive = archiveMessage.getRoot<spk::Archive>();
     struct timespec defaultMTime;
     KJ_SYSCALL(clock_gettime(CLOCK_REALTIME, &defaultMTime));
     archive.adoptFiles(root.packChildren(archiveMessage.getOrphanage(), context, defaultMTime));
-    capnp::writeMessageToFd(tmpfile, archiveMessage);
-
-    return tmpfile;
   }
 
   class ArchiveNode {
@@ -1167,11 +1954,16 @@ private:
            exe == "sandstorm-http-bridge";
   }
 
-  void addNode(ArchiveNode& root, kj::StringPtr path, const spk::SourceMap::Reader& sourceMap,
+  void addNode(ArchiveNode& root, kj::StringPtr path, SourceMapIndex& sourceIndex,
                bool recursive) {
     if (path.startsWith("/")) {
       context.exitError(kj::str("Destination (in-package) path must not start with '/': ", path));
     }
+    for (auto part: split(path, '/')) {
+      if (part.size() == 2 && part[0] == '.' && part[1] == '.') {
+        context.exitError(kj::str("Destination (in-package) path must not contain '..': ", path));
+      }
+    }
     if (path == ".") {
       path = "";
     }
@@ -1193,59 +1985,66 @@ private:
       node.setTarget(getHttpBridgeExe());
     } else {
       if (path.size() == 0 && recursive) {
-        addNode(root, "sandstorm-manifest", sourceMap, true);
+        addNode(root, "sandstorm-manifest", sourceIndex, true);
         if (packageDef.hasBridgeConfig() ||
             isHttpBridgeCommand(packageDef.getManifest().getContinueCommand())) {
-          addNode(root, "sandstorm-http-bridge-config", sourceMap, true);
-          addNode(root, "sandstorm-http-bridge", sourceMap, true);
+          addNode(root, "sandstorm-http-bridge-config", sourceIndex, true);
+          addNode(root, "sandstorm-http-bridge", sourceIndex, true);
         }
       }
 
-      auto mapping = mapFile(sourceDir, sourceMap, path);
+      auto mapping = sourceIndex.map(path);
       if (mapping.sourcePaths.size() == 0 && mapping.virtualChildren.size() == 0) {
         context.exitError(kj::str("No file found to satisfy requirement: ", path));
       } else {
-        initNode(node, path, kj::mv(mapping), sourceMap, recursive);
+        initNode(node, path, kj::mv(mapping), sourceIndex, recursive);
       }
     }
   }
 
   void initNode(ArchiveNode& node, kj::StringPtr srcPath, FileMapping&& mapping,
-                const spk::SourceMap::Reader& sourceMap, bool recursive) {
+                SourceMapIndex& sourceIndex, bool recursive) {
     if (mapping.sourcePaths.size() == 0 && mapping.virtualChildren.size() == 0) {
       // Nothing here.
       return;
     }
 
-    if (recursive && (mapping.sourcePaths.size() == 0 || isDirectory(mapping.sourcePaths[0]))) {
-      // Primary match is a directory, so merge all of the matching directories.
-      std::set<kj::String> seen;
-      for (auto& child: mapping.virtualChildren) {
-        seen.insert(kj::mv(child));
-      }
-      for (auto& target: mapping.sourcePaths) {
-        if (isDirectory(target)) {
-          // This is one of the directories to be merged. List it.
-          for (auto& child: listDirectory(target)) {
-            if (child != "." && child != "..") {
-              seen.insert(kj::mv(child));
-            }
+    if (recursive) {
+      // If the primary match is a directory, merge all of the matching directories.
+      KJ_IF_MAYBE(children, sourceIndex.listDirectory(srcPath)) {
+        for (auto& child: *children) {
+          // Note that this child node could be hidden. We need to map it directly in order to
+          // make sure it maps to a real file.
+          auto subPath = srcPath.size() == 0 ?
+              kj::str(child) : kj::str(srcPath, '/', child);
+          auto subMapping = sourceIndex.map(subPath);
+          if (child == PACK_CACHE_NAME && subMapping.sourcePaths.size() > 0 &&
+              isPackCacheDir(subMapping.sourcePaths[0])) {
+            // A source map that includes the package definition's directory would otherwise
+            // pack our own block cache.
+            continue;
           }
+          initNode(node.followPath(child), subPath, kj::mv(subMapping), sourceIndex,
+                   recursive);
         }
       }
+    }
 
-      for (auto& child: seen) {
-        // Note that this child node could be hidden. We need to use mapFile() on it directly
-        // in order to make sure it maps to a real file.
-        auto subPath = srcPath.size() == 0 ?
-            kj::str(child) : kj::str(srcPath, '/', child);
-        auto subMapping = mapFile(sourceDir, sourceMap, subPath);
-        initNode(node.followPath(child), subPath, kj::mv(subMapping), sourceMap,
-                 recursive);
-      }
+    if (mapping.sourcePaths.size() > 0) {
+      node.setTarget(kj::mv(mapping.sourcePaths[0]));
     }
+  }
+
+  kj::String getPackCacheDir() {
+    // The cache of compressed blocks lives next to the package definition.
+    return sourceDir == nullptr ? kj::heapString(PACK_CACHE_NAME)
+                                : kj::str(sourceDir, '/', PACK_CACHE_NAME);
+  }
 
-    node.setTarget(kj::mv(mapping.sourcePaths[0]));
+  bool isPackCacheDir(kj::StringPtr path) {
+    struct stat cacheStats, stats;
+    return stat(getPackCacheDir().cStr(), &cacheStats) == 0 && stat(path.cStr(), &stats) == 0 &&
+           cacheStats.st_dev == stats.st_dev && cacheStats.st_ino == stats.st_ino;
   }
 
   kj::String getHttpBridgeExe() {
@@ -1259,12 +2058,22 @@ private:
   // =====================================================================================
 
   kj::String dirname;
+  kj::String storeDir;
 
   kj::MainFunc getUnpackMain() {
     return kj::MainBuilder(context, "Sandstorm version " SANDSTORM_VERSION,
             "Check that <spkfile>'s signature is valid.  If so, unpack it to <outdir> and "
             "print the app ID and filename.  If <outdir> is not specified, it will be "
             "chosen by removing the suffix \".spk\" from the input file name.")
+        .addOptionWithArg({'j', "threads"}, KJ_BIND_METHOD(*this, setThreadCount), "<count>",
+            "Use up to <count> threads for decompression and for writing files. Defaults to the "
+            "number of CPUs, up to 8.")
+        .addOptionWithArg({"store"}, KJ_BIND_METHOD(*this, setUnpackStore), "<dir>",
+            "Deduplicate file contents against the content-addressed object store <dir> "
+            "(created if needed), hardlinking unpacked files to shared copies. <dir> must be on "
+            "the same filesystem as <outdir>. Unpacked files are then read-only, and a file's "
+            "modification time may be that of an earlier package with the same content. Use "
+            "`spk gc-store` to reclaim objects after deleting packages.")
         .expectArg("<spkfile>", KJ_BIND_METHOD(*this, setUnpackSpkfile))
         .expectOptionalArg("<outdir>", KJ_BIND_METHOD(*this, setUnpackDirname))
         .callAfterParsing(KJ_BIND_METHOD(*this, doUnpack))
@@ -1284,6 +2093,11 @@ private:
     return true;
   }
 
+  kj::MainBuilder::Validity setUnpackStore(kj::StringPtr name) {
+    storeDir = kj::heapString(name);
+    return true;
+  }
+
   kj::MainBuilder::Validity setUnpackDirname(kj::StringPtr name) {
     if (access(name.cStr(), F_OK) == 0) {
       return "Already exists.";
@@ -1302,10 +2116,107 @@ private:
       return "Output directory already exists.";
     }
 
+    if (isIndexedSpk(raiiOpen(spkfile, O_RDONLY))) {
+      unpackIndexed();
+      return true;
+    }
+
     byte publicKey[crypto_sign_PUBLICKEYBYTES];
+    kj::AutoCloseFd tmpfile;
+    MemoryMapping tmpMapping = openVerifiedArchive(publicKey, &tmpfile);
+
+    // Set up archive reader.
+    kj::ArrayPtr<const capnp::word> tmpWords = tmpMapping;
+    capnp::ReaderOptions options;
+    options.traversalLimitInWords = tmpWords.size();
+    capnp::FlatArrayMessageReader archiveMessage(tmpWords, options);
+
+    extractToDirname(tmpMapping, tmpfile, [&](ArchiveExtractor& extractor) {
+      extractor.addDirectory(archiveMessage.getRoot<spk::Archive>().getFiles(), "");
+    });
+
+    // Note the appid.
+    printAppId(publicKey);
+
+    return true;
+  }
+
+  void unpackIndexed() {
+    IndexedSpkReader reader(raiiOpen(spkfile, O_RDONLY));
+    auto index = reader.getIndex();
+
+    uint64_t contentSize = index.getContentSize();
+    if (contentSize > APP_SIZE_LIMIT) {
+      validationError(spkfile, "App too big after decompress.");
+    }
+
+    // Decompress all blocks in parallel into a temp file, then extract from there just like the
+    // original format.
+    auto tmpfile = openTemporary(spkfile);
+    KJ_SYSCALL(ftruncate(tmpfile, contentSize));
+    kj::ArrayPtr<byte> content;
+    if (contentSize > 0) {
+      void* ptr = mmap(nullptr, contentSize, PROT_READ | PROT_WRITE, MAP_SHARED, tmpfile, 0);
+      if (ptr == MAP_FAILED) {
+        KJ_FAIL_SYSCALL("mmap", errno);
+      }
+      content = kj::arrayPtr(reinterpret_cast<byte*>(ptr), contentSize);
+    }
+    KJ_DEFER(if (content.size() > 0) munmap(content.begin(), content.size()));
+
+    reader.readAll(content, threadCount);
+
+    extractToDirname(content, tmpfile, [&](ArchiveExtractor& extractor) {
+      extractor.addDirectory(index.getFiles(), "");
+    });
+
+    printAppId(reader.getPublicKey());
+  }
+
+  template <typename Func>
+  void extractToDirname(kj::ArrayPtr<const byte> archive, int archiveFd, Func&& addFiles) {
+    // Unpack into a staging directory beside the destination and only rename it into place once
+    // everything has been written, so that a failed unpack never leaves a partial tree behind.
+    auto stagingDir = kj::str(dirname, ".unpacking-", getpid());
+    KJ_SYSCALL(mkdir(stagingDir.cStr(), 0777), stagingDir);
+    bool committed = false;
+    KJ_DEFER(if (!committed) recursivelyDelete(stagingDir));
+
+    {
+      auto rootFd = raiiOpen(stagingDir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      ArchiveExtractor extractor(archive, archiveFd, rootFd);
+      kj::AutoCloseFd storeFd;
+      if (storeDir != nullptr) {
+        while (mkdir(storeDir.cStr(), 0755) < 0) {
+          int error = errno;
+          if (error == EEXIST) break;
+          if (error != EINTR) KJ_FAIL_SYSCALL("mkdir", error, storeDir);
+        }
+        storeFd = raiiOpen(storeDir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        extractor.setStore(storeFd);
+      }
+      addFiles(extractor);
+      extractor.run(threadCount);
+    }
+
+    // Another unpack to the same target may have beaten us to it.
+    KJ_REQUIRE(renameNoReplace(stagingDir, dirname), "Output directory already exists.", dirname);
+    committed = true;
+  }
+
+  MemoryMapping openVerifiedArchive(byte (&publicKey)[crypto_sign_PUBLICKEYBYTES],
+                                    kj::AutoCloseFd* tmpfileOut = nullptr) {
+    // Check the signature on `spkfile`, decompress its archive into a temporary file, and check
+    // the archive against the signature. Returns the archive mapped into memory and fills in
+    // `publicKey`. Exits with an error if anything doesn't check out. If `tmpfileOut` is given,
+    // the (unlinked) temp file is returned through it so the caller can reclaim its space early.
+
     byte sigBytes[crypto_hash_BYTES + crypto_sign_BYTES];
     byte expectedHash[sizeof(sigBytes)];
     unsigned long long hashLength = 0;  // will be overwritten later
+    byte hash[crypto_hash_BYTES];
+    uint32_t chunkSize = 0;
+    kj::Array<byte> chunkHashes;
 
     auto tmpfile = openTemporary(spkfile);
 
@@ -1315,9 +2226,8 @@ private:
       // Open the spk.
       auto spkfd = raiiOpen(spkfile, O_RDONLY);
 
-      // TODO(security):  We could at this point chroot into the output directory and unshare
-      //   various resources for extra security, if not for the fact that we need to invoke xz
-      //   later on.  Maybe link against the xz library so that we don't have to exec it?
+      // TODO(security):  Now that decompression happens in-process, we could at this point
+      //   chroot into the output directory and unshare various resources for extra security.
 
       // Check the magic number.
       auto expectedMagic = spk::MAGIC_NUMBER.get();
@@ -1325,13 +2235,12 @@ private:
       kj::FdInputStream(spkfd.get()).read(magic, expectedMagic.size());
       for (uint i: kj::indices(expectedMagic)) {
         if (magic[i] != expectedMagic[i]) {
-          return validationError(spkfile, "Does not appear to be an .spk (bad magic number).");
+          validationError(spkfile, "Does not appear to be an .spk (bad magic number).");
         }
       }
 
-      // Decompress the remaining bytes in the SPK using xz.
-      auto child = kj::heap<ChildProcess>("xz", "-dc", kj::mv(spkfd), ChildProcess::INPUT);
-      kj::FdInputStream in(child->getPipe());
+      // Decompress the remaining bytes in the SPK.
+      XzInputStream in(spkfd, threadCount);
 
       // Read in the signature.
       {
@@ -1340,126 +2249,363 @@ private:
         auto signature = signatureMessage.getRoot<spk::Signature>();
         auto pkReader = signature.getPublicKey();
         if (pkReader.size() != sizeof(publicKey)) {
-          return validationError(spkfile, "Invalid public key.");
+          validationError(spkfile, "Invalid public key.");
         }
         memcpy(publicKey, pkReader.begin(), sizeof(publicKey));
         auto sigReader = signature.getSignature();
         if (sigReader.size() != sizeof(sigBytes)) {
-          return validationError(spkfile, "Invalid signature format.");
+          validationError(spkfile, "Invalid signature format.");
         }
         memcpy(sigBytes, sigReader.begin(), sizeof(sigBytes));
+
+        chunkSize = signature.getChunkSize();
+        if (chunkSize != 0) {
+          auto hashesReader = signature.getChunkHashes();
+          if (chunkSize < MIN_SIGNATURE_CHUNK_SIZE || chunkSize > MAX_SIGNATURE_CHUNK_SIZE ||
+              hashesReader.size() == 0 || hashesReader.size() % crypto_hash_BYTES != 0 ||
+              hashesReader.size() / crypto_hash_BYTES > APP_SIZE_LIMIT / chunkSize + 1) {
+            validationError(spkfile, "Invalid signature format.");
+          }
+          chunkHashes = kj::heapArray<byte>(hashesReader.begin(), hashesReader.size());
+        }
       }
 
       // Verify the signature.
       int result = crypto_sign_open(
           expectedHash, &hashLength, sigBytes, sizeof(sigBytes), publicKey);
       if (result != 0) {
-        return validationError(spkfile, "Invalid signature.");
+        validationError(spkfile, "Invalid signature.");
       }
       if (hashLength != crypto_hash_BYTES) {
-        return validationError(spkfile, "Wrong signature size.");
+        validationError(spkfile, "Wrong signature size.");
       }
 
-      // Copy archive part to a temp file.
       kj::FdOutputStream tmpOut(tmpfile.get());
-      uint64_t totalRead = 0;
-      for (;;) {
-        byte buffer[8192];
-        size_t n = in.tryRead(buffer, 1, sizeof(buffer));
-        if (n == 0) break;
-        totalRead += n;
-        KJ_REQUIRE(totalRead <= APP_SIZE_LIMIT, "App too big after decompress.");
-        tmpOut.write(buffer, n);
+      if (chunkSize == 0) {
+        // Copy archive part to a temp file, hashing it as it goes by so that we don't need a
+        // second pass over the mapping.
+        static_assert(crypto_hash_BYTES == crypto_hash_sha512_BYTES,
+                      "crypto_hash is expected to be SHA-512");
+        crypto_hash_sha512_state hashState;
+        crypto_hash_sha512_init(&hashState);
+
+        kj::Array<byte> buffer = kj::heapArray<byte>(1 << 20);
+        uint64_t totalRead = 0;
+        for (;;) {
+          size_t n = in.tryRead(buffer.begin(), 1, buffer.size());
+          if (n == 0) break;
+          totalRead += n;
+          KJ_REQUIRE(totalRead <= APP_SIZE_LIMIT, "App too big after decompress.");
+          crypto_hash_sha512_update(&hashState, buffer.begin(), n);
+          tmpOut.write(buffer.begin(), n);
+        }
+
+        crypto_hash_sha512_final(&hashState, hash);
+      } else {
+        // Chunked signature: the leaves are authenticated by checking their Merkle root against
+        // the signature up front, after which each chunk can be checked on its own as soon as
+        // it has been decompressed. Chunks are verified a window at a time in parallel, and
+        // nothing unverified is ever written out.
+        merkleRoot(hash, chunkHashes);
+        if (memcmp(expectedHash, hash, crypto_hash_BYTES) != 0) {
+          validationError(spkfile, "Signature didn't match package contents.");
+        }
+
+        size_t chunkCount = chunkHashes.size() / crypto_hash_BYTES;
+        size_t window = kj::max(threadCount, 1u) * 2;
+        kj::Array<byte> buffer = kj::heapArray<byte>(window * chunkSize);
+        auto matched = kj::heapArray<bool>(window);
+        size_t chunksRead = 0;
+        uint64_t totalRead = 0;
+        for (;;) {
+          // Fill the whole window unless we hit EOF, so that every chunk but the last is full.
+          size_t n = in.tryRead(buffer.begin(), buffer.size(), buffer.size());
+          totalRead += n;
+          KJ_REQUIRE(totalRead <= APP_SIZE_LIMIT, "App too big after decompress.");
+
+          size_t count = (n + chunkSize - 1) / chunkSize;
+          if (chunksRead + count > chunkCount) {
+            validationError(spkfile, "Signature didn't match package contents.");
+          }
+
+          parallelFor(count, threadCount, [&](size_t i) {
+            auto chunk = buffer.slice(i * chunkSize, kj::min((i + 1) * chunkSize, n));
+            kj::ArrayPtr<const byte> pieces[1] = { chunk };
+            byte leaf[crypto_hash_BYTES];
+            hashChunk(leaf, kj::arrayPtr(pieces, 1));
+            matched[i] = memcmp(leaf, chunkHashes.begin() + (chunksRead + i) * crypto_hash_BYTES,
+                                crypto_hash_BYTES) == 0;
+          });
+          for (size_t i = 0; i < count; i++) {
+            if (!matched[i]) {
+              validationError(spkfile, "Signature didn't match package contents.");
+            }
+          }
+
+          tmpOut.write(buffer.begin(), n);
+          chunksRead += count;
+          if (n < buffer.size()) break;
+        }
+
+        if (chunksRead != chunkCount) {
+          validationError(spkfile, "Signature didn't match package contents.");
+        }
       }
     }
 
     // mmap the temp file.
     MemoryMapping tmpMapping(tmpfile, "(temp file)");
-    tmpfile = nullptr;  // We have the mapping now; don't need the fd.
-
-    // Hash the archive.
-    kj::ArrayPtr<const byte> tmpBytes = tmpMapping;
-    byte hash[crypto_hash_BYTES];
-    crypto_hash(hash, tmpBytes.begin(), tmpBytes.size());
+    if (tmpfileOut == nullptr) {
+      tmpfile = nullptr;  // We have the mapping now; don't need the fd.
+    } else {
+      *tmpfileOut = kj::mv(tmpfile);
+    }
 
     // Check that hashes match.
     if (memcmp(expectedHash, hash, crypto_hash_BYTES) != 0) {
-      return validationError(spkfile, "Signature didn't match package contents.");
+      validationError(spkfile, "Signature didn't match package contents.");
     }
 
-    // Set up archive reader.
-    kj::ArrayPtr<const capnp::word> tmpWords = tmpMapping;
-    capnp::ReaderOptions options;
-    options.traversalLimitInWords = tmpWords.size();
-    capnp::FlatArrayMessageReader archiveMessage(tmpWords, options);
+    return tmpMapping;
+  }
 
-    // Unpack.
-    KJ_SYSCALL(mkdir(dirname.cStr(), 0777), dirname);
-    unpackDir(archiveMessage.getRoot<spk::Archive>().getFiles(), dirname);
+  // =====================================================================================
+  // "cat" command
 
-    // Note the appid.
-    printAppId(publicKey);
+  kj::String catPath;
 
-    return true;
+  kj::MainFunc getCatMain() {
+    return kj::MainBuilder(context, "Sandstorm version " SANDSTORM_VERSION,
+            "Check that <spkfile>'s signature is valid.  If so, write the content of the file "
+            "at <path> within it to standard output.  If <path> is a symlink, print its "
+            "target; if it is a directory, list its entries.  For packages in the indexed "
+            "format (see `spk pack --indexed`), only the parts of the package covering <path> "
+            "are read; other packages have to be decompressed in full first.  Use the path "
+            "`sandstorm-manifest` to get the package's (binary) manifest.")
+        .expectArg("<spkfile>", KJ_BIND_METHOD(*this, setUnpackSpkfile))
+        .expectArg("<path>", KJ_BIND_METHOD(*this, setCatPath))
+        .callAfterParsing(KJ_BIND_METHOD(*this, doCat))
+        .build();
   }
 
-  void unpackDir(capnp::List<spk::Archive::File>::Reader files, kj::StringPtr dirname) {
-    std::set<kj::StringPtr> seen;
-
-    for (auto file: files) {
-      kj::StringPtr name = file.getName();
-      KJ_REQUIRE(name.size() != 0 && name != "." && name != ".." &&
-                 name.findFirst('/') == nullptr && name.findFirst('\0') == nullptr,
-                 "Archive contained invalid file name.", name);
+  kj::MainBuilder::Validity setCatPath(kj::StringPtr path) {
+    while (path.startsWith("/")) path = path.slice(1);
+    catPath = kj::heapString(path);
+    return true;
+  }
 
-      KJ_REQUIRE(seen.insert(name).second, "Archive contained duplicate file name.", name);
+  kj::MainBuilder::Validity doCat() {
+    kj::FdOutputStream out(STDOUT_FILENO);
 
-      auto path = kj::str(dirname, '/', name);
+    auto spkfd = raiiOpen(spkfile, O_RDONLY);
+    if (isIndexedSpk(spkfd)) {
+      IndexedSpkReader reader(kj::mv(spkfd));
 
-      KJ_ASSERT(access(path.cStr(), F_OK) != 0, "Unpacked file already exists.", path);
+      KJ_IF_MAYBE(file, reader.find(catPath)) {
+        switch (file->which()) {
+          case spk::PackageIndex::File::REGULAR: {
+            auto content = reader.read(file->getRegular());
+            out.write(content.begin(), content.size());
+            break;
+          }
+          case spk::PackageIndex::File::EXECUTABLE: {
+            auto content = reader.read(file->getExecutable());
+            out.write(content.begin(), content.size());
+            break;
+          }
+          case spk::PackageIndex::File::SYMLINK: {
+            auto text = kj::str(file->getSymlink(), '\n');
+            out.write(text.begin(), text.size());
+            break;
+          }
+          case spk::PackageIndex::File::DIRECTORY:
+            for (auto child: file->getDirectory()) {
+              auto text = kj::str(child.getName(), '\n');
+              out.write(text.begin(), text.size());
+            }
+            break;
+          default:
+            KJ_FAIL_REQUIRE("Unknown file type in archive.");
+        }
+        return true;
+      } else {
+        return "No such file in package.";
+      }
+    }
 
-      switch (file.which()) {
-        case spk::Archive::File::REGULAR: {
-          auto bytes = file.getRegular();
-          kj::FdOutputStream(raiiOpen(path, O_WRONLY | O_CREAT | O_EXCL, 0666))
-              .write(bytes.begin(), bytes.size());
+    spkfd = nullptr;
+    byte publicKey[crypto_sign_PUBLICKEYBYTES];
+    MemoryMapping mapping = openVerifiedArchive(publicKey);
+    kj::ArrayPtr<const capnp::word> words = mapping;
+    capnp::ReaderOptions options;
+    options.traversalLimitInWords = words.size();
+    capnp::FlatArrayMessageReader archiveMessage(words, options);
+
+    auto files = archiveMessage.getRoot<spk::Archive>().getFiles();
+    auto parts = split(catPath, '/');
+    for (uint i: kj::indices(parts)) {
+      kj::Maybe<spk::Archive::File::Reader> match;
+      for (auto file: files) {
+        auto name = file.getName();
+        if (name.size() == parts[i].size() &&
+            memcmp(name.begin(), parts[i].begin(), name.size()) == 0) {
+          match = file;
           break;
         }
+      }
 
-        case spk::Archive::File::EXECUTABLE: {
-          auto bytes = file.getExecutable();
-          kj::FdOutputStream(raiiOpen(path, O_WRONLY | O_CREAT | O_EXCL, 0777))
-              .write(bytes.begin(), bytes.size());
-          break;
+      KJ_IF_MAYBE(file, match) {
+        if (i + 1 < parts.size()) {
+          if (!file->isDirectory()) return "No such file in package.";
+          files = file->getDirectory();
+          continue;
         }
 
-        case spk::Archive::File::SYMLINK: {
-          KJ_SYSCALL(symlink(file.getSymlink().cStr(), path.cStr()), path);
-          break;
+        switch (file->which()) {
+          case spk::Archive::File::REGULAR: {
+            auto content = file->getRegular();
+            out.write(content.begin(), content.size());
+            break;
+          }
+          case spk::Archive::File::EXECUTABLE: {
+            auto content = file->getExecutable();
+            out.write(content.begin(), content.size());
+            break;
+          }
+          case spk::Archive::File::SYMLINK: {
+            auto text = kj::str(file->getSymlink(), '\n');
+            out.write(text.begin(), text.size());
+            break;
+          }
+          case spk::Archive::File::DIRECTORY:
+            for (auto child: file->getDirectory()) {
+              auto text = kj::str(child.getName(), '\n');
+              out.write(text.begin(), text.size());
+            }
+            break;
+          default:
+            KJ_FAIL_REQUIRE("Unknown file type in archive.");
         }
+        return true;
+      } else {
+        return "No such file in package.";
+      }
+    }
 
-        case spk::Archive::File::DIRECTORY: {
-          KJ_SYSCALL(mkdir(path.cStr(), 0777), path);
-          unpackDir(file.getDirectory(), path);
-          break;
+    return "No such file in package.";
+  }
+
+  // =====================================================================================
+  // "gc-store" command
+
+  kj::MainFunc getGcStoreMain() {
+    return kj::MainBuilder(context, "Sandstorm version " SANDSTORM_VERSION,
+            "Delete objects from the package store <dir> which are no longer used by any "
+            "package unpacked with `spk unpack --store=<dir>`, and print how much was freed. "
+            "Safe to run while unpacks are in progress.")
+        .expectArg("<dir>", KJ_BIND_METHOD(*this, doGcStore))
+        .build();
+  }
+
+  kj::MainBuilder::Validity doGcStore(kj::StringPtr dir) {
+    if (!isDirectory(dir)) {
+      return "Not a directory.";
+    }
+
+    time_t now = time(nullptr);
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+
+    for (auto& prefix: listDirectory(dir)) {
+      auto prefixPath = kj::str(dir, '/', prefix);
+      if (!isDirectory(prefixPath)) continue;
+
+      for (auto& name: listDirectory(prefixPath)) {
+        auto path = kj::str(prefixPath, '/', name);
+        // Entries can vanish under us: a concurrent unpack renames its temp files into place, and
+        // another gc-store may be running too.
+        struct stat stats;
+        if (lstat(path.cStr(), &stats) < 0) {
+          int error = errno;
+          if (error == ENOENT) continue;
+          KJ_FAIL_SYSCALL("lstat", error, path);
         }
 
-        default:
-          KJ_FAIL_REQUIRE("Unknown file type in archive.");
+        // Every unpacked copy of an object is a hardlink to it, so once only the store's own link
+        // remains, nothing uses it. A racing unpack that loses its object this way just adds it
+        // again. Temp files are left behind only by interrupted unpacks; give them an hour.
+        bool garbage = strstr(name.cStr(), ".tmp-") == nullptr
+            ? stats.st_nlink <= 1
+            : stats.st_ctime < now - 3600;
+        if (garbage) {
+          if (unlink(path.cStr()) < 0) {
+            int error = errno;
+            if (error == ENOENT) continue;
+            KJ_FAIL_SYSCALL("unlink", error, path);
+          }
+          ++count;
+          bytes += stats.st_size;
+        }
       }
+    }
 
-      struct timespec times[2];
-      auto ns = file.getLastModificationTimeNs();
-      times[0].tv_sec = ns / 1000000000ll;
-      times[0].tv_nsec = ns % 1000000000ll;
-      if (times[0].tv_nsec < 0) {
-        // C division rounds towards zero. :(
-        ++times[0].tv_sec;
-        times[0].tv_nsec += 1000000000ll;
-      }
-      times[1] = times[0];  // Also use mtime as atime.
-      KJ_SYSCALL(utimensat(AT_FDCWD, path.cStr(), times, AT_SYMLINK_NOFOLLOW));
+    context.exitInfo(kj::str("removed ", count, " objects (", bytes, " bytes)"));
+  }
+
+  // =====================================================================================
+  // "mount" command
+
+  kj::MainFunc getMountMain() {
+    return kj::MainBuilder(context, "Sandstorm version " SANDSTORM_VERSION,
+            "Check that <spkfile>'s signature is valid.  If so, print the app ID and mount the "
+            "package's contents read-only at <dir>, serving them directly out of the archive "
+            "rather than unpacking them to disk.  Runs until interrupted with Ctrl+C.")
+        .addOptionWithArg({'j', "threads"}, KJ_BIND_METHOD(*this, setThreadCount), "<count>",
+            "Use up to <count> threads for decompression. Defaults to the number of CPUs, up "
+            "to 8.")
+        .expectArg("<spkfile>", KJ_BIND_METHOD(*this, setUnpackSpkfile))
+        .expectArg("<dir>", KJ_BIND_METHOD(*this, setMountDir))
+        .callAfterParsing(KJ_BIND_METHOD(*this, doMount))
+        .build();
+  }
+
+  kj::MainBuilder::Validity doMount() {
+    kj::UnixEventPort::captureSignal(SIGINT);
+    kj::UnixEventPort::captureSignal(SIGTERM);
+
+    if (isIndexedSpk(raiiOpen(spkfile, O_RDONLY))) {
+      return "Mounting packages in the indexed format isn't supported yet. Use `spk unpack`.";
     }
+
+    byte publicKey[crypto_sign_PUBLICKEYBYTES];
+    auto archive = openVerifiedArchive(publicKey);
+    printAppId(publicKey);
+
+    kj::UnixEventPort eventPort;
+    kj::EventLoop eventLoop(eventPort);
+    kj::WaitScope waitScope(eventLoop);
+
+    auto rootNode = newArchiveFuseNode(kj::mv(archive));
+
+    FuseMount mount(mountDir, "ro");
+
+    // The archive can't change, so the kernel may cache everything indefinitely.
+    FuseOptions options;
+    options.cacheForever = true;
+
+    context.warning("Package mounted. Ctrl+C to unmount.");
+
+    bindFuse(eventPort, mount.getFd(), kj::mv(rootNode), options)
+        .then([&]() {
+          // Someone else unmounted us.
+          mount.dontUnmount();
+        })
+        .exclusiveJoin(eventPort.onSignal(SIGINT)
+            .exclusiveJoin(eventPort.onSignal(SIGTERM))
+            .then([](siginfo_t&& sig) {}))
+        .wait(waitScope);
+
+    return true;
   }
 
   // =====================================================================================
@@ -1487,8 +2633,10 @@ private:
             "at it.")
         .addOption({'c', "cache"}, KJ_BIND_METHOD(*this, enableFuseCaching),
             "Enable aggressive caching over the FUSE filesystem used to detect dependencies. "
-            "This may improve performance but means that you will have to restart `spk dev` "
-            "any time you make a change to your code.")
+            "This may improve performance significantly. Your source directories (search path "
+            "entries with relative paths) are watched with inotify so that changes to your "
+            "code still show up live, but you will have to restart `spk dev` to notice changes "
+            "anywhere else, such as to system files.")
         .callAfterParsing(KJ_BIND_METHOD(*this, doDev)))
         .build();
   }
@@ -1620,15 +2768,19 @@ private:
       kj::Function<void(kj::StringPtr)> callback = [&](kj::StringPtr path) {
         usedFiles.insert(kj::heapString(path));
       };
+      // Watching is only needed to keep the caches coherent.
+      kj::Maybe<kj::UnixEventPort&> watchPort;
+      if (fuseCaching) watchPort = eventPort;
       auto rootNode = makeUnionFs(sourceDir, packageDef.getSourceMap(), packageDef.getManifest(),
-                                  packageDef.getBridgeConfig(), getHttpBridgeExe(), callback);
+                                  packageDef.getBridgeConfig(), getHttpBridgeExe(), callback,
+                                  watchPort);
 
       FuseOptions options;
 
       // Caching improves performance significantly... but the ability to update code and see those
-      // updates live without restarting seems more important for this use case.
-      // TODO(perf): Implement active cache invalidation. FUSE has protocol support for it. Use
-      //   inotify at the other end to detect changes.
+      // updates live without restarting seems more important for this use case. With caching on,
+      // the union filesystem watches the source directories with inotify and the FUSE driver
+      // invalidates whatever changes there, but nothing else is watched.
       options.cacheForever = fuseCaching;
 
       auto onSignal = eventPort.onSignal(SIGINT)
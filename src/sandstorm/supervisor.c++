@@ -22,7 +22,9 @@
 #include <kj/async-unix.h>
 #include <kj/io.h>
 #include <capnp/rpc-twoparty.h>
+#include <capnp/serialize.h>
 #include <capnp/rpc.capnp.h>
+#include <capnp/schema.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -50,7 +52,10 @@
 #include <grp.h>
 #include <sys/inotify.h>
 #include <seccomp.h>
+#include <linux/seccomp.h>
+#include <linux/filter.h>
 #include <map>
+#include <algorithm>
 #include <unordered_map>
 #include <execinfo.h>
 #include <linux/netlink.h>
@@ -76,6 +81,12 @@ namespace sandstorm {
 class DiskUsageWatcher {
   // Class which watches a directory tree, counts up the total disk usage, and fires events when
   // it changes. Uses inotify. Which turns out to be... harder than it should be.
+  //
+  // The per-directory listings are saved to INDEX_FILE from time to time and on shutdown, so that
+  // on the next start directories whose ctime hasn't changed needn't be listed again. (Their
+  // children are still stat()ed, since a file can change size without touching its directory.)
+  // Directories which can't be watched because we've run out of inotify watches are polled in the
+  // background instead, a bounded amount at a time.
 
 public:
   DiskUsageWatcher(kj::UnixEventPort& eventPort): eventPort(eventPort) {}
@@ -83,9 +94,6 @@ public:
   kj::Promise<void> init() {
     // Start watching the current directory.
 
-    // Note: this function is also called to restart watching from scratch when the inotify event
-    //   queue overflows (hopefully rare).
-
     int fd;
     KJ_SYSCALL(fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
     inotifyFd = kj::AutoCloseFd(fd);
@@ -98,12 +106,35 @@ public:
 
     totalSize = 0;
     watchMap.clear();
+
+    // Walk the whole tree now, consulting the saved index, which we don't need afterwards. If
+    // every directory matched its saved listing, and no saved directory has gone away, there's
+    // no need to write the index again.
+    loadIndex();
+    directoriesFromIndex = 0;
     pendingWatches.add(nullptr);  // root directory
-    return readLoop();
+    addPendingWatches();
+    if (directoriesFromIndex != savedDirectories.size()) indexDirty = true;
+    savedDirectories.clear();
+    savedIndex = nullptr;
+
+    return readLoop()
+        .exclusiveJoin(pollLoop())
+        .exclusiveJoin(saveLoop());
   }
 
   uint64_t getSize() { return totalSize; }
 
+  void saveIfChanged() {
+    // Save the index now if anything has changed since it was last saved. Call before exiting.
+
+    if (indexDirty) {
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([this]() { saveIndex(); })) {
+        KJ_LOG(WARNING, "couldn't save disk usage index", *exception);
+      }
+    }
+  }
+
   kj::Promise<uint64_t> getSizeWhenChanged(uint64_t oldSize) {
     kj::Promise<void> trigger = nullptr;
     if (totalSize == oldSize) {
@@ -124,6 +155,20 @@ public:
   }
 
 private:
+  static constexpr const char* INDEX_FILE = "disk-usage";
+  static constexpr const char* INDEX_TEMP_FILE = "disk-usage.next";
+  // Where the index is saved, in the directory being watched. These are left out of the count,
+  // since otherwise saving the index would itself change the size.
+
+  static constexpr kj::Duration SAVE_INTERVAL = 60 * kj::SECONDS;
+  // How often to save the index, if anything has changed. If the supervisor is killed, the next
+  // start may have to list a few more directories, but never gets a size wrong, since sizes are
+  // always taken from disk.
+
+  static constexpr kj::Duration POLL_INTERVAL = 10 * kj::SECONDS;
+  static constexpr uint POLL_BUDGET = 1000;
+  // Every POLL_INTERVAL, stat() up to about POLL_BUDGET entries of directories we couldn't watch.
+
   kj::UnixEventPort& eventPort;
   kj::AutoCloseFd inotifyFd;
   kj::Own<kj::UnixEventPort::FdObserver> observer;
@@ -135,19 +180,54 @@ private:
   struct ChildInfo {
     kj::String name;
     uint64_t size;
+    bool isDir;
   };
   struct WatchInfo {
     kj::String path;  // null = root directory
-    std::map<kj::StringPtr, ChildInfo> childSizes;
+
+    kj::Vector<ChildInfo> children;
+    // Sorted by name. Grains can have very many files, and a sorted array takes a fraction of the
+    // memory of a map while still allowing binary search.
+
+    int64_t changeTime = 0;
+    // The directory's ctime in nanoseconds when `children` was last listed from disk, or zero
+    // if entries may have been added or removed since.
   };
   std::unordered_map<int, WatchInfo> watchMap;
-  // Maps inotify watch descriptors to info about what is being watched.
+  // Maps inotify watch descriptors to info about what is being watched. Directories which are
+  // polled rather than watched get negative keys.
+
+  std::map<kj::StringPtr, int> polledPaths;
+  // Keys of polled directories in `watchMap`, by path. Keys point into `WatchInfo::path`, except
+  // that the root directory's is "".
+
+  int nextPollKey = -1;
+  kj::String lastPolled;  // key in `polledPaths` where the poller left off
+
+  bool indexDirty = false;
+  // Whether any directory's listing (the names of its children, or its ctime) has changed since
+  // the index was last saved or loaded. Sizes aren't saved, so they don't count.
+
+  kj::Own<capnp::MessageReader> savedIndex;
+  std::map<kj::StringPtr, DiskUsageIndex::Directory::Reader> savedDirectories;
+  // The index saved by a previous run, while we're starting up.
+
+  size_t directoriesFromIndex = 0;
+  // Number of directories populated from `savedDirectories` rather than listed from disk.
 
   kj::Vector<kj::String> pendingWatches;
   // Directories we would like to watch, but we can't add watches on them just yet because we need
   // to finish processing a list of events received from inotify before we mess with the watch
   // descriptor table.
 
+  static kj::StringPtr pathKey(const kj::String& path) {
+    return path == nullptr ? kj::StringPtr("") : kj::StringPtr(path);
+  }
+
+  static int64_t changeTimeOf(const struct stat& stats) {
+    return stats.st_ctim.tv_sec * 1000000000ll + stats.st_ctim.tv_nsec;
+  }
+
   void addPendingWatches() {
     // Start watching everything that has been added to the pendingWatches list.
 
@@ -173,6 +253,21 @@ private:
           FLAGS | IN_DONT_FOLLOW | IN_EXCL_UNLINK);
 
       if (wd >= 0) {
+        auto existing = watchMap.find(wd);
+        if (existing != watchMap.end() && pathKey(existing->second.path) == pathKey(path) &&
+            isUpToDate(existing->second)) {
+          // We're already watching this directory under this path and nothing has been added or
+          // removed since it was listed, so there's nothing to do. This avoids relisting whole
+          // subtrees when relisting their parents (e.g. after a rescan) finds them again.
+          return;
+        }
+
+        // If we had been polling this path, we needn't any more.
+        auto polled = polledPaths.find(pathKey(path));
+        if (polled != polledPaths.end()) {
+          removeWatchInfo(watchMap.find(polled->second));
+        }
+
         WatchInfo& watchInfo = watchMap[wd];
 
         // Update the watch map. Note that it's possible that inotify_add_watch() returned a
@@ -181,36 +276,9 @@ private:
         // actually exactly what we want to do in these cases anyway.
         watchInfo.path = kj::mv(path);
 
-        // In the case that we are reusing an existing watch descriptor, we want to clear out the
-        // existing contents as they may be stale due to, again, race conditions.
-        for (auto& child: watchInfo.childSizes) {
-          totalSize -= child.second.size;
-        }
-        watchInfo.childSizes.clear();
-
-        // Now repopulate the children by listing the directory.
-        DIR* dir = opendir(pathPtr);
-        if (dir != nullptr) {
-          KJ_DEFER(closedir(dir));
-          for (;;) {
-            errno = 0;
-            struct dirent* entry = readdir(dir);
-            if (entry == nullptr) {
-              int error = errno;
-              if (error == 0) {
-                break;
-              } else {
-                KJ_FAIL_SYSCALL("readdir", error, pathPtr);
-              }
-            }
-
-            kj::StringPtr name = entry->d_name;
-            if (name != "." && name != "..") {
-              childEvent(watchInfo, name);
-            }
-          }
-        }
-
+        // In the case that we are reusing an existing watch descriptor, the existing contents
+        // may be stale due to, again, race conditions, so they are replaced.
+        populate(watchInfo);
         return;
       }
 
@@ -228,15 +296,136 @@ private:
           return;
 
         case ENOSPC:
-          // No more inotify watches available.
-          // TODO(someday): Revert to some sort of polling mode? For now, fall through to error
-          //   case.
+          // No more inotify watches available. Poll this directory instead.
+          addPolled(kj::mv(path));
+          return;
+
         default:
           KJ_FAIL_SYSCALL("inotify_add_watch", error, path);
       }
     }
   }
 
+  bool isUpToDate(WatchInfo& watchInfo) {
+    if (watchInfo.changeTime == 0) return false;
+    const char* pathPtr = watchInfo.path == nullptr ? "." : watchInfo.path.cStr();
+    struct stat stats;
+    return lstat(pathPtr, &stats) >= 0 && changeTimeOf(stats) == watchInfo.changeTime;
+  }
+
+  void addPolled(kj::String&& path) {
+    auto iter = polledPaths.find(pathKey(path));
+    if (iter != polledPaths.end()) {
+      // Already polling this path. The poller will notice any changes soon enough, so no need
+      // to list it again.
+      return;
+    }
+
+    if (polledPaths.empty()) {
+      KJ_LOG(WARNING, "out of inotify watches; polling some directories instead", path);
+    }
+
+    int key = nextPollKey--;
+    WatchInfo& watchInfo = watchMap[key];
+    watchInfo.path = kj::mv(path);
+    polledPaths.insert(std::make_pair(pathKey(watchInfo.path), key));
+    populate(watchInfo);
+  }
+
+  void removeWatchInfo(std::unordered_map<int, WatchInfo>::iterator iter) {
+    // Forget a directory which no longer exists.
+
+    // There shouldn't be any children left, but if there are, go ahead and un-count them.
+    for (auto& child: iter->second.children) {
+      totalSize -= child.size;
+    }
+    if (iter->first < 0) {
+      polledPaths.erase(pathKey(iter->second.path));
+    }
+    watchMap.erase(iter);
+    indexDirty = true;
+  }
+
+  void populate(WatchInfo& watchInfo) {
+    // (Re)list the directory, replacing whatever we knew about its children -- or, if the saved
+    // index has a listing as new as the directory, take the children from there.
+
+    for (auto& child: watchInfo.children) {
+      totalSize -= child.size;
+    }
+    watchInfo.children.resize(0);
+    watchInfo.changeTime = 0;
+
+    const char* pathPtr = watchInfo.path == nullptr ? "." : watchInfo.path.cStr();
+    DIR* dir = opendir(pathPtr);
+    if (dir == nullptr) return;
+    KJ_DEFER(closedir(dir));
+
+    // Note the ctime before listing, so that any change made while we list shows up next time.
+    struct stat stats;
+    KJ_SYSCALL(fstat(dirfd(dir), &stats), pathPtr);
+    int64_t changeTime = changeTimeOf(stats);
+
+    auto saved = savedDirectories.find(pathKey(watchInfo.path));
+    if (saved != savedDirectories.end() && saved->second.getChangeTimeNs() == changeTime &&
+        loadSavedChildren(watchInfo, saved->second)) {
+      watchInfo.changeTime = changeTime;
+      ++directoriesFromIndex;
+      return;
+    }
+
+    // Whatever we find, the listing (or at least its ctime) differs from the saved one.
+    indexDirty = true;
+
+    for (;;) {
+      errno = 0;
+      struct dirent* entry = readdir(dir);
+      if (entry == nullptr) {
+        int error = errno;
+        if (error == 0) {
+          break;
+        } else {
+          KJ_FAIL_SYSCALL("readdir", error, pathPtr);
+        }
+      }
+
+      kj::StringPtr name = entry->d_name;
+      if (name != "." && name != "..") {
+        childEvent(watchInfo, name);
+      }
+    }
+
+    watchInfo.changeTime = changeTime;
+  }
+
+  bool loadSavedChildren(WatchInfo& watchInfo, DiskUsageIndex::Directory::Reader saved) {
+    // Fill in `watchInfo.children` using the names in the saved index instead of listing the
+    // directory, or return false if the entry is bogus. The names can be trusted because the
+    // directory's ctime hasn't changed, but the sizes can't -- writing to a file doesn't touch
+    // its directory -- so each child is stat()ed as usual.
+
+    auto children = saved.getChildren();
+    kj::StringPtr prev;
+    for (auto i: kj::indices(children)) {
+      kj::StringPtr name = children[i].getName();
+      if ((i > 0 && !(prev < name)) || name.size() == 0 || name.findFirst('/') != nullptr ||
+          name == "." || name == "..") {
+        return false;
+      }
+      prev = name;
+    }
+
+    // The names are sorted, so each one is appended at the end. Adding them doesn't make the
+    // index dirty, unless a child has vanished (which would be odd, given the ctime).
+    bool wasDirty = indexDirty;
+    watchInfo.children.reserve(children.size());
+    for (auto child: children) {
+      childEvent(watchInfo, child.getName());
+    }
+    indexDirty = wasDirty || watchInfo.children.size() != children.size();
+    return true;
+  }
+
   kj::Promise<void> readLoop() {
     addPendingWatches();
     maybeFireEvents();
@@ -265,37 +454,151 @@ private:
           pos += eventSize;
 
           if (event->mask & IN_Q_OVERFLOW) {
-            // Queue overflow; start over from scratch.
-            inotifyFd = nullptr;
-            KJ_LOG(WARNING, "inotify event queue overflow; restarting watch from scratch");
-            return init();
+            // Queue overflow, so some events were lost. Our watches are all still in place,
+            // though, so there's no need to start over.
+            KJ_LOG(WARNING, "inotify event queue overflow; rescanning");
+            rescan();
+            continue;
           }
 
           auto iter = watchMap.find(event->wd);
           KJ_ASSERT(iter != watchMap.end(), "inotify gave unknown watch descriptor?");
 
           if (event->mask & (IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVE)) {
+            if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVE)) {
+              // The saved listing is no longer complete.
+              iter->second.changeTime = 0;
+            }
             childEvent(iter->second, event->name);
           }
 
           if (event->mask & IN_IGNORED) {
             // This watch descriptor is being removed, probably because it was deleted.
+            removeWatchInfo(iter);
+          }
+        }
+      }
+    });
+  }
 
-            // There shouldn't be any children left, but if there are, go ahead and un-count them.
-            for (auto& child: iter->second.childSizes) {
-              totalSize -= child.second.size;
-            }
+  void rescan() {
+    // After lost events, relist every directory we know of. Any file may have changed size
+    // without a trace in its directory's ctime, so nothing short of this is safe. Directories
+    // found along the way that we're already watching aren't listed a second time.
 
-            watchMap.erase(iter);
-          }
+    for (auto& entry: watchMap) {
+      // If the directory is gone, this just clears it; its IN_IGNORED event is on its way.
+      populate(entry.second);
+    }
+  }
+
+  kj::Promise<void> pollLoop() {
+    return eventPort.atSteadyTime(eventPort.steadyTime() + POLL_INTERVAL).then([this]() {
+      pollSome();
+      addPendingWatches();
+      maybeFireEvents();
+      return pollLoop();
+    });
+  }
+
+  void pollSome() {
+    // Check polled directories round-robin, stopping after about POLL_BUDGET stat()s.
+
+    uint budget = POLL_BUDGET;
+    size_t remaining = polledPaths.size();
+    while (budget > 0 && remaining-- > 0) {
+      auto iter = polledPaths.upper_bound(lastPolled);
+      if (iter == polledPaths.end()) iter = polledPaths.begin();
+      lastPolled = kj::heapString(iter->first);
+
+      auto watchIter = watchMap.find(iter->second);
+      KJ_ASSERT(watchIter != watchMap.end());
+      WatchInfo& watchInfo = watchIter->second;
+      const char* pathPtr = watchInfo.path == nullptr ? "." : watchInfo.path.cStr();
+
+      struct stat stats;
+      if (lstat(pathPtr, &stats) < 0 || !S_ISDIR(stats.st_mode)) {
+        // It's gone. If something else has taken its place, its parent will find it.
+        removeWatchInfo(watchIter);
+        --budget;
+      } else if (changeTimeOf(stats) != watchInfo.changeTime) {
+        populate(watchInfo);
+        budget -= kj::min(budget, uint(watchInfo.children.size() + 1));
+      } else {
+        // Same entries as before, but files may have changed size. Subdirectories are tracked
+        // on their own.
+        auto names = KJ_MAP(child, watchInfo.children) {
+          return child.isDir ? kj::String() : kj::heapString(child.name);
+        };
+        for (auto& name: names) {
+          if (name != nullptr) childEvent(watchInfo, name);
         }
+        budget -= kj::min(budget, uint(names.size() + 1));
       }
+    }
+  }
+
+  kj::Promise<void> saveLoop() {
+    return eventPort.atSteadyTime(eventPort.steadyTime() + SAVE_INTERVAL).then([this]() {
+      saveIfChanged();
+      return saveLoop();
     });
   }
 
+  void saveIndex() {
+    capnp::MallocMessageBuilder message;
+    auto directories = message.initRoot<DiskUsageIndex>().initDirectories(watchMap.size());
+    uint i = 0;
+    for (auto& entry: watchMap) {
+      WatchInfo& watchInfo = entry.second;
+      auto directory = directories[i++];
+      directory.setPath(pathKey(watchInfo.path));
+      directory.setChangeTimeNs(watchInfo.changeTime);
+      auto children = directory.initChildren(watchInfo.children.size());
+      for (auto j: kj::indices(watchInfo.children)) {
+        auto& child = watchInfo.children[j];
+        children[j].setName(child.name);
+        children[j].setIsDirectory(child.isDir);
+      }
+    }
+
+    {
+      auto fd = raiiOpen(INDEX_TEMP_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+      capnp::writeMessageToFd(fd, message);
+    }
+    KJ_SYSCALL(rename(INDEX_TEMP_FILE, INDEX_FILE));
+    indexDirty = false;
+  }
+
+  void loadIndex() {
+    // Read the index saved by a previous run, if there is one and it's readable.
+
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([this]() {
+      KJ_IF_MAYBE(fd, raiiOpenIfExists(INDEX_FILE, O_RDONLY | O_CLOEXEC)) {
+        capnp::ReaderOptions options;
+        options.traversalLimitInWords = kj::maxValue;
+        auto reader = kj::heap<capnp::StreamFdMessageReader>(fd->get(), options);
+        for (auto directory: reader->getRoot<DiskUsageIndex>().getDirectories()) {
+          savedDirectories.insert(std::make_pair(directory.getPath(), directory));
+        }
+        savedIndex = kj::mv(reader);
+      }
+    })) {
+      KJ_LOG(WARNING, "couldn't read disk usage index; rescanning", *exception);
+      savedDirectories.clear();
+      savedIndex = nullptr;
+    }
+  }
+
+  static bool isIndexFile(kj::StringPtr name) {
+    return name == INDEX_FILE || name == INDEX_TEMP_FILE;
+  }
+
   void childEvent(WatchInfo& watchInfo, kj::StringPtr name) {
     // Called to update the child table when we receive an inotify event with the given name.
 
+    if (watchInfo.path == nullptr && isIndexFile(name)) return;
+
     // OK, we received notification that something happened to the child named `name`.
     // Unfortunately, we don't have any idea how long ago this event happened. Worse, any
     // number of other events may have occurred since this one was generated. For example,
@@ -311,22 +614,32 @@ private:
     auto usage = getDiskUsage(watchInfo.path, name);
     totalSize += usage.bytes;
 
-    auto iter = watchInfo.childSizes.find(name);
+    auto& children = watchInfo.children;
+    auto iter = std::lower_bound(children.begin(), children.end(), name,
+        [](const ChildInfo& child, kj::StringPtr key) { return child.name < key; });
+    bool found = iter != children.end() && iter->name == name;
     if (usage.bytes == 0) {
-      // There is no longer a child by this name on disk. Remove whatever is in the map.
-      if (iter != watchInfo.childSizes.end()) {
-        totalSize -= iter->second.size;
-        watchInfo.childSizes.erase(iter);
+      // There is no longer a child by this name on disk. Remove whatever is in the array.
+      if (found) {
+        totalSize -= iter->size;
+        std::move(iter + 1, children.end(), iter);
+        children.removeLast();
+        indexDirty = true;
       }
-    } else if (iter == watchInfo.childSizes.end()) {
-      // There is a child by this name on disk, but not in the map. Add it.
-      ChildInfo newChild = { kj::heapString(name), usage.bytes };
-      kj::StringPtr namePtr = newChild.name;
-      KJ_ASSERT(watchInfo.childSizes.insert(std::make_pair(namePtr, kj::mv(newChild))).second);
+    } else if (!found) {
+      // There is a child by this name on disk, but not in the array. Insert it in order.
+      size_t pos = iter - children.begin();
+      children.add(ChildInfo { kj::heapString(name), usage.bytes, usage.isDir });
+      std::rotate(children.begin() + pos, children.end() - 1, children.end());
+      indexDirty = true;
     } else {
-      // There is a child by this name on disk and in the map. Check for a change in size.
-      totalSize -= iter->second.size;
-      iter->second.size = usage.bytes;
+      // There is a child by this name on disk and in the array. Check for a change in size.
+      totalSize -= iter->size;
+      iter->size = usage.bytes;
+      if (iter->isDir != usage.isDir) {
+        iter->isDir = usage.isDir;
+        indexDirty = true;
+      }
     }
 
     // If the child is a directory, plan to start watching it later. Note that IN_MODIFY events
@@ -411,6 +724,9 @@ private:
   }
 };
 
+constexpr kj::Duration DiskUsageWatcher::SAVE_INTERVAL;
+constexpr kj::Duration DiskUsageWatcher::POLL_INTERVAL;
+
 // =======================================================================================
 // Termination handling:  Must kill child if parent terminates.
 //
@@ -526,6 +842,8 @@ SupervisorMain::SupervisorMain(kj::ProcessContext& context): context(context) {
   KJ_SYSCALL(sigprocmask(SIG_SETMASK, &sigset, nullptr));
 }
 
+SupervisorMain::~SupervisorMain() noexcept(false) {}
+
 kj::MainFunc SupervisorMain::getMain() {
   return kj::MainBuilder(context, "Sandstorm version " SANDSTORM_VERSION,
                          "Runs a Sandstorm grain supervisor for the grain <grain-id>, which is "
@@ -551,6 +869,15 @@ kj::MainFunc SupervisorMain::getMain() {
                  "Dump libseccomp PFC output.")
       .addOption({'n', "new"}, [this]() { setIsNew(true); return true; },
                  "Initializes a new grain.  (Otherwise, runs an existing one.)")
+      .addOptionWithArg({"cgroup"}, KJ_BIND_METHOD(*this, setCgroup), "<path>",
+                        "Run the grain in its own cgroup, created under the cgroup v2 directory "
+                        "<path>, so that its resource usage can be reported and limited.  <path> "
+                        "must be delegated to (writable by) the user running the supervisor.")
+      .addOptionWithArg({"memory-limit"}, KJ_BIND_METHOD(*this, setMemoryLimit), "<bytes>",
+                        "Limit the grain's memory use, including page cache.  Requires --cgroup.")
+      .addOptionWithArg({"cpu-limit"}, KJ_BIND_METHOD(*this, setCpuLimit), "<percent>",
+                        "Limit the grain to <percent> of one CPU (may exceed 100 on multi-core "
+                        "machines).  Requires --cgroup.")
       .expectArg("<app-name>", KJ_BIND_METHOD(*this, setAppName))
       .expectArg("<grain-id>", KJ_BIND_METHOD(*this, setGrainId))
       .expectOneOrMoreArgs("<command>", KJ_BIND_METHOD(*this, addCommandArg))
@@ -603,6 +930,30 @@ kj::MainBuilder::Validity SupervisorMain::addEnv(kj::StringPtr arg) {
   return true;
 }
 
+kj::MainBuilder::Validity SupervisorMain::setCgroup(kj::StringPtr path) {
+  cgroupParent = realPath(kj::heapString(path));
+  return true;
+}
+
+kj::MainBuilder::Validity SupervisorMain::setMemoryLimit(kj::StringPtr arg) {
+  char* end;
+  memoryLimit = strtoull(arg.cStr(), &end, 10);
+  if (arg.size() == 0 || *end != '\0' || memoryLimit == 0) {
+    return "Must be a positive number of bytes.";
+  }
+  return true;
+}
+
+kj::MainBuilder::Validity SupervisorMain::setCpuLimit(kj::StringPtr arg) {
+  char* end;
+  unsigned long n = strtoul(arg.cStr(), &end, 10);
+  if (arg.size() == 0 || *end != '\0' || n == 0 || n > 100000) {
+    return "Must be a positive percentage.";
+  }
+  cpuLimitPercent = n;
+  return true;
+}
+
 kj::MainBuilder::Validity SupervisorMain::addCommandArg(kj::StringPtr arg) {
   command.add(kj::heapString(arg));
   return true;
@@ -610,12 +961,112 @@ kj::MainBuilder::Validity SupervisorMain::addCommandArg(kj::StringPtr arg) {
 
 // =====================================================================================
 
+class SupervisorMain::StartupTimer {
+  // Collects the spans of the startup trace. Spans recorded in the app's process after the fork
+  // are passed back to the supervisor through a pipe.
+
+public:
+  StartupTimer(): origin(now()) {}
+
+  template <typename Func>
+  void time(StartupTrace::Phase phase, Func&& func) {
+    int64_t start = now();
+    func();
+    spans.add(Span { phase, start - origin, now() - start });
+  }
+
+  void markFork() { forkTime = now(); }
+  // Note the start of the `appBootstrap` span, which finish() ends.
+
+  uint spanCount() { return spans.size(); }
+
+  void sendSince(uint index, int fd) {
+    // Write the spans recorded since `spanCount()` returned `index` to `fd`. This is small enough
+    // to be a single atomic pipe write.
+
+    size_t size = (spans.size() - index) * sizeof(Span);
+    KJ_ASSERT(size <= PIPE_BUF);
+    KJ_SYSCALL(write(fd, spans.begin() + index, size));
+  }
+
+  kj::Promise<void> receive(kj::AsyncInputStream& input) {
+    // Read spans written by sendSince() until EOF.
+
+    auto buffer = kj::heapArray<Span>(PIPE_BUF / sizeof(Span));
+    size_t size = buffer.size() * sizeof(Span);
+    return input.tryRead(buffer.begin(), size, size)
+        .then([this, KJ_MVCAP(buffer)](size_t n) {
+      for (auto& span: buffer.slice(0, n / sizeof(Span))) {
+        spans.add(span);
+      }
+    });
+  }
+
+  void finish(bool appAnswered) {
+    // Mark the trace complete and write it to the log.
+
+    int64_t end = now();
+    totalNs = end - origin;
+    this->appAnswered = appAnswered;
+    spans.add(Span { StartupTrace::Phase::APP_BOOTSTRAP, forkTime - origin, end - forkTime });
+    std::stable_sort(spans.begin(), spans.end(), [](const Span& a, const Span& b) {
+      return a.startNs < b.startNs;
+    });
+
+    // One line of "key=value" pairs, with times in microseconds, for easy grepping.
+    auto enumerants = capnp::Schema::from<StartupTrace::Phase>().getEnumerants();
+    kj::Vector<kj::String> fields;
+    fields.add(kj::str("total=", totalNs / 1000));
+    fields.add(kj::str("appAnswered=", appAnswered ? "true" : "false"));
+    for (auto& span: spans) {
+      fields.add(kj::str(enumerants[static_cast<uint>(span.phase)].getProto().getName(),
+                         '=', span.durationNs / 1000));
+    }
+    logSafely(kj::str("** SANDSTORM SUPERVISOR: Startup trace (us): ",
+                      kj::strArray(fields, " "), "\n").cStr());
+  }
+
+  void fill(StartupTrace::Builder builder) {
+    builder.setTotalNs(totalNs);
+    builder.setAppAnswered(appAnswered);
+    auto list = builder.initSpans(spans.size());
+    for (uint i: kj::indices(spans)) {
+      list[i].setPhase(spans[i].phase);
+      list[i].setStartNs(spans[i].startNs);
+      list[i].setDurationNs(spans[i].durationNs);
+    }
+  }
+
+private:
+  struct Span {
+    StartupTrace::Phase phase;
+    int64_t startNs;
+    int64_t durationNs;
+  };
+
+  int64_t origin;
+  int64_t forkTime = 0;
+  int64_t totalNs = 0;
+  bool appAnswered = false;
+  kj::Vector<Span> spans;
+
+  static int64_t now() {
+    // CLOCK_MONOTONIC is shared by all processes, so times from the app's process line up.
+    struct timespec ts;
+    KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+  }
+};
+
 kj::MainBuilder::Validity SupervisorMain::run() {
+  startupTimer = kj::heap<StartupTimer>();
   isIpTablesAvailable = checkIfIpTablesLoaded();
 
   setupSupervisor();
 
-  checkIfAlreadyRunning();  // Exits if another supervisor is still running in this sandbox.
+  startupTimer->time(StartupTrace::Phase::CHECK_IF_ALREADY_RUNNING, [&]() {
+    checkIfAlreadyRunning();  // Exits if another supervisor is still running in this sandbox.
+  });
 
   SANDSTORM_LOG("Starting up grain.");
 
@@ -625,17 +1076,25 @@ kj::MainBuilder::Validity SupervisorMain::run() {
   int fds[2];
   KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
 
+  // The app's process reports its part of the startup trace through this pipe, which exec()
+  // closes.
+  int traceFds[2];
+  KJ_SYSCALL(pipe2(traceFds, O_CLOEXEC));
+
   // Now time to run the start command, in a further chroot.
+  startupTimer->markFork();
   KJ_SYSCALL(childPid = fork());
   if (childPid == 0) {
     // We're in the child.
     KJ_SYSCALL(close(fds[0]));  // just to be safe, even though it's CLOEXEC.
-    runChild(fds[1]);
+    KJ_SYSCALL(close(traceFds[0]));
+    runChild(fds[1], traceFds[1]);
   } else {
     // We're in the supervisor.
     KJ_DEFER(killChild());
     KJ_SYSCALL(close(fds[1]));
-    runSupervisor(fds[0]);
+    KJ_SYSCALL(close(traceFds[1]));
+    runSupervisor(fds[0], traceFds[0]);
   }
 }
 
@@ -693,10 +1152,19 @@ void SupervisorMain::setupSupervisor() {
   KJ_SYSCALL(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0));
 
   closeFds();
-  checkPaths();
-  unshareOuter();
-  setupFilesystem();
-  setupStdio();
+  startupTimer->time(StartupTrace::Phase::CHECK_PATHS, [&]() { checkPaths(); });
+  startupTimer->time(StartupTrace::Phase::SETUP_CGROUP, [&]() { setupCgroup(); });
+
+  startupTimer->time(StartupTrace::Phase::UNSHARE_OUTER, [&]() { unshareOuter(); });
+
+  startupTimer->time(StartupTrace::Phase::SETUP_FILESYSTEM, [&]() { setupFilesystem(); });
+  startupTimer->time(StartupTrace::Phase::SETUP_STDIO, [&]() { setupStdio(); });
+
+  // Compile the seccomp filter before forking so that the supervisor and the child can both
+  // install the same copy.
+  startupTimer->time(StartupTrace::Phase::COMPILE_SECCOMP, [&]() {
+    seccompFilter = compileSeccomp(devmode, seccompDumpPfc);
+  });
 
   // Note:  permanentlyDropSuperuser() is performed post-fork; see comment in function def.
 }
@@ -803,6 +1271,115 @@ void SupervisorMain::checkPaths() {
   KJ_SYSCALL(close(logfd));
 }
 
+static void writeCgroupFile(int dirFd, kj::StringPtr name, kj::StringPtr value) {
+  int fd;
+  KJ_SYSCALL(fd = openat(dirFd, name.cStr(), O_WRONLY | O_CLOEXEC), name);
+  kj::AutoCloseFd ownFd(fd);
+  KJ_SYSCALL(write(fd, value.begin(), value.size()), name, value);
+}
+
+void SupervisorMain::setupCgroup() {
+  // Move ourselves -- and therefore, later, the grain -- into a cgroup of our own under
+  // `cgroupParent`, applying any limits. This must happen before unsharing the user namespace,
+  // while we still have our real uid's permissions on the delegated hierarchy.
+
+  if (cgroupParent == nullptr) {
+    if (memoryLimit != 0 || cpuLimitPercent != 0) {
+      context.exitError("--memory-limit and --cpu-limit require --cgroup.");
+    }
+    return;
+  }
+
+  cgroupParentFd = raiiOpen(cgroupParent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  int parentFd = cgroupParentFd;
+
+  // Make the controllers we use available to the grains' groups. Typically a previous grain has
+  // already done this, and the parent may not allow all of them, so failure isn't fatal; the
+  // stats for any missing controller are simply reported as zero.
+  for (const char* controller: {"+cpu", "+memory", "+io", "+pids"}) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      writeCgroupFile(parentFd, "cgroup.subtree_control", controller);
+    })) {
+      KJ_LOG(WARNING, "couldn't enable cgroup controller", controller, *exception);
+    }
+  }
+
+  // Grains normally remove their cgroups when they exit (see removeCgroup()), but one that was
+  // killed can't. Clean up after any such grain now. This fails harmlessly (EBUSY) for cgroups
+  // that are still in use.
+  auto name = kj::str("grain-", grainId);
+  for (auto& sibling: listDirectory(cgroupParent)) {
+    if (sibling.startsWith("grain-") && sibling != name) {
+      unlinkat(parentFd, sibling.cStr(), AT_REMOVEDIR);
+    }
+  }
+
+  if (mkdirat(parentFd, name.cStr(), 0755) < 0) {
+    // EEXIST means it was left over from a previous run of this grain, which is fine.
+    int error = errno;
+    if (error != EEXIST) {
+      KJ_FAIL_SYSCALL("mkdirat", error, cgroupParent, name);
+    }
+  }
+
+  int fd;
+  KJ_SYSCALL(fd = openat(parentFd, name.cStr(), O_RDONLY | O_DIRECTORY | O_CLOEXEC), name);
+  cgroupFd = kj::AutoCloseFd(fd);
+
+  // Apply limits. A cgroup left over from a previous run may still have old ones, so reset those
+  // that weren't requested, where the controller is available at all.
+  if (memoryLimit != 0) {
+    writeCgroupFile(cgroupFd, "memory.max", kj::str(memoryLimit));
+  } else if (faccessat(cgroupFd, "memory.max", W_OK, 0) == 0) {
+    writeCgroupFile(cgroupFd, "memory.max", "max");
+  }
+  if (cpuLimitPercent != 0) {
+    // cpu.max is "<quota> <period>", in microseconds.
+    writeCgroupFile(cgroupFd, "cpu.max", kj::str(cpuLimitPercent * 1000, " 100000"));
+  } else if (faccessat(cgroupFd, "cpu.max", W_OK, 0) == 0) {
+    writeCgroupFile(cgroupFd, "cpu.max", "max 100000");
+  }
+
+  writeCgroupFile(cgroupFd, "cgroup.procs", kj::str(getpid()));
+}
+
+void SupervisorMain::removeCgroup() {
+  // Remove the grain's cgroup, once the grain's processes have exited. A cgroup can't be removed
+  // while it has members -- including us -- so first move to a leaf shared by exiting supervisors.
+  // Failure isn't fatal; the next grain to start will try again.
+
+  if (cgroupParentFd == nullptr) return;
+
+  KJ_IF_MAYBE(exception, kj::runCatchingExceptions([this]() {
+    if (mkdirat(cgroupParentFd, "exiting", 0755) < 0) {
+      int error = errno;
+      if (error != EEXIST) {
+        KJ_FAIL_SYSCALL("mkdirat", error, cgroupParent, "exiting");
+      }
+    }
+    int fd;
+    KJ_SYSCALL(fd = openat(cgroupParentFd, "exiting", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    kj::AutoCloseFd exitingFd(fd);
+    writeCgroupFile(exitingFd, "cgroup.procs", "0");
+
+    // The rest of the sandbox's processes are killed when its init exits, but may take a moment
+    // to disappear.
+    auto name = kj::str("grain-", grainId);
+    for (uint attempt = 0;; attempt++) {
+      if (unlinkat(cgroupParentFd, name.cStr(), AT_REMOVEDIR) == 0) break;
+      int error = errno;
+      if (error == EINTR) continue;
+      if (error == EBUSY && attempt < 50) {
+        usleep(10000);
+        continue;
+      }
+      KJ_FAIL_SYSCALL("rmdir", error, cgroupParent, name);
+    }
+  })) {
+    KJ_LOG(WARNING, "couldn't remove grain's cgroup", *exception);
+  }
+}
+
 void SupervisorMain::writeSetgroupsIfPresent(const char *contents) {
   KJ_IF_MAYBE(fd, raiiOpenIfExists("/proc/self/setgroups", O_WRONLY | O_CLOEXEC)) {
     kj::FdOutputStream(kj::mv(*fd)).write(contents, strlen(contents));
@@ -957,8 +1534,8 @@ void SupervisorMain::setupStdio() {
   // supervisor, stdout is how we tell our parent that we're ready to receive connections.
 }
 
-void SupervisorMain::setupSeccomp() {
-  // Install a rudimentary seccomp blacklist.
+kj::Array<struct sock_filter> SupervisorMain::compileSeccomp(bool devmode, bool dumpPfc) {
+  // Compile a rudimentary seccomp blacklist to BPF.
   // TODO(security): Change this to a whitelist.
 
   scmp_filter_ctx ctx = seccomp_init(SCMP_ACT_ALLOW);
@@ -1078,15 +1655,48 @@ void SupervisorMain::setupSeccomp() {
 
   // TODO(someday): Turn off POSIX message queues and other such esoteric features.
 
-  if (seccompDumpPfc) {
+  if (dumpPfc) {
     seccomp_export_pfc(ctx, 1);
   }
 
-  CHECK_SECCOMP(seccomp_load(ctx));
+  // libseccomp can only export to an FD, so go through a pipe. A BPF program is at most 4096
+  // instructions (32k), which fits in the pipe buffer, so this can't block.
+  int fds[2];
+  KJ_SYSCALL(pipe2(fds, O_CLOEXEC));
+  kj::AutoCloseFd readEnd(fds[0]);
+  {
+    kj::AutoCloseFd writeEnd(fds[1]);
+    CHECK_SECCOMP(seccomp_export_bpf(ctx, writeEnd));
+  }
+
+  kj::Vector<struct sock_filter> result;
+  for (;;) {
+    struct sock_filter buffer[64];
+    ssize_t n;
+    KJ_SYSCALL(n = read(readEnd, buffer, sizeof(buffer)));
+    if (n == 0) break;
+    KJ_ASSERT(n % sizeof(buffer[0]) == 0, "seccomp_export_bpf() wrote a partial instruction");
+    result.addAll(buffer, buffer + n / sizeof(buffer[0]));
+  }
+  return result.releaseAsArray();
 
 #undef CHECK_SECCOMP
 }
 
+void SupervisorMain::setupSeccomp() {
+  // Install the filter compiled by setupSupervisor().
+
+  KJ_ASSERT(seccompFilter.size() > 0, "seccomp filter wasn't compiled");
+
+  struct sock_fprog program;
+  memset(&program, 0, sizeof(program));
+  program.len = seccompFilter.size();
+  program.filter = seccompFilter.begin();
+
+  // The kernel requires no_new_privs for this, which setupSupervisor() enabled.
+  KJ_SYSCALL(prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program, 0, 0));
+}
+
 void SupervisorMain::unshareNetwork() {
   // Unshare the network and set up a new loopback device.
 
@@ -1403,17 +2013,17 @@ void SupervisorMain::enterSandbox() {
   KJ_SYSCALL(chdir("/"));
 
   // Unshare the network, creating a new loopback interface.
-  unshareNetwork();
+  startupTimer->time(StartupTrace::Phase::UNSHARE_NETWORK, [&]() { unshareNetwork(); });
 
   // Mount proc if --proc was passed.
-  maybeFinishMountingProc();
+  startupTimer->time(StartupTrace::Phase::MOUNT_PROC, [&]() { maybeFinishMountingProc(); });
 
   // Now actually drop all credentials.
-  permanentlyDropSuperuser();
+  startupTimer->time(StartupTrace::Phase::DROP_PRIVILEGES, [&]() { permanentlyDropSuperuser(); });
 
   // Use seccomp to disable dangerous syscalls. We do this last so that we can disable things
   // that we just used above, like unshare() or setuid().
-  setupSeccomp();
+  startupTimer->time(StartupTrace::Phase::SANDBOX_SECCOMP, [&]() { setupSeccomp(); });
 }
 
 // =====================================================================================
@@ -1471,10 +2081,13 @@ void SupervisorMain::checkIfAlreadyRunning() {
 
 // =====================================================================================
 
-[[noreturn]] void SupervisorMain::runChild(int apiFd) {
+[[noreturn]] void SupervisorMain::runChild(int apiFd, int traceFd) {
   // We are the child.
 
-  enterSandbox();
+  uint firstSpan = startupTimer->spanCount();
+  startupTimer->time(StartupTrace::Phase::ENTER_SANDBOX, [&]() { enterSandbox(); });
+  startupTimer->sendSince(firstSpan, traceFd);
+  KJ_SYSCALL(close(traceFd));
 
   // Reset all signal handlers to default.  (exec() will leave ignored signals ignored, and KJ
   // code likes to ignore e.g. SIGPIPE.)
@@ -1541,10 +2154,210 @@ public:
 //  }
 };
 
+class SupervisorMain::ResourceMonitor {
+  // Samples the grain's resource usage from its cgroup, no more often than SAMPLE_INTERVAL.
+
+public:
+  ResourceMonitor(kj::UnixEventPort& eventPort, int cgroupFd)
+      : eventPort(eventPort), cgroupFd(cgroupFd) {}
+  // `cgroupFd` is the grain's cgroup directory, or -1 if it doesn't have one.
+
+  kj::Promise<void> whenNewerThan(int64_t after) {
+    // Wait until the latest sample has a timestamp later than `after`.
+
+    auto now = eventPort.steadyTime();
+    if (!haveSample || now - lastSampleTime >= SAMPLE_INTERVAL) {
+      sample(now);
+    }
+    if (latest.timestampNs > after) {
+      return kj::READY_NOW;
+    }
+
+    return eventPort.atSteadyTime(lastSampleTime + SAMPLE_INTERVAL).then([this, after]() {
+      return whenNewerThan(after);
+    });
+  }
+
+  void fill(ResourceUsage::Builder builder) {
+    // Copy out the latest sample.
+
+    builder.setTimestampNs(latest.timestampNs);
+    builder.setAccounted(cgroupFd >= 0);
+    builder.setCpuUserNs(latest.cpuUserNs);
+    builder.setCpuSystemNs(latest.cpuSystemNs);
+    builder.setMemoryBytes(latest.memoryBytes);
+    builder.setMemoryPeakBytes(latest.memoryPeakBytes);
+    builder.setAnonymousMemoryBytes(latest.anonymousMemoryBytes);
+    builder.setMemoryLimitBytes(latest.memoryLimitBytes);
+    builder.setIoReadBytes(latest.ioReadBytes);
+    builder.setIoWriteBytes(latest.ioWriteBytes);
+    fillPressure(latest.cpuPressure, [&]() { return builder.initCpuPressure(); });
+    fillPressure(latest.memoryPressure, [&]() { return builder.initMemoryPressure(); });
+    fillPressure(latest.ioPressure, [&]() { return builder.initIoPressure(); });
+  }
+
+private:
+  static constexpr kj::Duration SAMPLE_INTERVAL = 2 * kj::SECONDS;
+
+  struct Pressure {
+    float someAvg10 = 0;
+    float fullAvg10 = 0;
+    uint64_t someTotalNs = 0;
+    uint64_t fullTotalNs = 0;
+  };
+
+  struct Sample {
+    int64_t timestampNs = 0;
+    uint64_t cpuUserNs = 0;
+    uint64_t cpuSystemNs = 0;
+    uint64_t memoryBytes = 0;
+    uint64_t memoryPeakBytes = 0;
+    uint64_t anonymousMemoryBytes = 0;
+    uint64_t memoryLimitBytes = 0;
+    uint64_t ioReadBytes = 0;
+    uint64_t ioWriteBytes = 0;
+    kj::Maybe<Pressure> cpuPressure;
+    kj::Maybe<Pressure> memoryPressure;
+    kj::Maybe<Pressure> ioPressure;
+  };
+
+  kj::UnixEventPort& eventPort;
+  int cgroupFd;
+  bool haveSample = false;
+  kj::TimePoint lastSampleTime = kj::origin<kj::TimePoint>();
+  Sample latest;
+
+  void sample(kj::TimePoint now) {
+    Sample result;
+    result.timestampNs = (now - kj::origin<kj::TimePoint>()) / kj::NANOSECONDS;
+
+    if (cgroupFd >= 0) {
+      // Any of these files may be missing if the corresponding controller isn't enabled, or if
+      // the kernel is too old; those numbers are just left as zero.
+      KJ_IF_MAYBE(text, readFile("cpu.stat")) {
+        forEachKeyValue(*text, [&](kj::StringPtr key, uint64_t value) {
+          if (key == "user_usec") result.cpuUserNs = value * 1000;
+          if (key == "system_usec") result.cpuSystemNs = value * 1000;
+        });
+      }
+      KJ_IF_MAYBE(text, readFile("memory.current")) {
+        result.memoryBytes = strtoull(text->cStr(), nullptr, 10);
+      }
+      KJ_IF_MAYBE(text, readFile("memory.peak")) {
+        result.memoryPeakBytes = strtoull(text->cStr(), nullptr, 10);
+      }
+      KJ_IF_MAYBE(text, readFile("memory.max")) {
+        // "max" parses as zero, which is what we report for no limit.
+        result.memoryLimitBytes = strtoull(text->cStr(), nullptr, 10);
+      }
+      KJ_IF_MAYBE(text, readFile("memory.stat")) {
+        forEachKeyValue(*text, [&](kj::StringPtr key, uint64_t value) {
+          if (key == "anon") result.anonymousMemoryBytes = value;
+        });
+      }
+      KJ_IF_MAYBE(text, readFile("io.stat")) {
+        // One line per device: "<major>:<minor> rbytes=N wbytes=N rios=N ...".
+        for (auto line: split(*text, '\n')) {
+          for (auto field: split(line, ' ')) {
+            auto str = kj::heapString(field);
+            if (str.startsWith("rbytes=")) {
+              result.ioReadBytes += strtoull(str.cStr() + strlen("rbytes="), nullptr, 10);
+            } else if (str.startsWith("wbytes=")) {
+              result.ioWriteBytes += strtoull(str.cStr() + strlen("wbytes="), nullptr, 10);
+            }
+          }
+        }
+      }
+      result.cpuPressure = readPressure("cpu.pressure");
+      result.memoryPressure = readPressure("memory.pressure");
+      result.ioPressure = readPressure("io.pressure");
+    }
+
+    // Without memory.peak, keep track of the peak ourselves, as well as we can.
+    result.memoryPeakBytes = kj::max(result.memoryPeakBytes,
+        kj::max(result.memoryBytes, latest.memoryPeakBytes));
+
+    latest = kj::mv(result);
+    lastSampleTime = now;
+    haveSample = true;
+  }
+
+  kj::Maybe<kj::String> readFile(kj::StringPtr name) {
+    int fd = openat(cgroupFd, name.cStr(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      int error = errno;
+      if (error != ENOENT) {
+        KJ_LOG(WARNING, "couldn't read cgroup file", name, strerror(error));
+      }
+      return nullptr;
+    }
+    kj::AutoCloseFd ownFd(fd);
+    return readAll(fd);
+  }
+
+  template <typename Func>
+  static void forEachKeyValue(kj::StringPtr text, Func&& func) {
+    // Parses the "<key> <value>" lines of cgroup files like cpu.stat and memory.stat.
+    for (auto line: split(text, '\n')) {
+      auto parts = split(line, ' ');
+      if (parts.size() == 2) {
+        func(kj::heapString(parts[0]), strtoull(kj::heapString(parts[1]).cStr(), nullptr, 10));
+      }
+    }
+  }
+
+  kj::Maybe<Pressure> readPressure(kj::StringPtr name) {
+    // Parses a pressure file, which looks like:
+    //   some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+    //   full avg10=0.00 avg60=0.00 avg300=0.00 total=0
+    // with totals in microseconds. (Older kernels have no "full" line for CPU.)
+
+    KJ_IF_MAYBE(text, readFile(name)) {
+      Pressure result;
+      for (auto line: split(*text, '\n')) {
+        auto fields = split(line, ' ');
+        if (fields.size() == 0) continue;
+        auto kind = kj::heapString(fields[0]);
+        if (kind != "some" && kind != "full") continue;
+        bool some = kind == "some";
+        for (auto field: fields) {
+          auto str = kj::heapString(field);
+          if (str.startsWith("avg10=")) {
+            (some ? result.someAvg10 : result.fullAvg10) =
+                strtof(str.cStr() + strlen("avg10="), nullptr);
+          } else if (str.startsWith("total=")) {
+            (some ? result.someTotalNs : result.fullTotalNs) =
+                strtoull(str.cStr() + strlen("total="), nullptr, 10) * 1000;
+          }
+        }
+      }
+      return result;
+    } else {
+      return nullptr;
+    }
+  }
+
+  template <typename InitFunc>
+  static void fillPressure(const kj::Maybe<Pressure>& pressure, InitFunc&& init) {
+    KJ_IF_MAYBE(p, pressure) {
+      auto builder = init();
+      builder.setSomeAvg10(p->someAvg10);
+      builder.setFullAvg10(p->fullAvg10);
+      builder.setSomeTotalNs(p->someTotalNs);
+      builder.setFullTotalNs(p->fullTotalNs);
+    }
+  }
+};
+
+constexpr kj::Duration SupervisorMain::ResourceMonitor::SAMPLE_INTERVAL;
+
 class SupervisorMain::SupervisorImpl final: public Supervisor::Server {
 public:
-  inline SupervisorImpl(UiView::Client&& mainView, DiskUsageWatcher& diskWatcher)
-      : mainView(kj::mv(mainView)), diskWatcher(diskWatcher) {}
+  inline SupervisorImpl(UiView::Client&& mainView, DiskUsageWatcher& diskWatcher,
+                        ResourceMonitor& resourceMonitor, kj::ForkedPromise<void>& startupDone,
+                        StartupTimer& startupTimer)
+      : mainView(kj::mv(mainView)), diskWatcher(diskWatcher), resourceMonitor(resourceMonitor),
+        startupDone(startupDone), startupTimer(startupTimer) {}
 
   kj::Promise<void> getMainView(GetMainViewContext context) {
     context.getResults(capnp::MessageSize {4, 1}).setView(mainView);
@@ -1557,6 +2370,7 @@ public:
   }
 
   kj::Promise<void> shutdown(ShutdownContext context) {
+    diskWatcher.saveIfChanged();
     killChildAndExit(0);
   }
 
@@ -1573,9 +2387,26 @@ public:
     });
   }
 
+  kj::Promise<void> getResourceUsage(GetResourceUsageContext context) {
+    auto after = context.getParams().getAfter();
+    context.releaseParams();
+    return resourceMonitor.whenNewerThan(after).then([this, context]() mutable {
+      resourceMonitor.fill(context.getResults().initUsage());
+    });
+  }
+
+  kj::Promise<void> getStartupTrace(GetStartupTraceContext context) {
+    return startupDone.addBranch().then([this, context]() mutable {
+      startupTimer.fill(context.getResults().initTrace());
+    });
+  }
+
 private:
   UiView::Client mainView;
   DiskUsageWatcher& diskWatcher;
+  ResourceMonitor& resourceMonitor;
+  kj::ForkedPromise<void>& startupDone;
+  StartupTimer& startupTimer;
 };
 
 struct SupervisorMain::AcceptedConnection {
@@ -1609,7 +2440,7 @@ public:
   }
 };
 
-[[noreturn]] void SupervisorMain::runSupervisor(int apiFd) {
+[[noreturn]] void SupervisorMain::runSupervisor(int apiFd, int traceFd) {
   // We're currently in a somewhat dangerous state: our root directory is controlled
   // by the app.  If glibc reads, say, /etc/nsswitch.conf, the grain could take control
   // of the supervisor.  Fix this by chrooting to the supervisor directory.
@@ -1619,7 +2450,7 @@ public:
   KJ_SYSCALL(chroot("."));
 
   permanentlyDropSuperuser();
-  setupSeccomp();
+  startupTimer->time(StartupTrace::Phase::SETUP_SECCOMP, [&]() { setupSeccomp(); });
 
   // TODO(soon): Somehow make sure all grandchildren die if supervisor dies. Currently SIGKILL
   //   on the supervisor won't give it a chance to kill the sandbox pid tree. Perhaps the
@@ -1629,13 +2460,20 @@ public:
   kj::UnixEventPort::captureSignal(SIGCHLD);
   auto ioContext = kj::setupAsyncIo();
 
+  // Computes grain size; started below. Constructed first so that it can save its index when we
+  // exit.
+  DiskUsageWatcher diskWatcher(ioContext.unixEventPort);
+
   // Detect child exit.
-  auto exitPromise = ioContext.unixEventPort.onSignal(SIGCHLD).then([this](siginfo_t info) {
+  auto exitPromise = ioContext.unixEventPort.onSignal(SIGCHLD)
+      .then([this, &diskWatcher](siginfo_t info) {
     KJ_ASSERT(childPid != 0);
     int status;
     KJ_SYSCALL(waitpid(childPid, &status, 0));
     childPid = 0;
     KJ_ASSERT(WIFEXITED(status) || WIFSIGNALED(status));
+    diskWatcher.saveIfChanged();
+    removeCgroup();
     if (WIFSIGNALED(status)) {
       context.exitError(kj::str(
           "** SANDSTORM SUPERVISOR: App exited due to signal ", WTERMSIG(status),
@@ -1650,8 +2488,14 @@ public:
   });
 
   // Compute grain size and watch for changes.
-  DiskUsageWatcher diskWatcher(ioContext.unixEventPort);
-  auto diskWatcherTask = diskWatcher.init();
+  kj::Promise<void> diskWatcherTask = nullptr;
+  startupTimer->time(StartupTrace::Phase::DISK_USAGE_SCAN, [&]() {
+    diskWatcherTask = diskWatcher.init();
+  });
+
+  // Report CPU, memory, and I/O usage from the grain's cgroup, if it has one.
+  ResourceMonitor resourceMonitor(ioContext.unixEventPort,
+                                  cgroupFd == nullptr ? -1 : cgroupFd.get());
 
   // Set up the RPC connection to the app and export the supervisor interface.
   auto appConnection = ioContext.lowLevelProvider->wrapSocketFd(apiFd,
@@ -1666,11 +2510,30 @@ public:
   hostId.setSide(capnp::rpc::twoparty::Side::CLIENT);
   UiView::Client app = server.bootstrap(hostId).castAs<UiView>();
 
+  // The startup trace is complete once the app has answered that. By then its process has also
+  // exec()ed, closing its end of the pipe through which it reports its own spans.
+  auto traceInput = ioContext.lowLevelProvider->wrapInputFd(traceFd,
+      kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC |
+      kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+  auto& traceStream = *traceInput;
+  auto startupDone = app.whenResolved()
+      .then([]() { return true; }, [](kj::Exception&& e) {
+    KJ_LOG(ERROR, "app failed to answer bootstrap request", e);
+    return false;
+  }).then([this, &traceStream](bool appAnswered) {
+    return startupTimer->receive(traceStream).then([this, appAnswered]() {
+      startupTimer->finish(appAnswered);
+    });
+  }).attach(kj::mv(traceInput)).eagerlyEvaluate([](kj::Exception&& e) {
+    KJ_LOG(ERROR, "couldn't complete startup trace", e);
+  }).fork();
+
   // Set up the external RPC interface, re-exporting the UiView.
   // TODO(someday):  If there are multiple front-ends, or the front-ends restart a lot, we'll
   //   want to wrap the UiView and cache session objects.  Perhaps we could do this by making
   //   them persistable, though it's unclear how that would work with SessionContext.
-  Supervisor::Client mainCap = kj::heap<SupervisorImpl>(kj::mv(app), diskWatcher);
+  Supervisor::Client mainCap = kj::heap<SupervisorImpl>(
+      kj::mv(app), diskWatcher, resourceMonitor, startupDone, *startupTimer);
   ErrorHandlerImpl errorHandler;
   kj::TaskSet tasks(errorHandler);
   unlink("socket");  // Clear stale socket, if any.
@@ -1698,6 +2561,7 @@ public:
       .wait(ioContext.waitScope);
 
   SANDSTORM_LOG("App disconnected API socket but didn't actually exit; killing it.");
+  diskWatcher.saveIfChanged();
   killChildAndExit(1);
 }
 
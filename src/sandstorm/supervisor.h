@@ -20,7 +20,9 @@
 #include "abstract-main.h"
 #include <kj/vector.h>
 #include <kj/async-io.h>
+#include <kj/io.h>
 #include <capnp/capability.h>
+#include <linux/filter.h>
 
 namespace sandstorm {
 
@@ -37,6 +39,7 @@ class SupervisorMain: public AbstractMain {
 
 public:
   SupervisorMain(kj::ProcessContext& context);
+  ~SupervisorMain() noexcept(false);
 
   kj::MainFunc getMain() override;
 
@@ -48,6 +51,9 @@ public:
   kj::MainBuilder::Validity setVar(kj::StringPtr path);
   kj::MainBuilder::Validity addEnv(kj::StringPtr arg);
   kj::MainBuilder::Validity addCommandArg(kj::StringPtr arg);
+  kj::MainBuilder::Validity setCgroup(kj::StringPtr path);
+  kj::MainBuilder::Validity setMemoryLimit(kj::StringPtr arg);
+  kj::MainBuilder::Validity setCpuLimit(kj::StringPtr arg);
   // Flag handlers
 
   kj::MainBuilder::Validity run();
@@ -61,29 +67,42 @@ private:
   kj::String varPath;
   kj::Vector<kj::String> command;
   kj::Vector<kj::String> environment;
+  kj::String cgroupParent;
+  uint64_t memoryLimit = 0;
+  unsigned int cpuLimitPercent = 0;
+  kj::AutoCloseFd cgroupParentFd;
+  kj::AutoCloseFd cgroupFd;  // The grain's own cgroup, if `cgroupParent` was given.
   bool isNew = false;
   bool mountProc = false;
   bool keepStdio = false;
   bool devmode = false;
   bool seccompDumpPfc = false;
   bool isIpTablesAvailable = false;
+  kj::Array<struct sock_filter> seccompFilter;  // Installed in both the supervisor and child.
 
   class SandstormApiImpl;
   class SupervisorImpl;
   struct AcceptedConnection;
   class ErrorHandlerImpl;
+  class ResourceMonitor;
+  class StartupTimer;
+
+  kj::Own<StartupTimer> startupTimer;  // Created by run().
 
   void bind(kj::StringPtr src, kj::StringPtr dst, unsigned long flags = 0);
   kj::String realPath(kj::StringPtr path);
   void setupSupervisor();
   void closeFds();
   void checkPaths();
+  void setupCgroup();
+  void removeCgroup();
   void writeSetgroupsIfPresent(const char *contents);
   void writeUserNSMap(const char *type, kj::StringPtr contents);
   void unshareOuter();
   void makeCharDeviceNode(const char *name, const char* realName, int major, int minor);
   void setupFilesystem();
   void setupStdio();
+  static kj::Array<struct sock_filter> compileSeccomp(bool devmode, bool dumpPfc);
   void setupSeccomp();
   void unshareNetwork();
   bool checkIfIpTablesLoaded();
@@ -91,12 +110,12 @@ private:
   void permanentlyDropSuperuser();
   void enterSandbox();
   void checkIfAlreadyRunning();
-  [[noreturn]] void runChild(int apiFd);
+  [[noreturn]] void runChild(int apiFd, int traceFd);
 
   kj::Promise<void> acceptLoop(kj::ConnectionReceiver& serverPort,
                                capnp::Capability::Client bootstrapInterface,
                                kj::TaskSet& taskSet);
-  [[noreturn]] void runSupervisor(int apiFd);
+  [[noreturn]] void runSupervisor(int apiFd, int traceFd);
 };
 
 }  // namespace sandstorm
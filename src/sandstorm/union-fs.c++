@@ -20,12 +20,18 @@
 #include <capnp/serialize.h>
 #include <map>
 #include <set>
+#include <algorithm>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
 #include "fuse.h"
+#include "util.h"
 
 #if __QTCREATOR
 #define KJ_MVCAP(var) var
@@ -76,10 +82,47 @@ protected:
     return context.tailCall(delegate.readlinkRequest(context.getParams().totalSize()));
   }
 
+  kj::Promise<void> watch(WatchContext context) override {
+    auto params = context.getParams();
+    auto subRequest = delegate.watchRequest(params.totalSize());
+    subRequest.setWatcher(params.getWatcher());
+    subRequest.setIgnore(params.getIgnore());
+    return context.tailCall(kj::mv(subRequest));
+  }
+
 protected:
   fuse::Node::Client delegate;
 };
 
+class PrefixingWatcher final: public fuse::ChangeWatcher::Server {
+  // Forwards invalidations to another watcher after prefixing each path, so that a node mapped
+  // at some sub-path reports changes relative to the root of the mapping.
+
+public:
+  PrefixingWatcher(fuse::ChangeWatcher::Client delegate, kj::String prefix)
+      : delegate(kj::mv(delegate)), prefix(kj::mv(prefix)) {}
+
+protected:
+  kj::Promise<void> invalidate(InvalidateContext context) override {
+    auto paths = context.getParams().getPaths();
+    auto subRequest = delegate.invalidateRequest();
+    auto subPaths = subRequest.initPaths(paths.size());
+    for (uint i = 0; i < paths.size(); i++) {
+      if (paths[i].size() == 0) {
+        subPaths.set(i, prefix);
+      } else {
+        subPaths.set(i, kj::str(prefix, '/', paths[i]));
+      }
+    }
+    context.releaseParams();
+    return context.tailCall(kj::mv(subRequest));
+  }
+
+private:
+  fuse::ChangeWatcher::Client delegate;
+  kj::String prefix;
+};
+
 class SimpleDirecotry: public fuse::Directory::Server {
   // Implementation of fuse::Directory that is easier to implement because it just calls a
   // method that returns the whole content as an array.
@@ -89,11 +132,29 @@ public:
     uint64_t inodeNumber = 1;  // Kernel refuses to display inode = 0 for whatever reason.
     kj::String name;
     fuse::Node::Type type;
+
+    kj::Maybe<fuse::Node::Client> node;
+    fuse::Node::Attributes::Reader attributes;
+    uint64_t ttl = 0;
+    // Filled in only by simpleReadPlus(), and even then `node` may be null if the entry couldn't
+    // be looked up. `attributes` points into one of the `owners` of the enclosing PlusListing.
+  };
+
+  struct PlusListing {
+    kj::Array<SimpleEntry> entries;
+    kj::Array<capnp::Response<ReadPlusResults>> owners;
   };
 
   virtual kj::Promise<kj::Array<SimpleEntry>> simpleRead() = 0;
   // Read the complete contents of the directory.
 
+  virtual kj::Promise<PlusListing> simpleReadPlus() {
+    // Like simpleRead() but also fills in each entry's node and attributes. Directories which
+    // can't do this cheaply needn't override it; the FUSE driver will fall back to read().
+    return kj::Exception(kj::Exception::Type::UNIMPLEMENTED, __FILE__, __LINE__,
+                         kj::heapString("readPlus() not implemented"));
+  }
+
   static kj::Promise<kj::Array<SimpleEntry>> readFrom(
       fuse::Directory::Client directory, uint64_t offset = 0,
       kj::Vector<SimpleEntry>&& alreadyRead = kj::Vector<SimpleEntry>(16)) {
@@ -128,7 +189,63 @@ public:
     });
   }
 
+  static kj::Promise<PlusListing> readPlusFrom(
+      fuse::Directory::Client directory, uint64_t offset = 0,
+      kj::Vector<SimpleEntry>&& alreadyRead = kj::Vector<SimpleEntry>(16),
+      kj::Vector<capnp::Response<ReadPlusResults>>&& owners =
+          kj::Vector<capnp::Response<ReadPlusResults>>()) {
+    // Like readFrom(), but uses readPlus(). Fails if `directory` doesn't implement readPlus().
+
+    auto request = directory.readPlusRequest();
+    request.setOffset(offset);
+
+    static const uint DEFAULT_COUNT = 128;
+    request.setCount(DEFAULT_COUNT);
+
+    return request.send().then([KJ_MVCAP(directory), KJ_MVCAP(alreadyRead), KJ_MVCAP(owners)](
+        capnp::Response<ReadPlusResults>&& response) mutable
+        -> kj::Promise<PlusListing> {
+      auto entries = response.getEntries();
+      uint64_t newOffset = 0;
+      for (auto item: entries) {
+        auto entry = item.getEntry();
+        SimpleEntry simple {
+          entry.getInodeNumber(),
+          kj::heapString(entry.getName()),
+          entry.getType()
+        };
+        if (item.hasNode()) {
+          simple.node = item.getNode();
+          simple.attributes = item.getAttributes();
+          simple.ttl = item.getTtl();
+        }
+        alreadyRead.add(kj::mv(simple));
+        newOffset = entry.getNextOffset();
+      }
+      bool mayBeMore = entries.size() == DEFAULT_COUNT;
+      owners.add(kj::mv(response));
+
+      if (mayBeMore) {
+        return readPlusFrom(kj::mv(directory), newOffset, kj::mv(alreadyRead), kj::mv(owners));
+      } else {
+        return PlusListing { alreadyRead.releaseAsArray(), owners.releaseAsArray() };
+      }
+    });
+  }
+
 protected:
+  kj::Promise<void> readPlus(ReadPlusContext context) override {
+    KJ_IF_MAYBE(c, cachedPlusResults) {
+      fillPlusResponse(c->entries, context);
+      return kj::READY_NOW;
+    } else {
+      return simpleReadPlus().then([this, context](PlusListing&& listing) mutable {
+        fillPlusResponse(listing.entries, context);
+        cachedPlusResults = kj::mv(listing);
+      });
+    }
+  }
+
   kj::Promise<void> read(ReadContext context) {
     KJ_IF_MAYBE(c, cachedResults) {
       fillResponse(*c, context);
@@ -143,6 +260,53 @@ protected:
 
 private:
   kj::Maybe<kj::Array<SimpleEntry>> cachedResults;
+  kj::Maybe<PlusListing> cachedPlusResults;
+
+  static void fillPlusResponse(kj::Array<SimpleEntry>& entries, ReadPlusContext context) {
+    auto params = context.getParams();
+
+    // Slice down to the list we're returning now.
+    auto startOffset = kj::min(entries.size(), params.getOffset());
+    auto slice = entries.slice(startOffset, entries.size());
+    slice = slice.slice(0, kj::min(slice.size(), params.getCount()));
+
+    context.releaseParams();
+
+    // Calculate space needs;
+    capnp::MessageSize spaceNeeded = {
+      capnp::sizeInWords<ReadPlusResults>() +
+          slice.size() * (capnp::sizeInWords<fuse::Directory::EntryPlus>() +
+                          capnp::sizeInWords<fuse::Directory::Entry>()),
+      0
+    };
+    for (auto& entry: slice) {
+      spaceNeeded.wordCount += entry.name.size() / sizeof(capnp::word) + 1;
+      if (entry.node != nullptr) {
+        spaceNeeded.wordCount += entry.attributes.totalSize().wordCount;
+        ++spaceNeeded.capCount;
+      }
+    }
+
+    // Fill in results.
+    auto results = context.getResults(spaceNeeded);
+    auto builder = results.initEntries(slice.size());
+    for (size_t i: kj::indices(slice)) {
+      auto itemBuilder = builder[i];
+      auto entryBuilder = itemBuilder.initEntry();
+      auto& entry = slice[i];
+
+      entryBuilder.setInodeNumber(entry.inodeNumber);
+      entryBuilder.setNextOffset(startOffset + i + 1);
+      entryBuilder.setType(entry.type);
+      entryBuilder.setName(entry.name);
+
+      KJ_IF_MAYBE(node, entry.node) {
+        itemBuilder.setNode(*node);
+        itemBuilder.setAttributes(entry.attributes);
+        itemBuilder.setTtl(entry.ttl);
+      }
+    }
+  }
 
   static void fillResponse(const kj::Array<SimpleEntry>& entries, ReadContext context) {
     auto params = context.getParams();
@@ -179,12 +343,80 @@ private:
   }
 };
 
+struct UnionIndexEpoch: public kj::Refcounted {
+  // Shared by every UnionNode in one tree. Incremented whenever the tree reports that something
+  // changed, which discards every directory index built before then.
+
+  uint64_t value = 0;
+
+  uint activeWatches = 0;
+  // Number of watch() calls on the tree for which at least one layer is actually being watched.
+  // While non-zero, changes are reported, so indexes are kept until the epoch changes rather than
+  // expiring after their TTL.
+};
+
+class EpochBumpingWatcher final: public fuse::ChangeWatcher::Server {
+  // Forwards invalidations to another watcher, after first discarding all directory indexes in
+  // the tree. Changes are rare enough that there's no point working out which indexes they affect.
+
+public:
+  EpochBumpingWatcher(fuse::ChangeWatcher::Client delegate, kj::Own<UnionIndexEpoch> epoch)
+      : delegate(kj::mv(delegate)), epoch(kj::mv(epoch)) {}
+
+protected:
+  kj::Promise<void> invalidate(InvalidateContext context) override {
+    ++epoch->value;
+    auto params = context.getParams();
+    auto subRequest = delegate.invalidateRequest(params.totalSize());
+    subRequest.setPaths(params.getPaths());
+    context.releaseParams();
+    return context.tailCall(kj::mv(subRequest));
+  }
+
+private:
+  fuse::ChangeWatcher::Client delegate;
+  kj::Own<UnionIndexEpoch> epoch;
+};
+
+class UnionWatch final: public Handle::Server {
+  // Returned by UnionNode::watch(). Holds the layers' watch handles, and counts itself in
+  // `UnionIndexEpoch::activeWatches` once any of them turns out to have succeeded.
+
+public:
+  UnionWatch(kj::Own<UnionIndexEpoch> epoch, kj::Array<Handle::Client> handles,
+             kj::Array<kj::Promise<bool>> layersWatched)
+      : epoch(kj::mv(epoch)), handles(kj::mv(handles)) {
+    settled = kj::joinPromises(kj::mv(layersWatched))
+        .then([this](kj::Array<bool>&& results) {
+      for (bool watched: results) {
+        if (watched) {
+          active = true;
+          ++this->epoch->activeWatches;
+          // Something may have changed before the watch started.
+          ++this->epoch->value;
+          break;
+        }
+      }
+    }).eagerlyEvaluate(nullptr);
+  }
+
+  ~UnionWatch() noexcept(false) {
+    if (active) --epoch->activeWatches;
+  }
+
+private:
+  kj::Own<UnionIndexEpoch> epoch;
+  kj::Array<Handle::Client> handles;
+  bool active = false;
+  kj::Promise<void> settled = nullptr;
+};
+
 class UnionDirectory final: public SimpleDirecotry {
   // Directory that merges the contents of several directories.
 
 public:
-  explicit UnionDirectory(kj::Array<fuse::Directory::Client> layers)
-      : layers(kj::mv(layers)) {}
+  UnionDirectory(kj::Array<fuse::Directory::Client> layers, kj::Own<UnionIndexEpoch> epoch)
+      : layers(kj::mv(layers)), epoch(kj::mv(epoch)) {}
 
   kj::Promise<kj::Array<SimpleEntry>> simpleRead() override {
     // Read from each delegate.
@@ -221,28 +453,161 @@ public:
     });
   }
 
+  kj::Promise<PlusListing> simpleReadPlus() override;
+  // Defined after UnionNode.
+
 private:
   kj::Array<fuse::Directory::Client> layers;
+  kj::Own<UnionIndexEpoch> epoch;
 };
 
+static int64_t monotonicNanos() {
+  struct timespec ts;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
 class UnionNode final: public DelegatingNode {
   // Merges several nodes into one.
+  //
+  // A lookup must in principle ask every layer, and most names asked for (e.g. by module loaders
+  // probing search paths) exist in none of them. So, when there's more than one layer, the first
+  // lookup lists every layer as a directory and builds an index of which layers contain which
+  // names. Later lookups go only to the layers that contain the name, and fail immediately if
+  // there are none. The index is discarded as soon as the tree reports a change via watch(). If
+  // nothing is watching the tree (or no layer could be watched), it also expires after `indexTtl`
+  // nanoseconds (the smallest TTL of the layers themselves). Under a watch, just as when the
+  // caller uses `FuseOptions::cacheForever`, changes to layers that can't be watched are missed.
 
 public:
-  explicit UnionNode(kj::Array<fuse::Node::Client> layers)
-      : DelegatingNode(layers[0]), layers(kj::mv(layers)) {}
+  UnionNode(kj::Array<fuse::Node::Client> layers, kj::Own<UnionIndexEpoch> epoch,
+            uint64_t indexTtl)
+      : DelegatingNode(layers[0]), layers(kj::mv(layers)), epoch(kj::mv(epoch)),
+        indexTtl(indexTtl) {}
 
 protected:
   kj::Promise<void> lookup(LookupContext context) override {
+    if (layers.size() == 1) {
+      // Nothing to narrow down.
+      auto params = context.getParams();
+      return lookupIn(kj::heapArray<uint>({0u}), params.getName(), context);
+    }
+
+    auto name = kj::heapString(context.getParams().getName());
+    context.releaseParams();
+
+    return ensureIndex().then([this, KJ_MVCAP(name), context]() mutable {
+      KJ_IF_MAYBE(i, index) {
+        return lookupIn((*i)->layersContaining(name), name, context);
+      } else {
+        // Only possible if building the index failed outright. Ask everyone.
+        auto all = kj::heapArray<uint>(layers.size());
+        for (uint j: kj::indices(all)) all[j] = j;
+        return lookupIn(kj::mv(all), name, context);
+      }
+    });
+  }
+
+  kj::Promise<void> openAsDirectory(OpenAsDirectoryContext context) override {
+    // Call openAsDirectory() on all children and then return a UnionDirectory of the pipelined
+    // results. No need to wait; if pipelined requests on the layers fail then we simply treat
+    // them as empty directories anyway.
+    auto dirLayers = kj::heapArrayBuilder<fuse::Directory::Client>(layers.size());
+    for (auto& layer: layers) {
+      dirLayers.add(layer.openAsDirectoryRequest(capnp::MessageSize {4,0})
+          .send().getDirectory());
+    }
+
+    context.releaseParams();
+
+    auto results = context.getResults(capnp::MessageSize {4,1});
+    results.setDirectory(kj::heap<UnionDirectory>(dirLayers.finish(), kj::addRef(*epoch)));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> watch(WatchContext context) override {
+    // Watch every layer. Layers that can't be watched (e.g. generated files that never change)
+    // will just produce broken handles, which is harmless.
     auto params = context.getParams();
-    auto name = params.getName();
-    auto paramsSize = params.totalSize();
+    fuse::ChangeWatcher::Client watcher = kj::heap<EpochBumpingWatcher>(
+        params.getWatcher(), kj::addRef(*epoch));
+    auto handles = kj::heapArrayBuilder<Handle::Client>(layers.size());
+    auto watched = kj::heapArrayBuilder<kj::Promise<bool>>(layers.size());
+    for (auto& layer: layers) {
+      auto request = layer.watchRequest(params.totalSize());
+      request.setWatcher(watcher);
+      request.setIgnore(params.getIgnore());
+      auto promise = request.send();
+      handles.add(promise.getHandle());
+      watched.add(promise.then([](auto&&) { return true; },
+                               [](kj::Exception&&) { return false; }));
+    }
+
+    context.releaseParams();
+
+    context.getResults(capnp::MessageSize {4, 1})
+        .setHandle(kj::heap<UnionWatch>(kj::addRef(*epoch), handles.finish(), watched.finish()));
+    return kj::READY_NOW;
+  }
+
+private:
+  typedef SimpleDirecotry::SimpleEntry SimpleEntry;
 
-    // Forward the lookup request to each node in our list.
+  struct DirectoryIndex {
+    kj::Array<kj::Array<SimpleEntry>> listings;
+    // Contents of each layer. Owns the names in `layersByName`.
+
+    std::map<kj::StringPtr, kj::Vector<uint>> layersByName;
+    // Indexes into `layers` of each layer containing each name, in order.
+
+    kj::Vector<uint> unlistedLayers;
+    // Layers which couldn't be listed, e.g. because they aren't directories or aren't readable.
+    // These must always be asked.
+
+    uint64_t epoch;
+    int64_t expirationTime;
+
+    kj::Array<uint> layersContaining(kj::StringPtr name) {
+      kj::ArrayPtr<const uint> listed;
+      auto iter = layersByName.find(name);
+      if (iter != layersByName.end()) {
+        listed = iter->second.asPtr();
+      }
+
+      // Merge the two sorted lists, since earlier layers take precedence.
+      auto result = kj::heapArrayBuilder<uint>(listed.size() + unlistedLayers.size());
+      auto a = listed.begin();
+      auto b = unlistedLayers.begin();
+      while (a != listed.end() || b != unlistedLayers.end()) {
+        if (b == unlistedLayers.end() || (a != listed.end() && *a < *b)) {
+          result.add(*a++);
+        } else {
+          result.add(*b++);
+        }
+      }
+      return result.finish();
+    }
+  };
+
+  kj::Array<fuse::Node::Client> layers;
+  kj::Own<UnionIndexEpoch> epoch;
+  uint64_t indexTtl;
+
+  kj::Maybe<kj::Own<DirectoryIndex>> index;
+  kj::Maybe<kj::ForkedPromise<void>> indexBuilding;
+  bool indexInProgress = false;
+
+  kj::Promise<void> lookupIn(kj::Array<uint> candidates, kj::StringPtr name,
+                             LookupContext context) {
+    // Forward the lookup request to each of the given layers.
+
+    KJ_REQUIRE(candidates.size() > 0, "no such file or directory");
+
+    capnp::MessageSize paramsSize = { name.size() / sizeof(capnp::word) + 4, 0 };
     auto promises =
-        kj::Vector<kj::Promise<kj::Maybe<capnp::Response<LookupResults>>>>(layers.size());
-    for (auto& layer: layers) {
-      auto request = layer.lookupRequest(paramsSize);
+        kj::Vector<kj::Promise<kj::Maybe<capnp::Response<LookupResults>>>>(candidates.size());
+    for (uint i: candidates) {
+      auto request = layers[i].lookupRequest(paramsSize);
       request.setName(name);
       promises.add(request.send()
           .then([](capnp::Response<LookupResults>&& results) mutable
@@ -257,7 +622,7 @@ protected:
     context.releaseParams();
 
     return kj::joinPromises(promises.releaseAsArray())
-        .then([context](auto&& layerResults) mutable {
+        .then([this, context](auto&& layerResults) mutable {
       kj::Vector<fuse::Node::Client> outLayers(layerResults.size());
       uint64_t ttl = kj::maxValue;
 
@@ -271,45 +636,196 @@ protected:
       KJ_REQUIRE(outLayers.size() > 0, "no such file or directory");
 
       auto outResults = context.getResults(capnp::MessageSize {2, 1});
-      outResults.setNode(kj::heap<UnionNode>(outLayers.releaseAsArray()));
+      outResults.setNode(kj::heap<UnionNode>(
+          outLayers.releaseAsArray(), kj::addRef(*epoch), ttl));
       outResults.setTtl(ttl);
     });
   }
 
-  kj::Promise<void> openAsDirectory(OpenAsDirectoryContext context) override {
-    // Call openAsDirectory() on all children and then return a UnionDirectory of the pipelined
-    // results. No need to wait; if pipelined requests on the layers fail then we simply treat
-    // them as empty directories anyway.
-    auto dirLayers = kj::heapArrayBuilder<fuse::Directory::Client>(layers.size());
+  kj::Promise<void> ensureIndex() {
+    KJ_IF_MAYBE(i, index) {
+      if ((*i)->epoch == epoch->value &&
+          (epoch->activeWatches > 0 || monotonicNanos() < (*i)->expirationTime)) {
+        return kj::READY_NOW;
+      }
+    }
+
+    if (!indexInProgress) {
+      indexInProgress = true;
+      uint64_t startEpoch = epoch->value;
+      int64_t startTime = monotonicNanos();
+      indexBuilding = buildIndex().then(
+          [this, startEpoch, startTime](kj::Own<DirectoryIndex>&& newIndex) {
+        newIndex->epoch = startEpoch;
+        int64_t maxTime = kj::maxValue;
+        newIndex->expirationTime = indexTtl >= uint64_t(maxTime - startTime)
+            ? maxTime : startTime + int64_t(indexTtl);
+        index = kj::mv(newIndex);
+        indexInProgress = false;
+      }, [this](kj::Exception&& e) {
+        KJ_LOG(ERROR, "couldn't index union directory", e);
+        index = nullptr;
+        indexInProgress = false;
+      }).fork();
+    }
+
+    return KJ_ASSERT_NONNULL(indexBuilding).addBranch();
+  }
+
+  kj::Promise<kj::Own<DirectoryIndex>> buildIndex() {
+    auto listings = kj::heapArrayBuilder<kj::Promise<kj::Maybe<kj::Array<SimpleEntry>>>>(
+        layers.size());
     for (auto& layer: layers) {
-      dirLayers.add(layer.openAsDirectoryRequest(capnp::MessageSize {4,0})
-          .send().getDirectory());
+      auto dir = layer.openAsDirectoryRequest(capnp::MessageSize {4, 0}).send().getDirectory();
+      listings.add(SimpleDirecotry::readFrom(kj::mv(dir))
+          .then([](kj::Array<SimpleEntry>&& entries) -> kj::Maybe<kj::Array<SimpleEntry>> {
+        return kj::mv(entries);
+      }, [](kj::Exception&& e) -> kj::Maybe<kj::Array<SimpleEntry>> {
+        return nullptr;
+      }));
     }
 
-    context.releaseParams();
+    return kj::joinPromises(listings.finish())
+        .then([](kj::Array<kj::Maybe<kj::Array<SimpleEntry>>>&& results) {
+      auto result = kj::heap<DirectoryIndex>();
+      auto builder = kj::heapArrayBuilder<kj::Array<SimpleEntry>>(results.size());
+      for (uint i: kj::indices(results)) {
+        KJ_IF_MAYBE(entries, results[i]) {
+          for (auto& entry: *entries) {
+            auto& list = result->layersByName[entry.name];
+            // Guard against a layer listing the same name twice.
+            if (list.size() == 0 || list.end()[-1] != i) list.add(i);
+          }
+          builder.add(kj::mv(*entries));
+        } else {
+          result->unlistedLayers.add(i);
+          builder.add(kj::Array<SimpleEntry>());
+        }
+      }
+      result->listings = builder.finish();
+      return kj::mv(result);
+    });
+  }
+};
 
-    auto results = context.getResults(capnp::MessageSize {4,1});
-    results.setDirectory(kj::heap<UnionDirectory>(dirLayers.finish()));
-    return kj::READY_NOW;
+struct NameLess {
+  // Orders names like StringPtr's operator<, but also accepts unterminated slices, so that maps
+  // keyed by name can be searched with one component of a longer path without copying it.
+
+  typedef void is_transparent;
+
+  static bool less(kj::ArrayPtr<const char> a, kj::ArrayPtr<const char> b) {
+    int cmp = memcmp(a.begin(), b.begin(), kj::min(a.size(), b.size()));
+    return cmp < 0 || (cmp == 0 && a.size() < b.size());
+  }
+
+  inline bool operator()(kj::StringPtr a, kj::StringPtr b) const {
+    return less(a.asArray(), b.asArray());
+  }
+  inline bool operator()(kj::StringPtr a, kj::ArrayPtr<const char> b) const {
+    return less(a.asArray(), b);
+  }
+  inline bool operator()(kj::ArrayPtr<const char> a, kj::StringPtr b) const {
+    return less(a, b.asArray());
+  }
+};
+
+class HideTrie final: public kj::Refcounted {
+  // A set of paths to hide, split at slashes into a tree, so that what is hidden beneath some
+  // child can be found with one lookup instead of by scanning every path. Subtrees are shared
+  // between the nodes that use them.
+
+public:
+  static kj::Own<HideTrie> build(capnp::List<capnp::Text>::Reader hidePaths) {
+    auto root = kj::refcounted<HideTrie>();
+    for (auto path: hidePaths) {
+      HideTrie* node = root.get();
+      for (auto part: split(path, '/')) {
+        auto iter = node->children.find(part);
+        if (iter == node->children.end()) {
+          auto child = kj::refcounted<HideTrie>();
+          child->name = kj::heapString(part);
+          HideTrie& ref = *child;
+          node->children.insert(std::make_pair(kj::StringPtr(ref.name), kj::mv(child)));
+          node = &ref;
+        } else {
+          node = iter->second.get();
+        }
+      }
+      node->hidden = true;
+    }
+    return kj::mv(root);
+  }
+
+  inline bool isHidden() { return hidden; }
+  // Is this path itself hidden (along with everything under it)?
+
+  kj::Maybe<HideTrie&> find(kj::StringPtr childName) {
+    // Returns the subtree for the given child, or null if nothing at or under it is hidden.
+    auto iter = children.find(childName);
+    if (iter == children.end()) {
+      return nullptr;
+    } else {
+      return *iter->second;
+    }
+  }
+
+  inline bool hides(kj::StringPtr childName) {
+    KJ_IF_MAYBE(child, find(childName)) {
+      return child->isHidden();
+    } else {
+      return false;
+    }
   }
 
+  bool hidesPath(kj::StringPtr path) {
+    // Is the slash-separated relative `path`, or any of its parents, hidden?
+    if (hidden) return true;
+    HideTrie* node = this;
+    for (auto part: split(path, '/')) {
+      auto iter = node->children.find(part);
+      if (iter == node->children.end()) return false;
+      node = iter->second.get();
+      if (node->hidden) return true;
+    }
+    return false;
+  }
+
+  void listHidden(kj::Vector<kj::String>& paths, kj::StringPtr prefix = nullptr) {
+    // Add the topmost hidden paths in the tree, relative to this node, to `paths`.
+    for (auto& child: children) {
+      auto path = prefix == nullptr ? kj::heapString(child.first)
+                                    : kj::str(prefix, '/', child.first);
+      if (child.second->hidden) {
+        paths.add(kj::mv(path));
+      } else {
+        child.second->listHidden(paths, path);
+      }
+    }
+  }
+
+  inline kj::Own<HideTrie> addRef() { return kj::addRef(*this); }
+
 private:
-  kj::Array<fuse::Node::Client> layers;
+  kj::String name;
+  bool hidden = false;
+  std::map<kj::StringPtr, kj::Own<HideTrie>, NameLess> children;
+  // Keys point into each child's `name`.
 };
 
 class HidingDirectory final: public SimpleDirecotry {
   // Directory that filters out a set of hidden paths from its contents.
 
 public:
-  HidingDirectory(fuse::Directory::Client delegate, std::set<kj::StringPtr> hidePaths)
-      : delegate(kj::mv(delegate)), hidePaths(kj::mv(hidePaths)) {}
+  HidingDirectory(fuse::Directory::Client delegate, kj::Own<HideTrie> hides)
+      : delegate(kj::mv(delegate)), hides(kj::mv(hides)) {}
 
   kj::Promise<kj::Array<SimpleEntry>> simpleRead() override {
     return readFrom(delegate).then([this](kj::Array<SimpleEntry>&& entries) {
       kj::Vector<SimpleEntry> outEntries(entries.size());
 
       for (auto& entry: entries) {
-        if (hidePaths.count(entry.name) == 0) {
+        if (!hides->hides(entry.name)) {
           outEntries.add(kj::mv(entry));
         }
       }
@@ -318,51 +834,177 @@ public:
     });
   }
 
+  kj::Promise<PlusListing> simpleReadPlus() override;
+  // Defined after HidingNode.
+
 private:
   fuse::Directory::Client delegate;
-  std::set<kj::StringPtr> hidePaths;
+  kj::Own<HideTrie> hides;
 };
 
 class HidingNode final: public DelegatingNode {
   // A node which hides some set of its contents.
 
 public:
-  HidingNode(fuse::Node::Client delegate, std::set<kj::StringPtr> hidePaths)
-      : DelegatingNode(delegate), hidePaths(kj::mv(hidePaths)) {}
+  HidingNode(fuse::Node::Client delegate, kj::Own<HideTrie> hides)
+      : DelegatingNode(delegate), hides(kj::mv(hides)) {}
+
+  static fuse::Node::Client wrap(fuse::Node::Client node, kj::Maybe<HideTrie&> hides) {
+    // Wraps `node` only if something beneath it is hidden.
+    KJ_IF_MAYBE(h, hides) {
+      return kj::heap<HidingNode>(kj::mv(node), h->addRef());
+    } else {
+      return kj::mv(node);
+    }
+  }
 
 protected:
   kj::Promise<void> lookup(LookupContext context) override {
     auto params = context.getParams();
     auto name = params.getName();
 
-    KJ_REQUIRE(hidePaths.count(name) == 0, "path hidden");
+    // Keep our own reference to the subtree, since the lookup may outlive this node.
+    kj::Maybe<kj::Own<HideTrie>> subHides;
+    KJ_IF_MAYBE(h, hides->find(name)) {
+      KJ_REQUIRE(!h->isHidden(), "path hidden");
+      subHides = h->addRef();
+    }
 
     auto subRequest = delegate.lookupRequest(params.totalSize());
     subRequest.setName(name);
 
-    std::set<kj::StringPtr> subHides;
-    for (auto& hidden: hidePaths) {
-      if (hidden.size() > name.size() &&
-          hidden.startsWith(name) &&
-          hidden[name.size()] == '/') {
-        subHides.insert(hidden.slice(name.size() + 1));
-      }
-    }
-
     context.releaseParams();
 
-    return subRequest.send().then([KJ_MVCAP(name), KJ_MVCAP(subHides), context](
+    return subRequest.send().then([KJ_MVCAP(subHides), context](
         capnp::Response<LookupResults>&& results) mutable {
       auto outResults = context.getResults(results.totalSize());
-      outResults.setNode(kj::heap<HidingNode>(results.getNode(), kj::mv(subHides)));
+      KJ_IF_MAYBE(h, subHides) {
+        outResults.setNode(kj::heap<HidingNode>(results.getNode(), kj::mv(*h)));
+      } else {
+        // Nothing beneath this child is hidden, so there's no need to wrap it.
+        outResults.setNode(results.getNode());
+      }
       outResults.setTtl(results.getTtl());
     });
   }
 
+  kj::Promise<void> watch(WatchContext context) override {
+    // Hidden paths can't be seen, so there's no point watching them -- and they may be huge (e.g.
+    // /proc when mapping the whole root directory).
+    auto params = context.getParams();
+    kj::Vector<kj::String> ignore;
+    for (auto path: params.getIgnore()) {
+      ignore.add(kj::heapString(path));
+    }
+    hides->listHidden(ignore);
+
+    auto subRequest = delegate.watchRequest();
+    subRequest.setWatcher(params.getWatcher());
+    auto list = subRequest.initIgnore(ignore.size());
+    for (uint i: kj::indices(ignore)) {
+      list.set(i, ignore[i]);
+    }
+    context.releaseParams();
+    return context.tailCall(kj::mv(subRequest));
+  }
+
 private:
-  std::set<kj::StringPtr> hidePaths;
+  kj::Own<HideTrie> hides;
 };
 
+kj::Promise<SimpleDirecotry::PlusListing> UnionDirectory::simpleReadPlus() {
+  // Read from each delegate, falling back to a plain read() for layers that don't support
+  // readPlus(). Entries from such layers won't have nodes.
+  auto subRequests = kj::heapArrayBuilder<kj::Promise<PlusListing>>(layers.size());
+  for (auto& layer: layers) {
+    subRequests.add(readPlusFrom(layer).then([](PlusListing&& result)
+        -> kj::Promise<PlusListing> {
+      return kj::mv(result);
+    }, [layer](kj::Exception&& exception) mutable -> kj::Promise<PlusListing> {
+      return readFrom(layer).then([](kj::Array<SimpleEntry>&& entries) {
+        return PlusListing { kj::mv(entries), nullptr };
+      }, [](kj::Exception&& exception) {
+        // Perhaps this layer is not a directory. Treat it as empty.
+        return PlusListing();
+      });
+    }));
+  }
+
+  return kj::joinPromises(subRequests.finish())
+      .then([this](kj::Array<PlusListing>&& allListings) {
+    // Merge as in simpleRead(), but now an entry's node must be the union of the nodes from every
+    // layer containing that name, just as UnionNode::lookup() would have produced. If any of
+    // those layers didn't give us a node, we can't construct the union, so leave it null.
+    std::map<kj::StringPtr, kj::Vector<SimpleEntry*>> entryMap;
+
+    size_t ownerCount = 0;
+    for (auto& listing: allListings) {
+      for (auto& entry: listing.entries) {
+        entryMap[entry.name].add(&entry);
+      }
+      ownerCount += listing.owners.size();
+    }
+
+    auto results = kj::heapArrayBuilder<SimpleEntry>(entryMap.size());
+    for (auto& mapEntry: entryMap) {
+      auto& sources = mapEntry.second;
+      bool haveAllNodes = true;
+      uint64_t ttl = kj::maxValue;
+      for (auto source: sources) {
+        if (source->node == nullptr) {
+          haveAllNodes = false;
+          break;
+        }
+        ttl = kj::min(ttl, source->ttl);
+      }
+
+      kj::Maybe<fuse::Node::Client> node;
+      if (haveAllNodes) {
+        auto nodes = kj::heapArrayBuilder<fuse::Node::Client>(sources.size());
+        for (auto source: sources) {
+          KJ_IF_MAYBE(n, source->node) {
+            nodes.add(kj::mv(*n));
+          }
+        }
+        node = fuse::Node::Client(kj::heap<UnionNode>(nodes.finish(), kj::addRef(*epoch), ttl));
+      }
+
+      // In case of dups, we prefer entries from earlier layers.
+      SimpleEntry result = kj::mv(*sources[0]);
+      result.node = kj::mv(node);
+      result.ttl = ttl;
+      results.add(kj::mv(result));
+    }
+
+    auto owners = kj::heapArrayBuilder<capnp::Response<ReadPlusResults>>(ownerCount);
+    for (auto& listing: allListings) {
+      for (auto& owner: listing.owners) {
+        owners.add(kj::mv(owner));
+      }
+    }
+
+    return PlusListing { results.finish(), owners.finish() };
+  });
+}
+
+kj::Promise<SimpleDirecotry::PlusListing> HidingDirectory::simpleReadPlus() {
+  return readPlusFrom(delegate).then([this](PlusListing&& listing) {
+    kj::Vector<SimpleEntry> outEntries(listing.entries.size());
+
+    for (auto& entry: listing.entries) {
+      if (!hides->hides(entry.name)) {
+        // Nodes must hide the same things they would if looked up.
+        KJ_IF_MAYBE(node, entry.node) {
+          entry.node = HidingNode::wrap(kj::mv(*node), hides->find(entry.name));
+        }
+        outEntries.add(kj::mv(entry));
+      }
+    }
+
+    return PlusListing { outEntries.releaseAsArray(), kj::mv(listing.owners) };
+  });
+}
+
 class TrackingNode final: public DelegatingNode {
   // A node which tracks what nodes are ultimately opened.
 
@@ -375,7 +1017,7 @@ protected:
   kj::Promise<void> lookup(LookupContext context) override {
     auto params = context.getParams();
     auto name = params.getName();
-    auto subPath = path == nullptr ? kj::heapString(name) : kj::str(path, '/', name);
+    auto subPath = childPath(path, name);
     auto request = delegate.lookupRequest(params.totalSize());
     request.setName(name);
     context.releaseParams();
@@ -392,10 +1034,8 @@ protected:
     return DelegatingNode::openAsFile(kj::mv(context));
   }
 
-  kj::Promise<void> openAsDirectory(OpenAsDirectoryContext context) override {
-    markUsed();
-    return DelegatingNode::openAsDirectory(kj::mv(context));
-  }
+  kj::Promise<void> openAsDirectory(OpenAsDirectoryContext context) override;
+  // Defined after TrackingDirectory.
 
   kj::Promise<void> readlink(ReadlinkContext context) override {
     markUsed();
@@ -407,6 +1047,12 @@ private:
   bool isUsed = false;
   kj::Function<void(kj::StringPtr)>& callback;
 
+  friend class TrackingDirectory;
+
+  static kj::String childPath(kj::StringPtr path, kj::StringPtr name) {
+    return path == nullptr ? kj::heapString(name) : kj::str(path, '/', name);
+  }
+
   void markUsed() {
     if (!isUsed) {
       isUsed = true;
@@ -417,6 +1063,63 @@ private:
   }
 };
 
+class TrackingDirectory final: public fuse::Directory::Server {
+  // A directory opened from a TrackingNode. Nodes returned by readPlus() are wrapped so that they
+  // are tracked just like nodes obtained by lookup().
+
+public:
+  TrackingDirectory(fuse::Directory::Client delegate, kj::StringPtr path,
+                    kj::Function<void(kj::StringPtr)>& callback)
+      : delegate(kj::mv(delegate)),
+        path(path == nullptr ? nullptr : kj::heapString(path)),
+        callback(callback) {}
+
+protected:
+  kj::Promise<void> read(ReadContext context) override {
+    auto params = context.getParams();
+    auto subRequest = delegate.readRequest(params.totalSize());
+    subRequest.setOffset(params.getOffset());
+    subRequest.setCount(params.getCount());
+    return context.tailCall(kj::mv(subRequest));
+  }
+
+  kj::Promise<void> readPlus(ReadPlusContext context) override {
+    auto params = context.getParams();
+    auto subRequest = delegate.readPlusRequest(params.totalSize());
+    subRequest.setOffset(params.getOffset());
+    subRequest.setCount(params.getCount());
+    context.releaseParams();
+
+    return subRequest.send().then([this, context](auto&& response) mutable {
+      auto results = context.getResults(response.totalSize());
+      results.setEntries(response.getEntries());
+      for (auto item: results.getEntries()) {
+        if (item.hasNode()) {
+          item.setNode(kj::heap<TrackingNode>(
+              item.getNode(),
+              TrackingNode::childPath(path, item.getEntry().getName()),
+              callback));
+        }
+      }
+    });
+  }
+
+private:
+  fuse::Directory::Client delegate;
+  kj::String path;  // null = root directory
+  kj::Function<void(kj::StringPtr)>& callback;
+};
+
+kj::Promise<void> TrackingNode::openAsDirectory(OpenAsDirectoryContext context) {
+  markUsed();
+  context.releaseParams();
+  auto directory = delegate.openAsDirectoryRequest(capnp::MessageSize {4, 0})
+      .send().getDirectory();
+  context.getResults(capnp::MessageSize {4, 1}).setDirectory(
+      kj::heap<TrackingDirectory>(kj::mv(directory), path, callback));
+  return kj::READY_NOW;
+}
+
 class SingletonDirectory final: public SimpleDirecotry {
 public:
   explicit SingletonDirectory(kj::StringPtr path): path(path) {}
@@ -506,6 +1209,27 @@ protected:
     KJ_FAIL_REQUIRE("not a symlink");
   }
 
+  kj::Promise<void> watch(WatchContext context) override {
+    // Ignored paths are relative to us, so only those beneath `path` concern the member.
+    auto params = context.getParams();
+    kj::Vector<kj::StringPtr> ignore;
+    for (auto ignored: params.getIgnore()) {
+      if (ignored.startsWith(path) && ignored.size() > path.size() &&
+          ignored[path.size()] == '/') {
+        ignore.add(ignored.slice(path.size() + 1));
+      }
+    }
+
+    auto request = member.watchRequest(params.totalSize());
+    request.setWatcher(kj::heap<PrefixingWatcher>(params.getWatcher(), kj::heapString(path)));
+    auto list = request.initIgnore(ignore.size());
+    for (uint i: kj::indices(ignore)) {
+      list.set(i, ignore[i]);
+    }
+    context.releaseParams();
+    return context.tailCall(kj::mv(request));
+  }
+
 private:
   fuse::Node::Client member;
   kj::StringPtr path;
@@ -639,12 +1363,242 @@ private:
   kj::Array<capnp::word> data;
 };
 
+// =======================================================================================
+// Archive filesystem
+
+class ArchiveTree final: public kj::Refcounted {
+  // An spk::Archive, indexed for serving over FUSE. The index is built in one pass when the
+  // archive is opened, so that serving it never traverses the message again (which would
+  // eventually exceed the reader's traversal limit on a long-lived mount). Names and content point
+  // straight into the mapping.
+
+public:
+  struct Entry {
+    kj::StringPtr name;
+    fuse::Node::Type type;
+    uint32_t permissions;
+    kj::ArrayPtr<const kj::byte> content;  // File content, or symlink target.
+    int64_t lastModificationTimeNs;
+    uint64_t inodeNumber;
+    kj::Array<Entry> children;  // Directories only. Sorted by name.
+  };
+
+  explicit ArchiveTree(MemoryMapping&& mappingParam): mapping(kj::mv(mappingParam)) {
+    kj::ArrayPtr<const capnp::word> words = mapping;
+    capnp::ReaderOptions options;
+    options.traversalLimitInWords = words.size();
+    capnp::FlatArrayMessageReader message(words, options);
+
+    root.type = fuse::Node::Type::DIRECTORY;
+    root.permissions = 0555;
+    root.lastModificationTimeNs = 0;
+    root.inodeNumber = nextInode++;
+    root.children = indexDirectory(message.getRoot<spk::Archive>().getFiles());
+  }
+
+  Entry root;
+
+  kj::Maybe<const Entry&> findChild(const Entry& dir, kj::StringPtr name) const {
+    auto iter = std::lower_bound(dir.children.begin(), dir.children.end(), name,
+        [](const Entry& entry, kj::StringPtr n) { return entry.name < n; });
+    if (iter != dir.children.end() && iter->name == name) {
+      return *iter;
+    } else {
+      return nullptr;
+    }
+  }
+
+private:
+  MemoryMapping mapping;
+  uint64_t nextInode = 1;
+
+  kj::Array<Entry> indexDirectory(capnp::List<spk::Archive::File>::Reader files) {
+    auto entries = kj::heapArray<Entry>(files.size());
+
+    for (uint i: kj::indices(entries)) {
+      auto file = files[i];
+      auto& entry = entries[i];
+
+      entry.name = file.getName();
+      KJ_REQUIRE(entry.name.size() != 0 && entry.name != "." && entry.name != ".." &&
+                 entry.name.findFirst('/') == nullptr && entry.name.findFirst('\0') == nullptr,
+                 "Archive contained invalid file name.", entry.name);
+      entry.lastModificationTimeNs = file.getLastModificationTimeNs();
+      entry.inodeNumber = nextInode++;
+
+      switch (file.which()) {
+        case spk::Archive::File::REGULAR:
+          entry.type = fuse::Node::Type::REGULAR;
+          entry.permissions = 0444;
+          entry.content = file.getRegular();
+          break;
+
+        case spk::Archive::File::EXECUTABLE:
+          entry.type = fuse::Node::Type::REGULAR;
+          entry.permissions = 0555;
+          entry.content = file.getExecutable();
+          break;
+
+        case spk::Archive::File::SYMLINK: {
+          // Capnp text is NUL-terminated, so this can be turned back into a Text::Reader later.
+          auto target = file.getSymlink();
+          entry.type = fuse::Node::Type::SYMLINK;
+          entry.permissions = 0777;
+          entry.content = kj::arrayPtr(reinterpret_cast<const kj::byte*>(target.begin()),
+                                       target.size());
+          break;
+        }
+
+        case spk::Archive::File::DIRECTORY:
+          entry.type = fuse::Node::Type::DIRECTORY;
+          entry.permissions = 0555;
+          entry.children = indexDirectory(file.getDirectory());
+          break;
+
+        default:
+          KJ_FAIL_REQUIRE("Unknown file type in archive.");
+      }
+    }
+
+    std::sort(entries.begin(), entries.end(),
+        [](const Entry& a, const Entry& b) { return a.name < b.name; });
+    for (uint i = 1; i < entries.size(); i++) {
+      KJ_REQUIRE(entries[i - 1].name != entries[i].name,
+                 "Archive contained duplicate file name.", entries[i].name);
+    }
+
+    return entries;
+  }
+};
+
+class ArchiveFile final: public fuse::File::Server {
+public:
+  ArchiveFile(kj::Own<ArchiveTree> tree, kj::ArrayPtr<const kj::byte> data)
+      : tree(kj::mv(tree)), data(data) {}
+
+protected:
+  kj::Promise<void> read(ReadContext context) {
+    auto params = context.getParams();
+    auto offset = kj::min(data.size(), params.getOffset());
+    auto size = kj::min(data.size() - offset, params.getSize());
+
+    auto results = context.getResults(capnp::MessageSize { size / sizeof(capnp::word) + 4, 0 });
+    results.setData(data.slice(offset, offset + size));
+
+    return kj::READY_NOW;
+  }
+
+private:
+  kj::Own<ArchiveTree> tree;
+  kj::ArrayPtr<const kj::byte> data;
+};
+
+class ArchiveDirectory final: public SimpleDirecotry {
+public:
+  ArchiveDirectory(kj::Own<ArchiveTree> tree, const ArchiveTree::Entry& entry)
+      : tree(kj::mv(tree)), entry(entry) {}
+
+  kj::Promise<kj::Array<SimpleEntry>> simpleRead() override {
+    auto result = kj::heapArrayBuilder<SimpleEntry>(entry.children.size() + 2);
+
+    result.add(SimpleEntry { entry.inodeNumber, kj::str("."), fuse::Node::Type::DIRECTORY });
+    result.add(SimpleEntry { 1, kj::str(".."), fuse::Node::Type::DIRECTORY });
+    for (auto& child: entry.children) {
+      result.add(SimpleEntry { child.inodeNumber, kj::heapString(child.name), child.type });
+    }
+
+    return result.finish();
+  }
+
+private:
+  kj::Own<ArchiveTree> tree;
+  const ArchiveTree::Entry& entry;
+};
+
+class ArchiveNode final: public fuse::Node::Server {
+  // A node within an ArchiveTree. The archive never changes, so all TTLs are infinite.
+
+public:
+  ArchiveNode(kj::Own<ArchiveTree> tree, const ArchiveTree::Entry& entry)
+      : tree(kj::mv(tree)), entry(entry) {}
+
+protected:
+  kj::Promise<void> lookup(LookupContext context) override {
+    KJ_REQUIRE(entry.type == fuse::Node::Type::DIRECTORY, "not a directory");
+
+    KJ_IF_MAYBE(child, tree->findChild(entry, context.getParams().getName())) {
+      context.releaseParams();
+      auto results = context.getResults(capnp::MessageSize {4, 1});
+      results.setNode(kj::heap<ArchiveNode>(kj::addRef(*tree), *child));
+      results.setTtl(kj::maxValue);
+      return kj::READY_NOW;
+    } else {
+      KJ_FAIL_REQUIRE("no such file or directory");
+    }
+  }
+
+  kj::Promise<void> getAttributes(GetAttributesContext context) override {
+    auto results = context.getResults(capnp::MessageSize {
+      capnp::sizeInWords<GetAttributesResults>() +
+          capnp::sizeInWords<fuse::Node::Attributes>(),
+      0
+    });
+    results.setTtl(kj::maxValue);
+
+    auto attr = results.initAttributes();
+    attr.setInodeNumber(entry.inodeNumber);
+    attr.setType(entry.type);
+    attr.setPermissions(entry.permissions);
+    attr.setLinkCount(1);
+    attr.setSize(entry.content.size());
+    attr.setLastAccessTime(entry.lastModificationTimeNs);
+    attr.setLastModificationTime(entry.lastModificationTimeNs);
+    attr.setLastStatusChangeTime(entry.lastModificationTimeNs);
+
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> openAsFile(OpenAsFileContext context) override {
+    KJ_REQUIRE(entry.type == fuse::Node::Type::REGULAR, "not a file");
+    auto results = context.getResults(capnp::MessageSize { 4, 1 });
+    results.setFile(kj::heap<ArchiveFile>(kj::addRef(*tree), entry.content));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> openAsDirectory(OpenAsDirectoryContext context) override {
+    KJ_REQUIRE(entry.type == fuse::Node::Type::DIRECTORY, "not a directory");
+    auto results = context.getResults(capnp::MessageSize { 4, 1 });
+    results.setDirectory(kj::heap<ArchiveDirectory>(kj::addRef(*tree), entry));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> readlink(ReadlinkContext context) override {
+    KJ_REQUIRE(entry.type == fuse::Node::Type::SYMLINK, "not a symlink");
+    capnp::Text::Reader link(reinterpret_cast<const char*>(entry.content.begin()),
+                             entry.content.size());
+    context.getResults(capnp::MessageSize { link.size() / sizeof(capnp::word) + 4, 0 })
+        .setLink(link);
+    return kj::READY_NOW;
+  }
+
+private:
+  kj::Own<ArchiveTree> tree;
+  const ArchiveTree::Entry& entry;
+};
+
 }  // namespace
 
+fuse::Node::Client newArchiveFuseNode(MemoryMapping&& archive) {
+  auto tree = kj::refcounted<ArchiveTree>(kj::mv(archive));
+  auto& root = tree->root;
+  return kj::heap<ArchiveNode>(kj::mv(tree), root);
+}
+
 fuse::Node::Client makeUnionFs(kj::StringPtr sourceDir, spk::SourceMap::Reader sourceMap,
                                spk::Manifest::Reader manifest,
                                spk::BridgeConfig::Reader bridgeConfig, kj::StringPtr bridgePath,
-                               kj::Function<void(kj::StringPtr)>& callback) {
+                               kj::Function<void(kj::StringPtr)>& callback,
+                               kj::Maybe<kj::UnixEventPort&> eventPort) {
   auto searchPath = sourceMap.getSearchPath();
   auto layers = kj::Vector<fuse::Node::Client>(searchPath.size() + 10);
 
@@ -677,6 +1631,14 @@ fuse::Node::Client makeUnionFs(kj::StringPtr sourceDir, spk::SourceMap::Reader s
     kj::String ownSourcePath;
     kj::StringPtr packagePath = mapping.getPackagePath();
 
+    // Only watch the app's own source, i.e. paths relative to the source dir. Anything else
+    // (typically system directories) is large and changes rarely, so isn't worth the inotify
+    // watches.
+    kj::Maybe<kj::UnixEventPort&> layerEventPort;
+    if (!sourcePath.startsWith("/")) {
+      layerEventPort = eventPort;
+    }
+
     // Interpret relative paths against the source dir (if it's not the current directory).
     if (sourceDir.size() != 0 && !sourcePath.startsWith("/")) {
       ownSourcePath = kj::str(sourceDir, '/', sourcePath);
@@ -699,16 +1661,12 @@ fuse::Node::Client makeUnionFs(kj::StringPtr sourceDir, spk::SourceMap::Reader s
 
     // Create the filesystem node.
     // We set a low TTL here, but note that the spk tool overrides it anyway.
-    fuse::Node::Client node = newLoopbackFuseNode(sourcePath, 1 * kj::SECONDS);
+    fuse::Node::Client node = newLoopbackFuseNode(sourcePath, 1 * kj::SECONDS, layerEventPort);
 
     // If any contents are hidden, wrap in a hiding node.
     auto hides = mapping.getHidePaths();
     if (hides.size() > 0) {
-      std::set<kj::StringPtr> hideSet;
-      for (auto hide: hides) {
-        hideSet.insert(hide);
-      }
-      node = kj::heap<HidingNode>(kj::mv(node), kj::mv(hideSet));
+      node = kj::heap<HidingNode>(kj::mv(node), HideTrie::build(hides));
     }
 
     // If the contents are mapped to a non-root location, wrap in a singleton node.
@@ -721,7 +1679,9 @@ fuse::Node::Client makeUnionFs(kj::StringPtr sourceDir, spk::SourceMap::Reader s
     layers.add(kj::mv(node));
   }
 
-  auto merged = kj::heap<UnionNode>(layers.releaseAsArray());
+  // The root's layers don't tell us their TTL, so assume the loopback nodes' TTL from above.
+  auto merged = kj::heap<UnionNode>(layers.releaseAsArray(), kj::refcounted<UnionIndexEpoch>(),
+                                    1 * kj::SECONDS / kj::NANOSECONDS);
   return kj::heap<TrackingNode>(kj::mv(merged), nullptr, callback);
 }
 
@@ -844,4 +1804,253 @@ FileMapping mapFile(kj::StringPtr sourceDir, spk::SourceMap::Reader sourceMap, k
   };
 }
 
+// =======================================================================================
+
+struct SourceMapIndex::DiskNode {
+  enum class Kind {
+    UNKNOWN,    // not stat()ed yet (only search path roots start out this way)
+    MISSING,
+    DIRECTORY,
+    SYMLINK,
+    OTHER
+  };
+
+  kj::String name;
+  kj::String path;   // as mapFile() would report it
+  Kind kind = Kind::UNKNOWN;   // of the node itself, not following symlinks
+
+  bool listed = false;
+  bool listable = false;  // whether opening `path` (following symlinks) gave a directory
+
+  std::map<kj::StringPtr, kj::Own<DiskNode>, NameLess> children;
+  // Keys point into each child's `name`. Filled in when `listed` becomes true.
+};
+
+struct SourceMapIndex::Entry {
+  kj::StringPtr packagePath;
+  kj::Own<HideTrie> hides;
+  kj::Own<DiskNode> root;
+};
+
+SourceMapIndex::SourceMapIndex(kj::StringPtr sourceDir, spk::SourceMap::Reader sourceMap) {
+  auto searchPath = sourceMap.getSearchPath();
+  auto builder = kj::heapArrayBuilder<Entry>(searchPath.size());
+  for (auto dir: searchPath) {
+    auto root = kj::heap<DiskNode>();
+    // Prepend `sourceDir` to relative paths.
+    root->path = joinPaths(sourceDir, dir.getSourcePath());
+    builder.add(Entry { dir.getPackagePath(), HideTrie::build(dir.getHidePaths()), kj::mv(root) });
+  }
+  entries = builder.finish();
+}
+
+SourceMapIndex::~SourceMapIndex() noexcept(false) {}
+
+void SourceMapIndex::readDirectory(DiskNode& node) {
+  // Fill in `node.children`, if `node` turns out to be a directory.
+
+  if (node.listed) return;
+  node.listed = true;
+
+  int fd = open(node.path.cStr(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    int error = errno;
+    if (error == ENOENT || error == ENOTDIR || error == ELOOP) {
+      // Not a directory, so it has no children.
+      return;
+    }
+    if (error == EACCES || error == EPERM) {
+      // mapFile() skips what it can't access, so we do too.
+      return;
+    }
+    KJ_FAIL_SYSCALL("open", error, node.path);
+  }
+
+  DIR* dir = fdopendir(fd);
+  if (dir == nullptr) {
+    int error = errno;
+    close(fd);
+    KJ_FAIL_SYSCALL("fdopendir", error, node.path);
+  }
+  KJ_DEFER(closedir(dir));
+  node.listable = true;
+
+  for (;;) {
+    errno = 0;
+    struct dirent* entry = readdir(dir);
+    if (entry == nullptr) {
+      int error = errno;
+      if (error == 0) {
+        break;
+      } else {
+        KJ_FAIL_SYSCALL("readdir", error, node.path);
+      }
+    }
+
+    kj::StringPtr name = entry->d_name;
+    if (name == "." || name == "..") continue;
+
+    auto child = kj::heap<DiskNode>();
+    child->name = kj::heapString(name);
+    child->path = joinPaths(node.path, name);
+
+    switch (entry->d_type) {
+      case DT_DIR:
+        child->kind = DiskNode::Kind::DIRECTORY;
+        break;
+      case DT_LNK:
+        child->kind = DiskNode::Kind::SYMLINK;
+        break;
+      case DT_UNKNOWN: {
+        // The file system doesn't report types in directory listings.
+        struct stat stats;
+        if (fstatat(dirfd(dir), entry->d_name, &stats, AT_SYMLINK_NOFOLLOW) < 0) {
+          int error = errno;
+          if (error == ENOENT) continue;  // deleted since we listed it
+          if (error == EACCES) continue;  // mapFile() would skip it too
+          KJ_FAIL_SYSCALL("fstatat", error, child->path);
+        }
+        child->kind = S_ISDIR(stats.st_mode) ? DiskNode::Kind::DIRECTORY
+                    : S_ISLNK(stats.st_mode) ? DiskNode::Kind::SYMLINK
+                    : DiskNode::Kind::OTHER;
+        break;
+      }
+      default:
+        child->kind = DiskNode::Kind::OTHER;
+        break;
+    }
+
+    DiskNode& ref = *child;
+    node.children.insert(std::make_pair(kj::StringPtr(ref.name), kj::mv(child)));
+  }
+}
+
+kj::Maybe<SourceMapIndex::DiskNode&> SourceMapIndex::resolve(DiskNode& root,
+                                                            kj::StringPtr subPath) {
+  // Find `subPath` beneath `root`, or null if it doesn't exist. Like faccessat() in mapFile(),
+  // symlinks are followed in all but the last component.
+
+  DiskNode* node = &root;
+  for (auto part: split(subPath, '/')) {
+    if (part.size() == 0 || (part.size() == 1 && part[0] == '.')) continue;
+    KJ_REQUIRE(!(part.size() == 2 && part[0] == '.' && part[1] == '.'),
+               "path must not contain '..'", subPath);
+
+    readDirectory(*node);
+    auto iter = node->children.find(part);
+    if (iter == node->children.end()) return nullptr;
+    node = iter->second.get();
+  }
+
+  if (node->kind == DiskNode::Kind::UNKNOWN) {
+    // Only search path roots aren't stat()ed as part of listing their parent.
+    struct stat stats;
+    if (lstat(node->path.cStr(), &stats) < 0) {
+      node->kind = DiskNode::Kind::MISSING;
+    } else if (S_ISDIR(stats.st_mode)) {
+      node->kind = DiskNode::Kind::DIRECTORY;
+    } else if (S_ISLNK(stats.st_mode)) {
+      node->kind = DiskNode::Kind::SYMLINK;
+    } else {
+      node->kind = DiskNode::Kind::OTHER;
+    }
+  }
+
+  if (node->kind == DiskNode::Kind::MISSING) {
+    return nullptr;
+  } else {
+    return *node;
+  }
+}
+
+void SourceMapIndex::lookup(kj::StringPtr virtualPath, kj::Vector<DiskNode*>& matches,
+                            kj::Vector<kj::String>& virtualChildren) {
+  // Same search as mapFile(), against the cache.
+
+  for (auto& entry: entries) {
+    KJ_IF_MAYBE(subPath, tryRemovePathPrefix(virtualPath, entry.packagePath)) {
+      // If the path is some file or subdirectory inside the virtual path, check whether it's
+      // hidden.
+      if (subPath->size() > 0 && entry.hides->hidesPath(*subPath)) continue;
+
+      KJ_IF_MAYBE(node, resolve(*entry.root, *subPath)) {
+        matches.add(node);
+      }
+    } else {
+      // packagePath is not a prefix of `virtualPath`, but is `virtualPath` a prefix of
+      // packagePath?
+      KJ_IF_MAYBE(child, tryRemovePathPrefix(entry.packagePath, virtualPath)) {
+        KJ_IF_MAYBE(slashPos, child->findFirst('/')) {
+          virtualChildren.add(kj::heapString(child->slice(0, *slashPos)));
+        } else {
+          virtualChildren.add(kj::heapString(*child));
+        }
+      }
+    }
+  }
+}
+
+FileMapping SourceMapIndex::map(kj::StringPtr virtualPath) {
+  kj::Vector<DiskNode*> matches;
+  kj::Vector<kj::String> virtualChildren;
+  lookup(virtualPath, matches, virtualChildren);
+
+  auto sourcePaths = kj::heapArrayBuilder<kj::String>(matches.size());
+  for (auto match: matches) {
+    if (virtualPath.size() == 0 && match->kind == DiskNode::Kind::SYMLINK) {
+      // This is a root mapping. In this case we follow symlinks eagerly.
+      char* real;
+      KJ_SYSCALL(real = realpath(match->path.cStr(), NULL));
+      KJ_DEFER(free(real));
+      sourcePaths.add(kj::str(real));
+    } else {
+      sourcePaths.add(kj::heapString(match->path));
+    }
+  }
+
+  return FileMapping {
+    sourcePaths.finish(),
+    virtualChildren.releaseAsArray()
+  };
+}
+
+kj::Maybe<kj::Array<kj::String>> SourceMapIndex::listDirectory(kj::StringPtr virtualPath) {
+  kj::Vector<DiskNode*> matches;
+  kj::Vector<kj::String> virtualChildren;
+  lookup(virtualPath, matches, virtualChildren);
+
+  auto isDir = [&](DiskNode& node) {
+    if (node.kind == DiskNode::Kind::DIRECTORY) return true;
+    if (virtualPath.size() == 0 && node.kind == DiskNode::Kind::SYMLINK) {
+      // map() reports the root's symlinks resolved, so they count if they lead to a directory.
+      readDirectory(node);
+      return node.listable;
+    }
+    return false;
+  };
+
+  if (matches.size() == 0 ? virtualChildren.size() == 0 : !isDir(*matches[0])) {
+    return nullptr;
+  }
+
+  std::set<kj::StringPtr> names;
+  for (auto& child: virtualChildren) {
+    names.insert(child);
+  }
+  for (auto match: matches) {
+    if (isDir(*match)) {
+      readDirectory(*match);
+      for (auto& child: match->children) {
+        names.insert(child.first);
+      }
+    }
+  }
+
+  auto result = kj::heapArrayBuilder<kj::String>(names.size());
+  for (auto& name: names) {
+    result.add(kj::heapString(name));
+  }
+  return result.finish();
+}
+
 }  // namespace sandstorm
@@ -22,15 +22,25 @@
 #include <sandstorm/fuse.capnp.h>
 #include <sandstorm/package.capnp.h>
 #include <kj/function.h>
+#include <kj/vector.h>
+
+namespace kj { class UnixEventPort; }
 
 namespace sandstorm {
 
 fuse::Node::Client makeUnionFs(kj::StringPtr sourceDir, spk::SourceMap::Reader sourceMap,
                                spk::Manifest::Reader manifest, spk::BridgeConfig::Reader bridgeConfig,
-                               kj::StringPtr bridgePath, kj::Function<void(kj::StringPtr)>& callback);
+                               kj::StringPtr bridgePath, kj::Function<void(kj::StringPtr)>& callback,
+                               kj::Maybe<kj::UnixEventPort&> eventPort = nullptr);
 // Creates a new filesystem based os `sourceMap`. Whenever a file is opened (for the first time),
 // `callback` will be invoked with the (virtual) path name.
 //
+// If `eventPort` is given, the filesystem implements `Node.watch()` by watching, with inotify, the
+// search path entries whose source paths are relative (i.e. within `sourceDir`), minus their
+// hidden paths. Changes anywhere else -- e.g. to system files mapped from `/` -- are not reported,
+// so serving the result with `FuseOptions::cacheForever` means those are only picked up on
+// restart.
+//
 // `manifest` is used to populate the special file `/sandstorm-manifest`, and `bridgePath` is the
 // file that should be mapped as `/sandstorm-http-bridge`.
 //
@@ -53,6 +63,50 @@ FileMapping mapFile(kj::StringPtr sourceDir, spk::SourceMap::Reader sourceMap,
 // the case of a file, the first should be used, but in the case of a directory, they should be
 // merged.
 
+class SourceMapIndex {
+  // Maps many virtual paths through one source map, giving the same answers as mapFile() but
+  // without redoing its work for each path. Every on-disk directory that is looked into is read
+  // once -- stat()ing entries relative to the directory's fd only when the file system doesn't
+  // report their types -- and cached, and hide paths are matched through a trie, so mapping a
+  // whole package costs time proportional to the files visited rather than to that times the
+  // number of search path entries.
+  //
+  // The source directories are assumed not to change while the index is in use.
+
+public:
+  SourceMapIndex(kj::StringPtr sourceDir, spk::SourceMap::Reader sourceMap);
+  ~SourceMapIndex() noexcept(false);
+  KJ_DISALLOW_COPY(SourceMapIndex);
+
+  FileMapping map(kj::StringPtr virtualPath);
+  // Same as mapFile(sourceDir, sourceMap, virtualPath). `virtualPath` must not contain "..".
+
+  kj::Maybe<kj::Array<kj::String>> listDirectory(kj::StringPtr virtualPath);
+  // If the first match for `virtualPath` is a directory -- or nothing on disk matches but other
+  // mappings live beneath it -- returns the sorted names of its children, merged across every
+  // matching directory and virtual child. Otherwise returns null.
+
+private:
+  struct DiskNode;
+  struct Entry;
+  kj::Array<Entry> entries;
+
+  static void readDirectory(DiskNode& node);
+  static kj::Maybe<DiskNode&> resolve(DiskNode& root, kj::StringPtr subPath);
+
+  void lookup(kj::StringPtr virtualPath, kj::Vector<DiskNode*>& matches,
+              kj::Vector<kj::String>& virtualChildren);
+};
+
+class MemoryMapping;
+
+fuse::Node::Client newArchiveFuseNode(MemoryMapping&& archive);
+// Serves an spk::Archive -- the decompressed body of a package, whose signature the caller must
+// already have checked -- as a read-only filesystem, without unpacking it. Content is read
+// straight out of the mapping, which is kept alive until every node is dropped. Throws if the
+// archive is malformed (e.g. invalid or duplicate file names) in the same ways `spk unpack` would
+// complain.
+
 }  // namespace sandstorm
 
 #endif // SANDSTORM_UNION_FS_H_
@@ -71,5 +71,19 @@ KJ_TEST("base64 encoding/decoding") {
   }
 }
 
+KJ_TEST("parseHttpDate") {
+  // The three formats HTTP allows, followed by two that apps send anyway.
+  KJ_EXPECT(KJ_ASSERT_NONNULL(parseHttpDate("Wed, 15 Nov 1995 06:25:24 GMT")) == 816416724);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(parseHttpDate("Wed, 15-Nov-95 06:25:24 GMT")) == 816416724);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(parseHttpDate("Wed Nov 15 06:25:24 1995")) == 816416724);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(parseHttpDate("Wed, 15-Nov-1995 06:25:24 GMT")) == 816416724);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(parseHttpDate("Wed, 15 Nov 1995 06:25:24 -0000")) == 816416724);
+
+  KJ_EXPECT(parseHttpDate("") == nullptr);
+  KJ_EXPECT(parseHttpDate("yesterday") == nullptr);
+  KJ_EXPECT(parseHttpDate("Wed, 15 Nov 1995 06:25:24 GMT and then some") == nullptr);
+  KJ_EXPECT(parseHttpDate("Wed, 15 Nov 1995 06:25:24 PST") == nullptr);
+}
+
 }  // namespace
 }  // namespace sandstorm
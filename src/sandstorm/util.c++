@@ -22,6 +22,12 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <time.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <kj/thread.h>
+#include <kj/mutex.h>
+#include <atomic>
 
 namespace sandstorm {
 
@@ -109,6 +115,67 @@ kj::AutoCloseFd openTemporary(kj::StringPtr near) {
   return result;
 }
 
+size_t getFileSize(int fd, kj::StringPtr filename) {
+  struct stat stats;
+  KJ_SYSCALL(fstat(fd, &stats));
+  KJ_REQUIRE(S_ISREG(stats.st_mode), "Not a regular file.", filename);
+  return stats.st_size;
+}
+
+void parallelFor(size_t count, uint threadCount, kj::Function<void(size_t)> func) {
+  std::atomic<size_t> next(0);
+  kj::MutexGuarded<kj::Maybe<kj::Exception>> firstError;
+
+  auto work = [&]() {
+    for (;;) {
+      size_t i = next++;
+      if (i >= count) break;
+
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() { func(i); })) {
+        auto lock = firstError.lockExclusive();
+        if (*lock == nullptr) *lock = kj::mv(*exception);
+        next = count;  // Stop the other workers early.
+        break;
+      }
+    }
+  };
+
+  {
+    size_t extraThreads = kj::min(size_t(kj::max(threadCount, 1u)), count);
+    if (extraThreads > 0) --extraThreads;
+    auto threads = kj::heapArrayBuilder<kj::Own<kj::Thread>>(extraThreads);
+    for (size_t i = 0; i < extraThreads; i++) {
+      threads.add(kj::heap<kj::Thread>(work));
+    }
+    work();
+    // Destroying `threads` joins them.
+  }
+
+  kj::Maybe<kj::Exception> error = kj::mv(*firstError.lockExclusive());
+  KJ_IF_MAYBE(exception, error) {
+    kj::throwFatalException(kj::mv(*exception));
+  }
+}
+
+MemoryMapping::MemoryMapping(int fd, kj::StringPtr filename): content(nullptr) {
+  size_t size = getFileSize(fd, filename);
+
+  if (size != 0) {
+    void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED) {
+      KJ_FAIL_SYSCALL("mmap", errno, filename);
+    }
+
+    content = kj::arrayPtr(reinterpret_cast<byte*>(ptr), size);
+  }
+}
+
+MemoryMapping::~MemoryMapping() {
+  if (content != nullptr) {
+    KJ_SYSCALL(munmap(content.begin(), content.size()));
+  }
+}
+
 bool isDirectory(kj::StringPtr path) {
   struct stat stats;
   KJ_SYSCALL(lstat(path.cStr(), &stats));
@@ -254,6 +321,32 @@ kj::ArrayPtr<const char> extractProtocolFromUrl(kj::StringPtr url) {
   }
 }
 
+kj::Maybe<time_t> parseHttpDate(kj::StringPtr value) {
+  struct tm t;
+  memset(&t, 0, sizeof(t));
+
+  // There are three allowed formats for HTTP dates.  Ugh.
+  char* end = strptime(value.cStr(), "%a, %d %b %Y %T GMT", &t);
+  if (end == nullptr) {
+    end = strptime(value.cStr(), "%a, %d-%b-%y %T GMT", &t);
+    if (end == nullptr) {
+      end = strptime(value.cStr(), "%a %b %d %T %Y", &t);
+      if (end == nullptr) {
+        // Not valid per HTTP spec, but MediaWiki seems to return this format sometimes.
+        end = strptime(value.cStr(), "%a, %d-%b-%Y %T GMT", &t);
+        if (end == nullptr) {
+          // Not valid per HTTP spec, but used by Rack.
+          end = strptime(value.cStr(), "%a, %d %b %Y %T -0000", &t);
+        }
+      }
+    }
+  }
+  if (end == nullptr || *end != '\0') {
+    return nullptr;
+  }
+  return timegm(&t);
+}
+
 // =======================================================================================
 // This code is derived from libb64 which has been placed in the public domain.
 // For details, see http://sourceforge.net/projects/libb64
@@ -521,4 +614,14 @@ kj::Array<byte> base64Decode(kj::StringPtr input) {
   return output;
 }
 
+kj::String hexEncode(kj::ArrayPtr<const byte> input) {
+  static const char DIGITS[] = "0123456789abcdef";
+  auto result = kj::heapString(input.size() * 2);
+  for (uint i: kj::indices(input)) {
+    result[i * 2] = DIGITS[input[i] >> 4];
+    result[i * 2 + 1] = DIGITS[input[i] & 15];
+  }
+  return result;
+}
+
 }  // namespace sandstorm
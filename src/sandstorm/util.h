@@ -26,6 +26,9 @@
 #include <fcntl.h>
 #include <kj/debug.h>
 #include <kj/vector.h>
+#include <kj/function.h>
+#include <capnp/blob.h>
+#include <capnp/common.h>
 
 namespace sandstorm {
 
@@ -102,6 +105,53 @@ kj::Maybe<uint> parseUInt(kj::StringPtr s, int base);
 // input.
 
 kj::AutoCloseFd openTemporary(kj::StringPtr near);
+
+size_t getFileSize(int fd, kj::StringPtr filename);
+// Get the size of the regular file open as `fd`. Throws if it isn't a regular file. `filename` is
+// only used in error messages.
+
+void parallelFor(size_t count, uint threadCount, kj::Function<void(size_t)> func);
+// Call `func(i)` for each `i` in [0, count), spread across up to `threadCount` threads (the calling
+// thread included), and return once all calls are done. `func` must be safe to call concurrently.
+// If any call throws, remaining indices are skipped and the first exception is rethrown here.
+
+class MemoryMapping {
+  // A read-only, private mmap() of an entire file. Unmaps in the destructor.
+
+public:
+  MemoryMapping(): content(nullptr) {}
+  explicit MemoryMapping(int fd, kj::StringPtr filename);
+  ~MemoryMapping();
+
+  KJ_DISALLOW_COPY(MemoryMapping);
+  inline MemoryMapping(MemoryMapping&& other): content(other.content) {
+    other.content = nullptr;
+  }
+  inline MemoryMapping& operator=(MemoryMapping&& other) {
+    MemoryMapping old(kj::mv(*this));
+    content = other.content;
+    other.content = nullptr;
+    return *this;
+  }
+
+  inline operator kj::ArrayPtr<const byte>() const {
+    return content;
+  }
+
+  inline operator capnp::Data::Reader() const {
+    return content;
+  }
+
+  inline operator kj::ArrayPtr<const capnp::word>() const {
+    return kj::arrayPtr(reinterpret_cast<const capnp::word*>(content.begin()),
+                        content.size() / sizeof(capnp::word));
+  }
+
+  inline size_t size() const { return content.size(); }
+
+private:
+  kj::ArrayPtr<byte> content;
+};
 // Creates a temporary file in the same directory as the file specified by "near", immediately
 // unlinks it, and then returns the file descriptor,  which will be open for both read and write.
 
@@ -137,6 +187,9 @@ kj::Maybe<kj::ArrayPtr<const char>> splitFirst(kj::ArrayPtr<const char>& input,
 kj::ArrayPtr<const char> extractHostFromUrl(kj::StringPtr url);
 kj::ArrayPtr<const char> extractProtocolFromUrl(kj::StringPtr url);
 
+kj::Maybe<time_t> parseHttpDate(kj::StringPtr value);
+// Parse an HTTP date such as "Wed, 15 Nov 1995 06:25:24 GMT", returning null if it isn't one.
+
 kj::String base64Encode(kj::ArrayPtr<const byte> input, bool breakLines);
 // Encode the input as base64. If `breakLines` is true, insert line breaks every 72 characters and
 // at the end of the output. (Otherwise, return one long line.)
@@ -144,6 +197,9 @@ kj::String base64Encode(kj::ArrayPtr<const byte> input, bool breakLines);
 kj::Array<byte> base64Decode(kj::StringPtr input);
 // Decode base64 input to bytes. Non-base64 characters in the input will be ignored.
 
+kj::String hexEncode(kj::ArrayPtr<const byte> input);
+// Encode the input as lower-case hex.
+
 }  // namespace sandstorm
 
 #endif // SANDSTORM_UTIL_H_